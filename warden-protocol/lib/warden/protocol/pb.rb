@@ -589,6 +589,8 @@ module Warden
       optional :rlimits, ResourceLimits, 4
       optional :discard_output, :bool, 5, :default => false
       optional :log_tag, :string, 6
+      optional :ring_buffer_size, :uint32, 7
+      optional :max_chunk_size, :uint32, 8
     end
 
     class RunResponse
@@ -620,6 +622,8 @@ module Warden
       optional :rlimits, ResourceLimits, 4
       optional :discard_output, :bool, 5, :default => false
       optional :log_tag, :string, 6
+      optional :ring_buffer_size, :uint32, 7
+      optional :max_chunk_size, :uint32, 8
     end
 
     class SpawnResponse
@@ -38,6 +38,18 @@ module Warden::Protocol
       it_should_default_to nil
     end
 
+    field :ring_buffer_size do
+      it_should_be_optional
+      it_should_default_to nil
+      it_should_be_typed_as_uint32
+    end
+
+    field :max_chunk_size do
+      it_should_be_optional
+      it_should_default_to nil
+      it_should_be_typed_as_uint32
+    end
+
     field :rlimits do
       it_should_be_optional
 
@@ -37,6 +37,18 @@ describe Warden::Protocol::SpawnRequest do
     it_should_default_to nil
   end
 
+  field :ring_buffer_size do
+    it_should_be_optional
+    it_should_default_to nil
+    it_should_be_typed_as_uint32
+  end
+
+  field :max_chunk_size do
+    it_should_be_optional
+    it_should_default_to nil
+    it_should_be_typed_as_uint32
+  end
+
   it "should be populated with ResourceLimits object" do
     request.rlimits = Warden::Protocol::ResourceLimits.new
     expect(request).to be_valid
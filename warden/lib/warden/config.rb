@@ -10,11 +10,17 @@ module Warden
         "unix_domain_permissions" => 0755,
         "container_klass"         => "Warden::Container::Insecure",
         "container_grace_time"    => (5 * 60), # 5 minutes
+        "container_pool_size"     => 0,
+        "container_reaper_concurrency" => 2,
+        "container_recovery_concurrency" => 8,
         "job_output_limit"        => (10 * 1024 * 1024), # 10 megabytes
         "quota" => {
           "disk_quota_enabled" => true,
         },
         "allow_nested_warden" => false,
+        "framed_job_links" => false,
+        "wshd_jobs" => true,
+        "native_setup" => true,
       }
     end
 
@@ -36,6 +42,19 @@ module Warden
           "container_klass"       => String,
           "container_grace_time"  => enum(nil, Integer),
 
+          # Containers to create and start ahead of create requests, per
+          # rootfs. Requests with a network or bind mounts are not served
+          # from the pool.
+          "container_pool_size"   => Integer,
+
+          # Destroyed containers are deleted in the background, this many at
+          # a time.
+          "container_reaper_concurrency" => Integer,
+
+          # Containers found in the depot on startup are recovered in the
+          # background, this many at a time.
+          "container_recovery_concurrency" => Integer,
+
           # See getrlimit(2) for details. Integer values are passed verbatim.
           optional("container_rlimits") => {
             optional("as")         => Integer,
@@ -63,6 +82,18 @@ module Warden
 
           "allow_nested_warden" => bool,
 
+          # Link jobs over a single framed connection (iomux-attach) instead
+          # of one connection per stream (iomux-link).
+          optional("framed_job_links") => bool,
+
+          # Run jobs of linux containers inside wshd, attaching to them over
+          # jobs.sock, instead of through iomux-spawn, wsh, and iomux-link.
+          optional("wshd_jobs") => bool,
+
+          # Create linux containers with the setup helper in src/setup instead
+          # of create.sh and setup.sh, when the helper was built.
+          optional("native_setup") => bool,
+
           optional("pidfile") => enum(nil, String),
 
           optional("syslog_socket") => enum(nil, String),
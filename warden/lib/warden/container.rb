@@ -2,6 +2,7 @@
 
 # Insecure container should be available on all platforms
 require "warden/container/insecure"
+require "warden/container/warm_pool"
 
 # Require Linux container only when running on Linux
 if RUBY_PLATFORM =~ /linux/i
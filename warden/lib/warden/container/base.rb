@@ -3,6 +3,7 @@
 require "warden/container/spawn"
 require "warden/errors"
 require "warden/event_emitter"
+require "warden/metrics"
 require "warden/util"
 
 require "eventmachine"
@@ -22,6 +23,11 @@ module Warden
       include EventEmitter
       include Spawn
 
+      # Upper bounds that iomux-spawn and wshd put on the output buffering
+      # options of a spawn request
+      MAX_RING_BUFFER_SIZE = 64 * 1024 * 1024
+      MAX_CHUNK_SIZE = 16 * 1024 * 1024
+
       class << self
 
         attr_reader :root_path
@@ -37,8 +43,19 @@ module Warden
           @registry ||= {}
         end
 
+        # Maps handles of containers that are still being recovered to the
+        # fibers waiting for them.
+        def recovering
+          @recovering ||= {}
+        end
+
+        def handle_in_use?(handle)
+          registry.has_key?(handle) || recovering.has_key?(handle)
+        end
+
         def reset!
           @registry = nil
+          @recovering = nil
         end
 
         # These attributes need to be set by some setup routine.
@@ -107,6 +124,13 @@ module Warden
           true
         end
 
+        # Whether a container that was warmed up ahead of time can serve a
+        # create request (see WarmPool). Networks and bind mounts can only be
+        # set up while the container starts.
+        def warmable?(request)
+          request.network.nil? && Array(request.bind_mounts).empty?
+        end
+
         def from_snapshot(container_path)
           snapshot = Yajl::Parser.parse(File.read(snapshot_path(container_path)), :check_utf8 => false)
           snapshot["resources"]["network"] = Warden::Network::Address.new(snapshot["resources"]["network"])
@@ -282,20 +306,27 @@ module Warden
         t1 = Time.now
 
         before_method = "before_%s" % klass_name
-        hook(before_method, request, response)
-        emit(before_method.to_sym)
+        Metrics.time("%s.before" % klass_name) do
+          hook(before_method, request, response)
+          emit(before_method.to_sym)
+        end
 
         around_method = "around_%s" % klass_name
-        hook(around_method, request, response) do
-          do_method = "do_%s" % klass_name
-          send(do_method, request, response, &blk)
+        Metrics.time("%s.do" % klass_name) do
+          hook(around_method, request, response) do
+            do_method = "do_%s" % klass_name
+            send(do_method, request, response, &blk)
+          end
         end
 
         after_method = "after_%s" % klass_name
-        emit(after_method.to_sym)
-        hook(after_method, request, response)
+        Metrics.time("%s.after" % klass_name) do
+          emit(after_method.to_sym)
+          hook(after_method, request, response)
+        end
 
         t2 = Time.now
+        Metrics.observe(klass_name, t2 - t1)
 
         logger.debug("%s (took %.6f)" % [klass_name, t2 - t1],
                     :request => request.filtered_hash,
@@ -364,7 +395,7 @@ module Warden
 
         if !@resources.has_key?("handle")
           if opts[:handle]
-            if self.class.registry[opts[:handle]]
+            if self.class.handle_in_use?(opts[:handle])
               raise WardenError.new("container with handle: #{opts[:handle]} already exists.")
             end
 
@@ -471,6 +502,44 @@ module Warden
         raise WardenError.new("not implemented")
       end
 
+      # Creates and starts the container like a create request would, without
+      # making it visible to clients yet.
+      def warm_up(request)
+        response = request.create_response
+
+        hook(:before_create, request, response)
+
+        hook(:around_create, request, response) do
+          do_create(request, response)
+        end
+
+        nil
+      end
+
+      # Completes a create request with a container that was warmed up.
+      def claim(request)
+        response = request.create_response
+
+        check_state_in(State::Born)
+
+        new_handle = request.handle || handle
+        if self.class.handle_in_use?(new_handle)
+          raise WardenError.new("container with handle: #{new_handle} already exists.")
+        end
+
+        @resources["handle"] = new_handle
+        @logger = nil
+
+        if request.grace_time
+          self.grace_time = request.grace_time
+        end
+
+        emit(:after_create)
+        hook(:after_create, request, response)
+
+        response
+      end
+
       def around_stop
         check_state_in(State::Active, State::Stopped)
 
@@ -529,8 +598,9 @@ module Warden
         raise WardenError.new("not implemented")
       end
 
-      def around_spawn
+      def around_spawn(request, response)
         check_state_in(State::Active)
+        check_output_buffering(request)
 
         begin
           delete_snapshot
@@ -586,6 +656,8 @@ module Warden
           :rlimits => request.rlimits,
           :discard_output => request.discard_output,
           :log_tag => request.log_tag,
+          :ring_buffer_size => request.ring_buffer_size,
+          :max_chunk_size => request.max_chunk_size,
         })
 
         spawn_response = dispatch(spawn_request)
@@ -747,6 +819,24 @@ module Warden
         end
       end
 
+      # Rejects buffering options that iomux-spawn or wshd would refuse, so the
+      # request fails with a useful error instead of a failed spawn
+      def check_output_buffering(request)
+        limits = {
+          "ring_buffer_size" => MAX_RING_BUFFER_SIZE,
+          "max_chunk_size" => MAX_CHUNK_SIZE,
+        }
+
+        limits.each do |field, max|
+          value = request.send(field)
+          next if value.nil?
+
+          unless value > 0 && value <= max
+            raise WardenError.new("#{field} must be between 1 and #{max}, got #{value}")
+          end
+        end
+      end
+
       # Converts resource limits mentioned in a spawn/run request into a hash of
       # environment variables that can be passed to the job being spawned.
       def resource_limits(request)
@@ -775,7 +865,11 @@ module Warden
         f = Fiber.current
 
         spawn_path = File.join(bin_path, "iomux-spawn")
-        spawner = DeferredChild.new(spawn_path, job_root, *args)
+        spawn_args = []
+        spawn_args += ["-r", run_options[:ring_buffer_size].to_s] if run_options[:ring_buffer_size]
+        spawn_args += ["-c", run_options[:max_chunk_size].to_s] if run_options[:max_chunk_size]
+
+        spawner = DeferredChild.new(spawn_path, *spawn_args, job_root, *args)
         spawner.logger = logger
 
         # When iomux-spawn starts up, there is a chance that it can fail before
@@ -820,7 +914,7 @@ module Warden
         end
 
         # Wait for the spawner to be ready to receive connections
-        spawner_alive = Fiber.yield
+        spawner_alive = Metrics.time("spawn.spawner") { Fiber.yield }
         raise WardenError.new("iomux-spawn failed")  if spawner_alive == :no
 
         # Wait for the spawned child to be continued
@@ -828,7 +922,7 @@ module Warden
         job.logger = logger
         job.run(run_options)
 
-        spawner_alive = Fiber.yield
+        spawner_alive = Metrics.time("spawn.child") { Fiber.yield }
         raise WardenError.new("iomux-spawn failed") if spawner_alive == :no
 
         job
@@ -836,11 +930,15 @@ module Warden
         catch_spawner_failure = false
       end
 
+      def recover_job(job_id, job_snapshot)
+        Job.new(self, job_id, job_snapshot)
+      end
+
       def recover_jobs(jobs_snapshot)
         jobs = {}
 
         jobs_snapshot.each do |job_id, job_snapshot|
-          job = Job.new(self, Integer(job_id), job_snapshot)
+          job = recover_job(Integer(job_id), job_snapshot)
 
           if !job.terminated? && job.stale?
             job.cleanup
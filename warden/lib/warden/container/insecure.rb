@@ -43,6 +43,8 @@ module Warden
           { discard_output: request.discard_output,
             syslog_socket: Server.config.server["syslog_socket"],
             log_tag: request.log_tag,
+            ring_buffer_size: request.ring_buffer_size,
+            max_chunk_size: request.max_chunk_size,
           },
           File.join(container_path, "run.sh"),
           input: request.script,
@@ -27,6 +27,16 @@ module Warden
           File.join(job_root_path, "cursors")
         end
 
+        # Jobs spawned by an older iomux-spawn don't serve job.sock
+        def link_command
+          if Server.config.server["framed_job_links"] &&
+              File.exist?(File.join(job_root_path, "job.sock"))
+            File.join(container.bin_path, "iomux-attach")
+          else
+            File.join(container.bin_path, "iomux-link")
+          end
+        end
+
         # Assumption: spawner cleans up after itself
         def stale?
           File.directory?(job_root_path) && Dir.glob(File.join(job_root_path, "*.sock")).empty?
@@ -39,14 +49,19 @@ module Warden
         def run(options = {})
           discard_output = @snapshot.fetch("discard_output", options[:discard_output])
           syslog_tag = @snapshot.fetch("log_tag", options[:log_tag])
+          max_chunk_size = @snapshot.fetch("max_chunk_size", options[:max_chunk_size])
 
           syslog_socket = options[:syslog_socket]
 
           @snapshot["discard_output"] = discard_output
           @snapshot["log_tag"] = syslog_tag
+          @snapshot["max_chunk_size"] = max_chunk_size
 
           if !terminated?
-            iomux_link = File.join(container.bin_path, "iomux-link")
+            iomux_link = link_command
+
+            link_args = ["-w", cursors_path]
+            link_args += ["-c", max_chunk_size.to_s] if max_chunk_size
 
             argv =
               if syslog_tag
@@ -59,12 +74,12 @@ module Warden
                 [ "/bin/bash",
                   "-c",
                   # tee to logger and back to stdout/stderr
-                  "exec #{iomux_link} -w #{cursors_path} #{job_root_path}" \
+                  "exec #{iomux_link} #{link_args.join(" ")} #{job_root_path}" \
                     " 1> >(tee -a >(#{out_logger_command}) >&1)" \
                     " 2> >(tee -a >(#{err_logger_command}) >&2)",
                 ]
               else
-                [iomux_link, "-w", cursors_path, job_root_path]
+                [iomux_link, *link_args, job_root_path]
               end
 
             @child = DeferredChild.new(*argv,
@@ -5,7 +5,10 @@ require "warden/container/features/cgroup"
 require "warden/container/features/mem_limit"
 require "warden/container/features/net"
 require "warden/container/features/quota"
+require "warden/container/reaper"
+require "warden/container/wshd_job"
 require "warden/errors"
+require "warden/metrics"
 
 require "shellwords"
 
@@ -24,6 +27,13 @@ module Warden
 
         attr_reader :bind_mount_script_template
 
+        # Filesystem that instances in the depot are mounted with, as probed
+        # by the setup helper when the server starts.
+        attr_reader :container_fs_type
+
+        # Deletes the directories of destroyed containers in the background
+        attr_reader :reaper
+
         def setup(config)
           unless Process.uid == 0
             raise WardenError.new("linux containers require root privileges")
@@ -52,6 +62,47 @@ module Warden
           }
 
           sh File.join(root_path, "setup.sh"), options
+
+          if native_setup?(config)
+            @container_fs_type = sh(setup_path, "probe", container_depot_path).strip
+          end
+
+          setup_reaper(config)
+        end
+
+        # Containers are buried as <container_id>.<uid>. Their uid is only
+        # released once they were deleted, so that files left behind don't
+        # count towards the disk quota of the next container using it.
+        def setup_reaper(config)
+          @reaper = Reaper.new(File.join(container_depot_path, ".graveyard"),
+                               config.server["container_reaper_concurrency"],
+                               File.join(root_path, "reap.sh"))
+
+          reaper.entries.each do |grave_path|
+            uid = grave_uid(grave_path)
+            uid_pool.delete(uid) if uid
+
+            reaper.enqueue(grave_path) do
+              uid_pool.release(uid) if uid
+            end
+          end
+        end
+
+        def grave_uid(grave_path)
+          uid = File.basename(grave_path).split(".", 2)[1]
+          Integer(uid) if uid =~ /\A\d+\z/
+        end
+
+        def setup_path
+          Warden::Util.path("src/setup/setup")
+        end
+
+        def native_setup?(config = Server.config)
+          config.server["native_setup"] && File.executable?(setup_path)
+        end
+
+        def warmable?(request)
+          super && (request.rootfs.nil? || Dir.exist?(request.rootfs))
         end
 
         def alive?(path)
@@ -84,6 +135,7 @@ module Warden
           "allow_nested_warden" => Server.config.allow_nested_warden?.to_s,
           "container_iface_mtu" => container_iface_mtu,
           "dns_servers" => Server.config.network["dns_servers"].join("\n"),
+          "fs_type" => self.class.container_fs_type.to_s,
         }
       end
 
@@ -98,14 +150,38 @@ module Warden
           options[:env]["rootfs_path"] = request.rootfs
         end
 
-        sh File.join(root_path, "create.sh"), container_path, options
-        logger.debug("Container created")
+        if self.class.native_setup?
+          skeleton_path = File.join(root_path, "skeleton")
+          out = Metrics.time("create.setup") do
+            sh self.class.setup_path, "create", skeleton_path, container_path, options
+          end
+
+          timings = Metrics.parse_timings(out)
+          Metrics.observe_all("create.setup", timings)
+          logger.debug("Container created", :timings => timings)
+        else
+          Metrics.time("create.setup") do
+            sh File.join(root_path, "create.sh"), container_path, options
+          end
+
+          logger.debug("Container created")
+        end
 
         write_bind_mount_commands(request)
         logger.debug2("Wrote bind mount commands")
 
-        sh File.join(container_path, "start.sh"), options
-        logger.debug("Container started")
+        out = Metrics.time("create.start") do
+          sh File.join(container_path, "start.sh"), options
+        end
+
+        # start.sh prints how long net.sh took, wshd how long its hooks took
+        timings = Metrics.parse_timings(out)
+        timings.merge!(Metrics.parse_timings(wshd_out_log))
+        Metrics.observe_all("create.start", timings)
+        logger.debug("Container started", :timings => timings)
+
+        # The wsh and wshd of this container can copy files themselves
+        @resources["wshd_copy"] = true
 
         nil
       end
@@ -120,14 +196,44 @@ module Warden
       end
 
       def do_destroy(request, response)
-        sh File.join(container_path, "stop.sh"), "-w", "0", raise: false
-        sh File.join(root_path, "destroy.sh"), container_path
+        Metrics.time("destroy.stop") do
+          sh File.join(container_path, "stop.sh"), "-w", "0", raise: false
+        end
+
+        # Tear down the network and cgroups before the network is released
+        Metrics.time("destroy.cleanup") do
+          if File.exist?(File.join(container_path, "etc", "config"))
+            sh File.join(container_path, "destroy.sh")
+          end
+        end
+
+        if File.directory?(container_path)
+          uid = @acquired["uid"]
+          name = [container_id, uid].compact.join(".")
+
+          begin
+            self.class.reaper.bury(container_path, name) do
+              self.class.uid_pool.release(uid) if uid
+            end
+
+            # Released by the reaper
+            @acquired.delete("uid")
+          rescue SystemCallError => err
+            logger.warn("Deleting container in place: #{err.message}")
+            sh File.join(root_path, "reap.sh"), container_path
+          end
+        end
+
         logger.debug("Container destroyed")
 
         nil
       end
 
       def create_job(request)
+        if wshd_jobs?
+          return create_wshd_job(request)
+        end
+
         wsh_path = File.join(bin_path, "wsh")
         socket_path = File.join(container_path, "run", "wshd.sock")
         user = request.privileged ? "root" : "vcap"
@@ -150,6 +256,8 @@ module Warden
           discard_output: request.discard_output,
           syslog_socket: Server.config.server["syslog_socket"],
           log_tag: request.log_tag,
+          ring_buffer_size: request.ring_buffer_size,
+          max_chunk_size: request.max_chunk_size,
         }
 
         spawn_job(run_options, *args)
@@ -159,7 +267,18 @@ module Warden
         src_path = request.src_path
         dst_path = request.dst_path
 
-        perform_rsync(src_path, "vcap@container:#{dst_path}")
+        if wshd_copy?
+          rootfs_path = container_rootfs_path
+
+          if rootfs_path
+            # Copy straight into the root of the container, skipping wshd
+            perform_wsh_copy("--copy-in", src_path, dst_path, "--rootfs", rootfs_path)
+          else
+            perform_wsh_copy("--copy-in", src_path, dst_path)
+          end
+        else
+          perform_rsync(src_path, "vcap@container:#{dst_path}")
+        end
 
         nil
       end
@@ -168,7 +287,11 @@ module Warden
         src_path = request.src_path
         dst_path = request.dst_path
 
-        perform_rsync("vcap@container:#{src_path}", dst_path)
+        if wshd_copy?
+          perform_wsh_copy("--copy-out", src_path, dst_path)
+        else
+          perform_rsync("vcap@container:#{src_path}", dst_path)
+        end
 
         if request.owner
           sh "chown", "-R", request.owner, dst_path
@@ -179,6 +302,81 @@ module Warden
 
       private
 
+      def jobs_socket_path
+        File.join(container_path, "run", "jobs.sock")
+      end
+
+      # Containers created before wshd served jobs.sock keep using wsh
+      def wshd_jobs?
+        Server.config.server["wshd_jobs"] && File.exist?(jobs_socket_path)
+      end
+
+      def create_wshd_job(request)
+        user = request.privileged ? "root" : "vcap"
+        lang = { "LANG" => ENV['LANG'] || "en_US.UTF-8" }
+
+        spawn_options = {
+          ring_buffer_size: request.ring_buffer_size,
+          max_chunk_size: request.max_chunk_size,
+        }
+
+        wshd_job_id = Metrics.time("spawn.wshd") do
+          WshdJob.spawn(jobs_socket_path, user, ["/bin/bash"],
+                        resource_limits(request).merge(lang),
+                        request.script, spawn_options)
+        end
+
+        job = WshdJob.new(self, self.class.generate_job_id, "wshd_job_id" => wshd_job_id)
+        job.logger = logger
+        job.run(
+          discard_output: request.discard_output,
+          syslog_socket: Server.config.server["syslog_socket"],
+          log_tag: request.log_tag,
+        )
+
+        job
+      end
+
+      def recover_job(job_id, job_snapshot)
+        if job_snapshot.has_key?("wshd_job_id")
+          WshdJob.new(self, job_id, job_snapshot)
+        else
+          super
+        end
+      end
+
+      def wshd_out_log
+        File.read(File.join(container_path, "run", "wshd.out.log"))
+      rescue Errno::ENOENT
+        ""
+      end
+
+      # Containers created before wsh could copy files keep using rsync
+      def wshd_copy?
+        @resources["wshd_copy"]
+      end
+
+      # Root of the container as seen from the host, through its wshd
+      def container_rootfs_path
+        pid_path = File.join(container_path, "run", "wshd.pid")
+        return nil unless File.exist?(pid_path)
+
+        proc_path = File.join("/proc", File.read(pid_path).strip)
+
+        # The pid is stale when wshd is gone, and may have been reused
+        comm = File.read(File.join(proc_path, "comm")).strip rescue nil
+        return nil unless comm == "wshd"
+
+        File.join(proc_path, "root")
+      end
+
+      def perform_wsh_copy(mode, src_path, dst_path, *args)
+        wsh_path = File.join(bin_path, "wsh")
+        socket_path = File.join(container_path, "run", "wshd.sock")
+
+        sh wsh_path, "--socket", socket_path, "--user", "vcap", *args, mode, src_path, dst_path
+      end
+
       def perform_rsync(src_path, dst_path)
         wsh_path = File.join(bin_path, "wsh")
         socket_path = File.join(container_path, "run", "wshd.sock")
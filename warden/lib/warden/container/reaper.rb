@@ -0,0 +1,102 @@
+# coding: UTF-8
+
+require "warden/container/spawn"
+require "warden/errors"
+require "warden/metrics"
+
+require "eventmachine"
+require "fiber"
+require "fileutils"
+require "steno"
+require "steno/core_ext"
+
+module Warden
+
+  module Container
+
+    # Deletes the directories of destroyed containers in the background, so
+    # that destroy requests don't wait for their writable layer to be removed.
+    #
+    # Directories are moved into the graveyard, which must be on the same file
+    # system as the container depot. Entries left in the graveyard when the
+    # server stops are reaped when it starts again.
+    class Reaper
+
+      include Spawn
+
+      # Seconds to wait before reaping an entry again after a failure
+      RETRY_DELAY = 10
+
+      attr_reader :graveyard_path
+      attr_reader :concurrency
+
+      def initialize(graveyard_path, concurrency, reap_script)
+        @graveyard_path = graveyard_path
+        @concurrency = [concurrency, 1].max
+        @reap_script = reap_script
+        @queue = []
+        @active = 0
+
+        FileUtils.mkdir_p(graveyard_path)
+      end
+
+      # Paths of the entries currently in the graveyard
+      def entries
+        Dir.glob(File.join(graveyard_path, "*"))
+      end
+
+      # Number of entries queued or being reaped
+      def pending
+        @queue.size + @active
+      end
+
+      # Moves path into the graveyard as name, and queues it to be reaped. The
+      # block is called once it was deleted.
+      def bury(path, name, &blk)
+        grave_path = File.join(graveyard_path, name)
+        File.rename(path, grave_path)
+
+        enqueue(grave_path, &blk)
+      end
+
+      # Queues an entry of the graveyard to be reaped
+      def enqueue(grave_path, &blk)
+        @queue << [grave_path, blk]
+
+        ::EM.next_tick { run }
+
+        grave_path
+      end
+
+      private
+
+      def run
+        while @active < concurrency && !@queue.empty?
+          grave_path, blk = @queue.shift
+          @active += 1
+
+          Fiber.new { reap(grave_path, blk) }.resume
+        end
+      end
+
+      def reap(grave_path, blk)
+        Metrics.time("destroy.reap") do
+          sh @reap_script, grave_path
+        end
+
+        logger.debug("Reaped #{grave_path}")
+
+        blk.call if blk
+      rescue WardenError => err
+        logger.log_exception(err)
+
+        ::EM.add_timer(RETRY_DELAY) do
+          enqueue(grave_path, &blk)
+        end
+      ensure
+        @active -= 1
+        run
+      end
+    end
+  end
+end
@@ -0,0 +1,131 @@
+# coding: UTF-8
+
+require "warden/errors"
+
+require "eventmachine"
+require "steno"
+require "steno/core_ext"
+require "warden/protocol"
+
+module Warden
+
+  module Container
+
+    # Holds containers that were created and started ahead of time, so that a
+    # create request only has to claim one. Containers are kept per rootfs,
+    # and every pool is refilled in the background, one container at a time,
+    # after a claim.
+    #
+    # Containers in a pool have acquired their uid and network, but are not
+    # in the registry and have no snapshot, so they are destroyed on restart.
+    class WarmPool
+
+      # Seconds to wait before warming up again after a failure
+      RETRY_DELAY = 5
+
+      # Number of create latencies a percentile report covers
+      LATENCY_WINDOW = 100
+
+      attr_reader :klass
+      attr_reader :size
+
+      def initialize(klass, size)
+        @klass = klass
+        @size = size
+        @containers = Hash.new { |h, k| h[k] = [] }
+        @filling = {}
+        @latencies = { true => [], false => [] }
+      end
+
+      # Number of containers ready to be claimed for rootfs
+      def ready(rootfs = nil)
+        @containers[rootfs].size
+      end
+
+      # Completes request with a container from the pool. Returns the
+      # container and the response, or nil when the request can't be served
+      # from the pool.
+      def claim(request)
+        return nil unless klass.warmable?(request)
+
+        rootfs = request.rootfs
+        container = @containers[rootfs].shift
+        refill(rootfs)
+
+        return nil unless container
+
+        begin
+          response = container.claim(request)
+        rescue WardenError
+          @containers[rootfs].unshift(container)
+          raise
+        end
+
+        [container, response]
+      end
+
+      # Starts warming up containers for rootfs until its pool is full
+      def refill(rootfs = nil)
+        return if @filling[rootfs]
+        return if @containers[rootfs].size >= size
+
+        @filling[rootfs] = true
+
+        ::EM.next_tick do
+          Fiber.new { warm_up(rootfs) }.resume
+        end
+      end
+
+      # Records how long a create took, with or without the pool, and reports
+      # percentiles once enough creates were seen.
+      def record(pooled, duration)
+        latencies = @latencies[pooled]
+        latencies << duration
+
+        return if latencies.size < LATENCY_WINDOW
+
+        sorted = latencies.sort
+        latencies.clear
+
+        logger.info("Create latency", {
+          :pooled => pooled,
+          :count => sorted.size,
+          :p50 => percentile(sorted, 50),
+          :p90 => percentile(sorted, 90),
+          :p99 => percentile(sorted, 99),
+          :max => sorted.last,
+        })
+      end
+
+      private
+
+      def warm_up(rootfs)
+        t1 = Time.now
+
+        container = klass.new
+        container.warm_up(Protocol::CreateRequest.new(:rootfs => rootfs))
+
+        @containers[rootfs] << container
+
+        logger.debug("Warmed up container (took %.6f)" % [Time.now - t1],
+                     :rootfs => rootfs,
+                     :ready => @containers[rootfs].size)
+
+        @filling.delete(rootfs)
+        refill(rootfs)
+      rescue => err
+        logger.log_exception(err)
+
+        ::EM.add_timer(RETRY_DELAY) do
+          @filling.delete(rootfs)
+          refill(rootfs)
+        end
+      end
+
+      # Nearest rank
+      def percentile(sorted, p)
+        sorted[[(sorted.size * p / 100.0).ceil - 1, 0].max]
+      end
+    end
+  end
+end
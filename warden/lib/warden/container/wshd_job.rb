@@ -0,0 +1,436 @@
+# coding: UTF-8
+
+require "warden/container/base"
+require "warden/errors"
+
+require "em/posix/spawn"
+require "eventmachine"
+require "socket"
+
+module Warden
+  module Container
+    class Base
+      # A job that wshd runs and buffers itself (see src/wsh/job.h). Instead of
+      # forking iomux-spawn, wsh, and iomux-link per job, warden talks to
+      # wshd over a single connection to jobs.sock per request.
+      class WshdJob < Job
+        MAGIC = 0x5753484a # "WSHJ"
+        VERSION = 1
+
+        REQUEST_SPAWN = 1
+        REQUEST_ATTACH = 2
+        REQUEST_KILL = 3
+
+        HEADER_SIZE = 16
+        FRAME_HEADER_SIZE = 16
+
+        TAG_USER = 1
+        TAG_ARG = 2
+        TAG_ENV = 3
+        TAG_STDIN = 4
+        TAG_RING_BUFFER_SIZE = 5
+        TAG_MAX_CHUNK_SIZE = 6
+
+        STREAM_STDOUT = 0
+        STREAM_STDERR = 1
+        STREAM_STATUS = 2
+
+        def self.header(type, length)
+          [MAGIC, VERSION, type, length].pack("NNNN")
+        end
+
+        def self.record(tag, value)
+          value = value.to_s.b
+          [tag, value.bytesize].pack("CN") + value
+        end
+
+        def self.encode_spawn(user, argv, env, input, options = {})
+          body = record(TAG_USER, user)
+          argv.each { |arg| body << record(TAG_ARG, arg) }
+          env.each { |key, value| body << record(TAG_ENV, "#{key}=#{value}") }
+          body << record(TAG_STDIN, input) if input
+
+          if options[:ring_buffer_size]
+            body << record(TAG_RING_BUFFER_SIZE, [options[:ring_buffer_size]].pack("N"))
+          end
+
+          if options[:max_chunk_size]
+            body << record(TAG_MAX_CHUNK_SIZE, [options[:max_chunk_size]].pack("N"))
+          end
+
+          header(REQUEST_SPAWN, body.bytesize) + body
+        end
+
+        # Asks wshd to start a job. Must be called from within a fiber, which
+        # is resumed once wshd has replied.
+        #
+        # Returns the id that wshd assigned to the job.
+        def self.spawn(socket_path, user, argv, env, input, options = {})
+          f = Fiber.current
+
+          request = encode_spawn(user, argv, env, input, options)
+
+          begin
+            conn = EM.connect_unix_domain(socket_path, SpawnConnection, request)
+          rescue EM::ConnectionError, RuntimeError => err
+            raise WardenError.new("cannot connect to wshd: #{err.message}")
+          end
+
+          conn.callback { |id| f.resume(:ok, id) }
+          conn.errback { |error| f.resume(:err, error) }
+
+          status, result = Fiber.yield
+
+          if status == :err
+            message = "wshd failed to spawn job"
+            message += ": #{result}" if result
+            raise WardenError.new(message)
+          end
+
+          result
+        end
+
+        class SpawnConnection < ::EM::Connection
+          include ::EM::Deferrable
+
+          # Upper bound on the reply, see JOB_MAX_ERROR_LENGTH in job.h
+          MAX_REPLY_LENGTH = 4 + 256
+
+          def initialize(request)
+            @request = request
+            @buffer = "".b
+            @id = nil
+            @error = nil
+          end
+
+          def post_init
+            send_data(@request)
+          end
+
+          def receive_data(data)
+            @buffer << data
+            return if @buffer.bytesize < HEADER_SIZE
+
+            magic, _, type, length = @buffer.unpack("NNNN")
+            unless magic == MAGIC && type == REQUEST_SPAWN && length.between?(4, MAX_REPLY_LENGTH)
+              close_connection
+              return
+            end
+
+            return if @buffer.bytesize < HEADER_SIZE + length
+
+            # An id of 0 means the job couldn't be spawned, and says why
+            id = @buffer.byteslice(HEADER_SIZE, 4).unpack("N").first
+            if id == 0
+              @error = @buffer.byteslice(HEADER_SIZE + 4, length - 4)
+            else
+              @id = id
+            end
+
+            close_connection
+          end
+
+          def unbind
+            if @id
+              set_deferred_success(@id)
+            else
+              set_deferred_failure(@error)
+            end
+          end
+        end
+
+        # Sends a signal to the job, without waiting for anything in return.
+        class KillConnection < ::EM::Connection
+          def initialize(id, signal)
+            @id = id
+            @signal = signal
+          end
+
+          def post_init
+            body = [@id, @signal].pack("NN")
+            send_data(WshdJob.header(REQUEST_KILL, body.bytesize) + body)
+            close_connection_after_writing
+          end
+        end
+
+        # Sends output to syslog the way `logger -d` would, one datagram per
+        # line.
+        class SyslogWriter
+          # Facility user, severity info and error
+          PRIORITIES = { "stdout" => 14, "stderr" => 11 }
+
+          def initialize(tag, socket_path)
+            @tag = "warden.#{tag}"
+            @socket_path = socket_path || "/dev/log"
+            @partial = Hash.new { |h, k| h[k] = "".b }
+          end
+
+          def write(name, data)
+            lines = (@partial[name] << data).split("\n", -1)
+            @partial[name] = lines.pop
+
+            lines.each { |line| send_line(name, line) }
+          end
+
+          def flush
+            @partial.each do |name, line|
+              send_line(name, line) unless line.empty?
+            end
+
+            @partial.clear
+          end
+
+          def close
+            flush
+            @socket.close if @socket
+            @socket = nil
+          end
+
+          private
+
+          def send_line(name, line)
+            timestamp = Time.now.strftime("%b %e %H:%M:%S")
+            message = "<#{PRIORITIES[name]}>#{timestamp} #{@tag}: #{line}"
+
+            socket.sendmsg_nonblock(message)
+          rescue IO::WaitWritable, SystemCallError
+            # Drop the line, like logger does when syslog is not keeping up
+          end
+
+          def socket
+            @socket ||= Socket.new(:UNIX, :DGRAM).tap do |s|
+              s.connect(Socket.sockaddr_un(@socket_path))
+            end
+          end
+        end
+
+        # Attached stream of a job. Listeners have the same interface as the
+        # ones of EM::POSIX::Spawn::Child, so that Job#stream works unchanged.
+        class Stream
+          Listener = ::EM::POSIX::Spawn::Child::ReadableStream::Listener
+
+          attr_reader :buffer
+
+          def initialize(name, discard_output)
+            @name = name
+            @discard_output = discard_output
+            @buffer = "".b
+            @listeners = []
+            @closed = false
+          end
+
+          def <<(data)
+            @buffer << data unless @discard_output
+            @listeners.each { |listener| listener.call(@buffer) }
+          end
+
+          def close
+            @closed = true
+            @listeners.each { |listener| listener.close(@buffer) }
+            @listeners.clear
+          end
+
+          def add_listener(&block)
+            listener = Listener.new(@name, &block)
+
+            if @closed
+              EM.next_tick { listener.close(@buffer) }
+            else
+              EM.next_tick { listener.call(@buffer) } unless @buffer.empty?
+              @listeners << listener
+            end
+
+            listener
+          end
+        end
+
+        # Connection to wshd that receives the framed output and the exit
+        # status of a job. Takes the place of the iomux-link child of Job.
+        class AttachConnection < ::EM::Connection
+          include ::EM::Deferrable
+
+          STREAM_NAMES = ["stdout", "stderr"]
+
+          attr_reader :exit_status
+
+          def initialize(job, options)
+            @job = job
+            @max = options[:max]
+            @discard_output = options[:discard_output]
+            @syslog = options[:syslog]
+
+            @buffer = "".b
+            @frame = nil
+            @status = nil
+            @failed = false
+            @streams = STREAM_NAMES.map { |name| Stream.new(name, @discard_output) }
+          end
+
+          def post_init
+            body = [@job.wshd_job_id, *@job.positions].pack("NQ>Q>")
+            send_data(WshdJob.header(REQUEST_ATTACH, body.bytesize) + body)
+          end
+
+          def stdout
+            @streams[STREAM_STDOUT].buffer
+          end
+
+          def stderr
+            @streams[STREAM_STDERR].buffer
+          end
+
+          def add_streams_listener(&listener)
+            @streams.map { |stream| stream.add_listener(&listener) }
+          end
+
+          def kill(signal = "TERM")
+            @job.signal(signal)
+          end
+
+          def receive_data(data)
+            @buffer << data
+
+            while !@failed
+              if @frame.nil?
+                break if @buffer.bytesize < FRAME_HEADER_SIZE
+
+                @frame = @buffer.unpack("CxxxNQ>")
+                @buffer = @buffer.byteslice(FRAME_HEADER_SIZE..-1)
+              end
+
+              stream, length, pos = @frame
+              break if @buffer.bytesize < length
+
+              payload = @buffer.byteslice(0, length)
+              @buffer = @buffer.byteslice(length..-1)
+              @frame = nil
+
+              receive_frame(stream, pos, payload)
+            end
+          end
+
+          def unbind
+            return if @failed
+
+            @streams.each(&:close)
+            @syslog.close if @syslog
+
+            # Without a status, the job is lost (e.g. wshd went away)
+            @exit_status =
+              if @status && (@status & 0x7f) == 0
+                (@status >> 8) & 0xff
+              else
+                255
+              end
+
+            set_deferred_success
+          end
+
+          protected
+
+          def receive_frame(stream, pos, payload)
+            if stream == STREAM_STATUS
+              @status = payload.unpack("N").first
+              close_connection
+              return
+            end
+
+            return if stream > STREAM_STDERR
+
+            @streams[stream] << payload
+            @job.advance(stream, pos + payload.bytesize)
+            @syslog.write(STREAM_NAMES[stream], payload) if @syslog
+
+            if !@discard_output && @max && stdout.bytesize + stderr.bytesize > @max
+              abort_output(WardenError.new("command exceeded maximum output"))
+            end
+          end
+
+          def abort_output(err)
+            @failed = true
+            @streams.each(&:close)
+            @syslog.close if @syslog
+            close_connection
+
+            set_deferred_failure(err)
+          end
+        end
+
+        def wshd_job_id
+          @snapshot["wshd_job_id"]
+        end
+
+        # Stream positions up to which output was delivered. They are saved
+        # with the container snapshot, so a recovered job is attached after
+        # the output it delivered before the restart. A snapshot written before
+        # the last frames arrived means those frames are delivered again.
+        def positions
+          @snapshot.fetch("positions", [0, 0])
+        end
+
+        def advance(stream, pos)
+          positions = self.positions.dup
+          positions[stream] = [positions[stream], pos].max
+          @snapshot["positions"] = positions
+        end
+
+        def socket_path
+          File.join(container.container_path, "run", "jobs.sock")
+        end
+
+        # wshd retains jobs until their exit status has been collected
+        def stale?
+          false
+        end
+
+        def signal(signal)
+          signo = signal.is_a?(Integer) ? signal : Signal.list.fetch(signal.to_s)
+          EM.connect_unix_domain(socket_path, KillConnection, wshd_job_id, signo)
+        rescue EM::ConnectionError, RuntimeError => err
+          logger.warn("Cannot signal job #{wshd_job_id}: #{err}") if logger
+        end
+
+        def run(options = {})
+          discard_output = @snapshot.fetch("discard_output", options[:discard_output])
+          syslog_tag = @snapshot.fetch("log_tag", options[:log_tag])
+
+          @snapshot["discard_output"] = discard_output
+          @snapshot["log_tag"] = syslog_tag
+
+          if !terminated?
+            syslog = SyslogWriter.new(syslog_tag, options[:syslog_socket]) if syslog_tag
+
+            begin
+              @child = EM.connect_unix_domain(socket_path, AttachConnection, self,
+                :max => Server.config.server["job_output_limit"],
+                :discard_output => discard_output,
+                :syslog => syslog)
+            rescue EM::ConnectionError, RuntimeError => err
+              logger.warn("Cannot attach to job #{wshd_job_id}: #{err}") if logger
+              @snapshot["status"] = [255, "", ""]
+              return
+            end
+
+            setup_child_handlers
+          end
+        end
+
+        protected
+
+        def setup_child_handlers
+          @child.callback do
+            resume [@child.exit_status, @child.stdout, @child.stderr]
+          end
+
+          @child.errback do |err|
+            @err = err
+            # Stop the job, it is of no use without its output
+            signal("TERM")
+
+            resume [255, @child.stdout, @child.stderr]
+          end
+        end
+      end
+    end
+  end
+end
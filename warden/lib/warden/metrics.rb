@@ -0,0 +1,105 @@
+# coding: UTF-8
+
+module Warden
+
+  # Aggregates how long requests and the phases they are made of took into
+  # histograms, so they can be scraped through the health check server.
+  module Metrics
+
+    # Upper bounds of the histogram buckets, in seconds
+    BUCKETS = [
+      0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+      0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60,
+    ]
+
+    class Histogram
+
+      attr_reader :count
+      attr_reader :sum
+
+      def initialize
+        @counts = Array.new(BUCKETS.size, 0)
+        @count = 0
+        @sum = 0.0
+      end
+
+      def observe(seconds)
+        i = BUCKETS.index { |bound| seconds <= bound }
+        @counts[i] += 1 if i
+        @count += 1
+        @sum += seconds
+      end
+
+      # Cumulative count per upper bound, ending with +Inf
+      def buckets
+        total = 0
+
+        cumulative = BUCKETS.zip(@counts).map do |bound, count|
+          [bound, total += count]
+        end
+
+        cumulative << ["+Inf", @count]
+      end
+    end
+
+    def self.histograms
+      @histograms ||= Hash.new { |h, k| h[k] = Histogram.new }
+    end
+
+    def self.reset!
+      @histograms = nil
+    end
+
+    # Records that phase took seconds
+    def self.observe(phase, seconds)
+      histograms[phase.to_s].observe(seconds)
+    end
+
+    # Records how long the block took, and returns what it returned
+    def self.time(phase)
+      t1 = Time.now
+
+      begin
+        yield
+      ensure
+        observe(phase, Time.now - t1)
+      end
+    end
+
+    # Records every phase in a hash of timings, prefixed with prefix
+    def self.observe_all(prefix, timings)
+      timings.each do |phase, seconds|
+        observe("#{prefix}.#{phase}", seconds)
+      end
+    end
+
+    # Parses "phase seconds" lines, as printed by the setup helper, start.sh
+    # and wshd. Other lines are ignored.
+    def self.parse_timings(out)
+      out.to_s.lines.each_with_object({}) do |line, timings|
+        if m = line.match(/\A(\S+) (\d+\.\d+)\s*\z/)
+          timings[m[1].sub(/\.sh\z/, "")] = m[2].to_f
+        end
+      end
+    end
+
+    # Renders the histograms in the Prometheus text format
+    def self.render
+      lines = []
+      lines << "# TYPE warden_duration_seconds histogram"
+
+      histograms.keys.sort.each do |phase|
+        h = histograms[phase]
+
+        h.buckets.each do |bound, count|
+          lines << 'warden_duration_seconds_bucket{phase="%s",le="%s"} %d' % [phase, bound, count]
+        end
+
+        lines << 'warden_duration_seconds_sum{phase="%s"} %.6f' % [phase, h.sum]
+        lines << 'warden_duration_seconds_count{phase="%s"} %d' % [phase, h.count]
+      end
+
+      lines.join("\n") + "\n"
+    end
+  end
+end
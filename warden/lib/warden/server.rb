@@ -2,8 +2,10 @@
 
 require "warden/config"
 require "warden/container"
+require "warden/container/spawn"
 require "warden/errors"
 require "warden/event_emitter"
+require "warden/metrics"
 require "warden/network"
 require "warden/pool/network"
 require "warden/pool/port"
@@ -18,11 +20,14 @@ require "steno/core_ext"
 require "warden/protocol"
 require "warden/protocol/buffer"
 require "pidfile"
+require "yajl"
 
 module Warden
 
   module Server
 
+    extend Container::Spawn
+
     class Drainer
       class DrainNotifier < ::EM::Connection
         def initialize(drainer)
@@ -179,6 +184,10 @@ module Warden
       @drainer
     end
 
+    def self.container_pool
+      @container_pool
+    end
+
     def self.setup_server
       # noop
     end
@@ -218,47 +227,179 @@ module Warden
       setup_user
     end
 
+    # Must be called after containers are recovered, so that their resources
+    # are not handed out to warm containers
+    def self.setup_container_pool
+      size = config.server["container_pool_size"]
+      return if size <= 0
+
+      @container_pool = Container::WarmPool.new(container_klass, size)
+      @container_pool.refill
+    end
+
+    # Reserves the resources and handles of the containers in the depot, so
+    # that they are not handed out while the containers are recovered in the
+    # background. Returns what recover_containers_in_background needs.
+    #
     # Must be called after pools are setup
     def self.recover_containers
       max_job_id = 0
+      entries = []
 
       Dir.glob(File.join(container_klass.container_depot_path, "*")) do |path|
-        if !File.exist?(container_klass.snapshot_path(path))
-          logger.info("Destroying container without snapshot at: #{path}")
-          system(File.join(container_klass.root_path, "destroy.sh"), path)
-          next
-        end
+        snapshot = read_snapshot(path)
+
+        if snapshot
+          (snapshot["jobs"] || {}).each_key do |job_id|
+            max_job_id = job_id.to_i > max_job_id ? job_id.to_i : max_job_id
+          end
 
-        if !container_klass.alive?(path)
-          logger.info("Destroying dead container at: #{path}")
-          system(File.join(container_klass.root_path, "destroy.sh"), path)
-          next
+          container_klass.recovering[snapshot["resources"]["handle"]] = []
         end
 
-        begin
-          c = container_klass.from_snapshot(path)
-          c.setup_grace_timer
+        resources = reserved_resources(path, snapshot)
+        reserve(resources)
 
-          logger.info("Recovered container at: #{path}", :resources => c.resources)
+        entries << [path, snapshot, resources]
+      end
+
+      container_klass.job_id = max_job_id
+
+      entries
+    end
+
+    # Recovers the containers in entries, or destroys them when they are dead,
+    # running at most container_recovery_concurrency at a time
+    def self.recover_containers_in_background(entries)
+      t1 = Time.now
+      queue = entries.dup
+      counts = Hash.new(0)
+
+      workers = [config.server["container_recovery_concurrency"], queue.size].min
+      if workers <= 0
+        logger.info("Recovered containers", :recovered => 0, :destroyed => 0)
+        return
+      end
 
-          c.jobs.each do |job_id, job|
-            max_job_id = job_id > max_job_id ? job_id : max_job_id
+      workers.times do
+        Fiber.new do
+          while entry = queue.shift
+            counts[recover_container(*entry)] += 1
           end
 
-          container_klass.registry[c.handle] = c
-        rescue WardenError => err
-          logger.log_exception(err)
+          workers -= 1
+          if workers == 0
+            t2 = Time.now
+            Metrics.observe("recovery", t2 - t1)
 
-          logger.warn("Destroying unrecoverable container at: #{path}")
-          system(File.join(container_klass.root_path, "destroy.sh"), path)
-        end
+            logger.info("Recovered containers (took %.6f)" % [t2 - t1],
+                        :recovered => counts[:recovered],
+                        :destroyed => counts[:destroyed])
+          end
+        end.resume
       end
 
-      container_klass.job_id = max_job_id
+      nil
+    end
+
+    def self.recover_container(path, snapshot, resources)
+      handle = snapshot["resources"]["handle"] if snapshot
+
+      if snapshot.nil?
+        logger.info("Destroying container without snapshot at: #{path}")
+        return destroy_container(path, resources)
+      end
+
+      if !container_klass.alive?(path)
+        logger.info("Destroying dead container at: #{path}")
+        return destroy_container(path, resources)
+      end
+
+      begin
+        c = container_klass.from_snapshot(path)
+        c.setup_grace_timer
+
+        logger.info("Recovered container at: #{path}", :resources => c.resources)
+
+        container_klass.registry[c.handle] = c
+
+        :recovered
+      rescue => err
+        logger.log_exception(err)
+
+        logger.warn("Destroying unrecoverable container at: #{path}")
+
+        # The container released what it acquired when it failed
+        reserve(resources)
+        destroy_container(path, resources)
+      end
+    ensure
+      if handle && waiters = container_klass.recovering.delete(handle)
+        waiters.each { |f| ::EM.next_tick { f.resume } }
+      end
+    end
+
+    def self.destroy_container(path, resources)
+      sh File.join(container_klass.root_path, "destroy.sh"), path, :raise => false
+
+      container_klass.uid_pool.release(resources["uid"]) if resources["uid"]
+      container_klass.network_pool.release(resources["network"]) if resources["network"]
+      resources["ports"].each { |port| container_klass.port_pool.release(port) }
+
+      :destroyed
+    end
 
+    def self.read_snapshot(path)
+      snapshot_path = container_klass.snapshot_path(path)
+      return nil unless File.exist?(snapshot_path)
+
+      Yajl::Parser.parse(File.read(snapshot_path), :check_utf8 => false)
+    rescue Yajl::ParseError => err
+      logger.warn("Ignoring invalid snapshot at: #{snapshot_path}", :error => err.message)
       nil
     end
 
+    # Resources of a container, from its snapshot when it has one, or from
+    # the configuration written when it was created
+    def self.reserved_resources(path, snapshot)
+      resources = { "ports" => [] }
+
+      if snapshot
+        snapshot_resources = snapshot["resources"]
+        resources["uid"] = snapshot_resources["uid"]
+        resources["ports"] = Array(snapshot_resources["ports"])
+
+        if network = snapshot_resources["network"]
+          resources["network"] = Network::Address.new(network)
+        end
+      else
+        instance_config = read_instance_config(path)
+        resources["uid"] = instance_config["user_uid"].to_i if instance_config["user_uid"]
+
+        if host_ip = instance_config["network_host_ip"]
+          netmask = container_klass.network_pool.pooled_netmask
+          resources["network"] = Network::Address.new(host_ip).network(netmask)
+        end
+      end
+
+      resources
+    end
+
+    def self.read_instance_config(path)
+      File.readlines(File.join(path, "etc", "config")).each_with_object({}) do |line, instance_config|
+        key, value = line.chomp.split("=", 2)
+        instance_config[key] = value if value
+      end
+    rescue Errno::ENOENT
+      {}
+    end
+
+    def self.reserve(resources)
+      container_klass.uid_pool.delete(resources["uid"]) if resources["uid"]
+      container_klass.network_pool.delete(resources["network"]) if resources["network"]
+      container_klass.port_pool.delete(*resources["ports"])
+    end
+
     def self.run!
       ::EM.epoll
 
@@ -278,7 +419,8 @@ module Warden
             logger.log_exception(error)
           end
 
-          recover_containers
+          recovering = recover_containers
+          setup_container_pool
 
           FileUtils.rm_f(unix_domain_path)
           server = ::EM.start_unix_domain_server(unix_domain_path, ClientConnection)
@@ -306,6 +448,10 @@ module Warden
           # Let the world know Warden is ready for action.
           logger.info("Listening on #{unix_domain_path}")
 
+          # Requests for containers that are still being recovered wait for
+          # them in find_container
+          recover_containers_in_background(recovering)
+
           if pidfile = config.server["pidfile"]
             logger.info("Writing pid #{Process.pid} to #{pidfile}")
             PidFile.new(piddir: File.dirname(pidfile), pidfile: File.basename(pidfile))
@@ -318,7 +464,18 @@ module Warden
 
     class HealthCheck < EM::Connection
       def receive_data(data)
-        send_data("HTTP/1.1 200 OK\r\n")
+        # Requests for /metrics get the timing histograms, anything else
+        # is a health check
+        if data =~ /\AGET \/metrics[ ?]/
+          body = Metrics.render
+          send_data("HTTP/1.1 200 OK\r\n")
+          send_data("Content-Type: text/plain; version=0.0.4\r\n")
+          send_data("Content-Length: #{body.bytesize}\r\n\r\n")
+          send_data(body)
+        else
+          send_data("HTTP/1.1 200 OK\r\n")
+        end
+
         close_connection_after_writing
       end
     end
@@ -450,7 +607,10 @@ module Warden
 
         when Protocol::ListRequest
           response = request.create_response
-          response.handles = Server.container_klass.registry.keys.map(&:to_s)
+          # Containers that are still being recovered are listed too, so
+          # clients reconciling after a restart don't take them for gone
+          klass = Server.container_klass
+          response.handles = (klass.registry.keys + klass.recovering.keys).uniq.map(&:to_s)
           send_response(response)
 
         when Protocol::EchoRequest
@@ -459,9 +619,23 @@ module Warden
           send_response(response)
 
         when Protocol::CreateRequest
-          container = Server.container_klass.new
-          container.register_connection(self)
-          response = container.dispatch(request)
+          t1 = Time.now
+
+          pool = Server.container_pool
+          container, response = pool.claim(request) if pool
+          pooled = !container.nil?
+
+          if pooled
+            container.register_connection(self)
+          else
+            container = Server.container_klass.new
+            container.register_connection(self)
+            response = container.dispatch(request)
+          end
+
+          duration = Time.now - t1
+          Metrics.observe("create.claim", duration) if pooled
+          pool.record(pooled, duration) if pool
           send_response(response)
 
         else
@@ -521,6 +695,11 @@ module Warden
       protected
 
       def find_container(handle)
+        if waiters = Server.container_klass.recovering[handle]
+          waiters << Fiber.current
+          Fiber.yield
+        end
+
         Server.container_klass.registry[handle].tap do |container|
           raise WardenError.new("unknown handle") if container.nil?
 
@@ -19,4 +19,10 @@ for instance in ${instances_path}/*; do
   ./destroy.sh ${instance} &
 done
 
+# Containers that were destroyed but not yet deleted
+for grave in ${instances_path}/.graveyard/*; do
+  echo "Reaping ${grave}"
+  ./reap.sh ${grave} &
+done
+
 wait
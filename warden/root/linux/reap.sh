@@ -0,0 +1,37 @@
+#!/bin/bash
+
+[ -n "$DEBUG" ] && set -o xtrace
+set -o nounset
+set -o errexit
+shopt -s nullglob
+
+if [ $# -ne 1 ]
+then
+  echo "Usage: $0 <grave_path>"
+  exit 1
+fi
+
+target=$1
+
+if [ ! -d $target ]
+then
+  exit 0
+fi
+
+# Lazily unmount anything still mounted below the target, deepest first
+for mountpoint in $(cut -d ' ' -f 2 /proc/mounts | grep "^${target}/" | sort -r)
+do
+  umount -l $mountpoint || true
+done
+
+# Delete at idle I/O priority, so that running containers are not slowed
+# down. Retry 5 times to avoid occasional device busy.
+count=0
+until ionice -c 3 nice -n 19 rm -rf $target || [ $count -eq 4 ]; do
+   ((count++))
+   sleep 0.3
+done
+if [ -d $target ]
+then
+  exit 1
+fi
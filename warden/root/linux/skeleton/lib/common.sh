@@ -93,18 +93,35 @@ function should_use_aufs() {
   grep -q aufs /proc/filesystems
 }
 
-function setup_fs() {
-  mkdir -p tmp/rootfs mnt
-
-  if should_use_aufs; then
-    mount -n -t aufs -o br:tmp/rootfs=rw:$rootfs_path=ro+wh none mnt
+function probe_fs() {
+  # Warden probes the depot once per boot and passes the result along
+  if [ -n "${fs_type:-}" ]; then
+    echo $fs_type
+  elif should_use_aufs; then
+    echo aufs
   elif should_use_overlayfs; then
-    mount -n -t overlayfs -o rw,upperdir=tmp/rootfs,lowerdir=$rootfs_path none mnt
+    echo overlayfs
   else
-    setup_fs_other
+    echo other
   fi
 }
 
+function setup_fs() {
+  mkdir -p tmp/rootfs mnt
+
+  case "$(probe_fs)" in
+    aufs)
+      mount -n -t aufs -o br:tmp/rootfs=rw:$rootfs_path=ro+wh none mnt
+      ;;
+    overlayfs)
+      mount -n -t overlayfs -o rw,upperdir=tmp/rootfs,lowerdir=$rootfs_path none mnt
+      ;;
+    *)
+      setup_fs_other
+      ;;
+  esac
+}
+
 function teardown_fs() {
   umount mnt
 }
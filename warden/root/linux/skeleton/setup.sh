@@ -21,6 +21,7 @@ user_uid=${user_uid:-10000}
 group_gid=$user_uid
 rootfs_path=$(readlink -f $rootfs_path)
 allow_nested_warden=${allow_nested_warden:-false}
+fs_type=${fs_type:-}
 
 # Write configuration
 cat > etc/config <<-EOS
@@ -34,6 +35,7 @@ network_ifb_iface=$network_ifb_iface
 user_uid=$user_uid
 rootfs_path=$rootfs_path
 allow_nested_warden=$allow_nested_warden
+fs_type=$fs_type
 EOS
 
 setup_fs
@@ -15,7 +15,9 @@ then
   exit 1
 fi
 
-./net.sh setup
+# Print how long net.sh took, like wshd does for the hooks it runs
+TIMEFORMAT="net.sh %3R"
+{ time ./net.sh setup 2>&3; } 3>&2 2>&1
 
 ./bin/wshd --run ./run --lib ./lib --root ./mnt --title "wshd: $id" \
   1> ./run/wshd.out.log \
@@ -171,6 +171,62 @@ describe Warden::Container::Base do
     end
   end
 
+  context "warm up" do
+    let(:container) { Container.new }
+
+    before do
+      allow(container).to receive(:do_create)
+      allow(container).to receive(:delete_snapshot)
+      allow(container).to receive(:write_snapshot)
+    end
+
+    it "should call #do_create" do
+      expect(container).to receive(:do_create)
+      container.warm_up(Warden::Protocol::CreateRequest.new)
+    end
+
+    it "should acquire a network and a uid" do
+      container.warm_up(Warden::Protocol::CreateRequest.new)
+      expect(container.network).to eq(network)
+      expect(container.uid).to eq(uid)
+    end
+
+    it "should not register with the global registry" do
+      container.warm_up(Warden::Protocol::CreateRequest.new)
+      expect(Container.registry).to be_empty
+    end
+
+    context "when claimed" do
+      before do
+        container.warm_up(Warden::Protocol::CreateRequest.new)
+      end
+
+      it "should register with the global registry" do
+        response = container.claim(Warden::Protocol::CreateRequest.new)
+        expect(Container.registry[response.handle]).to eq(container)
+      end
+
+      it "should take the handle of the request" do
+        response = container.claim(Warden::Protocol::CreateRequest.new(:handle => "warm"))
+        expect(response.handle).to eq("warm")
+        expect(container.handle).to eq("warm")
+      end
+
+      it "should take the grace time of the request" do
+        container.claim(Warden::Protocol::CreateRequest.new(:grace_time => 7))
+        expect(container.grace_time).to eq(7)
+      end
+
+      it "should not take a handle that already exists" do
+        Container.registry["warm"] = double("container")
+
+        expect do
+          container.claim(Warden::Protocol::CreateRequest.new(:handle => "warm"))
+        end.to raise_error(Warden::WardenError, /already exists/)
+      end
+    end
+  end
+
   context "dispatch" do
     let(:response) { double("response", filtered_hash: {}).as_null_object }
     let(:request) { double("request", filtered_hash: {fake: "request", sensitive: "information"}, create_response: response).as_null_object }
@@ -305,6 +361,45 @@ describe Warden::Container::Base do
     end
   end
 
+  describe "spawn" do
+    let(:job) { double("job", :job_id => 1) }
+
+    before(:each) do
+      @container = initialize_container
+      @container.dispatch(Warden::Protocol::CreateRequest.new)
+      allow(@container).to receive(:create_job).and_return(job)
+    end
+
+    def spawn_request(options = {})
+      Warden::Protocol::SpawnRequest.new({ :script => "true" }.merge(options))
+    end
+
+    it "should accept output buffering options within bounds" do
+      request = spawn_request(
+        :ring_buffer_size => Container::MAX_RING_BUFFER_SIZE,
+        :max_chunk_size => 1)
+
+      expect(@container.dispatch(request).job_id).to eq 1
+    end
+
+    {
+      "ring_buffer_size" => Container::MAX_RING_BUFFER_SIZE,
+      "max_chunk_size" => Container::MAX_CHUNK_SIZE,
+    }.each do |field, max|
+      it "should reject a #{field} of 0" do
+        expect do
+          @container.dispatch(spawn_request(field.to_sym => 0))
+        end.to raise_error(Warden::WardenError, /#{field}/)
+      end
+
+      it "should reject a #{field} above #{max}" do
+        expect do
+          @container.dispatch(spawn_request(field.to_sym => max + 1))
+        end.to raise_error(Warden::WardenError, /#{field}/)
+      end
+    end
+  end
+
   describe "connection management" do
     let(:container) { Container.new }
     let(:connection) { new_connection }
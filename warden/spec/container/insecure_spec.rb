@@ -18,6 +18,7 @@ describe "insecure" do
   let(:have_uid_support) { false }
   let(:server_pidfile) { nil }
   let(:syslog_socket) { nil }
+  let(:framed_job_links) { false }
 
   before do
     FileUtils.mkdir_p(container_depot_path)
@@ -54,7 +55,8 @@ describe "insecure" do
           "container_grace_time" => 5,
           "job_output_limit" => 100 * 1024,
           "pidfile" => server_pidfile,
-          "syslog_socket" => syslog_socket },
+          "syslog_socket" => syslog_socket,
+          "framed_job_links" => framed_job_links },
         "network" => {
           "pool_start_address" => start_address,
           "pool_size" => 64,
@@ -103,6 +105,12 @@ describe "insecure" do
   it_should_behave_like "snapshotting_common"
   it_should_behave_like "writing_pidfile"
 
+  context "with framed job links" do
+    let(:framed_job_links) { true }
+
+    it_should_behave_like "running commands"
+  end
+
   describe "net_in" do
     attr_reader :handle
 
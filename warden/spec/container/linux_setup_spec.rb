@@ -0,0 +1,99 @@
+# coding: UTF-8
+
+require "spec_helper"
+
+require "warden/util"
+
+require "open3"
+require "tmpdir"
+
+describe "linux setup helper", :platform => "linux", :needs_root => true do
+  let(:setup_path) { Warden::Util.path("src/setup/setup") }
+  let(:skeleton_path) { File.join(Warden::Util.path("root"), "linux", "skeleton") }
+  let(:container_rootfs_path) { File.join(Dir.tmpdir, "warden", "rootfs") }
+
+  let(:env) do
+    {
+      "id" => "setupspec",
+      "network_host_ip" => "10.0.0.1",
+      "network_container_ip" => "10.0.0.2",
+      "user_uid" => "10001",
+      "rootfs_path" => container_rootfs_path,
+      "fs_type" => "other",
+      "dns_servers" => "8.8.8.8",
+    }
+  end
+
+  before do
+    unless File.directory?(container_rootfs_path)
+      raise "%s does not exist" % container_rootfs_path
+    end
+
+    @work_path = Dir.mktmpdir
+  end
+
+  after do
+    FileUtils.rm_rf(@work_path)
+  end
+
+  def setup(*args)
+    out, err, status = Open3.capture3(env, setup_path, *args)
+    expect(status).to be_success, err
+    out
+  end
+
+  def create(name)
+    out = setup("create", skeleton_path, File.join(@work_path, name))
+
+    out.lines.each_with_object({}) do |line, timings|
+      phase, seconds = line.split
+      timings[phase] = seconds.to_f
+    end
+  end
+
+  it "should probe the filesystem of a path" do
+    expect(%w(aufs overlayfs other)).to include(setup("probe", @work_path).strip)
+  end
+
+  it "should write the configuration of the instance" do
+    create("instance")
+
+    config = File.read(File.join(@work_path, "instance", "etc", "config"))
+    expect(config).to include("id=setupspec\n")
+    expect(config).to include("rootfs_path=#{File.realpath(container_rootfs_path)}\n")
+    expect(config).to include("fs_type=other\n")
+  end
+
+  it "should set up the writable layer of the instance" do
+    create("instance")
+
+    root = File.join(@work_path, "instance", "tmp", "rootfs")
+
+    %w(tty random urandom null zero fuse).each do |dev|
+      expect(File.chardev?(File.join(root, "dev", dev))).to be true
+    end
+
+    expect(File.readlink(File.join(root, "dev", "stdin"))).to eq "fd/0"
+    expect(File.read(File.join(root, "etc", "hostname"))).to eq "setupspec\n"
+    expect(File.read(File.join(root, "etc", "hosts"))).to include("10.0.0.2 setupspec\n")
+    expect(File.read(File.join(root, "etc", "resolv.conf"))).to eq "nameserver 8.8.8.8\n"
+    expect(File.read(File.join(root, "etc", "passwd"))).to match(/^vcap:[^:]*:10001:10001:/)
+  end
+
+  it "should report the time every phase took" do
+    runs = 5
+
+    totals = Hash.new(0.0)
+    runs.times do |i|
+      create("instance-#{i}").each do |phase, seconds|
+        totals[phase] += seconds
+      end
+    end
+
+    expect(totals.keys).to eq %w(copy config fs dev etc user)
+
+    totals.each do |phase, seconds|
+      puts "%-8s %.6fs" % [phase, seconds / runs]
+    end
+  end
+end
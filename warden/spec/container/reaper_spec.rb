@@ -0,0 +1,84 @@
+# coding: UTF-8
+
+require "spec_helper"
+
+require "warden/container/reaper"
+require "warden/util"
+
+describe Warden::Container::Reaper, :platform => "linux" do
+  let(:reap_script) { Warden::Util.path("root/linux/reap.sh") }
+  let(:concurrency) { 2 }
+
+  subject(:reaper) do
+    described_class.new(File.join(@work_path, ".graveyard"), concurrency, reap_script)
+  end
+
+  before do
+    @work_path = Dir.mktmpdir
+  end
+
+  after do
+    FileUtils.rm_rf(@work_path)
+  end
+
+  def create_container(name)
+    path = File.join(@work_path, name)
+    FileUtils.mkdir_p(File.join(path, "tmp", "rootfs"))
+    File.write(File.join(path, "tmp", "rootfs", "file"), "contents")
+    path
+  end
+
+  describe "#bury" do
+    it "should move the directory into the graveyard" do
+      path = create_container("container")
+
+      em do
+        grave_path = reaper.bury(path, "container.10000")
+
+        expect(File.exist?(path)).to be false
+        expect(grave_path).to eq File.join(reaper.graveyard_path, "container.10000")
+        done
+      end
+    end
+
+    it "should delete the directory in the background and call the block" do
+      path = create_container("container")
+
+      em do
+        reaper.bury(path, "container") do
+          expect(reaper.entries).to be_empty
+          done
+        end
+
+        expect(reaper.pending).to eq 1
+      end
+    end
+
+    it "should reap no more entries at a time than its concurrency" do
+      reaped = 0
+
+      em do
+        4.times do |i|
+          reaper.bury(create_container("container-#{i}"), "container-#{i}") do
+            expect(reaper.pending).to be <= 4 - reaped
+            reaped += 1
+            done if reaped == 4
+          end
+        end
+
+        ::EM.next_tick do
+          expect(reaper.pending).to eq 4
+          expect(reaper.instance_variable_get(:@active)).to eq concurrency
+        end
+      end
+    end
+  end
+
+  describe "#entries" do
+    it "should list entries left in the graveyard" do
+      FileUtils.mkdir_p(File.join(reaper.graveyard_path, "container.10000"))
+
+      expect(reaper.entries).to eq [File.join(reaper.graveyard_path, "container.10000")]
+    end
+  end
+end
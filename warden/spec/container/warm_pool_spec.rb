@@ -0,0 +1,140 @@
+# coding: UTF-8
+
+require "spec_helper"
+
+require "warden/container/warm_pool"
+
+describe Warden::Container::WarmPool do
+
+  class SpecWarmContainer
+    attr_reader :warm_request
+
+    def self.warmable?(request)
+      request.network.nil?
+    end
+
+    def warm_up(request)
+      @warm_request = request
+    end
+
+    def claim(request)
+      request.create_response
+    end
+  end
+
+  let(:klass) { SpecWarmContainer }
+  let(:size) { 2 }
+
+  subject(:pool) { described_class.new(klass, size) }
+
+  def refill_and_wait(rootfs = nil)
+    em do
+      pool.refill(rootfs)
+
+      ::EM.add_periodic_timer(0.01) do
+        done if pool.ready(rootfs) == size
+      end
+    end
+  end
+
+  describe "#refill" do
+    it "should warm up containers until the pool is full" do
+      refill_and_wait
+      expect(pool.ready).to eq(size)
+    end
+
+    it "should keep a pool per rootfs" do
+      refill_and_wait("/some/rootfs")
+      expect(pool.ready("/some/rootfs")).to eq(size)
+      expect(pool.ready).to eq(0)
+    end
+
+    it "should warm up containers with the rootfs of the pool" do
+      expect(klass).to receive(:new).twice.and_wrap_original do |m|
+        m.call.tap do |container|
+          expect(container).to receive(:warm_up) do |request|
+            expect(request.rootfs).to eq("/some/rootfs")
+          end
+        end
+      end
+
+      refill_and_wait("/some/rootfs")
+    end
+  end
+
+  describe "#claim" do
+    let(:request) { Warden::Protocol::CreateRequest.new(:handle => "warm") }
+
+    it "should return nil when the pool is empty" do
+      em do
+        expect(pool.claim(request)).to be_nil
+        done
+      end
+    end
+
+    it "should return a container and the response when the pool is not empty" do
+      refill_and_wait
+
+      em do
+        container, response = pool.claim(request)
+        expect(container).to be_a(SpecWarmContainer)
+        expect(response).to be_a(Warden::Protocol::CreateResponse)
+        expect(pool.ready).to eq(size - 1)
+        done
+      end
+    end
+
+    it "should not serve requests that the container can't warm up for" do
+      refill_and_wait
+
+      em do
+        request.network = "10.0.0.0"
+        expect(pool.claim(request)).to be_nil
+        expect(pool.ready).to eq(size)
+        done
+      end
+    end
+
+    it "should put the container back when claiming fails" do
+      refill_and_wait
+
+      allow_any_instance_of(SpecWarmContainer).to receive(:claim).
+        and_raise(Warden::WardenError.new("claim"))
+
+      em do
+        expect do
+          pool.claim(request)
+        end.to raise_error(Warden::WardenError, "claim")
+
+        expect(pool.ready).to eq(size)
+        done
+      end
+    end
+  end
+
+  describe "#record" do
+    let(:logger) { double("logger").as_null_object }
+
+    before do
+      allow(pool).to receive(:logger).and_return(logger)
+    end
+
+    it "should report percentiles once a window of creates was seen" do
+      expect(logger).to receive(:info).once do |message, data|
+        expect(message).to eq("Create latency")
+        expect(data[:pooled]).to eq(true)
+        expect(data[:p50]).to eq(50)
+        expect(data[:max]).to eq(100)
+      end
+
+      (1..100).each { |i| pool.record(true, i) }
+    end
+
+    it "should report creates with and without the pool apart" do
+      expect(logger).to_not receive(:info)
+
+      50.times { pool.record(true, 1) }
+      50.times { pool.record(false, 1) }
+    end
+  end
+end
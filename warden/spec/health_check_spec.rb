@@ -83,4 +83,11 @@ describe "health check" do
     expect(response.code).to eq "200"
     expect(response.body).to be_empty
   end
+
+  it "should serve timing histograms on /metrics" do
+    uri = URI.parse("http://127.0.0.1:2345/metrics")
+    response = Net::HTTP.get_response(uri)
+    expect(response.code).to eq "200"
+    expect(response.body).to start_with("# TYPE warden_duration_seconds histogram\n")
+  end
 end
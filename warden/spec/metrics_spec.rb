@@ -0,0 +1,73 @@
+# coding: UTF-8
+
+require "spec_helper"
+
+require "warden/metrics"
+
+describe Warden::Metrics do
+  before do
+    described_class.reset!
+  end
+
+  describe ".observe" do
+    it "should count observations in the bucket they fall into and above" do
+      described_class.observe("create", 0.003)
+      described_class.observe("create", 0.7)
+
+      histogram = described_class.histograms["create"]
+      expect(histogram.count).to eq 2
+      expect(histogram.sum).to be_within(0.0001).of(0.703)
+
+      buckets = Hash[histogram.buckets]
+      expect(buckets[0.0025]).to eq 0
+      expect(buckets[0.005]).to eq 1
+      expect(buckets[1]).to eq 2
+      expect(buckets["+Inf"]).to eq 2
+    end
+
+    it "should count observations above the last bucket only in +Inf" do
+      described_class.observe("destroy", 120)
+
+      buckets = Hash[described_class.histograms["destroy"].buckets]
+      expect(buckets[60]).to eq 0
+      expect(buckets["+Inf"]).to eq 1
+    end
+  end
+
+  describe ".time" do
+    it "should record how long the block took and return its value" do
+      expect(described_class.time("stop") { :value }).to eq :value
+      expect(described_class.histograms["stop"].count).to eq 1
+    end
+
+    it "should record blocks that raise" do
+      expect do
+        described_class.time("stop") { raise "error" }
+      end.to raise_error("error")
+
+      expect(described_class.histograms["stop"].count).to eq 1
+    end
+  end
+
+  describe ".parse_timings" do
+    it "should parse phase timings and ignore other output" do
+      out = "copy 0.000657\nnet.sh 0.052\nsome output\n"
+
+      expect(described_class.parse_timings(out)).to eq(
+        "copy" => 0.000657,
+        "net" => 0.052,
+      )
+    end
+  end
+
+  describe ".render" do
+    it "should render histograms in the prometheus text format" do
+      described_class.observe("create.setup.copy", 0.0001)
+
+      out = described_class.render
+      expect(out).to include('warden_duration_seconds_bucket{phase="create.setup.copy",le="0.001"} 1')
+      expect(out).to include('warden_duration_seconds_bucket{phase="create.setup.copy",le="+Inf"} 1')
+      expect(out).to include('warden_duration_seconds_count{phase="create.setup.copy"} 1')
+    end
+  end
+end
@@ -0,0 +1,265 @@
+# coding: UTF-8
+
+require "spec_helper"
+
+require "warden/server"
+
+require "fiber"
+require "tmpdir"
+
+describe Warden::Server do
+  let(:container_klass) { Warden::Server.container_klass }
+  let(:uid_pool) { container_klass.uid_pool }
+  let(:network_pool) { container_klass.network_pool }
+  let(:port_pool) { container_klass.port_pool }
+  let(:start_port) { Warden::Server.config.port["pool_start_port"] }
+
+  before do
+    @depot_path = Dir.mktmpdir
+
+    allow(container_klass).to receive(:container_depot_path).and_return(@depot_path)
+    allow(container_klass).to receive(:root_path).and_return("/warden/root")
+    allow(container_klass).to receive(:alive?).and_return(true)
+    allow(Warden::Server).to receive(:sh)
+  end
+
+  after do
+    container_klass.reset!
+    FileUtils.rm_rf(@depot_path)
+  end
+
+  def create_container(name, resources = nil)
+    path = File.join(@depot_path, name)
+    FileUtils.mkdir_p(File.join(path, "etc"))
+
+    if resources
+      snapshot = { "jobs" => {}, "resources" => resources.merge("handle" => name) }
+      File.write(container_klass.snapshot_path(path), Yajl::Encoder.encode(snapshot))
+    end
+
+    path
+  end
+
+  def fake_container(handle)
+    double(handle, :handle => handle, :resources => {}, :setup_grace_timer => nil, :register_connection => nil)
+  end
+
+  # Makes from_snapshot return a container on the next tick, like restoring
+  # a container that has to wait for its jobs
+  def recover_on_next_tick
+    allow(container_klass).to receive(:from_snapshot) do |path|
+      fiber = Fiber.current
+      ::EM.next_tick { fiber.resume }
+      Fiber.yield
+
+      fake_container(File.basename(path))
+    end
+  end
+
+  def find_container(handle)
+    connection = Warden::Server::ClientConnection.allocate
+
+    Fiber.new do
+      begin
+        yield connection.send(:find_container, handle)
+      rescue Warden::WardenError => err
+        yield err
+      end
+    end.resume
+  end
+
+  def list
+    connection = Warden::Server::ClientConnection.allocate
+
+    response = nil
+    allow(connection).to receive(:send_response) { |r| response = r }
+    connection.send(:process, Warden::Protocol::ListRequest.new)
+
+    response.handles
+  end
+
+  describe ".recover_containers" do
+    it "should reserve the resources and handle of containers with a snapshot" do
+      create_container("alive", "uid" => 10001, "network" => "10.254.0.4", "ports" => [start_port])
+
+      expect {
+        Warden::Server.recover_containers
+      }.to change { [uid_pool.size, network_pool.size, port_pool.size] }.by([-1, -1, -1])
+
+      expect(container_klass.recovering).to eq("alive" => [])
+      expect(container_klass.handle_in_use?("alive")).to be true
+      expect(container_klass.registry).to be_empty
+    end
+
+    it "should reserve the uid and network of containers without a snapshot from their config" do
+      path = create_container("partial")
+      File.write(File.join(path, "etc", "config"), "user_uid=10002\nnetwork_host_ip=10.254.0.9\n")
+
+      expect {
+        Warden::Server.recover_containers
+      }.to change { [uid_pool.size, network_pool.size] }.by([-1, -1])
+
+      expect(container_klass.recovering).to be_empty
+    end
+
+    it "should not destroy containers" do
+      create_container("dead", "uid" => 10001, "network" => "10.254.0.4", "ports" => [])
+      allow(container_klass).to receive(:alive?).and_return(false)
+
+      Warden::Server.recover_containers
+
+      expect(Warden::Server).to_not have_received(:sh)
+    end
+  end
+
+  describe ".recover_containers_in_background" do
+    it "should recover containers after returning" do
+      create_container("alive", "uid" => 10001, "network" => "10.254.0.4", "ports" => [])
+      recover_on_next_tick
+
+      em do
+        Warden::Server.recover_containers_in_background(Warden::Server.recover_containers)
+
+        expect(container_klass.registry).to be_empty
+        expect(container_klass.recovering).to have_key("alive")
+
+        ::EM.add_timer(0.05) do
+          expect(container_klass.registry.keys).to eq ["alive"]
+          expect(container_klass.recovering).to be_empty
+          done
+        end
+      end
+    end
+
+    it "should list containers that are still being recovered" do
+      create_container("alive", "uid" => 10001, "network" => "10.254.0.4", "ports" => [])
+      recover_on_next_tick
+
+      em do
+        Warden::Server.recover_containers_in_background(Warden::Server.recover_containers)
+
+        expect(container_klass.registry).to be_empty
+        expect(list).to eq ["alive"]
+
+        ::EM.add_timer(0.05) do
+          expect(container_klass.recovering).to be_empty
+          expect(list).to eq ["alive"]
+          done
+        end
+      end
+    end
+
+    it "should resume requests for a container once it is recovered" do
+      create_container("alive", "uid" => 10001, "network" => "10.254.0.4", "ports" => [])
+      recover_on_next_tick
+
+      em do
+        entries = Warden::Server.recover_containers
+
+        find_container("alive") do |container|
+          expect(container.handle).to eq "alive"
+          expect(container_klass.registry["alive"]).to be container
+          done
+        end
+
+        # The request waits for the container
+        expect(container_klass.recovering["alive"].size).to eq 1
+
+        Warden::Server.recover_containers_in_background(entries)
+      end
+    end
+
+    it "should fail requests for a container that was destroyed while they waited" do
+      create_container("dead", "uid" => 10001, "network" => "10.254.0.4", "ports" => [])
+      allow(container_klass).to receive(:alive?).and_return(false)
+
+      em do
+        entries = Warden::Server.recover_containers
+
+        find_container("dead") do |err|
+          expect(err).to be_a Warden::WardenError
+          expect(err.message).to eq "unknown handle"
+          done
+        end
+
+        Warden::Server.recover_containers_in_background(entries)
+      end
+    end
+
+    it "should destroy dead containers and release their resources" do
+      path = create_container("dead", "uid" => 10001, "network" => "10.254.0.4", "ports" => [start_port])
+      allow(container_klass).to receive(:alive?).with(path).and_return(false)
+
+      sizes = lambda { [uid_pool.size, network_pool.size, port_pool.size] }
+      initial = sizes.call
+
+      em do
+        Warden::Server.recover_containers_in_background(Warden::Server.recover_containers)
+
+        ::EM.next_tick do
+          expect(Warden::Server).to have_received(:sh).
+            with("/warden/root/destroy.sh", path, :raise => false)
+          expect(sizes.call).to eq initial
+          expect(container_klass.handle_in_use?("dead")).to be false
+          done
+        end
+      end
+    end
+
+    it "should destroy containers without a snapshot and release their resources" do
+      path = create_container("partial")
+      File.write(File.join(path, "etc", "config"), "user_uid=10002\nnetwork_host_ip=10.254.0.9\n")
+
+      sizes = lambda { [uid_pool.size, network_pool.size] }
+      initial = sizes.call
+
+      em do
+        Warden::Server.recover_containers_in_background(Warden::Server.recover_containers)
+
+        ::EM.next_tick do
+          expect(Warden::Server).to have_received(:sh).
+            with("/warden/root/destroy.sh", path, :raise => false)
+          expect(sizes.call).to eq initial
+          expect(container_klass.registry).to be_empty
+          done
+        end
+      end
+    end
+
+    it "should recover no more containers at a time than its concurrency" do
+      concurrency = Warden::Server.config.server["container_recovery_concurrency"]
+      count = concurrency + 3
+
+      count.times do |i|
+        create_container("container-#{i}", "uid" => 10001 + i, "network" => "10.254.0.#{4 * (i + 1)}", "ports" => [])
+      end
+
+      active = 0
+      max_active = 0
+
+      allow(container_klass).to receive(:from_snapshot) do |path|
+        active += 1
+        max_active = [max_active, active].max
+
+        fiber = Fiber.current
+        ::EM.add_timer(0.01) { fiber.resume }
+        Fiber.yield
+
+        active -= 1
+        fake_container(File.basename(path))
+      end
+
+      em do
+        Warden::Server.recover_containers_in_background(Warden::Server.recover_containers)
+
+        expect(active).to eq concurrency
+
+        ::EM.add_timer(0.2) do
+          expect(max_active).to eq concurrency
+          expect(container_klass.registry.size).to eq count
+          done
+        end
+      end
+    end
+  end
+end
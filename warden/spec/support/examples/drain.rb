@@ -92,6 +92,16 @@ shared_examples "drain" do
     expect(c.info(:handle => handle).container_path).to eq new_path
   end
 
+  it "should not reuse the handle of existing containers" do
+    handle = client.create(:handle => "recovered").handle
+
+    drain_and_restart
+
+    expect do
+      create_client.create(:handle => handle)
+    end.to raise_error(Warden::Client::ServerError, /already exists/)
+  end
+
   it "should not place existing containers networks back into the pool" do
     old_handle = client.create.handle
 
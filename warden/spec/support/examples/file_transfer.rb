@@ -93,6 +93,34 @@ shared_examples "file transfer" do
     expect(File.read(File.join(@outdir, @relative_sentinel_path))).to eq @sentinel_contents
   end
 
+  it "should only copy the contents of a directory with a trailing slash" do
+    copy_in \
+      :src_path => @sentinel_dir + "/",
+      :dst_path => "/tmp/contents"
+
+    c_path = path_in_container("/tmp/contents/sentinel")
+    response = run "cat #{c_path}"
+    expect(response.exit_status).to eq 0
+    expect(response.stdout).to eq @sentinel_contents
+
+    copy_out \
+      :src_path => "/tmp/contents/",
+      :dst_path => @outdir
+
+    expect(File.read(File.join(@outdir, "sentinel"))).to eq @sentinel_contents
+  end
+
+  it "should copy a single file to the destination path" do
+    copy_in \
+      :src_path => @sentinel_path,
+      :dst_path => "/tmp/renamed"
+
+    c_path = path_in_container("/tmp/renamed")
+    response = run "cat #{c_path}"
+    expect(response.exit_status).to eq 0
+    expect(response.stdout).to eq @sentinel_contents
+  end
+
   it "should preserve file permissions" do
     File.chmod(0755, @sentinel_path)
 
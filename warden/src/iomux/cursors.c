@@ -0,0 +1,235 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cursors.h"
+#include "stream_header.h"
+#include "util.h"
+
+#define CURSORS_MAGIC   0x494f4d43 /* "IOMC" */
+#define CURSORS_VERSION 2
+
+#define CURSORS_V1_FILE_SIZE (CURSORS_NSTREAMS * sizeof(uint32_t))
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t posns[CURSORS_NSTREAMS];
+} __attribute__((packed)) cursors_file_t;
+
+struct cursors_s {
+  int             fd;
+  cursors_file_t *file;            /* mapping of the file */
+
+  uint64_t        posns[CURSORS_NSTREAMS];
+  uint64_t        synced_posns[CURSORS_NSTREAMS];
+  struct timespec synced_at;
+};
+
+static uint64_t elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000 +
+         (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Reads positions from an existing file, in either format.
+ *
+ * @return 0 on success, -1 if the file isn't a cursors file.
+ */
+static int cursors_load(cursors_t *cursors) {
+  struct stat     st;
+  uint32_t        v1[CURSORS_NSTREAMS];
+  cursors_file_t  v2;
+  ssize_t         nread = 0;
+  int             ii    = 0;
+
+  if (-1 == fstat(cursors->fd, &st)) {
+    return -1;
+  }
+
+  if (0 == st.st_size) {
+    /* Freshly created */
+    return 0;
+  }
+
+  if (CURSORS_V1_FILE_SIZE == st.st_size) {
+    nread = pread(cursors->fd, v1, sizeof(v1), 0);
+    if (sizeof(v1) != nread) {
+      return -1;
+    }
+
+    for (ii = 0; ii < CURSORS_NSTREAMS; ++ii) {
+      cursors->posns[ii] = ntohl(v1[ii]);
+    }
+
+    return 0;
+  }
+
+  if (sizeof(v2) != st.st_size) {
+    return -1;
+  }
+
+  nread = pread(cursors->fd, &v2, sizeof(v2), 0);
+  if (sizeof(v2) != nread) {
+    return -1;
+  }
+
+  if ((CURSORS_MAGIC != ntohl(v2.magic)) ||
+      (CURSORS_VERSION != ntohl(v2.version))) {
+    return -1;
+  }
+
+  for (ii = 0; ii < CURSORS_NSTREAMS; ++ii) {
+    cursors->posns[ii] = ntoh64(v2.posns[ii]);
+  }
+
+  return 0;
+}
+
+cursors_t *cursors_open(const char *path) {
+  cursors_t *cursors = NULL;
+  void      *addr    = MAP_FAILED;
+  int        ii      = 0;
+
+  assert(NULL != path);
+
+  cursors = calloc(1, sizeof(*cursors));
+  assert(NULL != cursors);
+
+  cursors->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (-1 == cursors->fd) {
+    goto err;
+  }
+
+  if (-1 == cursors_load(cursors)) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  /* Files in the old format are converted in place */
+  if (-1 == ftruncate(cursors->fd, sizeof(cursors_file_t))) {
+    goto err;
+  }
+
+  addr = mmap(NULL, sizeof(cursors_file_t), PROT_READ | PROT_WRITE,
+              MAP_SHARED, cursors->fd, 0);
+  if (MAP_FAILED == addr) {
+    goto err;
+  }
+
+  cursors->file = (cursors_file_t *) addr;
+  cursors->file->magic = htonl(CURSORS_MAGIC);
+  cursors->file->version = htonl(CURSORS_VERSION);
+
+  for (ii = 0; ii < CURSORS_NSTREAMS; ++ii) {
+    cursors->file->posns[ii] = hton64(cursors->posns[ii]);
+  }
+
+  cursors_sync(cursors);
+
+  return cursors;
+
+err:
+  if (-1 != cursors->fd) {
+    close(cursors->fd);
+  }
+
+  free(cursors);
+
+  return NULL;
+}
+
+uint64_t cursors_get(const cursors_t *cursors, int stream) {
+  assert(NULL != cursors);
+  assert(stream >= 0 && stream < CURSORS_NSTREAMS);
+
+  return cursors->posns[stream];
+}
+
+void cursors_update(cursors_t *cursors, int stream, uint64_t pos) {
+  uint64_t nbytes = 0;
+  int      ii     = 0;
+
+  assert(NULL != cursors);
+  assert(stream >= 0 && stream < CURSORS_NSTREAMS);
+
+  if (pos <= cursors->posns[stream]) {
+    return;
+  }
+
+  cursors->posns[stream] = pos;
+  cursors->file->posns[stream] = hton64(pos);
+
+  for (ii = 0; ii < CURSORS_NSTREAMS; ++ii) {
+    nbytes += cursors->posns[ii] - cursors->synced_posns[ii];
+  }
+
+  if ((nbytes >= CURSORS_SYNC_BYTES) ||
+      (elapsed_ms(&cursors->synced_at) >= CURSORS_SYNC_INTERVAL_MS)) {
+    cursors_sync(cursors);
+  }
+}
+
+int cursors_tick(cursors_t *cursors) {
+  uint64_t elapsed = 0;
+  int      ii      = 0;
+
+  assert(NULL != cursors);
+
+  for (ii = 0; ii < CURSORS_NSTREAMS; ++ii) {
+    if (cursors->posns[ii] != cursors->synced_posns[ii]) {
+      break;
+    }
+  }
+
+  if (CURSORS_NSTREAMS == ii) {
+    return -1;
+  }
+
+  elapsed = elapsed_ms(&cursors->synced_at);
+  if (elapsed >= CURSORS_SYNC_INTERVAL_MS) {
+    cursors_sync(cursors);
+    return -1;
+  }
+
+  return CURSORS_SYNC_INTERVAL_MS - elapsed;
+}
+
+void cursors_sync(cursors_t *cursors) {
+  int ii = 0;
+
+  assert(NULL != cursors);
+
+  /* Best effort; the positions are still in the page cache if this fails */
+  msync(cursors->file, sizeof(cursors_file_t), MS_SYNC);
+
+  for (ii = 0; ii < CURSORS_NSTREAMS; ++ii) {
+    cursors->synced_posns[ii] = cursors->posns[ii];
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &cursors->synced_at);
+}
+
+void cursors_close(cursors_t *cursors) {
+  assert(NULL != cursors);
+
+  cursors_sync(cursors);
+
+  munmap(cursors->file, sizeof(cursors_file_t));
+  close(cursors->fd);
+
+  free(cursors);
+}
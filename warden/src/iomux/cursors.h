@@ -0,0 +1,66 @@
+#ifndef CURSORS_H
+#define CURSORS_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Persists the stdout/stderr positions of a linked job in a small file that is
+ * mapped into memory. Updates are plain stores into the mapping, so they
+ * survive the process dying at any point. They are only flushed to disk
+ * periodically (see cursors_update() and cursors_tick()), which bounds how
+ * much output is replayed after the machine itself goes down.
+ *
+ * The file holds a magic number, a version, and one 64 bit position per
+ * stream, all in network byte order. Files in the original format (two 32 bit
+ * positions) are converted when opened.
+ */
+
+#define CURSORS_NSTREAMS 2
+
+/* Flush at least this often while positions change */
+#define CURSORS_SYNC_INTERVAL_MS 1000
+#define CURSORS_SYNC_BYTES       (1024 * 1024)
+
+typedef struct cursors_s cursors_t;
+
+/**
+ * Opens or creates the cursors file at _path_.
+ *
+ * @return NULL if the file can't be opened or isn't a cursors file.
+ */
+cursors_t *cursors_open(const char *path);
+
+uint64_t cursors_get(const cursors_t *cursors, int stream);
+
+/**
+ * Records the position of _stream_. Positions never move backwards; anything
+ * lower than what is stored is ignored. Flushes the file if enough time has
+ * passed or enough output went by since the last flush.
+ */
+void cursors_update(cursors_t *cursors, int stream, uint64_t pos);
+
+/**
+ * Flushes the file if positions changed since the last flush, and the sync
+ * interval has passed since. cursors_update() only does this while output
+ * flows; callers that wait for output call this when their wait times out.
+ *
+ * @return Milliseconds until a flush is due, or -1 if there's nothing to flush.
+ */
+int cursors_tick(cursors_t *cursors);
+
+/**
+ * Flushes the file to disk.
+ *
+ * NB: This isn't async-signal-safe, msync(2) isn't on the list. Positions are
+ *     stored in the mapping as they change, so a process that is killed needs
+ *     no cleanup to keep them.
+ */
+void cursors_sync(cursors_t *cursors);
+
+/**
+ * Flushes and closes the file.
+ */
+void cursors_close(cursors_t *cursors);
+
+#endif
@@ -0,0 +1,258 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cursors.h"
+#include "job_protocol.h"
+#include "util.h"
+
+/*
+ * Counterpart of iomux-link that receives stdout, stderr, and the exit status
+ * of a job over the single, framed connection of job.sock (see
+ * job_protocol.h), instead of over one connection per stream.
+ */
+
+#define INTERNAL_ERROR_STATUS 255
+
+#define DEFAULT_MAX_CHUNK_SIZE 65536
+#define MAX_CHUNK_SIZE         (16 * 1024 * 1024)
+
+static cursors_t *cursors = NULL;
+
+static void sighandler(int signum) {
+  /*
+   * Positions are already in the mapping, which outlives the process. The
+   * kernel writes them back; flushing here isn't async-signal-safe.
+   */
+  _exit(0);
+}
+
+/**
+ * Waits for the next frame, flushing the positions once they are due while
+ * the job is idle.
+ */
+static void wait_for_frame(int fd) {
+  struct pollfd pfd;
+  int           timeout_ms = -1;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while ((NULL != cursors) && (-1 != (timeout_ms = cursors_tick(cursors)))) {
+    /* Errors surface when reading */
+    if (0 != poll(&pfd, 1, timeout_ms)) {
+      break;
+    }
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-w <saved position path>] [-c <max chunk size>]"
+          " <socket directory>\n",
+          name);
+  exit(INTERNAL_ERROR_STATUS);
+}
+
+static int parse_args(int argc, char *argv[], char **saved_posns_path,
+                      size_t *max_chunk_size, char **sockets_dir) {
+  int opt = -1;
+
+  while ((opt = getopt(argc, argv, "w:c:")) != -1) {
+    switch (opt) {
+      case 'w':
+        *saved_posns_path = optarg;
+        break;
+
+      case 'c':
+        if (parse_size(optarg, MAX_CHUNK_SIZE, max_chunk_size)) {
+          return 1;
+        }
+        break;
+
+      default:
+        return 1;
+    }
+  }
+
+  if (optind != argc -1) {
+    return 1;
+  }
+
+  *sockets_dir = argv[optind];
+
+  return 0;
+}
+
+/**
+ * Reads the payload of a data frame and writes whatever lies beyond the
+ * current position of its stream to _dst_fd_.
+ *
+ * @return 0 on success, -1 if the connection or the destination broke.
+ */
+static int copy_frame(int fd, const job_frame_header_t *header, int dst_fd,
+                      uint64_t *pos, uint8_t *buf, size_t buf_size) {
+  uint64_t frame_pos = header->pos;
+  size_t   nremain   = header->length;
+  size_t   nto_read  = 0;
+  size_t   nskip     = 0;
+  ssize_t  nread     = 0;
+  uint8_t  hup       = 0;
+
+  while (nremain > 0) {
+    nto_read = MIN(nremain, buf_size);
+
+    nread = atomic_read(fd, buf, nto_read, &hup);
+    if (nread < nto_read) {
+      return -1;
+    }
+
+    /* Skip data that was already written before reconnecting */
+    nskip = (*pos > frame_pos) ? MIN(*pos - frame_pos, nto_read) : 0;
+
+    if (nskip < nto_read) {
+      atomic_write(dst_fd, buf + nskip, nto_read - nskip, &hup);
+      if (hup) {
+        return -1;
+      }
+
+      /* Frames may start past the current position if output was dropped */
+      *pos = frame_pos + nto_read;
+    }
+
+    frame_pos += nto_read;
+    nremain -= nto_read;
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int                exit_status      = INTERNAL_ERROR_STATUS;
+  char               socket_path[PATH_MAX + 1];
+  int                fd               = -1, ii = 0, nwritten = 0;
+  int                dst_fds[2]       = {STDOUT_FILENO, STDERR_FILENO};
+  uint8_t            hup              = 0;
+  uint8_t            request[JOB_REQUEST_SIZE];
+  uint8_t            header_buf[JOB_FRAME_HEADER_SIZE];
+  uint8_t           *buf              = NULL;
+  uint32_t           status           = 0;
+  uint64_t           posns[2]         = {0, 0};
+  char              *saved_posns_path = NULL;
+  char              *sockets_dir      = NULL;
+  int                signals[2]       = {SIGTERM, SIGINT};
+  size_t             max_chunk_size   = DEFAULT_MAX_CHUNK_SIZE;
+  size_t             buf_size         = 0;
+  job_frame_header_t header;
+  struct sigaction   sa;
+
+  if (parse_args(argc, argv, &saved_posns_path, &max_chunk_size,
+                 &sockets_dir)) {
+    usage(argv[0]);
+  }
+
+  if (NULL != saved_posns_path) {
+    cursors = cursors_open(saved_posns_path);
+    if (NULL == cursors) {
+      perrorf("Failed reading saved position from %s:", saved_posns_path);
+      goto cleanup;
+    }
+
+    for (ii = 0; ii < 2; ++ii) {
+      posns[ii] = cursors_get(cursors, ii);
+    }
+  }
+
+  /* Frames are never larger than this, a bigger buffer would be wasted */
+  buf_size = MIN(max_chunk_size, JOB_FRAME_MAX_LENGTH);
+  buf = malloc(buf_size);
+  if (NULL == buf) {
+    perror("malloc()");
+    goto cleanup;
+  }
+
+  memset(socket_path, 0, sizeof(socket_path));
+  nwritten = snprintf(socket_path, sizeof(socket_path), "%s/job.sock",
+                      sockets_dir);
+  if (nwritten >= sizeof(socket_path)) {
+    fprintf(stderr, "Socket path too long\n");
+    goto cleanup;
+  }
+
+  fd = unix_domain_connect(socket_path);
+  if (-1 == fd) {
+    perrorf("Failed connecting to %s: ", socket_path);
+    goto cleanup;
+  }
+
+  for (ii = 0; ii < 2; ++ii) {
+    sa.sa_flags = 0;
+    sa.sa_handler = sighandler;
+    sigemptyset(&sa.sa_mask);
+    if (-1 == sigaction(signals[ii], &sa, NULL)) {
+      perror("Failed installing signal handler");
+      goto cleanup;
+    }
+  }
+
+  job_request_encode(request, posns);
+  if (atomic_write(fd, request, sizeof(request), &hup) < sizeof(request)) {
+    perrorf("Failed sending request to %s: ", socket_path);
+    goto cleanup;
+  }
+
+  /* Copy frames until the status arrives or the connection breaks */
+  while (1) {
+    wait_for_frame(fd);
+
+    if (atomic_read(fd, header_buf, sizeof(header_buf), &hup) <
+        sizeof(header_buf)) {
+      break;
+    }
+
+    if (-1 == job_frame_header_decode(header_buf, &header)) {
+      fprintf(stderr, "Invalid frame header\n");
+      break;
+    }
+
+    if (JOB_STREAM_STATUS == header.stream) {
+      if (atomic_read(fd, &status, sizeof(status), &hup) == sizeof(status)) {
+        status = ntohl(status);
+        if (WIFEXITED(status)) {
+          exit_status = WEXITSTATUS(status);
+        }
+      }
+
+      break;
+    }
+
+    if (-1 == copy_frame(fd, &header, dst_fds[header.stream],
+                         &(posns[header.stream]), buf, buf_size)) {
+      break;
+    }
+
+    if (NULL != cursors) {
+      cursors_update(cursors, header.stream, posns[header.stream]);
+    }
+  }
+
+cleanup:
+  if (NULL != cursors) {
+    cursors_close(cursors);
+  }
+
+  if (-1 != fd) {
+    close(fd);
+  }
+
+  free(buf);
+
+  return exit_status;
+}
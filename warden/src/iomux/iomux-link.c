@@ -1,4 +1,3 @@
-#include <arpa/inet.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
@@ -8,106 +7,62 @@
 #include <sys/select.h>
 #include <unistd.h>
 
+#include "cursors.h"
 #include "pump.h"
 #include "status_reader.h"
 #include "util.h"
 
 #define INTERNAL_ERROR_STATUS 255
 
-/* These must be visible to the signal handlers */
-static char *saved_posns_path = NULL;
-static pump_t pumps[2];
-
-static int read_saved_posns(const char *path, uint32_t *saved_posns, size_t size) {
-  FILE   *f     = NULL;
-  int     ii    = 0;
-  size_t  nread = 0;
-
-  f = fopen(path, "r");
-  if (NULL == f) {
-    if (ENOENT == errno) {
-      for (ii = 0; ii < size; ++ii) {
-        saved_posns[ii] = 0;
-      }
-      return 0;
-    } else {
-      return 1;
-    }
-  }
-
-  for (ii = 0; ii < size; ++ii) {
-    nread = fread(saved_posns + ii, sizeof(uint32_t), 1, f);
-    if (nread < 1) {
-      fclose(f);
-      return 1;
-    }
-
-    saved_posns[ii] = ntohl(saved_posns[ii]);
-  }
-
-  fclose(f);
-
-  return 0;
-}
-
-static int write_posns(const char *path, uint32_t *saved_posns, size_t size) {
-  FILE     *f        = NULL;
-  size_t    nwritten = 0;
-  int       ii       = 0;
-  uint32_t  pos      = 0;
-
-  f = fopen(path, "w+");
-  if (NULL == f) {
-    return 1;
-  }
+#define DEFAULT_MAX_CHUNK_SIZE 65536
+#define MAX_CHUNK_SIZE         (16 * 1024 * 1024)
 
-  for (ii = 0; ii < size; ++ii) {
-    pos = htonl(saved_posns[ii]);
-    nwritten = fwrite(&pos, sizeof(uint32_t), 1, f);
-    if (nwritten < 1) {
-      fclose(f);
-      return 1;
-    }
-  }
-
-  fclose(f);
+static cursors_t *cursors = NULL;
 
-  return 0;
-}
+static pump_t pumps[2];
 
 static void save_posns(void) {
-  uint32_t saved_posns[2]  = {0, 0};
   int ii = 0;
 
-  if (NULL != saved_posns_path) {
+  if (NULL != cursors) {
     for (ii = 0; ii < 2; ++ii) {
-      saved_posns[ii] = pumps[ii].pos;
+      cursors_update(cursors, ii, pumps[ii].pos);
     }
-    write_posns(saved_posns_path, saved_posns, 2);
   }
 }
 
 static void sighandler(int signum) {
-  save_posns();
-  exit(0);
+  /*
+   * Positions are already in the mapping, which outlives the process. The
+   * kernel writes them back; flushing here isn't async-signal-safe.
+   */
+  _exit(0);
 }
 
 static void usage(const char *name) {
-  fprintf(stderr, "Usage: %s [-w <saved position path>] <socket directory>\n",
+  fprintf(stderr,
+          "Usage: %s [-w <saved position path>] [-c <max chunk size>]"
+          " <socket directory>\n",
           name);
   exit(INTERNAL_ERROR_STATUS);
 }
 
 static int parse_args(int argc, char *argv[], char **saved_posns_path,
-                      char **sockets_dir) {
+                      size_t *max_chunk_size, char **sockets_dir) {
   int opt = -1;
 
-  while ((opt = getopt(argc, argv, "w:")) != -1) {
+  while ((opt = getopt(argc, argv, "w:c:")) != -1) {
     switch (opt) {
       case 'w':
         *saved_posns_path = optarg;
         break;
 
+      case 'c':
+        if (parse_size(optarg, MAX_CHUNK_SIZE, max_chunk_size)) {
+          return 1;
+        }
+        break;
+
       default:
         return 1;
     }
@@ -129,20 +84,25 @@ int main(int argc, char *argv[]) {
   int      fds[3]          = {-1, -1, -1}, nfds = 0, ii = 0, nwritten = 0;
   uint8_t  done            = 0, hup = 0;
   fd_set   readable_fds;
-  uint32_t saved_posns[2]  = {0, 0};
+  uint64_t saved_posns[2]  = {0, 0};
+  char    *saved_posns_path = NULL;
   char    *sockets_dir = NULL;
   int      signals[2] = {SIGTERM, SIGINT};
+  size_t   max_chunk_size = DEFAULT_MAX_CHUNK_SIZE;
+  int      timeout_ms = -1;
+  struct timeval timeout;
   status_reader_t status_reader;
   struct sigaction sa;
 
-  if (parse_args(argc, argv, &saved_posns_path, &sockets_dir)) {
+  if (parse_args(argc, argv, &saved_posns_path, &max_chunk_size,
+                 &sockets_dir)) {
     usage(argv[0]);
   }
 
   if (NULL != saved_posns_path) {
-    if (read_saved_posns(saved_posns_path, saved_posns, 2)) {
-      fprintf(stderr, "Failed reading saved position from %s\n",
-              saved_posns_path);
+    cursors = cursors_open(saved_posns_path);
+    if (NULL == cursors) {
+      perrorf("Failed reading saved position from %s:", saved_posns_path);
       goto cleanup;
     }
   }
@@ -166,8 +126,14 @@ int main(int argc, char *argv[]) {
     set_nonblocking(fds[ii]);
   }
 
-  pump_setup(&pumps[0], fds[0], STDOUT_FILENO, saved_posns[0]);
-  pump_setup(&pumps[1], fds[1], STDERR_FILENO, saved_posns[1]);
+  for (ii = 0; ii < 2; ++ii) {
+    saved_posns[ii] = (NULL != cursors) ? cursors_get(cursors, ii) : 0;
+  }
+
+  pump_setup(&pumps[0], fds[0], STDOUT_FILENO, saved_posns[0],
+             max_chunk_size);
+  pump_setup(&pumps[1], fds[1], STDERR_FILENO, saved_posns[1],
+             max_chunk_size);
   status_reader_init(&status_reader, fds[2]);
 
   for (ii = 0; ii < 2; ++ii) {
@@ -199,7 +165,13 @@ int main(int argc, char *argv[]) {
       break;
     }
 
-    if (-1 != select(nfds, &readable_fds, NULL, NULL, NULL)) {
+    /* Flush the positions of a link that went idle once they are due */
+    timeout_ms = (NULL != cursors) ? cursors_tick(cursors) : -1;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+    if (-1 != select(nfds, &readable_fds, NULL, NULL,
+                     (-1 != timeout_ms) ? &timeout : NULL)) {
       /* Pump stderr/stdout */
       for (ii = 0; ii < 2; ++ii) {
         if (fds[ii] > 0 && FD_ISSET(fds[ii], &readable_fds)) {
@@ -208,6 +180,8 @@ int main(int argc, char *argv[]) {
             close(fds[ii]);
             fds[ii] = -1;
           }
+
+          save_posns();
         }
       }
 
@@ -232,9 +206,15 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  save_posns();
+  for (ii = 0; ii < 2; ++ii) {
+    pump_teardown(&pumps[ii]);
+  }
 
 cleanup:
+  if (NULL != cursors) {
+    cursors_close(cursors);
+  }
+
   for (ii = 0; ii < 3; ++ii) {
     if (-1 != fds[ii]) {
       close(fds[ii]);
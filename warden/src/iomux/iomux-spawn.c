@@ -1,62 +1,250 @@
 #include <assert.h>
+#include <errno.h>
 #include <linux/limits.h>
-#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "child.h"
 #include "dlog.h"
+#include "job_server.h"
 #include "muxer.h"
+#include "reactor.h"
 #include "status_writer.h"
 #include "util.h"
 
-static void *run_muxer(void *data) {
-  assert(NULL != data);
+/*
+ * Everything for a single job is driven by one reactor: the stdout/stderr
+ * muxers, the status writer, the job server, and the SIGCHLD notification for
+ * the child.
+ */
+typedef struct {
+  reactor_t       *reactor;
+  muxer_t         *muxers[2];
+  status_writer_t *sw;
+  job_server_t    *js;
+  child_t         *child;
+
+  uint8_t          continued;
+  int              nclients;     /* number of streams that have a client */
+  int              nstopped;     /* number of muxers/servers that are done */
+  int              child_status;
+  int              exit_status;
+} spawn_t;
+
+static void continue_child(spawn_t *spawn) {
+  if (spawn->continued) {
+    return;
+  }
+
+  spawn->continued = 1;
+  child_continue(spawn->child);
+
+  printf("child active\n");
+  fflush(stdout);
+}
+
+/*
+ * The child is only continued once stdout, stderr, and status all have a
+ * client, so that no output is missed.
+ */
+static void on_client(void *data) {
+  spawn_t *spawn = (spawn_t *) data;
+
+  assert(NULL != spawn);
+
+  spawn->nclients++;
+  if (3 == spawn->nclients) {
+    continue_child(spawn);
+  }
+}
+
+/*
+ * A single client of the job server receives all streams.
+ */
+static void on_job_client(void *data) {
+  spawn_t *spawn = (spawn_t *) data;
+
+  assert(NULL != spawn);
+
+  continue_child(spawn);
+}
+
+/*
+ * The reactor keeps running until both muxers and the job server have flushed
+ * everything to their clients.
+ */
+static void on_stopped(void *data) {
+  spawn_t *spawn = (spawn_t *) data;
 
-  muxer_run((muxer_t *) data);
+  assert(NULL != spawn);
+
+  spawn->nstopped++;
+  if (3 == spawn->nstopped) {
+    reactor_stop(spawn->reactor);
+  }
+}
+
+static void on_sigchld(reactor_t *reactor, int fd, uint32_t events,
+                       void *data) {
+  spawn_t                 *spawn = (spawn_t *) data;
+  struct signalfd_siginfo  fdsi;
+  uint8_t                  hup   = 0;
+  pid_t                    pid;
+  int                      ii    = 0;
+
+  assert(NULL != spawn);
+
+  /* Ignore siginfo, it doesn't matter how many signals were coalesced */
+  atomic_read(fd, &fdsi, sizeof(fdsi), &hup);
+
+  do {
+    pid = waitpid(spawn->child->pid, &(spawn->child_status), WNOHANG);
+  } while (-1 == pid && EINTR == errno);
+
+  if (0 == pid) {
+    return;
+  }
+
+  if (-1 == pid) {
+    perrorf("Waitpid for child failed: ");
+    spawn->exit_status = 1;
+  } else {
+    DLOG("child exited, status = %d", WEXITSTATUS(spawn->child_status));
+  }
+
+  status_writer_finish(spawn->sw, spawn->child_status);
+
+  for (ii = 0; ii < 2; ++ii) {
+    muxer_stop(spawn->muxers[ii], on_stopped, spawn);
+  }
 
-  return NULL;
+  /* The muxers have drained the child's output, so this sends all of it */
+  job_server_finish(spawn->js, spawn->child_status, on_stopped, spawn);
 }
 
-static void *run_status_writer(void *data) {
-  assert(NULL != data);
+static int sigchld_fd(void) {
+  sigset_t mask;
+  int      fd;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+
+  if (-1 == sigprocmask(SIG_BLOCK, &mask, NULL)) {
+    perror("sigprocmask()");
+    assert(0);
+  }
+
+  fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (-1 == fd) {
+    perror("signalfd()");
+    assert(0);
+  }
 
-  status_writer_run((status_writer_t *) data);
+  return fd;
+}
 
-  return NULL;
+#define DEFAULT_RING_BUFFER_SIZE 65535
+#define MAX_RING_BUFFER_SIZE     (64 * 1024 * 1024)
+#define MAX_CHUNK_SIZE           (16 * 1024 * 1024)
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-m] [-s] [-l skip|disconnect] [-r <ring buffer size>]\n"
+          "       [-c <max chunk size>] <socket directory> <cmd>\n"
+          "\n"
+          "  -m  Mirror the output buffers in virtual memory, which makes\n"
+          "      writing to clients cheaper for jobs with a lot of output.\n"
+          "  -s  Move output with splice(2) where possible, implies -m.\n"
+          "  -l  What to do with a job.sock client that lags behind by more\n"
+          "      than the buffered output: skip to the oldest buffered byte\n"
+          "      (default), or disconnect it. Clients of the stream sockets\n"
+          "      are always disconnected, as they can't tell what they missed.\n"
+          "  -r  How many bytes of each stream to keep around for clients\n"
+          "      that (re)connect later (default: 64KB).\n"
+          "  -c  Upper bound on how much output is read at a time. Reads grow\n"
+          "      up to this size while the job keeps them full (default: 64KB).\n",
+          name);
 }
 
 int main(int argc, char *argv[]) {
   int              backlog          = 10;
-  muxer_t         *muxers[2]        = {NULL, NULL};
-  status_writer_t *sw               = NULL;
-  child_t         *child            = NULL;
-  int              child_status     = -1;
-  int              ring_buffer_size = 65535;
-  int              fds[3]           = {-1, -1, -1};
-  int              ii               = 0, exit_status = 0, nwritten = 0;
-  pthread_t        sw_thread, muxer_threads[2];
-  char             socket_paths[3][PATH_MAX + 1];
-  char             *socket_names[3] = { "stdout.sock", "stderr.sock", "status.sock" };
-  barrier_t        *barrier = NULL;
-
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s <socket directory> <cmd>\n", argv[0]);
+  spawn_t          spawn;
+  size_t           ring_buffer_size = DEFAULT_RING_BUFFER_SIZE;
+  size_t           max_chunk_size   = 0;
+  unsigned int     muxer_flags      = 0;
+  unsigned int     js_flags         = 0;
+  int              opt              = 0;
+  int              fds[4]           = {-1, -1, -1, -1};
+  int              sfd              = -1;
+  int              ii               = 0, nwritten = 0;
+  char             socket_paths[4][PATH_MAX + 1];
+  char             *socket_names[4] = { "stdout.sock", "stderr.sock", "status.sock",
+                                        "job.sock" };
+
+  memset(&spawn, 0, sizeof(spawn));
+  spawn.child_status = -1;
+
+  /* Stop at the first non-option, the command may have options of its own */
+  while (-1 != (opt = getopt(argc, argv, "+msl:r:c:"))) {
+    switch (opt) {
+      case 'm':
+        muxer_flags |= MUXER_MIRRORED;
+        break;
+
+      case 's':
+        muxer_flags |= MUXER_SPLICE;
+        break;
+
+      case 'l':
+        if (0 == strcmp(optarg, "skip")) {
+          js_flags &= ~JOB_SERVER_DISCONNECT_LAGGING;
+        } else if (0 == strcmp(optarg, "disconnect")) {
+          js_flags |= JOB_SERVER_DISCONNECT_LAGGING;
+        } else {
+          usage(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'r':
+        if (parse_size(optarg, MAX_RING_BUFFER_SIZE, &ring_buffer_size)) {
+          usage(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'c':
+        if (parse_size(optarg, MAX_CHUNK_SIZE, &max_chunk_size)) {
+          usage(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind < 2) {
+    usage(argv[0]);
     exit(EXIT_FAILURE);
   }
 
   /* Setup listeners on domain sockets */
-  for (ii = 0; ii < 3; ++ii) {
+  for (ii = 0; ii < 4; ++ii) {
     memset(socket_paths[ii], 0, sizeof(socket_paths[ii]));
     nwritten = snprintf(socket_paths[ii], sizeof(socket_paths[ii]),
-                        "%s/%s", argv[1], socket_names[ii]);
+                        "%s/%s", argv[optind], socket_names[ii]);
     if (nwritten >= sizeof(socket_paths[ii])) {
       fprintf(stderr, "Socket path too long\n");
-      exit_status = 1;
+      spawn.exit_status = 1;
       goto cleanup;
     }
 
@@ -66,7 +254,7 @@ int main(int argc, char *argv[]) {
 
     if (-1 == fds[ii]) {
       perrorf("Failed creating socket at %s:", socket_paths[ii]);
-      exit_status = 1;
+      spawn.exit_status = 1;
       goto cleanup;
     }
 
@@ -79,90 +267,81 @@ int main(int argc, char *argv[]) {
    */
   setsid();
 
-  child = child_create(argv + 2, argc - 2);
+  spawn.child = child_create(argv + optind + 1, argc - optind - 1);
 
-  printf("child_pid=%d\n", child->pid);
+  printf("child_pid=%d\n", spawn.child->pid);
   fflush(stdout);
 
+  spawn.reactor = reactor_alloc();
+
+  /* Reap the child from within the reactor */
+  sfd = sigchld_fd();
+  reactor_add(spawn.reactor, sfd, EPOLLIN, on_sigchld, &spawn);
+
   /* Muxers for stdout/stderr */
-  muxers[0] = muxer_alloc(fds[0], child->stdout[0], ring_buffer_size);
-  muxers[1] = muxer_alloc(fds[1], child->stderr[0], ring_buffer_size);
+  spawn.muxers[0] = muxer_alloc(spawn.reactor, fds[0], spawn.child->stdout[0],
+                                ring_buffer_size, muxer_flags);
+  spawn.muxers[1] = muxer_alloc(spawn.reactor, fds[1], spawn.child->stderr[0],
+                                ring_buffer_size, muxer_flags);
   for (ii = 0; ii < 2; ++ii) {
-    if (pthread_create(&muxer_threads[ii], NULL, run_muxer, muxers[ii])) {
-      perrorf("Failed creating muxer thread:");
-      exit_status = 1;
-      goto cleanup;
+    if (0 != max_chunk_size) {
+      muxer_set_max_chunk_size(spawn.muxers[ii], max_chunk_size);
     }
 
-    DLOG("created muxer thread for socket=%s", socket_paths[ii]);
+    muxer_on_client(spawn.muxers[ii], on_client, &spawn);
+    muxer_start(spawn.muxers[ii]);
   }
 
   /* Status writer */
-  barrier = barrier_alloc();
-  sw = status_writer_alloc(fds[2], barrier);
-  if (pthread_create(&sw_thread, NULL, run_status_writer, sw)) {
-    perrorf("Failed creating muxer thread:");
-    exit_status = 1;
-    goto cleanup;
-  }
+  spawn.sw = status_writer_alloc(spawn.reactor, fds[2]);
+  status_writer_on_client(spawn.sw, on_client, &spawn);
+  status_writer_start(spawn.sw);
 
-  /* Wait for clients on stdout, stderr, and status */
-  for (ii = 0; ii < 2; ++ii) {
-    muxer_wait_for_client(muxers[ii]);
-  }
-  barrier_wait(barrier);
+  /* Job server, serving all streams over a single connection */
+  spawn.js = job_server_alloc(spawn.reactor, fds[3], spawn.muxers,
+                              js_flags);
+  job_server_on_client(spawn.js, on_job_client, &spawn);
+  job_server_start(spawn.js);
 
-  child_continue(child);
-
-  printf("child active\n");
-  fflush(stdout);
-
-  if (-1 == waitpid(child->pid, &child_status, 0)) {
-    perrorf("Waitpid for child failed: ");
-    exit_status = 1;
-    goto cleanup;
-  }
-
-  DLOG("child exited, status = %d", WEXITSTATUS(child_status));
-
-  /* Wait for status writer */
-  status_writer_finish(sw, child_status);
-  pthread_join(sw_thread, NULL);
-
-  /* Wait for muxers */
-  for (ii = 0; ii < 2; ++ii) {
-    muxer_stop(muxers[ii]);
-    pthread_join(muxer_threads[ii], NULL);
-  }
+  /* Runs until the child has exited and all of its output is written out */
+  reactor_run(spawn.reactor);
 
   DLOG("all done, cleaning up and exiting");
 
 cleanup:
-  if (NULL != child) {
-    child_free(child);
+  if (NULL != spawn.child) {
+    child_free(spawn.child);
   }
 
-  if (NULL != barrier) {
-    barrier_free(barrier);
+  if (NULL != spawn.sw) {
+    status_writer_free(spawn.sw);
   }
 
-  if (NULL != sw) {
-    status_writer_free(sw);
+  if (NULL != spawn.js) {
+    job_server_free(spawn.js);
   }
 
   for (ii = 0; ii < 2; ++ii) {
-    if (NULL != muxers[ii]) {
-      muxer_free(muxers[ii]);
+    if (NULL != spawn.muxers[ii]) {
+      muxer_free(spawn.muxers[ii]);
     }
   }
 
+  if (NULL != spawn.reactor) {
+    reactor_free(spawn.reactor);
+  }
+
+  if (-1 != sfd) {
+    close(sfd);
+  }
+
   /* Close accept sockets and clean up paths */
-  for (ii = 0; ii < 3; ++ii) {
+  for (ii = 0; ii < 4; ++ii) {
     if (-1 != fds[ii]) {
       close(fds[ii]);
       unlink(socket_paths[ii]);
     }
   }
 
-  return exit_status;
+  return spawn.exit_status;
 }
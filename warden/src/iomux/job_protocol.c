@@ -0,0 +1,93 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "job_protocol.h"
+#include "stream_header.h"
+
+static void put_u32(uint8_t *buf, uint32_t val) {
+  val = htonl(val);
+  memcpy(buf, &val, sizeof(val));
+}
+
+static void put_u64(uint8_t *buf, uint64_t val) {
+  val = hton64(val);
+  memcpy(buf, &val, sizeof(val));
+}
+
+static uint32_t get_u32(const uint8_t *buf) {
+  uint32_t val = 0;
+
+  memcpy(&val, buf, sizeof(val));
+
+  return ntohl(val);
+}
+
+static uint64_t get_u64(const uint8_t *buf) {
+  uint64_t val = 0;
+
+  memcpy(&val, buf, sizeof(val));
+
+  return ntoh64(val);
+}
+
+void job_request_encode(uint8_t *buf, const uint64_t posns[2]) {
+  assert(NULL != buf);
+  assert(NULL != posns);
+
+  put_u32(buf, JOB_PROTOCOL_MAGIC);
+  put_u32(buf + 4, JOB_PROTOCOL_VERSION);
+  put_u64(buf + 8, posns[0]);
+  put_u64(buf + 16, posns[1]);
+}
+
+int job_request_decode(const uint8_t *buf, uint64_t posns[2]) {
+  assert(NULL != buf);
+  assert(NULL != posns);
+
+  if ((JOB_PROTOCOL_MAGIC != get_u32(buf)) ||
+      (JOB_PROTOCOL_VERSION != get_u32(buf + 4))) {
+    return -1;
+  }
+
+  posns[0] = get_u64(buf + 8);
+  posns[1] = get_u64(buf + 16);
+
+  return 0;
+}
+
+void job_frame_header_encode(uint8_t *buf, const job_frame_header_t *header) {
+  assert(NULL != buf);
+  assert(NULL != header);
+
+  memset(buf, 0, JOB_FRAME_HEADER_SIZE);
+
+  buf[0] = header->stream;
+  put_u32(buf + 4, header->length);
+  put_u64(buf + 8, header->pos);
+}
+
+int job_frame_header_decode(const uint8_t *buf, job_frame_header_t *header) {
+  assert(NULL != buf);
+  assert(NULL != header);
+
+  header->stream = buf[0];
+  header->length = get_u32(buf + 4);
+  header->pos = get_u64(buf + 8);
+
+  if (header->stream > JOB_STREAM_STATUS) {
+    return -1;
+  }
+
+  if (header->length > JOB_FRAME_MAX_LENGTH) {
+    return -1;
+  }
+
+  if ((JOB_STREAM_STATUS == header->stream) &&
+      (sizeof(uint32_t) != header->length)) {
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef JOB_PROTOCOL_H
+#define JOB_PROTOCOL_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Framed protocol spoken on job.sock. It carries stdout, stderr, and the exit
+ * status of a job over a single connection.
+ *
+ * The client starts by sending a request with the positions it wants to
+ * resume stdout and stderr from:
+ *
+ *   magic (4 bytes) | version (4 bytes) | stdout pos (8) | stderr pos (8)
+ *
+ * The server then sends frames, each made of a header and _length_ bytes of
+ * payload:
+ *
+ *   stream (1 byte) | reserved (3 bytes) | length (4 bytes) | pos (8 bytes)
+ *
+ * _pos_ is the stream position of the first payload byte. Frames of a stream
+ * are sent in order, but there may be a gap between the position a client
+ * asked for and the first frame if that output is no longer buffered. The
+ * last frame is for JOB_STREAM_STATUS; its payload is the wait status of the
+ * job as a 4 byte integer, after which the server closes the connection.
+ *
+ * All integers are in network byte order.
+ */
+
+#define JOB_PROTOCOL_MAGIC   0x494f4d4a /* "IOMJ" */
+#define JOB_PROTOCOL_VERSION 1
+
+#define JOB_STREAM_STDOUT 0
+#define JOB_STREAM_STDERR 1
+#define JOB_STREAM_STATUS 2
+
+#define JOB_REQUEST_SIZE      24
+#define JOB_FRAME_HEADER_SIZE 16
+
+/* Upper bound on the payload of a single frame */
+#define JOB_FRAME_MAX_LENGTH (64 * 1024)
+
+typedef struct {
+  uint8_t  stream;
+  uint32_t length;
+  uint64_t pos;
+} job_frame_header_t;
+
+void job_request_encode(uint8_t *buf, const uint64_t posns[2]);
+
+/**
+ * @return 0 on success, -1 if _buf_ doesn't hold a supported request.
+ */
+int job_request_decode(const uint8_t *buf, uint64_t posns[2]);
+
+void job_frame_header_encode(uint8_t *buf, const job_frame_header_t *header);
+
+/**
+ * @return 0 on success, -1 if _buf_ doesn't hold a valid frame header.
+ */
+int job_frame_header_decode(const uint8_t *buf, job_frame_header_t *header);
+
+#endif
@@ -0,0 +1,601 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "dlog.h"
+#include "job_protocol.h"
+#include "job_server.h"
+#include "muxer.h"
+#include "reactor.h"
+#include "util.h"
+
+typedef enum {
+  STATE_CREATED,
+  STATE_STARTED,
+  STATE_FINISHING,
+  STATE_DONE,
+} job_server_state_t;
+
+typedef enum {
+  CLIENT_REQUEST,    /* waiting for the request */
+  CLIENT_STREAMING,  /* sending frames */
+  CLIENT_DONE,       /* status was sent */
+} job_client_state_t;
+
+typedef struct job_client_s job_client_t;
+
+/*
+ * Like muxer sinks, clients don't have queues of their own. Output is sent
+ * from the muxers' ring buffers, and a frame only describes data that is
+ * already buffered. A client that falls behind between frames skips ahead,
+ * which shows as a gap in the frame positions, or is disconnected (see
+ * JOB_SERVER_DISCONNECT_LAGGING). Frames are never cut short:
+ * the unsent part of a frame is copied out before the muxer overwrites it.
+ */
+struct job_client_s {
+  int                 fd;
+  job_server_t       *js;
+  reactor_handler_t  *handler;
+  uint32_t            events;      /* what the handler is registered for */
+
+  job_client_state_t  state;
+
+  uint8_t             request[JOB_REQUEST_SIZE];
+  size_t              request_off;
+
+  uint64_t            posns[2];    /* next position to send, per stream */
+  int                 next_stream; /* streams take turns */
+
+  uint8_t             in_frame;    /* a frame is partially written */
+  job_frame_header_t  frame;
+  uint8_t             frame_header[JOB_FRAME_HEADER_SIZE];
+  size_t              frame_off;   /* bytes of the frame written so far */
+
+  uint8_t            *spill;       /* payload from spill_off on, if copied */
+  size_t              spill_off;
+
+  LIST_ENTRY(job_client_s) next_client;
+};
+
+LIST_HEAD(job_client_head, job_client_s);
+
+struct job_server_s {
+  job_server_state_t      state;
+  uint8_t                 status[4]; /* in network byte order */
+  unsigned int            flags;
+
+  reactor_t              *reactor;
+  muxer_t                *muxers[2];
+
+  int                     accept_fd;
+  reactor_handler_t      *accept_handler;
+
+  struct job_client_head  clients;
+
+  notify_cb_t             client_cb; /* invoked once a client has connected */
+  void                   *client_cb_data;
+
+  notify_cb_t             done_cb;   /* invoked once all clients are done */
+  void                   *done_cb_data;
+};
+
+static void job_server_handle_client(reactor_t *reactor, int fd,
+                                     uint32_t events, void *data);
+
+static job_client_t *job_client_alloc(job_server_t *js, int fd) {
+  job_client_t *client = NULL;
+
+  assert(NULL != js);
+  assert(fd >= 0);
+
+  client = calloc(1, sizeof(*client));
+  assert(NULL != client);
+
+  client->fd = fd;
+  client->js = js;
+  client->state = CLIENT_REQUEST;
+
+  set_nonblocking(client->fd);
+
+  client->events = EPOLLIN;
+  client->handler = reactor_add(js->reactor, client->fd, client->events,
+                                job_server_handle_client, client);
+
+  return client;
+}
+
+static void job_client_free(job_client_t *client) {
+  assert(NULL != client);
+
+  reactor_remove(client->js->reactor, client->handler);
+  close(client->fd);
+  free(client->spill);
+  free(client);
+}
+
+static void job_client_set_events(job_client_t *client, uint32_t events) {
+  if (client->events != events) {
+    client->events = events;
+    reactor_modify(client->js->reactor, client->handler, events);
+  }
+}
+
+static void job_server_remove_client(job_server_t *js, job_client_t *client) {
+  assert(NULL != js);
+  assert(NULL != client);
+
+  LIST_REMOVE(client, next_client);
+  job_client_free(client);
+
+  if ((STATE_FINISHING == js->state) && LIST_EMPTY(&(js->clients))) {
+    js->state = STATE_DONE;
+
+    DLOG("job server done, accept_fd=%d", js->accept_fd);
+
+    if (NULL != js->done_cb) {
+      js->done_cb(js->done_cb_data);
+    }
+  }
+}
+
+/**
+ * Reads (the rest of) the request.
+ *
+ * @return -1 if the client hung up or sent garbage, 0 otherwise.
+ */
+static int job_client_read_request(job_client_t *client) {
+  job_server_t *js    = client->js;
+  ssize_t       nread = 0;
+  uint8_t       hup   = 0;
+
+  nread = atomic_read(client->fd, client->request + client->request_off,
+                      sizeof(client->request) - client->request_off, &hup);
+  client->request_off += nread;
+
+  if (client->request_off < sizeof(client->request)) {
+    return hup ? -1 : 0;
+  }
+
+  if (-1 == job_request_decode(client->request, client->posns)) {
+    DLOG("invalid request, fd=%d", client->fd);
+    return -1;
+  }
+
+  DLOG("client requested stdout=%llu stderr=%llu, fd=%d",
+       (unsigned long long) client->posns[0],
+       (unsigned long long) client->posns[1],
+       client->fd);
+
+  client->state = CLIENT_STREAMING;
+
+  /* Nothing more to read; only ask for writability when blocked */
+  job_client_set_events(client, 0);
+
+  /* Allow anyone waiting for a client to continue */
+  if (NULL != js->client_cb) {
+    js->client_cb(js->client_cb_data);
+    js->client_cb = NULL;
+  }
+
+  return 0;
+}
+
+/**
+ * Sets up the next frame to send, if there is anything to send.
+ *
+ * @return 1 if a frame was set up, -1 if the client lags behind and is to be
+ *         disconnected, 0 otherwise.
+ */
+static int job_client_next_frame(job_client_t *client) {
+  job_server_t *js = client->js;
+  muxer_t      *muxer = NULL;
+  int           ii = 0, stream = 0;
+
+  for (ii = 0; ii < 2; ++ii) {
+    stream = (client->next_stream + ii) % 2;
+    muxer = js->muxers[stream];
+
+    if (client->posns[stream] < muxer_tail(muxer)) {
+      if (js->flags & JOB_SERVER_DISCONNECT_LAGGING) {
+        DLOG("disconnecting lagging client, fd=%d", client->fd);
+        return -1;
+      }
+
+      DLOG("skipping nbytes=%llu for lagging client, fd=%d",
+           (unsigned long long) (muxer_tail(muxer) - client->posns[stream]),
+           client->fd);
+
+      client->posns[stream] = muxer_tail(muxer);
+    }
+
+    if (client->posns[stream] < muxer_head(muxer)) {
+      client->frame.stream = stream;
+      client->frame.pos = client->posns[stream];
+      /*
+       * Frames are kept small relative to the ring buffer, otherwise even
+       * clients that are keeping up would often have to spill the rest of a
+       * large frame before the next read overwrites it.
+       */
+      client->frame.length = MIN(muxer_head(muxer) - client->posns[stream],
+                                 MIN(JOB_FRAME_MAX_LENGTH,
+                                     MAX(muxer_capacity(muxer) / 4, 1)));
+
+      client->next_stream = (stream + 1) % 2;
+
+      return 1;
+    }
+  }
+
+  /* Caught up, the status goes last */
+  if ((STATE_FINISHING == js->state) &&
+      muxer_source_closed(js->muxers[0]) &&
+      muxer_source_closed(js->muxers[1])) {
+    client->frame.stream = JOB_STREAM_STATUS;
+    client->frame.pos = 0;
+    client->frame.length = sizeof(js->status);
+
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Writes frames until the client is caught up or would block.
+ *
+ * @return -1 if the client hung up or fell too far behind, 0 otherwise.
+ */
+static int job_client_flush(job_client_t *client) {
+  job_server_t *js       = client->js;
+  struct iovec  iov[3];
+  int           iovcnt   = 0;
+  size_t        nsent    = 0;
+  size_t        nwanted  = 0;
+  ssize_t       nwritten = 0;
+  uint8_t       hup      = 0;
+  muxer_t      *muxer    = NULL;
+  int           rv       = 0;
+
+  while (CLIENT_STREAMING == client->state) {
+    if (!client->in_frame) {
+      rv = job_client_next_frame(client);
+      if (-1 == rv) {
+        return -1;
+      }
+
+      if (0 == rv) {
+        /* Caught up */
+        job_client_set_events(client, 0);
+        break;
+      }
+
+      job_frame_header_encode(client->frame_header, &(client->frame));
+      client->frame_off = 0;
+      client->in_frame = 1;
+    }
+
+    iovcnt = 0;
+
+    if (client->frame_off < sizeof(client->frame_header)) {
+      iov[iovcnt].iov_base = client->frame_header + client->frame_off;
+      iov[iovcnt].iov_len = sizeof(client->frame_header) - client->frame_off;
+      iovcnt++;
+      nsent = 0;
+    } else {
+      nsent = client->frame_off - sizeof(client->frame_header);
+    }
+
+    if (JOB_STREAM_STATUS == client->frame.stream) {
+      iov[iovcnt].iov_base = js->status + nsent;
+      iov[iovcnt].iov_len = sizeof(js->status) - nsent;
+      iovcnt++;
+    } else if (NULL != client->spill) {
+      iov[iovcnt].iov_base = client->spill + (nsent - client->spill_off);
+      iov[iovcnt].iov_len = client->frame.length - nsent;
+      iovcnt++;
+    } else {
+      muxer = js->muxers[client->frame.stream];
+
+      assert(client->frame.pos + nsent >= muxer_tail(muxer));
+
+      iovcnt += muxer_iov(muxer, client->frame.pos + nsent,
+                          client->frame.length - nsent, iov + iovcnt);
+    }
+
+    nwanted = sizeof(client->frame_header) + client->frame.length -
+              client->frame_off;
+
+    nwritten = atomic_writev(client->fd, iov, iovcnt, &hup);
+    client->frame_off += nwritten;
+
+    DLOG("wrote nbytes=%zd to fd=%d", nwritten, client->fd);
+
+    if (hup) {
+      DLOG("hup on fd=%d", client->fd);
+      return -1;
+    }
+
+    if (nwritten < nwanted) {
+      /* Blocked, continue once the client is writable again */
+      job_client_set_events(client, EPOLLOUT);
+      break;
+    }
+
+    client->in_frame = 0;
+
+    free(client->spill);
+    client->spill = NULL;
+
+    if (JOB_STREAM_STATUS == client->frame.stream) {
+      client->state = CLIENT_DONE;
+    } else {
+      client->posns[client->frame.stream] += client->frame.length;
+    }
+  }
+
+  return 0;
+}
+
+static void job_server_service_client(job_server_t *js,
+                                      job_client_t *client) {
+  if (-1 == job_client_flush(client)) {
+    job_server_remove_client(js, client);
+  } else if (CLIENT_DONE == client->state) {
+    job_server_remove_client(js, client);
+  }
+}
+
+static void job_server_handle_client(reactor_t *reactor, int fd,
+                                     uint32_t events, void *data) {
+  job_client_t *client = (job_client_t *) data;
+  job_server_t *js     = NULL;
+
+  assert(NULL != client);
+
+  js = client->js;
+
+  if (CLIENT_REQUEST == client->state) {
+    if (-1 == job_client_read_request(client)) {
+      job_server_remove_client(js, client);
+      return;
+    }
+
+    if (CLIENT_REQUEST == client->state) {
+      return;
+    }
+  }
+
+  job_server_service_client(js, client);
+}
+
+/**
+ * Sends new output to clients that aren't blocked.
+ */
+static void job_server_handle_data(void *data) {
+  job_server_t *js   = (job_server_t *) data;
+  job_client_t *cur  = NULL;
+  job_client_t *next = NULL;
+
+  assert(NULL != js);
+
+  cur = LIST_FIRST(&(js->clients));
+
+  while (NULL != cur) {
+    next = LIST_NEXT(cur, next_client);
+
+    if ((CLIENT_STREAMING == cur->state) && (EPOLLOUT != cur->events)) {
+      job_server_service_client(js, cur);
+    }
+
+    cur = next;
+  }
+}
+
+/**
+ * Copies the unsent part of the client's frame, if it starts below _limit_.
+ */
+static void job_client_spill(job_client_t *client, uint64_t limit) {
+  muxer_t      *muxer  = client->js->muxers[client->frame.stream];
+  struct iovec  iov[2];
+  int           iovcnt = 0, ii = 0;
+  size_t        off    = 0;
+  uint64_t      start  = 0;
+
+  if (client->frame_off > sizeof(client->frame_header)) {
+    client->spill_off = client->frame_off - sizeof(client->frame_header);
+  } else {
+    client->spill_off = 0;
+  }
+
+  start = client->frame.pos + client->spill_off;
+  if (start >= limit) {
+    return;
+  }
+
+  DLOG("spilling nbytes=%zu for lagging client, fd=%d",
+       (size_t) (client->frame.length - client->spill_off), client->fd);
+
+  client->spill = malloc(client->frame.length - client->spill_off);
+  assert(NULL != client->spill);
+
+  iovcnt = muxer_iov(muxer, start, client->frame.length - client->spill_off,
+                     iov);
+  for (ii = 0; ii < iovcnt; ++ii) {
+    memcpy(client->spill + off, iov[ii].iov_base, iov[ii].iov_len);
+    off += iov[ii].iov_len;
+  }
+}
+
+/**
+ * Spills frames of clients that the upcoming read of the muxer could
+ * overwrite.
+ */
+static void job_server_handle_read(muxer_t *muxer, size_t size, void *data) {
+  job_server_t *js     = (job_server_t *) data;
+  job_client_t *cur    = NULL;
+  int           stream = 0;
+  uint64_t      limit  = 0;
+
+  assert(NULL != js);
+
+  stream = (muxer == js->muxers[JOB_STREAM_STDOUT]) ? JOB_STREAM_STDOUT
+                                                    : JOB_STREAM_STDERR;
+
+  /* Positions below this are no longer buffered after the read */
+  limit = muxer_head(muxer) + size;
+  limit = (limit > muxer_capacity(muxer)) ? (limit - muxer_capacity(muxer))
+                                          : 0;
+
+  LIST_FOREACH(cur, &(js->clients), next_client) {
+    if (cur->in_frame && (NULL == cur->spill) &&
+        (stream == cur->frame.stream)) {
+      job_client_spill(cur, limit);
+    }
+  }
+}
+
+/**
+ * Accepts a single pending connection.
+ *
+ * @return 0 if a connection was accepted, -1 otherwise.
+ */
+static int job_server_accept(job_server_t *js) {
+  int           client_fd = -1;
+  job_client_t *client    = NULL;
+
+  assert(NULL != js);
+
+  client_fd = accept(js->accept_fd, NULL, NULL);
+  if (-1 == client_fd) {
+    if (EAGAIN != errno && EINTR != errno) {
+      perror("accept()");
+    }
+    return -1;
+  }
+
+  set_cloexec(client_fd);
+
+  DLOG("accepted connection on fd=%d, client_fd=%d", js->accept_fd, client_fd);
+
+  client = job_client_alloc(js, client_fd);
+  LIST_INSERT_HEAD(&(js->clients), client, next_client);
+
+  return 0;
+}
+
+static void job_server_handle_accept(reactor_t *reactor, int fd,
+                                     uint32_t events, void *data) {
+  assert(NULL != data);
+
+  job_server_accept((job_server_t *) data);
+}
+
+job_server_t *job_server_alloc(reactor_t *reactor, int accept_fd,
+                               muxer_t *muxers[2], unsigned int flags) {
+  job_server_t *js = NULL;
+  int           ii = 0;
+
+  assert(NULL != reactor);
+  assert(accept_fd >= 0);
+  assert(NULL != muxers);
+
+  js = calloc(1, sizeof(*js));
+  assert(NULL != js);
+
+  js->state = STATE_CREATED;
+  js->reactor = reactor;
+  js->flags = flags;
+
+  for (ii = 0; ii < 2; ++ii) {
+    assert(NULL != muxers[ii]);
+    js->muxers[ii] = muxers[ii];
+  }
+
+  js->accept_fd = accept_fd;
+  set_nonblocking(js->accept_fd);
+  set_cloexec(js->accept_fd);
+
+  LIST_INIT(&(js->clients));
+
+  return js;
+}
+
+void job_server_on_client(job_server_t *js, notify_cb_t cb, void *data) {
+  assert(NULL != js);
+
+  js->client_cb = cb;
+  js->client_cb_data = data;
+}
+
+void job_server_start(job_server_t *js) {
+  int ii = 0;
+
+  assert(NULL != js);
+
+  assert(STATE_CREATED == js->state);
+  js->state = STATE_STARTED;
+
+  for (ii = 0; ii < 2; ++ii) {
+    muxer_on_data(js->muxers[ii], job_server_handle_data, js);
+    muxer_on_read(js->muxers[ii], job_server_handle_read, js);
+  }
+
+  js->accept_handler = reactor_add(js->reactor, js->accept_fd, EPOLLIN,
+                                   job_server_handle_accept, js);
+}
+
+void job_server_finish(job_server_t *js, int status, notify_cb_t cb,
+                       void *data) {
+  uint32_t out_status = 0;
+
+  assert(NULL != js);
+
+  assert(STATE_STARTED == js->state);
+  js->state = STATE_FINISHING;
+  js->done_cb = cb;
+  js->done_cb_data = data;
+
+  out_status = htonl((uint32_t) status);
+  memcpy(js->status, &out_status, sizeof(out_status));
+
+  reactor_remove(js->reactor, js->accept_handler);
+  js->accept_handler = NULL;
+
+  /* Clients that connected but weren't accepted yet are served as well */
+  while (0 == job_server_accept(js)) {
+  }
+
+  if (LIST_EMPTY(&(js->clients))) {
+    js->state = STATE_DONE;
+
+    if (NULL != cb) {
+      cb(data);
+    }
+
+    return;
+  }
+
+  /* Sends the status to clients that are caught up */
+  job_server_handle_data(js);
+}
+
+void job_server_free(job_server_t *js) {
+  job_client_t *cur = NULL;
+
+  assert(NULL != js);
+
+  while (NULL != (cur = LIST_FIRST(&(js->clients)))) {
+    LIST_REMOVE(cur, next_client);
+    job_client_free(cur);
+  }
+
+  free(js);
+}
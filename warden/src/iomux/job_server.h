@@ -0,0 +1,58 @@
+#ifndef JOB_SERVER_H
+#define JOB_SERVER_H 1
+
+#include "muxer.h"
+#include "reactor.h"
+#include "util.h"
+
+typedef struct job_server_s job_server_t;
+
+/*
+ * A client that falls so far behind that output it hasn't received yet is
+ * overwritten skips ahead to the oldest output still buffered, by default.
+ * Frames carry their positions, so the client sees the gap. With this flag,
+ * it is disconnected instead.
+ */
+#define JOB_SERVER_DISCONNECT_LAGGING 0x1
+
+/**
+ * Allocates a server for the framed job protocol (see job_protocol.h). It
+ * serves stdout and stderr straight from the buffers of the given muxers.
+ *
+ * @param reactor    Reactor that drives the server.
+ * @param accept_fd  FD to listen on for new connections.
+ * @param muxers     Muxers for stdout and stderr, in that order.
+ * @param flags      Bitwise OR of JOB_SERVER_* flags.
+ */
+job_server_t *job_server_alloc(reactor_t *reactor, int accept_fd,
+                               muxer_t *muxers[2], unsigned int flags);
+
+/**
+ * Registers a callback that is invoked once the first client has sent its
+ * request.
+ */
+void job_server_on_client(job_server_t *js, notify_cb_t cb, void *data);
+
+/**
+ * Starts accepting clients. The actual work is done from within reactor_run().
+ */
+void job_server_start(job_server_t *js);
+
+/**
+ * Tells the server that the child has completed. Clients, including those
+ * still waiting to be accepted, get the remaining output followed by the
+ * status, and are then disconnected.
+ *
+ * NB: The muxers must have been stopped before calling this.
+ *
+ * @param status  Exit status of the child.
+ * @param cb      Invoked once the last client is closed. This may happen before
+ *                job_server_finish() returns.
+ * @param data    Passed to _cb_.
+ */
+void job_server_finish(job_server_t *js, int status, notify_cb_t cb,
+                       void *data);
+
+void job_server_free(job_server_t *js);
+
+#endif
@@ -1,33 +1,55 @@
-#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/queue.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#include "barrier.h"
 #include "dlog.h"
 #include "muxer.h"
+#include "reactor.h"
 #include "ring_buffer.h"
+#include "stream_header.h"
 #include "util.h"
 
-#define READ_BUF_SIZE 4096
+/* Reads start out this big, and double while they keep filling the buffer */
+#define MIN_CHUNK_SIZE         4096
+#define DEFAULT_MAX_CHUNK_SIZE 65536
 
 typedef enum {
   STATE_CREATED,
   STATE_STARTED,
+  STATE_STOPPING,
   STATE_STOPPED,
 } muxer_state_t;
 
 typedef struct muxer_sink_s muxer_sink_t;
 
+/*
+ * A sink doesn't have a queue of its own: everything it still has to write is
+ * the window of the ring buffer between _pos_ and the source position. That
+ * bounds the queue of every sink to the size of the ring buffer.
+ */
 struct muxer_sink_s {
-  int fd;
+  int                fd;
+  muxer_t           *muxer;
+  reactor_handler_t *handler;
+
+  uint8_t            header[STREAM_HEADER_SIZE];
+  size_t             header_off; /* how much of the header has been written */
+
+  uint64_t           pos;        /* position of the next byte to write */
+  uint8_t            blocked;    /* waiting for the fd to become writable */
+
+  int                relay[2];   /* pipe that tee(2)s the source to the fd */
+  ssize_t            nteed;      /* bytes in the relay pipe for this pump */
 
   LIST_ENTRY(muxer_sink_s) next_sink;
 };
@@ -37,30 +59,63 @@ LIST_HEAD(muxer_sink_head, muxer_sink_s);
 struct muxer_s {
   muxer_state_t          state;
   ring_buffer_t          *buf;        /* buffer data is read into */
+  unsigned int            flags;
+
+  reactor_t              *reactor;
 
   int                     source_fd;  /* where data is read from */
-  uint32_t                source_pos; /* number of bytes read from the source */
+  uint64_t                source_pos; /* number of bytes read from the source */
+  reactor_handler_t      *source_handler;
   struct muxer_sink_head  sinks;      /* where data is written to */
 
-  barrier_t               *client_barrier; /* lifted once a client has connected */
-  pthread_mutex_t         lock;
+  uint8_t                *read_buf;   /* holds chunk_size bytes */
+  size_t                  chunk_size; /* how much to read from the source */
+  size_t                  max_chunk_size;
 
   int                     accept_fd;  /* where new connections are created */
-  pthread_t               accept_thread;
-  int                     acceptor_stop_pipe[2];
+  reactor_handler_t      *accept_handler;
+
+  notify_cb_t             client_cb;  /* invoked once a client has connected */
+  void                   *client_cb_data;
+
+  notify_cb_t             stopped_cb; /* invoked once all sinks are flushed */
+  void                   *stopped_cb_data;
+
+  notify_cb_t             data_cb;    /* invoked after reading the source */
+  void                   *data_cb_data;
 
-  int                     rw_stop_pipe[2];
+  muxer_read_cb_t         read_cb;    /* invoked before reading the source */
+  void                   *read_cb_data;
+
+  uint8_t                 spliceable; /* use the splice(2)/tee(2) fast path */
+  int                     devnull_fd; /* where unsent relay data is dropped */
 };
 
-static muxer_sink_t *muxer_sink_alloc(int sink_fd) {
+static void muxer_handle_sink(reactor_t *reactor, int fd, uint32_t events,
+                              void *data);
+
+static muxer_sink_t *muxer_sink_alloc(muxer_t *muxer, int sink_fd) {
   muxer_sink_t *sink = NULL;
 
+  assert(NULL != muxer);
   assert(sink_fd >= 0);
 
   sink = calloc(1, sizeof(*sink));
   assert(NULL != sink);
 
   sink->fd = sink_fd;
+  sink->muxer = muxer;
+  sink->relay[0] = -1;
+  sink->relay[1] = -1;
+
+  /* New sinks start out with whatever is left in the ring buffer */
+  sink->pos = muxer->source_pos - ring_buffer_size(muxer->buf);
+
+  stream_header_encode(sink->header, sink->pos);
+
+  set_nonblocking(sink->fd);
+  sink->handler = reactor_add(muxer->reactor, sink->fd, 0, muxer_handle_sink,
+                              sink);
 
   return sink;
 }
@@ -68,7 +123,14 @@ static muxer_sink_t *muxer_sink_alloc(int sink_fd) {
 static void muxer_sink_free(muxer_sink_t *sink) {
   assert(NULL != sink);
 
+  reactor_remove(sink->muxer->reactor, sink->handler);
   close(sink->fd);
+
+  if (-1 != sink->relay[0]) {
+    close(sink->relay[0]);
+    close(sink->relay[1]);
+  }
+
   free(sink);
 }
 
@@ -88,166 +150,459 @@ static void muxer_free_sinks(muxer_t *muxer) {
   }
 }
 
+static void muxer_remove_sink(muxer_t *muxer, muxer_sink_t *sink) {
+  assert(NULL != muxer);
+  assert(NULL != sink);
+
+  LIST_REMOVE(sink, next_sink);
+  muxer_sink_free(sink);
+
+  if ((STATE_STOPPING == muxer->state) && LIST_EMPTY(&(muxer->sinks))) {
+    muxer->state = STATE_STOPPED;
+
+    DLOG("muxer done, accept_fd=%d, source_fd=%d",
+         muxer->accept_fd, muxer->source_fd);
+
+    if (NULL != muxer->stopped_cb) {
+      muxer->stopped_cb(muxer->stopped_cb_data);
+    }
+  }
+}
+
+static uint8_t muxer_sink_caught_up(const muxer_t *muxer,
+                                    const muxer_sink_t *sink) {
+  return (sink->header_off == sizeof(sink->header)) &&
+         (sink->pos == muxer->source_pos);
+}
+
 /**
- * Writes the contents of the ring buffer to the sink.
+ * Writes as much of the sink's backlog as the fd takes without blocking.
  *
- * NB: The lock must be held when calling this function.
+ * @return -1 if the sink closed the connection, 0 otherwise.
  */
-static int muxer_catchup_sink(const muxer_t *muxer, int sink_fd) {
-  uint32_t  pos      = 0;
-  size_t    buf_size = 0;
-  uint8_t   hup      = 0;
-  uint8_t  *buf      = NULL;
+static int muxer_flush_sink(muxer_t *muxer, muxer_sink_t *sink) {
+  struct iovec iov[3];
+  int          iovcnt   = 0;
+  size_t       start    = 0;
+  size_t       nheader  = 0;
+  ssize_t      nwritten = 0;
+  uint8_t      hup      = 0;
 
   assert(NULL != muxer);
-  assert(sink_fd >= 0);
+  assert(NULL != sink);
+
+  if (sink->header_off < sizeof(sink->header)) {
+    iov[iovcnt].iov_base = sink->header + sink->header_off;
+    iov[iovcnt].iov_len = sizeof(sink->header) - sink->header_off;
+    iovcnt++;
+  }
+
+  if (sink->pos != muxer->source_pos) {
+    /* Logical offset of the sink's position in the ring buffer */
+    start = ring_buffer_size(muxer->buf) - (muxer->source_pos - sink->pos);
 
-  DLOG("catching sink up, fd=%d", sink_fd);
+    iovcnt += ring_buffer_iov(muxer->buf, start, muxer->source_pos - sink->pos,
+                              iov + iovcnt);
+  }
+
+  if (iovcnt > 0) {
+    /* Header and backlog go out straight from the ring buffer, in one go */
+    nwritten = atomic_writev(sink->fd, iov, iovcnt, &hup);
 
-  buf_size = ring_buffer_size(muxer->buf);
-  pos = muxer->source_pos - buf_size;
-  pos = htonl(pos);
+    nheader = MIN((size_t) nwritten, sizeof(sink->header) - sink->header_off);
+    sink->header_off += nheader;
+    sink->pos += nwritten - nheader;
+
+    DLOG("wrote nbytes=%zd to fd=%d", nwritten, sink->fd);
+  }
 
-  atomic_write(sink_fd, &pos, sizeof(uint32_t), &hup);
   if (hup) {
-    DLOG("hup on fd=%d", sink_fd);
+    DLOG("hup on fd=%d", sink->fd);
 
-    /* Sink closed conn */
     return -1;
   }
 
-  buf = ring_buffer_dup(muxer->buf);
-  atomic_write(sink_fd, buf, buf_size, NULL);
+  /* Only ask for writability while there's something left to write */
+  if (sink->blocked == muxer_sink_caught_up(muxer, sink)) {
+    sink->blocked = !sink->blocked;
+    reactor_modify(muxer->reactor, sink->handler,
+                   sink->blocked ? EPOLLOUT : 0);
+  }
+
+  return 0;
+}
 
-  free(buf);
+/**
+ * Flushes the sink, and disposes of it when it hung up or when there is
+ * nothing left for it to receive.
+ */
+static void muxer_service_sink(muxer_t *muxer, muxer_sink_t *sink) {
+  assert(NULL != muxer);
+  assert(NULL != sink);
 
-  return hup;
+  if (-1 == muxer_flush_sink(muxer, sink)) {
+    muxer_remove_sink(muxer, sink);
+  } else if ((NULL == muxer->source_handler) &&
+             muxer_sink_caught_up(muxer, sink)) {
+    muxer_remove_sink(muxer, sink);
+  }
 }
 
-static void muxer_write_to_sinks(muxer_t *muxer, uint8_t *data, size_t count) {
-  muxer_sink_t *cur = NULL;
-  muxer_sink_t *prev = NULL;
-  ssize_t nwritten = 0;
-  uint8_t hup = 0;
+static void muxer_handle_sink(reactor_t *reactor, int fd, uint32_t events,
+                              void *data) {
+  muxer_sink_t *sink = (muxer_sink_t *) data;
+
+  assert(NULL != sink);
+
+  muxer_service_sink(sink->muxer, sink);
+}
 
+/**
+ * Disconnects a sink whose backlog was partially overwritten in the ring
+ * buffer.
+ *
+ * @return -1 if the sink was disconnected, 0 otherwise.
+ */
+static int muxer_handle_lagging_sink(muxer_t *muxer, muxer_sink_t *sink) {
   assert(NULL != muxer);
-  assert(NULL != data);
+  assert(NULL != sink);
+
+  if ((muxer->source_pos - sink->pos) <= ring_buffer_size(muxer->buf)) {
+    return 0;
+  }
+
+  DLOG("disconnecting lagging sink, fd=%d", sink->fd);
+
+  muxer_remove_sink(muxer, sink);
 
-  DLOG("writing %zu bytes to all sinks", count);
+  return -1;
+}
+
+static void muxer_write_to_sinks(muxer_t *muxer) {
+  muxer_sink_t *cur = NULL;
+  muxer_sink_t *next = NULL;
+
+  assert(NULL != muxer);
 
   cur = LIST_FIRST(&(muxer->sinks));
 
   while (NULL != cur) {
-    nwritten = atomic_write(cur->fd, data, count, &hup);
+    next = LIST_NEXT(cur, next_sink);
 
-    DLOG("wrote nbytes=%zu to fd=%d", nwritten, cur->fd);
+    if (0 == muxer_handle_lagging_sink(muxer, cur)) {
+      muxer_service_sink(muxer, cur);
+    }
 
-    if (hup) {
-      /* Other side closed conn */
-      DLOG("hup on fd=%d", cur->fd);
+    cur = next;
+  }
+}
 
-      prev = cur;
-      cur = LIST_NEXT(cur, next_sink);
-      LIST_REMOVE(prev, next_sink);
-      muxer_sink_free(prev);
-    } else {
-      cur = LIST_NEXT(cur, next_sink);
+/**
+ * Empties the sink's relay pipe without sending what's left in it. Those bytes
+ * are in the ring buffer as well, so the sink gets them from there instead.
+ */
+static void muxer_sink_drop_relay(muxer_t *muxer, muxer_sink_t *sink) {
+  ssize_t ndropped = 0;
+
+  while (sink->nteed > 0) {
+    ndropped = splice(sink->relay[0], NULL, muxer->devnull_fd, NULL,
+                      sink->nteed, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (-1 == ndropped) {
+      if (EINTR == errno) {
+        continue;
+      }
+
+      perror("splice()");
+      assert(0);
     }
+
+    sink->nteed -= ndropped;
   }
+}
 
-  DLOG("done writing to sinks");
+/**
+ * Stops using the fast path, e.g. because the kernel doesn't support splicing
+ * between the kinds of fds involved.
+ */
+static void muxer_disable_splice(muxer_t *muxer) {
+  muxer_sink_t *sink = NULL;
+
+  DLOG("splice not supported, falling back to copying, source_fd=%d",
+       muxer->source_fd);
+
+  muxer->spliceable = 0;
+
+  LIST_FOREACH(sink, &(muxer->sinks), next_sink) {
+    muxer_sink_drop_relay(muxer, sink);
+  }
 }
 
 /**
- * Reads as many bytes as available from the source and writes the data to the
- * sinks.
+ * Duplicates whatever is in the source pipe to the relay pipes of the sinks
+ * that are caught up, without consuming it.
+ *
+ * @return -1 if tee(2) isn't supported, 0 otherwise.
  */
-static uint8_t muxer_pump(muxer_t *muxer, uint8_t stopped) {
-  uint8_t read_buf[READ_BUF_SIZE];
-  ssize_t nread = 0;
-  uint8_t hup = 0;
+static int muxer_tee_to_sinks(muxer_t *muxer, size_t size) {
+  muxer_sink_t *sink = NULL;
+  int           ii   = 0;
 
-  nread = atomic_read(muxer->source_fd, read_buf, READ_BUF_SIZE, &hup);
+  LIST_FOREACH(sink, &(muxer->sinks), next_sink) {
+    sink->nteed = 0;
 
-  DLOG("read nbytes=%zu from fd=%d", nread, muxer->source_fd);
+    /* Sinks with a backlog are served from the ring buffer, in order */
+    if (!muxer_sink_caught_up(muxer, sink)) {
+      continue;
+    }
 
-  checked_lock(&(muxer->lock));
+    if (-1 == sink->relay[0]) {
+      if (-1 == pipe(sink->relay)) {
+        perror("pipe()");
+        assert(0);
+      }
+
+      for (ii = 0; ii < 2; ++ii) {
+        set_nonblocking(sink->relay[ii]);
+        set_cloexec(sink->relay[ii]);
+      }
+    }
 
-  ring_buffer_append(muxer->buf, read_buf, nread);
-  muxer->source_pos += nread;
+    do {
+      sink->nteed = tee(muxer->source_fd, sink->relay[1], size,
+                        SPLICE_F_NONBLOCK);
+    } while (-1 == sink->nteed && EINTR == errno);
 
-  muxer_write_to_sinks(muxer, read_buf, nread);
+    if (-1 == sink->nteed) {
+      sink->nteed = 0;
 
-  checked_unlock(&(muxer->lock));
+      if (EAGAIN != errno) {
+        return -1;
+      }
+    }
+  }
 
-  return hup;
+  return 0;
 }
 
 /**
- * Accepts incoming connections, creates sinks for them, and writes the current
- * ring buffer state.
+ * Sends what was tee(2)d into the relay pipes to the sinks.
  */
-void *muxer_acceptor(void *data) {
-  muxer_t      *muxer    = NULL;
-  uint8_t       events   = 0;
-  int           sink_fd  = -1;
-  muxer_sink_t *sink     = NULL;
+static void muxer_splice_to_sinks(muxer_t *muxer) {
+  muxer_sink_t *sink    = NULL;
+  ssize_t       nmoved  = 0;
 
-  assert(NULL != data);
+  LIST_FOREACH(sink, &(muxer->sinks), next_sink) {
+    while (sink->nteed > 0) {
+      nmoved = splice(sink->relay[0], NULL, sink->fd, NULL, sink->nteed,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (-1 == nmoved) {
+        if (EINTR == errno) {
+          continue;
+        }
+
+        if (EINVAL == errno) {
+          muxer_disable_splice(muxer);
+          return;
+        }
+
+        /* Blocked or hung up; the regular write path deals with that */
+        break;
+      }
 
-  muxer = (muxer_t *) data;
+      DLOG("spliced nbytes=%zd to fd=%d", nmoved, sink->fd);
 
-  DLOG("accepting connections on fd=%d", muxer->accept_fd);
+      sink->pos += nmoved;
+      sink->nteed -= nmoved;
+    }
 
-  while (1) {
-    events = wait_readable_or_stop(muxer->accept_fd, muxer->acceptor_stop_pipe[0]);
+    muxer_sink_drop_relay(muxer, sink);
+  }
+}
 
-    if (events & MUXER_READABLE) {
-      sink_fd = accept(muxer->accept_fd, NULL, NULL);
-      if (-1 == sink_fd) {
-        perror("accept()");
-        break;
-      }
+/**
+ * Moves data from the source to the ring buffer and to the sinks that are
+ * caught up, without copying it through user space.
+ *
+ * @return Number of bytes moved, or -1 if the fast path isn't supported.
+ */
+static ssize_t muxer_pump_splice(muxer_t *muxer, uint8_t *hup) {
+  ssize_t nmoved = 0;
+  size_t  size   = 0;
 
-      set_cloexec(sink_fd);
+  size = MIN(muxer->chunk_size, ring_buffer_capacity(muxer->buf));
 
-      DLOG("accepted connection on fd=%d, client_fd=%d\n",
-           muxer->accept_fd,
-           sink_fd);
+  if (-1 == muxer_tee_to_sinks(muxer, size)) {
+    muxer_disable_splice(muxer);
+    return -1;
+  }
 
-      /* Prevent the reader/writer thread from reading any new data */
-      checked_lock(&(muxer->lock));
+  /*
+   * Tee'd bytes are still in the source, so this moves at least as many as
+   * went to any of the sinks.
+   */
+  nmoved = ring_buffer_splice_in(muxer->buf, muxer->source_fd, size, hup);
+  if (-1 == nmoved) {
+    muxer_disable_splice(muxer);
+    return -1;
+  }
 
-      if (-1 == muxer_catchup_sink(muxer, sink_fd)) {
-        /* Other side closed conn */
-        checked_unlock(&(muxer->lock));
-        continue;
-      }
+  DLOG("spliced nbytes=%zd from fd=%d", nmoved, muxer->source_fd);
 
-      sink = muxer_sink_alloc(sink_fd);
-      LIST_INSERT_HEAD(&(muxer->sinks), sink, next_sink);
+  muxer->source_pos += nmoved;
 
-      checked_unlock(&(muxer->lock));
+  muxer_splice_to_sinks(muxer);
 
-      /* Allow anyone waiting for a client to continue */
-      barrier_lift(muxer->client_barrier);
-    }
+  return nmoved;
+}
+
+/**
+ * Grows the chunk size if the last read filled it up, since that means the
+ * source produces more than is read at a time.
+ */
+static void muxer_adapt_chunk_size(muxer_t *muxer, size_t nread) {
+  if ((nread < muxer->chunk_size) ||
+      (muxer->chunk_size >= muxer->max_chunk_size)) {
+    return;
+  }
+
+  muxer->chunk_size = MIN(2 * muxer->chunk_size, muxer->max_chunk_size);
 
-    if (events & MUXER_STOP) {
-      DLOG("received stop for accept_fd=%d", muxer->accept_fd);
-      break;
+  muxer->read_buf = realloc(muxer->read_buf, muxer->chunk_size);
+  assert(NULL != muxer->read_buf);
+
+  DLOG("chunk size now %zu, source_fd=%d",
+       muxer->chunk_size, muxer->source_fd);
+}
+
+/**
+ * Reads as many bytes as available from the source (up to the chunk size) and
+ * appends them to the ring buffer. Sinks that are caught up may get the data
+ * directly, if the fast path is in use.
+ *
+ * @return Number of bytes read
+ */
+static ssize_t muxer_pump(muxer_t *muxer, uint8_t *hup) {
+  ssize_t nread = -1;
+
+  /* Neither path reads more than a chunk */
+  if (NULL != muxer->read_cb) {
+    muxer->read_cb(muxer, muxer->chunk_size, muxer->read_cb_data);
+  }
+
+  if (muxer->spliceable) {
+    nread = muxer_pump_splice(muxer, hup);
+  }
+
+  if (-1 == nread) {
+    nread = atomic_read(muxer->source_fd, muxer->read_buf, muxer->chunk_size,
+                        hup);
+
+    DLOG("read nbytes=%zu from fd=%d", nread, muxer->source_fd);
+
+    ring_buffer_append(muxer->buf, muxer->read_buf, nread);
+    muxer->source_pos += nread;
+  }
+
+  muxer_adapt_chunk_size(muxer, nread);
+
+  return nread;
+}
+
+/**
+ * Stops reading from the source and accepting new clients. Clients that are
+ * still connected are closed as soon as they have received everything.
+ */
+static void muxer_close_source(muxer_t *muxer) {
+  assert(NULL != muxer);
+
+  if (NULL != muxer->source_handler) {
+    reactor_remove(muxer->reactor, muxer->source_handler);
+    muxer->source_handler = NULL;
+
+    close(muxer->source_fd);
+  }
+
+  if (NULL != muxer->accept_handler) {
+    reactor_remove(muxer->reactor, muxer->accept_handler);
+    muxer->accept_handler = NULL;
+  }
+}
+
+static void muxer_notify_data(muxer_t *muxer) {
+  if (NULL != muxer->data_cb) {
+    muxer->data_cb(muxer->data_cb_data);
+  }
+}
+
+static void muxer_handle_source(reactor_t *reactor, int fd, uint32_t events,
+                                void *data) {
+  muxer_t *muxer = (muxer_t *) data;
+  uint8_t  hup   = 0;
+
+  assert(NULL != muxer);
+
+  DLOG("data ready on source_fd=%d", muxer->source_fd);
+
+  muxer_pump(muxer, &hup);
+
+  if (hup) {
+    DLOG("hup on source_fd=%d", muxer->source_fd);
+
+    muxer_close_source(muxer);
+  }
+
+  muxer_write_to_sinks(muxer);
+
+  muxer_notify_data(muxer);
+}
+
+/**
+ * Accepts an incoming connection, creates a sink for it, and starts writing
+ * the current ring buffer state.
+ */
+static void muxer_handle_accept(reactor_t *reactor, int fd, uint32_t events,
+                                void *data) {
+  muxer_t      *muxer    = (muxer_t *) data;
+  int           sink_fd  = -1;
+  muxer_sink_t *sink     = NULL;
+
+  assert(NULL != muxer);
+
+  sink_fd = accept(muxer->accept_fd, NULL, NULL);
+  if (-1 == sink_fd) {
+    if (EAGAIN != errno && EINTR != errno) {
+      perror("accept()");
     }
+    return;
   }
 
-  close(muxer->accept_fd);
+  set_cloexec(sink_fd);
+
+  DLOG("accepted connection on fd=%d, client_fd=%d",
+       muxer->accept_fd,
+       sink_fd);
 
-  return NULL;
+  sink = muxer_sink_alloc(muxer, sink_fd);
+  LIST_INSERT_HEAD(&(muxer->sinks), sink, next_sink);
+
+  if (-1 == muxer_flush_sink(muxer, sink)) {
+    /* Other side closed conn */
+    muxer_remove_sink(muxer, sink);
+    return;
+  }
+
+  /* Allow anyone waiting for a client to continue */
+  if (NULL != muxer->client_cb) {
+    muxer->client_cb(muxer->client_cb_data);
+    muxer->client_cb = NULL;
+  }
 }
 
-muxer_t *muxer_alloc(int accept_fd, int source_fd, size_t ring_buf_size) {
+muxer_t *muxer_alloc(reactor_t *reactor, int accept_fd, int source_fd,
+                     size_t ring_buf_size, unsigned int flags) {
   muxer_t *muxer = NULL;
-  int err = 0, ii = 0;
 
+  assert(NULL != reactor);
   assert(accept_fd >= 0);
   assert(source_fd >= 0);
   assert(ring_buf_size > 0);
@@ -256,6 +611,8 @@ muxer_t *muxer_alloc(int accept_fd, int source_fd, size_t ring_buf_size) {
   assert(NULL != muxer);
 
   muxer->state = STATE_CREATED;
+  muxer->reactor = reactor;
+  muxer->flags = flags;
 
   muxer->accept_fd = accept_fd;
   set_nonblocking(muxer->accept_fd);
@@ -264,133 +621,184 @@ muxer_t *muxer_alloc(int accept_fd, int source_fd, size_t ring_buf_size) {
   muxer->source_fd = source_fd;
   set_nonblocking(muxer->source_fd);
   muxer->source_pos = 0;
+  muxer->devnull_fd = -1;
 
-  muxer->buf = ring_buffer_alloc(ring_buf_size);
-  err = pthread_mutex_init(&(muxer->lock), NULL);
-  assert(!err);
-
-  LIST_INIT(&(muxer->sinks));
+  muxer->chunk_size = MIN_CHUNK_SIZE;
+  muxer->max_chunk_size = DEFAULT_MAX_CHUNK_SIZE;
+  muxer->read_buf = malloc(muxer->chunk_size);
+  assert(NULL != muxer->read_buf);
 
-  if (-1 == pipe(muxer->acceptor_stop_pipe)) {
-    perror("pipe()");
-    assert(0);
-  }
-  for (ii = 0; ii < 2; ++ii) {
-    set_cloexec(muxer->acceptor_stop_pipe[ii]);
+  if (flags & MUXER_MIRRORED) {
+    muxer->buf = ring_buffer_alloc_mirrored(ring_buf_size);
+    if (NULL == muxer->buf) {
+      DLOG("mirrored ring buffer not available, falling back");
+    }
   }
 
-  if (-1 == pipe(muxer->rw_stop_pipe)) {
-    perror("pipe()");
-    assert(0);
+  if (NULL == muxer->buf) {
+    muxer->buf = ring_buffer_alloc(ring_buf_size);
   }
-  for (ii = 0; ii < 2; ++ii) {
-    set_cloexec(muxer->rw_stop_pipe[ii]);
+
+  /* Data can only be spliced into a ring buffer that has a backing file */
+  if ((flags & MUXER_SPLICE) && ring_buffer_is_mirrored(muxer->buf)) {
+    muxer->devnull_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (-1 == muxer->devnull_fd) {
+      perror("open()");
+      assert(0);
+    }
+
+    muxer->spliceable = 1;
   }
 
-  muxer->client_barrier = barrier_alloc();
+  LIST_INIT(&(muxer->sinks));
 
   return muxer;
 }
 
-void muxer_run(muxer_t *muxer) {
-  muxer_sink_t *sink   = NULL;
-  uint8_t       hup    = 0;
-  uint8_t       events = 0;
+void muxer_on_client(muxer_t *muxer, notify_cb_t cb, void *data) {
+  assert(NULL != muxer);
+
+  muxer->client_cb = cb;
+  muxer->client_cb_data = data;
+}
 
+void muxer_on_data(muxer_t *muxer, notify_cb_t cb, void *data) {
   assert(NULL != muxer);
 
-  DLOG("running muxer for accept_fd=%d source_fd=%d",
-        muxer->accept_fd, muxer->source_fd);
+  muxer->data_cb = cb;
+  muxer->data_cb_data = data;
+}
 
-  checked_lock(&(muxer->lock));
+void muxer_on_read(muxer_t *muxer, muxer_read_cb_t cb, void *data) {
+  assert(NULL != muxer);
 
-  assert(STATE_CREATED == muxer->state);
-  muxer->state = STATE_STARTED;
+  muxer->read_cb = cb;
+  muxer->read_cb_data = data;
+}
 
-  checked_unlock(&(muxer->lock));
+uint64_t muxer_head(const muxer_t *muxer) {
+  assert(NULL != muxer);
 
-  if (pthread_create(&muxer->accept_thread, NULL, muxer_acceptor, muxer)) {
-    perror("pthread_create");
-    assert(0);
-  }
+  return muxer->source_pos;
+}
 
-  while (1) {
-    events = wait_readable_or_stop(muxer->source_fd, muxer->rw_stop_pipe[0]);
+uint64_t muxer_tail(const muxer_t *muxer) {
+  assert(NULL != muxer);
 
-    if (events & MUXER_READABLE) {
-      DLOG("data ready on source_fd=%d", muxer->source_fd);
+  return muxer->source_pos - ring_buffer_size(muxer->buf);
+}
 
-      hup = muxer_pump(muxer, (events & MUXER_STOP));
+size_t muxer_capacity(const muxer_t *muxer) {
+  assert(NULL != muxer);
 
-      if (hup) {
-        break;
-      }
-    }
+  return ring_buffer_capacity(muxer->buf);
+}
 
-    if (events & MUXER_STOP) {
-      DLOG("received stop event for source_fd=%d", muxer->source_fd);
-      break;
-    }
-  }
+uint8_t muxer_source_closed(const muxer_t *muxer) {
+  assert(NULL != muxer);
 
-  close(muxer->source_fd);
+  return (STATE_CREATED != muxer->state) && (NULL == muxer->source_handler);
+}
 
-  /* Stop acceptor thread */
-  atomic_write(muxer->acceptor_stop_pipe[1], "x", 1, &hup);
-  pthread_join(muxer->accept_thread, NULL);
+int muxer_iov(const muxer_t *muxer, uint64_t pos, size_t size,
+              struct iovec iov[2]) {
+  assert(NULL != muxer);
+  assert(pos >= muxer_tail(muxer));
+  assert(pos <= muxer->source_pos);
 
-  /* Close sinks */
-  LIST_FOREACH(sink, &(muxer->sinks), next_sink) {
-    close(sink->fd);
-  }
+  return ring_buffer_iov(muxer->buf, pos - muxer_tail(muxer), size, iov);
+}
 
-  DLOG("muxer done, accept_fd=%d, source_fd=%d",
-       muxer->accept_fd, muxer->source_fd);
+void muxer_set_max_chunk_size(muxer_t *muxer, size_t max_chunk_size) {
+  assert(NULL != muxer);
+  assert(max_chunk_size > 0);
+
+  muxer->max_chunk_size = max_chunk_size;
+  muxer->chunk_size = MIN(muxer->chunk_size, max_chunk_size);
 }
 
-void muxer_wait_for_client(muxer_t *muxer) {
+void muxer_start(muxer_t *muxer) {
   assert(NULL != muxer);
 
-  barrier_wait(muxer->client_barrier);
+  DLOG("starting muxer for accept_fd=%d source_fd=%d",
+        muxer->accept_fd, muxer->source_fd);
+
+  assert(STATE_CREATED == muxer->state);
+  muxer->state = STATE_STARTED;
+
+  muxer->source_handler = reactor_add(muxer->reactor, muxer->source_fd,
+                                      EPOLLIN, muxer_handle_source, muxer);
+  muxer->accept_handler = reactor_add(muxer->reactor, muxer->accept_fd,
+                                      EPOLLIN, muxer_handle_accept, muxer);
 }
 
-void muxer_stop(muxer_t *muxer) {
-  uint8_t hup = 0;
+void muxer_stop(muxer_t *muxer, notify_cb_t cb, void *data) {
+  ssize_t nread   = 0;
+  uint8_t hup     = 0;
+  int     pending = 0;
 
   assert(NULL != muxer);
 
   DLOG("stopping muxer, accept_fd=%d source_fd=%d",
        muxer->accept_fd, muxer->source_fd);
 
-  checked_lock(&(muxer->lock));
-
   assert(STATE_STARTED == muxer->state);
-  muxer->state = STATE_STOPPED;
 
-  checked_unlock(&(muxer->lock));
+  /*
+   * Pick up output that was written right before the child exited. Whatever
+   * still holds the source open (e.g. a daemonized grandchild) may keep
+   * writing, so only drain what was buffered at this point.
+   */
+  if (NULL != muxer->source_handler) {
+    if (-1 == ioctl(muxer->source_fd, FIONREAD, &pending)) {
+      pending = ring_buffer_capacity(muxer->buf);
+    }
+
+    while (!hup && (pending > 0)) {
+      nread = muxer_pump(muxer, &hup);
+      muxer_write_to_sinks(muxer);
+
+      if (nread <= 0) {
+        break;
+      }
+
+      pending -= nread;
+    }
+  }
+
+  muxer_close_source(muxer);
+
+  muxer_notify_data(muxer);
 
-  /* Notify thread executing muxer_run() */
-  atomic_write(muxer->rw_stop_pipe[1], "x", 1, &hup);
+  muxer->state = STATE_STOPPING;
+  muxer->stopped_cb = cb;
+  muxer->stopped_cb_data = data;
+
+  /* Closes sinks that are already caught up */
+  muxer_write_to_sinks(muxer);
+
+  if ((STATE_STOPPING == muxer->state) && LIST_EMPTY(&(muxer->sinks))) {
+    muxer->state = STATE_STOPPED;
+
+    if (NULL != cb) {
+      cb(data);
+    }
+  }
 }
 
 void muxer_free(muxer_t *muxer) {
-  int ii = 0;
-
   assert(NULL != muxer);
 
+  muxer_free_sinks(muxer);
+
   ring_buffer_free(muxer->buf);
   muxer->buf = NULL;
 
-  pthread_mutex_destroy(&(muxer->lock));
+  free(muxer->read_buf);
 
-  for (ii = 0; ii < 2; ++ii) {
-    close(muxer->acceptor_stop_pipe[ii]);
-    close(muxer->rw_stop_pipe[ii]);
+  if (-1 != muxer->devnull_fd) {
+    close(muxer->devnull_fd);
   }
 
-  muxer_free_sinks(muxer);
-
-  barrier_free(muxer->client_barrier);
-
   free(muxer);
 }
@@ -2,25 +2,123 @@
 #define MUXER_H 1
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
+#include "reactor.h"
+#include "util.h"
+
+/*
+ * Every client is served from the ring buffer at its own pace, so a slow
+ * client never holds up reading the source. A client that falls so far behind
+ * that its data is overwritten is disconnected. It can't skip ahead, since
+ * the stream only carries a position in its header: a client that counts
+ * bytes to track its position would silently undercount.
+ */
 typedef struct muxer_s muxer_t;
 
+/*
+ * Back the ring buffer with mirrored memory (see ring_buffer_alloc_mirrored()),
+ * so that each sink write is a single contiguous span. Falls back to a regular
+ * ring buffer where that isn't supported.
+ */
+#define MUXER_MIRRORED 0x2
+
+/*
+ * Move data with splice(2) and tee(2) instead of copying it through user
+ * space: from the source into the ring buffer, and on to clients that are
+ * caught up. Implies MUXER_MIRRORED. The source must be a pipe. Falls back to
+ * copying where the kernel doesn't support this.
+ */
+#define MUXER_SPLICE (0x4 | MUXER_MIRRORED)
+
 /**
  * Allocates a new muxer
  *
+ * @param reactor        Reactor that drives the muxer.
  * @param accept_fd      FD to listen on for new connections
  * @param source_fd      The input fd.
  * @param ring_buf_size  How much data should be buffered.
+ * @param flags          Bitwise OR of MUXER_* flags.
  *
  * @return A pointer to the new muxer
  */
-muxer_t *muxer_alloc(int accept_fd, int source_fd, size_t ring_buf_size);
+muxer_t *muxer_alloc(reactor_t *reactor, int accept_fd, int source_fd,
+                     size_t ring_buf_size, unsigned int flags);
+
+/**
+ * Registers a callback that is invoked once the first client has connected.
+ */
+void muxer_on_client(muxer_t *muxer, notify_cb_t cb, void *data);
+
+/**
+ * Registers a callback that is invoked whenever data was read from the source,
+ * and once more when the source is closed. This lets other consumers of the
+ * buffered data (see muxer_iov()) keep up.
+ */
+void muxer_on_data(muxer_t *muxer, notify_cb_t cb, void *data);
+
+/**
+ * Invoked right before the source is read, with an upper bound on how many
+ * bytes the read appends to the ring buffer. Positions below
+ * muxer_head() + _size_ - muxer_capacity() may be overwritten by it.
+ */
+typedef void (*muxer_read_cb_t)(muxer_t *muxer, size_t size, void *data);
 
-void muxer_run(muxer_t *muxer);
+/**
+ * Registers a callback that is invoked before every read from the source. This
+ * lets other consumers of the buffered data (see muxer_iov()) copy what they
+ * still need before it is overwritten.
+ */
+void muxer_on_read(muxer_t *muxer, muxer_read_cb_t cb, void *data);
 
-void muxer_wait_for_client(muxer_t *muxer);
+/**
+ * Position one past the newest byte read from the source.
+ */
+uint64_t muxer_head(const muxer_t *muxer);
 
-void muxer_stop(muxer_t *muxer);
+/**
+ * Position of the oldest byte that is still buffered.
+ */
+uint64_t muxer_tail(const muxer_t *muxer);
+
+/**
+ * Number of bytes of output retained for clients.
+ */
+size_t muxer_capacity(const muxer_t *muxer);
+
+uint8_t muxer_source_closed(const muxer_t *muxer);
+
+/**
+ * Describes up to _size_ buffered bytes starting at position _pos_, without
+ * copying them (see ring_buffer_iov()).
+ *
+ * @return Number of segments filled in.
+ */
+int muxer_iov(const muxer_t *muxer, uint64_t pos, size_t size,
+              struct iovec iov[2]);
+
+/**
+ * Caps how much is read from the source at a time. Reads start out small and
+ * grow up to this size while the source keeps filling them.
+ */
+void muxer_set_max_chunk_size(muxer_t *muxer, size_t max_chunk_size);
+
+/**
+ * Starts reading from the source and accepting clients. The actual work is
+ * done from within reactor_run().
+ */
+void muxer_start(muxer_t *muxer);
+
+/**
+ * Drains whatever is left in the source and stops accepting new clients.
+ * Connected clients are closed once they have received all data.
+ *
+ * @param cb    Invoked once the last client is closed. This may happen before
+ *              muxer_stop() returns.
+ * @param data  Passed to _cb_.
+ */
+void muxer_stop(muxer_t *muxer, notify_cb_t cb, void *data);
 
 void muxer_free(muxer_t *muxer);
 
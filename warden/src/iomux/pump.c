@@ -1,7 +1,8 @@
-#include <arpa/inet.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -16,10 +17,12 @@ typedef enum {
   STATE_PUMP
 } pump_state_t;
 
-void pump_setup(pump_t *pump, int src_fd, int dst_fd, uint32_t old_pos) {
+void pump_setup(pump_t *pump, int src_fd, int dst_fd, uint64_t old_pos,
+                size_t max_buf_size) {
   assert(NULL != pump);
   assert(src_fd >= 0);
   assert(dst_fd >= 0);
+  assert(max_buf_size > 0);
 
   memset(pump, 0, sizeof(*pump));
 
@@ -30,19 +33,40 @@ void pump_setup(pump_t *pump, int src_fd, int dst_fd, uint32_t old_pos) {
 
   pump->src_fd = src_fd;
   pump->dst_fd = dst_fd;
+
+  pump->max_buf_size = max_buf_size;
+  pump->buf_size = MIN(PUMP_SIZE, max_buf_size);
+  pump->buf = malloc(pump->buf_size);
+  assert(NULL != pump->buf);
+}
+
+/**
+ * Doubles the buffer (up to the maximum) after a read that filled it.
+ */
+static void pump_grow(pump_t *pump, size_t nread) {
+  if ((nread < pump->buf_size) || (pump->buf_size >= pump->max_buf_size)) {
+    return;
+  }
+
+  pump->buf_size = MIN(2 * pump->buf_size, pump->max_buf_size);
+
+  pump->buf = realloc(pump->buf, pump->buf_size);
+  assert(NULL != pump->buf);
 }
 
 int pump_run(pump_t *pump) {
-  uint8_t buf[PUMP_SIZE];
+  uint8_t *buf = NULL;
   uint8_t w_hup = 0, r_hup = 0;
   uint8_t *bufp = NULL, *buf_end = NULL;
   ssize_t  ncopy = 0, nread = 0, nwritten = 0;
   size_t ndiscard = 0;
   ptrdiff_t nremain = 0;
+  int header_size = 0;
 
   assert(NULL != pump);
 
-  nread = atomic_read(pump->src_fd, buf, sizeof(buf), &r_hup);
+  buf = pump->buf;
+  nread = atomic_read(pump->src_fd, buf, pump->buf_size, &r_hup);
 
   bufp = buf;
   buf_end = buf + nread;
@@ -52,17 +76,31 @@ int pump_run(pump_t *pump) {
 
     switch (pump->state) {
       case STATE_OFFSET:
-        ncopy = MIN(nremain, sizeof(pump->pos) - pump->pos_off);
+        /*
+         * Take the first 4 bytes before anything else, since they determine
+         * whether the rest of the header is there at all.
+         */
+        if (pump->header_off < STREAM_HEADER_V1_SIZE) {
+          ncopy = MIN(nremain, STREAM_HEADER_V1_SIZE - pump->header_off);
+        } else {
+          ncopy = MIN(nremain, sizeof(pump->header) - pump->header_off);
+        }
 
-        memcpy(pump->pos_bytes + pump->pos_off, bufp, ncopy);
+        memcpy(pump->header + pump->header_off, bufp, ncopy);
 
-        pump->pos_off += ncopy;
+        pump->header_off += ncopy;
         bufp += ncopy;
 
-        if (pump->pos_off == sizeof(pump->pos)) {
+        header_size = stream_header_decode(pump->header, pump->header_off,
+                                           &pump->pos);
+
+        if (-1 == header_size) {
+          fprintf(stderr, "Unsupported stream header version\n");
+          return 1;
+        }
+
+        if (header_size > 0) {
           /* Have the offset, can proceed to data */
-          memcpy(&pump->pos, pump->pos_bytes, sizeof(pump->pos_bytes));
-          pump->pos = ntohl(pump->pos);
           pump->state = STATE_DISCARD;
         }
         break;
@@ -90,7 +128,16 @@ int pump_run(pump_t *pump) {
     }
   }
 
+  pump_grow(pump, nread);
+
   return (w_hup || r_hup);
 }
 
+void pump_teardown(pump_t *pump) {
+  assert(NULL != pump);
+
+  free(pump->buf);
+  pump->buf = NULL;
+}
+
 
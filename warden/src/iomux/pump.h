@@ -1,23 +1,41 @@
 #ifndef PUMP_H
 #define PUMP_H 1
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "stream_header.h"
+
 typedef struct {
   int      state;
 
-  uint8_t  pos_bytes[4];
-  uint8_t  pos_off;
+  uint8_t  header[STREAM_HEADER_SIZE];
+  uint8_t  header_off;
 
-  uint32_t old_pos;
-  uint32_t pos;
+  uint64_t old_pos;
+  uint64_t pos;
 
   int      src_fd;
   int      dst_fd;
-} pump_t;
 
-void pump_setup(pump_t *pump, int src_fd, int dst_fd, uint32_t old_pos);
+  uint8_t *buf;
+  size_t   buf_size;      /* grows while reads keep filling the buffer */
+  size_t   max_buf_size;
+} pump_t;
 
+/**
+ * @param max_buf_size  Upper bound on how much is read from _src_fd_ at a time.
+ */
+void pump_setup(pump_t *pump, int src_fd, int dst_fd, uint64_t old_pos,
+                size_t max_buf_size);
+
+/**
+ * Copies whatever is available from the source to the destination.
+ *
+ * @return 1 if either side hung up or the stream is unusable, 0 otherwise.
+ */
 int pump_run(pump_t *pump);
 
+void pump_teardown(pump_t *pump);
+
 #endif
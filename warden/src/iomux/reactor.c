@@ -0,0 +1,217 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+#include "dlog.h"
+#include "reactor.h"
+#include "util.h"
+
+#define MAX_EVENTS 32
+
+struct reactor_handler_s {
+  int           fd;
+  reactor_cb_t  cb;
+  void         *data;
+
+  LIST_ENTRY(reactor_handler_s) next_handler;
+};
+
+LIST_HEAD(reactor_handler_head, reactor_handler_s);
+
+struct reactor_s {
+  int epoll_fd;
+
+  uint8_t running;
+  int     stop_pipe[2];
+
+  struct reactor_handler_head handlers;
+
+  /*
+   * Handlers that were removed while dispatching. They can still be referenced
+   * by events returned from the same epoll_wait() call, so they are only freed
+   * once the current round of callbacks is done.
+   */
+  struct reactor_handler_head removed;
+};
+
+static void reactor_handle_stop(reactor_t *reactor, int fd, uint32_t events,
+                                void *data) {
+  char    buf[16];
+  uint8_t hup = 0;
+
+  atomic_read(fd, buf, sizeof(buf), &hup);
+
+  DLOG("received stop, epoll_fd=%d", reactor->epoll_fd);
+
+  reactor->running = 0;
+}
+
+static void reactor_free_handlers(struct reactor_handler_head *head) {
+  reactor_handler_t *cur = NULL;
+
+  while (NULL != (cur = LIST_FIRST(head))) {
+    LIST_REMOVE(cur, next_handler);
+    free(cur);
+  }
+}
+
+reactor_t *reactor_alloc(void) {
+  reactor_t *reactor = NULL;
+  int        ii      = 0;
+
+  reactor = calloc(1, sizeof(*reactor));
+  assert(NULL != reactor);
+
+  reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (-1 == reactor->epoll_fd) {
+    perror("epoll_create1()");
+    assert(0);
+  }
+
+  LIST_INIT(&(reactor->handlers));
+  LIST_INIT(&(reactor->removed));
+
+  if (-1 == pipe(reactor->stop_pipe)) {
+    perror("pipe()");
+    assert(0);
+  }
+  for (ii = 0; ii < 2; ++ii) {
+    set_nonblocking(reactor->stop_pipe[ii]);
+    set_cloexec(reactor->stop_pipe[ii]);
+  }
+
+  reactor_add(reactor, reactor->stop_pipe[0], EPOLLIN, reactor_handle_stop,
+              NULL);
+
+  return reactor;
+}
+
+reactor_handler_t *reactor_add(reactor_t *reactor, int fd, uint32_t events,
+                               reactor_cb_t cb, void *data) {
+  reactor_handler_t  *handler = NULL;
+  struct epoll_event  ev;
+
+  assert(NULL != reactor);
+  assert(fd >= 0);
+  assert(NULL != cb);
+
+  handler = calloc(1, sizeof(*handler));
+  assert(NULL != handler);
+
+  handler->fd   = fd;
+  handler->cb   = cb;
+  handler->data = data;
+
+  ev.events   = events;
+  ev.data.ptr = handler;
+
+  if (-1 == epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("epoll_ctl()");
+    assert(0);
+  }
+
+  LIST_INSERT_HEAD(&(reactor->handlers), handler, next_handler);
+
+  return handler;
+}
+
+void reactor_modify(reactor_t *reactor, reactor_handler_t *handler,
+                    uint32_t events) {
+  struct epoll_event ev;
+
+  assert(NULL != reactor);
+  assert(NULL != handler);
+  assert(NULL != handler->cb);
+
+  ev.events   = events;
+  ev.data.ptr = handler;
+
+  if (-1 == epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, handler->fd, &ev)) {
+    perror("epoll_ctl()");
+    assert(0);
+  }
+}
+
+void reactor_remove(reactor_t *reactor, reactor_handler_t *handler) {
+  assert(NULL != reactor);
+  assert(NULL != handler);
+  assert(NULL != handler->cb);
+
+  /* The fd may already be closed, in which case the kernel dropped it */
+  if (-1 == epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL)) {
+    if (EBADF != errno && ENOENT != errno) {
+      perror("epoll_ctl()");
+      assert(0);
+    }
+  }
+
+  handler->cb = NULL;
+
+  LIST_REMOVE(handler, next_handler);
+  LIST_INSERT_HEAD(&(reactor->removed), handler, next_handler);
+}
+
+void reactor_run(reactor_t *reactor) {
+  struct epoll_event  events[MAX_EVENTS];
+  reactor_handler_t  *handler = NULL;
+  int                 nready  = 0, ii = 0;
+
+  assert(NULL != reactor);
+
+  reactor->running = 1;
+
+  while (reactor->running) {
+    nready = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, -1);
+    if (-1 == nready) {
+      if (EINTR == errno) {
+        continue;
+      }
+
+      perror("epoll_wait()");
+      assert(0);
+    }
+
+    for (ii = 0; ii < nready; ++ii) {
+      handler = (reactor_handler_t *) events[ii].data.ptr;
+
+      /* Skip handlers removed by an earlier callback in this round */
+      if (NULL == handler->cb) {
+        continue;
+      }
+
+      handler->cb(reactor, handler->fd, events[ii].events, handler->data);
+    }
+
+    reactor_free_handlers(&(reactor->removed));
+  }
+}
+
+void reactor_stop(reactor_t *reactor) {
+  uint8_t hup = 0;
+
+  assert(NULL != reactor);
+
+  atomic_write(reactor->stop_pipe[1], "x", 1, &hup);
+}
+
+void reactor_free(reactor_t *reactor) {
+  int ii = 0;
+
+  assert(NULL != reactor);
+
+  close(reactor->epoll_fd);
+
+  for (ii = 0; ii < 2; ++ii) {
+    close(reactor->stop_pipe[ii]);
+  }
+
+  reactor_free_handlers(&(reactor->handlers));
+  reactor_free_handlers(&(reactor->removed));
+
+  free(reactor);
+}
@@ -0,0 +1,56 @@
+#ifndef REACTOR_H
+#define REACTOR_H 1
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+typedef struct reactor_s reactor_t;
+typedef struct reactor_handler_s reactor_handler_t;
+
+/**
+ * Invoked from reactor_run() whenever _fd_ has one of the requested events
+ * pending. _events_ is the EPOLL* mask reported by the kernel.
+ */
+typedef void (*reactor_cb_t)(reactor_t *reactor, int fd, uint32_t events,
+                             void *data);
+
+reactor_t *reactor_alloc(void);
+
+/**
+ * Starts watching _fd_ for _events_ (EPOLLIN, EPOLLOUT, ...).
+ *
+ * @return A handle that identifies this registration.
+ */
+reactor_handler_t *reactor_add(reactor_t *reactor, int fd, uint32_t events,
+                               reactor_cb_t cb, void *data);
+
+/**
+ * Changes the set of events a registration is interested in.
+ */
+void reactor_modify(reactor_t *reactor, reactor_handler_t *handler,
+                    uint32_t events);
+
+/**
+ * Stops watching the fd of the registration. The fd itself is left open.
+ *
+ * NB: This is safe to call from within any callback, including the one for
+ *     the registration being removed.
+ */
+void reactor_remove(reactor_t *reactor, reactor_handler_t *handler);
+
+/**
+ * Dispatches events until reactor_stop() is called.
+ */
+void reactor_run(reactor_t *reactor);
+
+/**
+ * Makes reactor_run() return after the current round of callbacks.
+ *
+ * NB: This is the only function that may be called from a thread other than
+ *     the one executing reactor_run().
+ */
+void reactor_stop(reactor_t *reactor);
+
+void reactor_free(reactor_t *reactor);
+
+#endif
@@ -1,18 +1,34 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "ring_buffer.h"
 #include "util.h"
 
+/*
+ * The capacity is always a power of two, so that positions map onto the
+ * underlying array with a mask instead of a division. _head_ and _tail_ count
+ * bytes since the buffer was allocated and never wrap in practice.
+ *
+ * A mirrored buffer maps the same memory twice, back to back. Any run of up to
+ * _capacity_ bytes starting inside the first mapping is then contiguous, and
+ * the copies that would otherwise wrap around are done by the MMU.
+ */
 struct ring_buffer_s {
-  size_t capacity;     /* Total size of data */
-  size_t size;         /* How many bytes are currently stored in data */
-  size_t start;        /* Offset in data of the first logical byte */
-  uint8_t data[];
+  size_t   capacity;     /* Total size of data */
+  size_t   mask;         /* capacity - 1 */
+  uint64_t head;         /* Position one past the newest byte */
+  uint64_t tail;         /* Position of the oldest byte */
+  uint8_t  mirrored;     /* data is followed by a second mapping of itself */
+  int      memfd;        /* backing memory of a mirrored buffer, or -1 */
+  uint8_t *data;
 };
 
 /**
@@ -20,11 +36,18 @@ struct ring_buffer_s {
  * and size - 1 is the newest byte) into a raw offset in the underlying array.
  */
 static inline size_t log_to_raw(const ring_buffer_t *buf, size_t off) {
-  if (buf->size < buf->capacity) {
-    return off;
-  } else {
-    return (buf->start + off) % buf->capacity;
+  return (size_t) (buf->tail + off) & buf->mask;
+}
+
+static size_t round_up_pow2(size_t n) {
+  size_t ret = 1;
+
+  while (ret < n) {
+    ret <<= 1;
+    assert(0 != ret);
   }
+
+  return ret;
 }
 
 ring_buffer_t *ring_buffer_alloc(size_t capacity) {
@@ -32,18 +55,82 @@ ring_buffer_t *ring_buffer_alloc(size_t capacity) {
 
   assert(capacity > 0);
 
-  buf = calloc(sizeof(*buf) + capacity, sizeof(uint8_t));
+  capacity = round_up_pow2(capacity);
+
+  buf = calloc(1, sizeof(*buf) + capacity);
+  assert(NULL != buf);
+
+  buf->capacity = capacity;
+  buf->mask = capacity - 1;
+  buf->memfd = -1;
+  buf->data = (uint8_t *) (buf + 1);
+
+  return buf;
+}
+
+ring_buffer_t *ring_buffer_alloc_mirrored(size_t capacity) {
+  ring_buffer_t *buf = NULL;
+  uint8_t       *addr = MAP_FAILED;
+  int            fd = -1;
+  int            ii = 0;
+
+  assert(capacity > 0);
+
+  /* A power of two that is at least a page is also a multiple of one */
+  capacity = round_up_pow2(MAX(capacity, (size_t) sysconf(_SC_PAGESIZE)));
+
+#ifdef SYS_memfd_create
+  fd = syscall(SYS_memfd_create, "ring_buffer", 0);
+#endif
+  if (-1 == fd) {
+    return NULL;
+  }
+
+  if (-1 == ftruncate(fd, capacity)) {
+    goto err;
+  }
+
+  /* Reserve room for both views, then map the memory over each half */
+  addr = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+  if (MAP_FAILED == addr) {
+    goto err;
+  }
+
+  for (ii = 0; ii < 2; ++ii) {
+    if (MAP_FAILED == mmap(addr + ii * capacity, capacity,
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                           fd, 0)) {
+      goto err;
+    }
+  }
+
+  set_cloexec(fd);
+
+  buf = calloc(1, sizeof(*buf));
   assert(NULL != buf);
 
   buf->capacity = capacity;
+  buf->mask = capacity - 1;
+  buf->mirrored = 1;
+  buf->memfd = fd;
+  buf->data = addr;
 
   return buf;
+
+err:
+  if (MAP_FAILED != addr) {
+    munmap(addr, 2 * capacity);
+  }
+
+  close(fd);
+
+  return NULL;
 }
 
 void ring_buffer_append(ring_buffer_t *buf, const uint8_t *data, size_t size) {
-  size_t off = 0;
-  size_t nremain = size;
-  size_t nto_copy = 0;
+  size_t raw_head = 0;
+  size_t nfirst = 0;
 
   assert(NULL != buf);
   assert(NULL != data);
@@ -54,72 +141,169 @@ void ring_buffer_append(ring_buffer_t *buf, const uint8_t *data, size_t size) {
 
   /* Don't waste time copying bytes that would be overwritten */
   if (size > buf->capacity) {
-    off = size - buf->capacity;
-    nremain = buf->capacity;
+    data += size - buf->capacity;
+    buf->head += size - buf->capacity;
+    size = buf->capacity;
   }
 
-  while (nremain > 0) {
-    nto_copy = MIN(nremain, buf->capacity - buf->start);
-
-    memcpy(buf->data + buf->start, data + off, nto_copy);
+  raw_head = (size_t) buf->head & buf->mask;
+  nfirst = buf->mirrored ? size : MIN(size, buf->capacity - raw_head);
 
-    buf->size = MIN(buf->size + nto_copy, buf->capacity);
-    buf->start = (buf->start + nto_copy) % buf->capacity;
+  memcpy(buf->data + raw_head, data, nfirst);
+  if (nfirst < size) {
+    memcpy(buf->data, data + nfirst, size - nfirst);
+  }
 
-    off += nto_copy;
-    nremain -= nto_copy;
+  buf->head += size;
+  if (buf->head - buf->tail > buf->capacity) {
+    buf->tail = buf->head - buf->capacity;
   }
 }
 
 size_t ring_buffer_read(const ring_buffer_t *buf, size_t start, uint8_t *dst,
                         size_t size) {
-  size_t ncopied = 0;
-  size_t nremain = 0;
-  size_t nto_copy = 0;
+  size_t raw_start = 0;
+  size_t nfirst = 0;
 
   assert(NULL != buf);
   assert(NULL != dst);
-  assert(start <= buf->size);
+  assert(start <= ring_buffer_size(buf));
+
+  size = MIN(ring_buffer_size(buf) - start, size);
 
-  nremain = MIN(buf->size - start, size);
+  raw_start = log_to_raw(buf, start);
+  nfirst = buf->mirrored ? size : MIN(size, buf->capacity - raw_start);
 
-  while (nremain > 0) {
-    nto_copy = MIN(nremain, buf->capacity - log_to_raw(buf, start + ncopied));
+  memcpy(dst, buf->data + raw_start, nfirst);
+  if (nfirst < size) {
+    memcpy(dst + nfirst, buf->data, size - nfirst);
+  }
 
-    memcpy(dst + ncopied,
-           buf->data + log_to_raw(buf, start + ncopied),
-           nto_copy);
+  return size;
+}
 
-    nremain -= nto_copy;
-    ncopied += nto_copy;
+int ring_buffer_iov(const ring_buffer_t *buf, size_t start, size_t size,
+                    struct iovec iov[2]) {
+  size_t raw_start = 0;
+  size_t nfirst = 0;
+
+  assert(NULL != buf);
+  assert(NULL != iov);
+  assert(start <= ring_buffer_size(buf));
+
+  size = MIN(ring_buffer_size(buf) - start, size);
+  if (0 == size) {
+    return 0;
+  }
+
+  raw_start = log_to_raw(buf, start);
+  nfirst = buf->mirrored ? size : MIN(size, buf->capacity - raw_start);
+
+  iov[0].iov_base = (void *) (buf->data + raw_start);
+  iov[0].iov_len = nfirst;
+
+  if (nfirst == size) {
+    return 1;
   }
 
-  return ncopied;
+  iov[1].iov_base = (void *) buf->data;
+  iov[1].iov_len = size - nfirst;
+
+  return 2;
 }
 
-uint8_t *ring_buffer_dup(const ring_buffer_t *buf) {
-  uint8_t *ret = NULL;
+size_t ring_buffer_size(const ring_buffer_t *buf) {
+  assert(NULL != buf);
 
-  if (buf->size == 0) {
-    return NULL;
+  return (size_t) (buf->head - buf->tail);
+}
+
+/**
+ * Moves the data into the backing file at _off_.
+ *
+ * @return Number of bytes moved, or -1 if splice(2) failed for a reason other
+ *         than the pipe being empty.
+ */
+static ssize_t splice_into(int fd, int memfd, size_t off, size_t size,
+                           uint8_t *hup) {
+  loff_t  loff   = off;
+  ssize_t nmoved = 0;
+
+  do {
+    nmoved = splice(fd, NULL, memfd, &loff, size,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  } while (-1 == nmoved && EINTR == errno);
+
+  if (-1 == nmoved) {
+    return (EAGAIN == errno) ? 0 : -1;
+  }
+
+  if (0 == nmoved) {
+    *hup = 1;
   }
 
-  ret = malloc(buf->size);
+  return nmoved;
+}
+
+ssize_t ring_buffer_splice_in(ring_buffer_t *buf, int fd, size_t size,
+                              uint8_t *hup) {
+  size_t  raw_head = 0;
+  size_t  nfirst   = 0;
+  ssize_t nmoved   = 0;
+  ssize_t nsecond  = 0;
+
   assert(NULL != buf);
+  assert(NULL != hup);
+  assert(buf->mirrored);
 
-  ring_buffer_read(buf, 0, ret, buf->size);
+  *hup = 0;
 
-  return ret;
+  /* Anything more would overwrite itself */
+  size = MIN(size, buf->capacity);
+
+  /* The file is only _capacity_ long, the mirror exists only in memory */
+  raw_head = (size_t) buf->head & buf->mask;
+  nfirst = MIN(size, buf->capacity - raw_head);
+
+  nmoved = splice_into(fd, buf->memfd, raw_head, nfirst, hup);
+  if (-1 == nmoved) {
+    return -1;
+  }
+
+  if ((nmoved == nfirst) && (nfirst < size)) {
+    nsecond = splice_into(fd, buf->memfd, 0, size - nfirst, hup);
+    if (nsecond > 0) {
+      nmoved += nsecond;
+    }
+  }
+
+  buf->head += nmoved;
+  if (buf->head - buf->tail > buf->capacity) {
+    buf->tail = buf->head - buf->capacity;
+  }
+
+  return nmoved;
 }
 
-size_t ring_buffer_size(const ring_buffer_t *buf) {
+size_t ring_buffer_capacity(const ring_buffer_t *buf) {
   assert(NULL != buf);
 
-  return buf->size;
+  return buf->capacity;
+}
+
+uint8_t ring_buffer_is_mirrored(const ring_buffer_t *buf) {
+  assert(NULL != buf);
+
+  return buf->mirrored;
 }
 
 void ring_buffer_free(ring_buffer_t *buf) {
   assert(NULL != buf);
 
+  if (buf->mirrored) {
+    munmap(buf->data, 2 * buf->capacity);
+    close(buf->memfd);
+  }
+
   free(buf);
 }
@@ -3,11 +3,31 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 typedef struct ring_buffer_s ring_buffer_t;
 
+/**
+ * Allocates a ring buffer that retains the last _capacity_ bytes appended.
+ *
+ * NB: The capacity is rounded up to the next power of two.
+ */
 ring_buffer_t *ring_buffer_alloc(size_t capacity);
 
+/**
+ * Allocates a ring buffer whose memory is mapped twice, back to back, so that
+ * reads and ring_buffer_iov() never have to deal with wraparound. Meant for
+ * high-volume sources.
+ *
+ * NB: The capacity is rounded up to the next power of two that is at least
+ *     the page size.
+ *
+ * @return The new buffer, or NULL if the platform doesn't support it (e.g. no
+ *         memfd_create(2)).
+ */
+ring_buffer_t *ring_buffer_alloc_mirrored(size_t capacity);
+
 /**
  * Writes data to the supplied ring buffer.
  *
@@ -28,14 +48,44 @@ size_t ring_buffer_read(const ring_buffer_t *buf, size_t start, uint8_t *dst,
                         size_t size);
 
 /**
- * Returns a copy of the ring buffer.
+ * Describes _size_ bytes of the buffer, starting at offset _start_, without
+ * copying them. The bytes may wrap around the end of the underlying array, so
+ * they take at most two segments, or one if the buffer is mirrored.
+ *
+ * NB: The segments point into the buffer and are only valid until the next
+ *     append.
  *
- * NB: Caller is responsible for freeing the returned buffer.
+ * @param buf   The buffer being described.
+ * @param start Offset into the buffer that specifies where to start.
+ * @param size  How many bytes to describe.
+ * @param iov   Filled in with the segments.
+ *
+ * @return Number of segments filled in (0, 1, or 2).
+ */
+int ring_buffer_iov(const ring_buffer_t *buf, size_t start, size_t size,
+                    struct iovec iov[2]);
+
+/**
+ * Moves up to _size_ bytes from the pipe _fd_ into a mirrored buffer using
+ * splice(2), so the data never passes through user space.
+ *
+ * @param buf   A buffer allocated with ring_buffer_alloc_mirrored().
+ * @param fd    The read end of a non-blocking pipe.
+ * @param size  How many bytes to move at most.
+ * @param hup   Set if the write end of the pipe was closed.
+ *
+ * @return Number of bytes moved (0 if the pipe is empty), or -1 if splice(2)
+ *         failed. The caller can fall back to reading the data in that case.
  */
-uint8_t *ring_buffer_dup(const ring_buffer_t *buf);
+ssize_t ring_buffer_splice_in(ring_buffer_t *buf, int fd, size_t size,
+                              uint8_t *hup);
 
 size_t ring_buffer_size(const ring_buffer_t *buf);
 
+size_t ring_buffer_capacity(const ring_buffer_t *buf);
+
+uint8_t ring_buffer_is_mirrored(const ring_buffer_t *buf);
+
 void ring_buffer_free(ring_buffer_t *buf);
 
 #endif
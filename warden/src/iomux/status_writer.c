@@ -1,6 +1,6 @@
 #include <arpa/inet.h>
 #include <assert.h>
-#include <pthread.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -10,6 +10,7 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "reactor.h"
 #include "status_writer.h"
 #include "util.h"
 
@@ -32,12 +33,14 @@ LIST_HEAD(status_sink_head, status_sink_s);
 struct status_writer_s {
   int                   status;
   status_writer_state_t state;
-  pthread_mutex_t       state_lock;
 
-  barrier_t *barrier;
+  reactor_t         *reactor;
 
-  int accept_fd;                /* where new connections are created */
-  int acceptor_stop_pipe[2];
+  int                accept_fd; /* where new connections are created */
+  reactor_handler_t *accept_handler;
+
+  notify_cb_t  client_cb;       /* invoked once a client has connected */
+  void        *client_cb_data;
 
   struct status_sink_head sinks; /* where data is written to */
 };
@@ -77,16 +80,55 @@ static void status_writer_free_sinks(status_writer_t *sw) {
   }
 }
 
-status_writer_t *status_writer_alloc(int accept_fd, barrier_t *barrier) {
+/**
+ * Accepts a single pending connection.
+ *
+ * @return 0 if a connection was accepted, -1 otherwise.
+ */
+static int status_writer_accept(status_writer_t *sw) {
+  int            sink_fd = -1;
+  status_sink_t *sink    = NULL;
+
+  assert(NULL != sw);
+
+  sink_fd = accept(sw->accept_fd, NULL, NULL);
+  if (-1 == sink_fd) {
+    if (EAGAIN != errno && EINTR != errno) {
+      perror("accept()");
+    }
+    return -1;
+  }
+
+  set_cloexec(sink_fd);
+
+  sink = status_sink_alloc(sink_fd);
+  LIST_INSERT_HEAD(&(sw->sinks), sink, next_sink);
+
+  if (NULL != sw->client_cb) {
+    sw->client_cb(sw->client_cb_data);
+    sw->client_cb = NULL;
+  }
+
+  return 0;
+}
+
+static void status_writer_handle_accept(reactor_t *reactor, int fd,
+                                        uint32_t events, void *data) {
+  assert(NULL != data);
+
+  status_writer_accept((status_writer_t *) data);
+}
+
+status_writer_t *status_writer_alloc(reactor_t *reactor, int accept_fd) {
   status_writer_t *sw = NULL;
-  int err = 0, ii = 0;
 
+  assert(NULL != reactor);
   assert(accept_fd >= 0);
 
   sw = calloc(1, sizeof(*sw));
   assert(NULL != sw);
 
-  sw->barrier = barrier;
+  sw->reactor = reactor;
 
   sw->accept_fd = accept_fd;
   set_nonblocking(sw->accept_fd);
@@ -94,97 +136,59 @@ status_writer_t *status_writer_alloc(int accept_fd, barrier_t *barrier) {
 
   LIST_INIT(&(sw->sinks));
 
-  if (-1 == pipe(sw->acceptor_stop_pipe)) {
-    perror("pipe()");
-    assert(0);
-  }
-  set_nonblocking(sw->acceptor_stop_pipe[0]);
-  for (ii = 0; ii < 2; ++ii) {
-    set_cloexec(sw->acceptor_stop_pipe[ii]);
-  }
-
   sw->state = STATE_CREATED;
-  err = pthread_mutex_init(&(sw->state_lock), NULL);
-  assert(!err);
   sw->status = -1;
 
   return sw;
 }
 
-void status_writer_run(status_writer_t *sw) {
-  uint8_t events;
-  int sink_fd;
-  uint32_t out_status;
-  status_sink_t *sink = NULL;
-
+void status_writer_on_client(status_writer_t *sw, notify_cb_t cb, void *data) {
   assert(NULL != sw);
 
-  checked_lock(&(sw->state_lock));
+  sw->client_cb = cb;
+  sw->client_cb_data = data;
+}
+
+void status_writer_start(status_writer_t *sw) {
+  assert(NULL != sw);
 
   assert(STATE_CREATED == sw->state);
   sw->state = STATE_STARTED;
 
-  checked_unlock(&(sw->state_lock));
+  sw->accept_handler = reactor_add(sw->reactor, sw->accept_fd, EPOLLIN,
+                                   status_writer_handle_accept, sw);
+}
 
-  while (1) {
-    events = wait_readable_or_stop(sw->accept_fd, sw->acceptor_stop_pipe[0]);
+void status_writer_finish(status_writer_t *sw, int status) {
+  uint32_t       out_status;
+  status_sink_t *sink = NULL;
 
-    if (events & MUXER_READABLE) {
-      sink_fd = accept(sw->accept_fd, NULL, NULL);
-      if (-1 == sink_fd) {
-        perror("accept()");
-      } else {
-        sink = status_sink_alloc(sink_fd);
-        LIST_INSERT_HEAD(&(sw->sinks), sink, next_sink);
+  assert(NULL != sw);
 
-        if (NULL != sw->barrier) {
-          barrier_lift(sw->barrier);
-        }
-      }
-    }
+  assert(STATE_STARTED == sw->state);
 
-    if (events & MUXER_STOP) {
-      close(sw->accept_fd);
-      break;
-    }
-  }
+  sw->state = STATE_DONE;
+  sw->status = status;
 
-  checked_lock(&(sw->state_lock));
+  reactor_remove(sw->reactor, sw->accept_handler);
+  sw->accept_handler = NULL;
 
-  out_status = htonl((uint32_t) sw->status);
+  /* Clients that connected but weren't accepted yet also get the status */
+  while (0 == status_writer_accept(sw)) {
+  }
 
-  checked_unlock(&(sw->state_lock));
+  out_status = htonl((uint32_t) sw->status);
 
   /* Write out the status to each sink */
   LIST_FOREACH(sink, &(sw->sinks), next_sink) {
     atomic_write(sink->fd, &(out_status), sizeof(out_status), NULL);
     close(sink->fd);
   }
-
-  close(sw->acceptor_stop_pipe[0]);
-  close(sw->acceptor_stop_pipe[1]);
-}
-
-void status_writer_finish(status_writer_t *sw, int status) {
-  uint8_t hup;
-
-  checked_lock(&(sw->state_lock));
-
-  assert(STATE_STARTED == sw->state);
-
-  sw->state = STATE_DONE;
-  sw->status = status;
-
-  checked_unlock(&(sw->state_lock));
-
-  /* Notify thread executing status_writer_run() */
-  atomic_write(sw->acceptor_stop_pipe[1], "x", 1, &hup);
 }
 
 void status_writer_free(status_writer_t *sw) {
   assert(NULL != sw);
 
-  pthread_mutex_destroy(&(sw->state_lock));
   status_writer_free_sinks(sw);
   free(sw);
 }
@@ -3,28 +3,33 @@
 
 #include <stdint.h>
 
-#include "barrier.h"
+#include "reactor.h"
+#include "util.h"
 
 typedef struct status_writer_s status_writer_t;
 
 /**
  * Allocates a new status writer.
  *
+ * @param reactor   Reactor that drives the status writer.
  * @param accept_fd
- * @param barrier   If supplied, this barrier will be lifted once a client has
- *                  connected.
  */
-status_writer_t *status_writer_alloc(int accept_fd, barrier_t *barrier);
+status_writer_t *status_writer_alloc(reactor_t *reactor, int accept_fd);
 
 /**
- * Starts the status writer. This blocks until someone calls
- * status_writer_finish().
+ * Registers a callback that is invoked once the first client has connected.
  */
-void status_writer_run(status_writer_t *sw);
+void status_writer_on_client(status_writer_t *sw, notify_cb_t cb, void *data);
+
+/**
+ * Starts accepting clients. The actual work is done from within reactor_run().
+ */
+void status_writer_start(status_writer_t *sw);
 
 /**
  * Tells the status writer that the child has completed. The status
- * writer in turn writes out the supplied child status to any connected clients.
+ * writer in turn writes out the supplied child status to any connected clients,
+ * including those that are still waiting to be accepted.
  *
  * @param sw
  * @param status Exit status of the child.
@@ -0,0 +1,65 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "stream_header.h"
+
+uint64_t hton64(uint64_t val) {
+  return ((uint64_t) htonl((uint32_t) val) << 32) |
+         htonl((uint32_t) (val >> 32));
+}
+
+uint64_t ntoh64(uint64_t val) {
+  return hton64(val);
+}
+
+void stream_header_encode(uint8_t *buf, uint64_t pos) {
+  uint32_t u32 = 0;
+  uint64_t u64 = 0;
+
+  assert(NULL != buf);
+
+  u32 = htonl(STREAM_HEADER_MAGIC);
+  memcpy(buf, &u32, sizeof(u32));
+
+  u32 = htonl(STREAM_HEADER_VERSION);
+  memcpy(buf + 4, &u32, sizeof(u32));
+
+  u64 = hton64(pos);
+  memcpy(buf + 8, &u64, sizeof(u64));
+}
+
+int stream_header_decode(const uint8_t *buf, size_t size, uint64_t *pos) {
+  uint32_t u32 = 0;
+  uint64_t u64 = 0;
+
+  assert(NULL != buf);
+  assert(NULL != pos);
+
+  if (size < STREAM_HEADER_V1_SIZE) {
+    return 0;
+  }
+
+  memcpy(&u32, buf, sizeof(u32));
+  u32 = ntohl(u32);
+
+  if (STREAM_HEADER_MAGIC != u32) {
+    *pos = u32;
+    return STREAM_HEADER_V1_SIZE;
+  }
+
+  if (size < STREAM_HEADER_SIZE) {
+    return 0;
+  }
+
+  memcpy(&u32, buf + 4, sizeof(u32));
+  if (STREAM_HEADER_VERSION != ntohl(u32)) {
+    return -1;
+  }
+
+  memcpy(&u64, buf + 8, sizeof(u64));
+  *pos = ntoh64(u64);
+
+  return STREAM_HEADER_SIZE;
+}
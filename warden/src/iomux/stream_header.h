@@ -0,0 +1,49 @@
+#ifndef STREAM_HEADER_H
+#define STREAM_HEADER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Every stdout/stderr connection starts with a header that tells the client
+ * the stream position of the first byte that follows.
+ *
+ * Version 1 is just the position as a 32 bit integer, which wraps after 4GB
+ * of output. Version 2 is prefixed with a magic number and a version, and
+ * carries a 64 bit position:
+ *
+ *   magic (4 bytes) | version (4 bytes) | position (8 bytes)
+ *
+ * All fields are in network byte order. A client tells the two apart by the
+ * magic number; a version 1 position that happens to equal it is mistaken
+ * for a version 2 header, which is considered acceptable.
+ */
+#define STREAM_HEADER_MAGIC   0x494f4d58 /* "IOMX" */
+#define STREAM_HEADER_VERSION 2
+
+#define STREAM_HEADER_V1_SIZE 4
+#define STREAM_HEADER_SIZE    16
+
+/**
+ * Writes a version 2 header for _pos_ to _buf_.
+ */
+void stream_header_encode(uint8_t *buf, uint64_t pos);
+
+/**
+ * Decodes a (partial) header.
+ *
+ * @param buf   What has been received so far.
+ * @param size  Number of bytes in _buf_.
+ * @param pos   Set to the position, once the header is complete.
+ *
+ * @return Size of the header once it can be determined from _buf_, and 0 if
+ *         more data is needed for that. Returns -1 if the header is of an
+ *         unsupported version.
+ */
+int stream_header_decode(const uint8_t *buf, size_t size, uint64_t *pos);
+
+uint64_t hton64(uint64_t val);
+
+uint64_t ntoh64(uint64_t val);
+
+#endif
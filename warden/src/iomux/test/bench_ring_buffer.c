@@ -0,0 +1,195 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ring_buffer.h"
+#include "util.h"
+
+/*
+ * Compares the ring buffer against the modulo-indexed implementation it
+ * replaced, using the access pattern of the muxer: append a chunk read from
+ * the source, then read back the window a sink still has to write.
+ *
+ * Usage: bench [chunk size] [total MB]
+ */
+
+#define RING_CAPACITY 65535
+
+/*
+ * Copy of the previous implementation, for comparison. It is kept out of line
+ * so that it pays for a function call, like the real one does.
+ */
+
+#define BENCH_NOINLINE __attribute__((noinline))
+
+typedef struct {
+  size_t capacity;     /* Total size of data */
+  size_t size;         /* How many bytes are currently stored in data */
+  size_t start;        /* Offset in data of the first logical byte */
+  uint8_t data[];
+} legacy_ring_buffer_t;
+
+static inline size_t legacy_log_to_raw(const legacy_ring_buffer_t *buf,
+                                       size_t off) {
+  if (buf->size < buf->capacity) {
+    return off;
+  } else {
+    return (buf->start + off) % buf->capacity;
+  }
+}
+
+BENCH_NOINLINE
+static legacy_ring_buffer_t *legacy_ring_buffer_alloc(size_t capacity) {
+  legacy_ring_buffer_t *buf = NULL;
+
+  assert(capacity > 0);
+
+  buf = calloc(sizeof(*buf) + capacity, sizeof(uint8_t));
+  assert(NULL != buf);
+
+  buf->capacity = capacity;
+
+  return buf;
+}
+
+BENCH_NOINLINE
+static void legacy_ring_buffer_append(legacy_ring_buffer_t *buf,
+                                      const uint8_t *data, size_t size) {
+  size_t off = 0;
+  size_t nremain = size;
+  size_t nto_copy = 0;
+
+  if (0 == size) {
+    return;
+  }
+
+  if (size > buf->capacity) {
+    off = size - buf->capacity;
+    nremain = buf->capacity;
+  }
+
+  while (nremain > 0) {
+    nto_copy = MIN(nremain, buf->capacity - buf->start);
+
+    memcpy(buf->data + buf->start, data + off, nto_copy);
+
+    buf->size = MIN(buf->size + nto_copy, buf->capacity);
+    buf->start = (buf->start + nto_copy) % buf->capacity;
+
+    off += nto_copy;
+    nremain -= nto_copy;
+  }
+}
+
+BENCH_NOINLINE
+static size_t legacy_ring_buffer_read(const legacy_ring_buffer_t *buf,
+                                      size_t start, uint8_t *dst,
+                                      size_t size) {
+  size_t ncopied = 0;
+  size_t nremain = 0;
+  size_t nto_copy = 0;
+
+  nremain = MIN(buf->size - start, size);
+
+  while (nremain > 0) {
+    nto_copy = MIN(nremain,
+                   buf->capacity - legacy_log_to_raw(buf, start + ncopied));
+
+    memcpy(dst + ncopied,
+           buf->data + legacy_log_to_raw(buf, start + ncopied),
+           nto_copy);
+
+    nremain -= nto_copy;
+    ncopied += nto_copy;
+  }
+
+  return ncopied;
+}
+
+/* Benchmark driver */
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t nbytes, double elapsed) {
+  printf("%-8s %8.1f MB/s  (%.3fs)\n",
+         name, nbytes / elapsed / (1024 * 1024), elapsed);
+}
+
+int main(int argc, char *argv[]) {
+  size_t                chunk_size = 4096;
+  size_t                total      = 1024;
+  size_t                niter      = 0;
+  size_t                ii         = 0;
+  size_t                nread      = 0;
+  uint64_t              checksum   = 0;
+  uint8_t              *chunk      = NULL;
+  uint8_t              *dst        = NULL;
+  ring_buffer_t        *rb         = NULL;
+  legacy_ring_buffer_t *legacy     = NULL;
+  double                start      = 0;
+
+  if (argc > 1) {
+    chunk_size = strtoul(argv[1], NULL, 10);
+  }
+
+  if (argc > 2) {
+    total = strtoul(argv[2], NULL, 10);
+  }
+
+  assert(chunk_size > 0);
+
+  total *= 1024 * 1024;
+  niter = total / chunk_size;
+
+  chunk = malloc(chunk_size);
+  dst = malloc(chunk_size);
+  assert(NULL != chunk && NULL != dst);
+
+  for (ii = 0; ii < chunk_size; ++ii) {
+    chunk[ii] = (uint8_t) ii;
+  }
+
+  printf("chunk=%zu bytes, total=%zu MB, capacity=%d\n",
+         chunk_size, total / (1024 * 1024), RING_CAPACITY);
+
+  legacy = legacy_ring_buffer_alloc(RING_CAPACITY);
+  start = now();
+  for (ii = 0; ii < niter; ++ii) {
+    legacy_ring_buffer_append(legacy, chunk, chunk_size);
+    nread = legacy_ring_buffer_read(legacy,
+                                    legacy->size - MIN(legacy->size, chunk_size),
+                                    dst, chunk_size);
+    checksum += dst[nread - 1];
+  }
+  report("legacy", 2 * niter * chunk_size, now() - start);
+  free(legacy);
+
+  rb = ring_buffer_alloc(RING_CAPACITY);
+  start = now();
+  for (ii = 0; ii < niter; ++ii) {
+    ring_buffer_append(rb, chunk, chunk_size);
+    nread = ring_buffer_read(rb,
+                             ring_buffer_size(rb) - MIN(ring_buffer_size(rb), chunk_size),
+                             dst, chunk_size);
+    checksum += dst[nread - 1];
+  }
+  report("pow2", 2 * niter * chunk_size, now() - start);
+  ring_buffer_free(rb);
+
+  /* Keeps the reads from being optimized away */
+  printf("checksum=%llu\n", (unsigned long long) checksum);
+
+  free(chunk);
+  free(dst);
+
+  return 0;
+}
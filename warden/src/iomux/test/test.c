@@ -1,10 +1,18 @@
+#include "test_cursors.h"
+#include "test_job_protocol.h"
+#include "test_job_server.h"
 #include "test_muxer.h"
 #include "test_ring_buffer.h"
 #include "test_status_writer.h"
+#include "test_stream_header.h"
 
 int main(int argc, char **argv) {
   test_ring_buffer();
   test_muxer();
   test_status_writer();
+  test_stream_header();
+  test_cursors();
+  test_job_protocol();
+  test_job_server();
   return 0;
 }
@@ -0,0 +1,119 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cursors.h"
+#include "test_util.h"
+
+static void make_path(char *path) {
+  int fd = -1;
+
+  strcpy(path, "/tmp/cursors_test_XXXXXX");
+  fd = mkstemp(path);
+  assert(-1 != fd);
+  close(fd);
+  unlink(path);
+}
+
+static void test_cursors_persist(void) {
+  char        path[256];
+  cursors_t  *cursors = NULL;
+  struct stat st;
+
+  make_path(path);
+
+  /* A new file starts out at zero */
+  cursors = cursors_open(path);
+  TEST_CHECK(NULL != cursors);
+  TEST_CHECK(0 == cursors_get(cursors, 0));
+  TEST_CHECK(0 == cursors_get(cursors, 1));
+
+  cursors_update(cursors, 0, 0x100000000ULL);
+  cursors_update(cursors, 1, 10);
+
+  /* Positions never move backwards */
+  cursors_update(cursors, 1, 5);
+  TEST_CHECK(10 == cursors_get(cursors, 1));
+
+  cursors_close(cursors);
+
+  TEST_CHECK(0 == stat(path, &st));
+  TEST_CHECK(24 == st.st_size);
+
+  cursors = cursors_open(path);
+  TEST_CHECK(NULL != cursors);
+  TEST_CHECK(0x100000000ULL == cursors_get(cursors, 0));
+  TEST_CHECK(10 == cursors_get(cursors, 1));
+  cursors_close(cursors);
+
+  unlink(path);
+}
+
+static void test_cursors_legacy(void) {
+  char       path[256];
+  cursors_t *cursors = NULL;
+  uint32_t   v1[2]   = { htonl(1234), htonl(5678) };
+  FILE      *f       = NULL;
+
+  make_path(path);
+
+  /* Files with two 32 bit positions are still understood */
+  f = fopen(path, "w");
+  assert(NULL != f);
+  fwrite(v1, sizeof(v1), 1, f);
+  fclose(f);
+
+  cursors = cursors_open(path);
+  TEST_CHECK(NULL != cursors);
+  TEST_CHECK(1234 == cursors_get(cursors, 0));
+  TEST_CHECK(5678 == cursors_get(cursors, 1));
+  cursors_close(cursors);
+
+  /* Garbage isn't */
+  f = fopen(path, "w");
+  assert(NULL != f);
+  fwrite("garbage", 7, 1, f);
+  fclose(f);
+
+  cursors = cursors_open(path);
+  TEST_CHECK(NULL == cursors);
+
+  unlink(path);
+}
+
+static void test_cursors_tick(void) {
+  char       path[256];
+  cursors_t *cursors    = NULL;
+  int        timeout_ms = 0;
+
+  make_path(path);
+
+  cursors = cursors_open(path);
+  TEST_CHECK(NULL != cursors);
+
+  /* Nothing to flush */
+  TEST_CHECK(-1 == cursors_tick(cursors));
+
+  /* Too little to flush right away */
+  cursors_update(cursors, 0, 10);
+  timeout_ms = cursors_tick(cursors);
+  TEST_CHECK(timeout_ms > 0);
+  TEST_CHECK(timeout_ms <= CURSORS_SYNC_INTERVAL_MS);
+
+  /* Flushed once due, even though the position didn't change since */
+  usleep((timeout_ms + 10) * 1000);
+  TEST_CHECK(-1 == cursors_tick(cursors));
+
+  cursors_close(cursors);
+  unlink(path);
+}
+
+void test_cursors(void) {
+  test_cursors_persist();
+  test_cursors_legacy();
+  test_cursors_tick();
+}
@@ -0,0 +1,6 @@
+#ifndef TEST_CURSORS_H
+#define TEST_CURSORS_H 1
+
+void test_cursors(void);
+
+#endif
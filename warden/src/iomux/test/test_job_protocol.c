@@ -0,0 +1,65 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "job_protocol.h"
+#include "test_util.h"
+
+static void test_job_request_roundtrip(void) {
+  uint8_t  buf[JOB_REQUEST_SIZE];
+  uint64_t posns[2] = {0x123456789aULL, 42};
+  uint64_t decoded[2] = {0, 0};
+
+  job_request_encode(buf, posns);
+
+  TEST_CHECK(0 == job_request_decode(buf, decoded));
+  TEST_CHECK(decoded[0] == posns[0]);
+  TEST_CHECK(decoded[1] == posns[1]);
+
+  /* Requests for other versions are rejected */
+  buf[7] = JOB_PROTOCOL_VERSION + 1;
+  TEST_CHECK(-1 == job_request_decode(buf, decoded));
+
+  memset(buf, 0, sizeof(buf));
+  TEST_CHECK(-1 == job_request_decode(buf, decoded));
+}
+
+static void test_job_frame_header_roundtrip(void) {
+  uint8_t            buf[JOB_FRAME_HEADER_SIZE];
+  job_frame_header_t header = { JOB_STREAM_STDERR, 512, 0x100000000ULL };
+  job_frame_header_t decoded;
+
+  job_frame_header_encode(buf, &header);
+
+  TEST_CHECK(0 == job_frame_header_decode(buf, &decoded));
+  TEST_CHECK(decoded.stream == header.stream);
+  TEST_CHECK(decoded.length == header.length);
+  TEST_CHECK(decoded.pos == header.pos);
+}
+
+static void test_job_frame_header_invalid(void) {
+  uint8_t            buf[JOB_FRAME_HEADER_SIZE];
+  job_frame_header_t header = { JOB_STREAM_STATUS + 1, 1, 0 };
+  job_frame_header_t decoded;
+
+  /* Unknown stream */
+  job_frame_header_encode(buf, &header);
+  TEST_CHECK(-1 == job_frame_header_decode(buf, &decoded));
+
+  /* Oversized payload */
+  header.stream = JOB_STREAM_STDOUT;
+  header.length = JOB_FRAME_MAX_LENGTH + 1;
+  job_frame_header_encode(buf, &header);
+  TEST_CHECK(-1 == job_frame_header_decode(buf, &decoded));
+
+  /* The status payload is exactly one 32 bit integer */
+  header.stream = JOB_STREAM_STATUS;
+  header.length = 8;
+  job_frame_header_encode(buf, &header);
+  TEST_CHECK(-1 == job_frame_header_decode(buf, &decoded));
+}
+
+void test_job_protocol(void) {
+  test_job_request_roundtrip();
+  test_job_frame_header_roundtrip();
+  test_job_frame_header_invalid();
+}
@@ -0,0 +1,6 @@
+#ifndef TEST_JOB_PROTOCOL_H
+#define TEST_JOB_PROTOCOL_H 1
+
+void test_job_protocol(void);
+
+#endif
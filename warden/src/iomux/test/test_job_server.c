@@ -0,0 +1,382 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "barrier.h"
+#include "job_protocol.h"
+#include "job_server.h"
+#include "muxer.h"
+#include "reactor.h"
+#include "test_util.h"
+#include "util.h"
+
+/*
+ * Clients connect over TCP rather than a unix socket, since that lets the
+ * socket buffers be shrunk far below the size of a frame.
+ */
+#define SOCKET_BUFFER_SIZE 4096
+
+typedef struct {
+  reactor_t    *reactor;
+  pthread_t     reactor_thread;
+  int           sources[2][2]; /* pipes for stdout and stderr */
+  char          paths[2][256]; /* where the muxers listen */
+  int           listen_socks[2];
+  muxer_t      *muxers[2];
+  int           js_sock;
+  struct sockaddr_in js_addr;
+  job_server_t *js;
+  barrier_t    *client_barrier;
+} fixture_t;
+
+typedef struct {
+  uint8_t  hup;       /* the connection was closed */
+  uint8_t  finished;  /* the status frame was received */
+  uint32_t status;
+  uint64_t first_length;
+  uint64_t next_pos;  /* one past the last stdout byte received */
+  int      ngaps;     /* how many times stdout skipped ahead */
+  uint8_t  intact;    /* every payload byte matched what was written */
+} received_t;
+
+static uint8_t pattern_at(uint64_t pos) {
+  return (uint8_t) (pos % 251);
+}
+
+static void *run_reactor(void *data) {
+  assert(NULL != data);
+
+  reactor_run((reactor_t *) data);
+
+  return NULL;
+}
+
+static void start_reactor(fixture_t *f) {
+  if (pthread_create(&(f->reactor_thread), NULL, run_reactor, f->reactor)) {
+    perror("pthread_create");
+    assert(0);
+  }
+}
+
+static void stop_reactor(fixture_t *f) {
+  reactor_stop(f->reactor);
+  pthread_join(f->reactor_thread, NULL);
+}
+
+static void lift_barrier(void *data) {
+  barrier_lift((barrier_t *) data);
+}
+
+static void stop_reactor_cb(void *data) {
+  reactor_stop((reactor_t *) data);
+}
+
+static void fixture_setup(fixture_t *f, size_t ring_buffer_size,
+                          unsigned int flags) {
+  socklen_t addr_len = sizeof(f->js_addr);
+  int       size     = SOCKET_BUFFER_SIZE;
+  int       fd       = -1;
+  int       ii       = 0;
+
+  memset(f, 0, sizeof(*f));
+
+  f->reactor = reactor_alloc();
+
+  for (ii = 0; ii < 2; ++ii) {
+    if (-1 == pipe(f->sources[ii])) {
+      perror("pipe");
+      assert(0);
+    }
+
+    strcpy(f->paths[ii], "/tmp/job_server_test_sock_XXXXXX");
+    fd = mkstemp(f->paths[ii]);
+    assert(-1 != fd);
+    close(fd);
+
+    f->listen_socks[ii] = create_unix_domain_listener(f->paths[ii], 10);
+    assert(-1 != f->listen_socks[ii]);
+
+    f->muxers[ii] = muxer_alloc(f->reactor, f->listen_socks[ii],
+                                f->sources[ii][0], ring_buffer_size, 0);
+  }
+
+  /* Accepted sockets inherit the small send buffer */
+  f->js_sock = socket(AF_INET, SOCK_STREAM, 0);
+  assert(-1 != f->js_sock);
+  setsockopt(f->js_sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+  f->js_addr.sin_family = AF_INET;
+  f->js_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  f->js_addr.sin_port = 0;
+
+  assert(0 == bind(f->js_sock, (struct sockaddr *) &(f->js_addr),
+                   sizeof(f->js_addr)));
+  assert(0 == getsockname(f->js_sock, (struct sockaddr *) &(f->js_addr),
+                          &addr_len));
+  assert(0 == listen(f->js_sock, 10));
+
+  f->js = job_server_alloc(f->reactor, f->js_sock, f->muxers, flags);
+
+  f->client_barrier = barrier_alloc();
+  job_server_on_client(f->js, lift_barrier, f->client_barrier);
+
+  for (ii = 0; ii < 2; ++ii) {
+    muxer_start(f->muxers[ii]);
+  }
+  job_server_start(f->js);
+
+  start_reactor(f);
+}
+
+static void fixture_teardown(fixture_t *f) {
+  int ii = 0;
+
+  job_server_free(f->js);
+  close(f->js_sock);
+
+  for (ii = 0; ii < 2; ++ii) {
+    muxer_free(f->muxers[ii]);
+    close(f->listen_socks[ii]);
+    unlink(f->paths[ii]);
+  }
+
+  reactor_free(f->reactor);
+  barrier_free(f->client_barrier);
+}
+
+/**
+ * Connects a client that asks for all output from the start.
+ */
+static int client_connect(fixture_t *f) {
+  uint8_t  request[JOB_REQUEST_SIZE];
+  uint64_t posns[2] = {0, 0};
+  uint8_t  hup      = 0;
+  int      size     = SOCKET_BUFFER_SIZE;
+  int      fd       = -1;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(-1 != fd);
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  assert(0 == connect(fd, (struct sockaddr *) &(f->js_addr),
+                      sizeof(f->js_addr)));
+
+  job_request_encode(request, posns);
+  atomic_write(fd, request, sizeof(request), &hup);
+  assert(!hup);
+
+  barrier_wait(f->client_barrier);
+
+  return fd;
+}
+
+/**
+ * Writes _count_ bytes of the pattern to stdout, starting at _pos_.
+ */
+static void write_stdout(fixture_t *f, uint64_t pos, size_t count) {
+  uint8_t buf[4096];
+  size_t  ii  = 0, n = 0;
+  uint8_t hup = 0;
+
+  while (count > 0) {
+    n = MIN(count, sizeof(buf));
+
+    for (ii = 0; ii < n; ++ii) {
+      buf[ii] = pattern_at(pos + ii);
+    }
+
+    atomic_write(f->sources[JOB_STREAM_STDOUT][1], buf, n, &hup);
+    assert(!hup);
+
+    pos += n;
+    count -= n;
+  }
+}
+
+/**
+ * Lets the child "exit" with _status_. The reactor keeps running until the
+ * last client is done.
+ */
+static void finish(fixture_t *f, int status) {
+  int ii = 0;
+
+  for (ii = 0; ii < 2; ++ii) {
+    close(f->sources[ii][1]);
+  }
+
+  stop_reactor(f);
+
+  for (ii = 0; ii < 2; ++ii) {
+    muxer_stop(f->muxers[ii], NULL, NULL);
+  }
+
+  job_server_finish(f->js, status, stop_reactor_cb, f->reactor);
+
+  start_reactor(f);
+}
+
+static int read_exactly(int fd, uint8_t *buf, size_t count) {
+  ssize_t nread = 0;
+  uint8_t hup   = 0;
+
+  nread = atomic_read(fd, buf, count, &hup);
+
+  return ((size_t) nread == count) ? 0 : -1;
+}
+
+/**
+ * Reads frames until the server closes the connection.
+ */
+static void client_receive(int fd, received_t *r) {
+  uint8_t            header[JOB_FRAME_HEADER_SIZE];
+  uint8_t           *payload = NULL;
+  job_frame_header_t frame;
+  uint32_t           status  = 0;
+  uint32_t           ii      = 0;
+  int                nframes = 0;
+
+  memset(r, 0, sizeof(*r));
+  r->intact = 1;
+
+  payload = malloc(JOB_FRAME_MAX_LENGTH);
+  assert(NULL != payload);
+
+  while (!r->finished) {
+    if (-1 == read_exactly(fd, header, sizeof(header))) {
+      r->hup = 1;
+      break;
+    }
+
+    assert(0 == job_frame_header_decode(header, &frame));
+    assert(frame.length <= JOB_FRAME_MAX_LENGTH);
+
+    if (-1 == read_exactly(fd, payload, frame.length)) {
+      r->hup = 1;
+      break;
+    }
+
+    if (JOB_STREAM_STATUS == frame.stream) {
+      memcpy(&status, payload, sizeof(status));
+      r->status = ntohl(status);
+      r->finished = 1;
+      continue;
+    }
+
+    if (JOB_STREAM_STDOUT != frame.stream) {
+      continue;
+    }
+
+    if (0 == nframes++) {
+      r->first_length = frame.length;
+    }
+
+    if (frame.pos != r->next_pos) {
+      r->ngaps++;
+    }
+
+    for (ii = 0; ii < frame.length; ++ii) {
+      if (payload[ii] != pattern_at(frame.pos + ii)) {
+        r->intact = 0;
+      }
+    }
+
+    r->next_pos = frame.pos + frame.length;
+  }
+
+  free(payload);
+}
+
+/**
+ * Lets a client stop reading in the middle of a frame, and fall behind far
+ * enough for the rest of that frame to be overwritten.
+ *
+ * @return Number of bytes written to stdout.
+ */
+static size_t lag_mid_frame(fixture_t *f, size_t ring_buffer_size,
+                            received_t *r) {
+  size_t nwritten = 0;
+  int    fd       = -1;
+
+  /* Buffer more than a frame, which is more than the sockets hold */
+  write_stdout(f, 0, 4 * JOB_FRAME_MAX_LENGTH);
+  nwritten = 4 * JOB_FRAME_MAX_LENGTH;
+  usleep(100000);
+
+  fd = client_connect(f);
+
+  /* Let the server block in the middle of the first frame */
+  usleep(100000);
+
+  /* Overwrite everything that was buffered, several times over */
+  write_stdout(f, nwritten, 4 * ring_buffer_size);
+  nwritten += 4 * ring_buffer_size;
+
+  finish(f, 42);
+  client_receive(fd, r);
+  pthread_join(f->reactor_thread, NULL);
+
+  close(fd);
+
+  return nwritten;
+}
+
+/*
+ * By default, the client receives the whole frame it was in the middle of,
+ * skips ahead, and stays connected.
+ */
+static void test_job_server_skip_lagging(void) {
+  fixture_t  f;
+  received_t r;
+  size_t     ring_buffer_size = 1024 * 1024;
+  size_t     nwritten         = 0;
+
+  fixture_setup(&f, ring_buffer_size, 0);
+  nwritten = lag_mid_frame(&f, ring_buffer_size, &r);
+
+  TEST_CHECK(r.finished);
+  TEST_CHECK(r.status == 42);
+  TEST_CHECK(r.first_length == JOB_FRAME_MAX_LENGTH);
+  TEST_CHECK(r.intact);
+  TEST_CHECK(r.ngaps > 0);
+  TEST_CHECK(r.next_pos == nwritten);
+
+  fixture_teardown(&f);
+}
+
+/*
+ * With JOB_SERVER_DISCONNECT_LAGGING, the client still receives the whole
+ * frame it was in the middle of, and is disconnected instead of skipping.
+ */
+static void test_job_server_disconnect_lagging(void) {
+  fixture_t  f;
+  received_t r;
+  size_t     ring_buffer_size = 1024 * 1024;
+  size_t     nwritten         = 0;
+
+  fixture_setup(&f, ring_buffer_size, JOB_SERVER_DISCONNECT_LAGGING);
+  nwritten = lag_mid_frame(&f, ring_buffer_size, &r);
+
+  TEST_CHECK(r.hup);
+  TEST_CHECK(!r.finished);
+  TEST_CHECK(r.first_length == JOB_FRAME_MAX_LENGTH);
+  TEST_CHECK(r.intact);
+  TEST_CHECK(r.ngaps == 0);
+  TEST_CHECK(r.next_pos < nwritten);
+
+  fixture_teardown(&f);
+}
+
+void test_job_server(void) {
+  signal(SIGPIPE, SIG_IGN);
+
+  test_job_server_skip_lagging();
+  test_job_server_disconnect_lagging();
+}
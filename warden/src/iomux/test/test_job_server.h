@@ -0,0 +1,6 @@
+#ifndef TEST_JOB_SERVER_H
+#define TEST_JOB_SERVER_H 1
+
+void test_job_server(void);
+
+#endif
@@ -1,5 +1,5 @@
-#include <arpa/inet.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -9,6 +9,8 @@
 
 #include "barrier.h"
 #include "muxer.h"
+#include "reactor.h"
+#include "stream_header.h"
 #include "test_util.h"
 #include "util.h"
 
@@ -48,10 +50,10 @@ static void sink_free(sink_t *s) {
   free(s);
 }
 
-static void *run_muxer(void *data) {
+static void *run_reactor(void *data) {
   assert(NULL != data);
 
-  muxer_run((muxer_t *) data);
+  reactor_run((reactor_t *) data);
 
   return NULL;
 }
@@ -89,18 +91,198 @@ static void *run_sink(void *data) {
   return NULL;
 }
 
+static void *run_writer(void *data) {
+  int     fd  = *((int *) data);
+  uint8_t buf[4096];
+  uint8_t hup = 0;
+
+  memset(buf, 'C', sizeof(buf));
+
+  /* Keep the source full until the muxer closes it */
+  while (!hup) {
+    atomic_write(fd, buf, sizeof(buf), &hup);
+  }
+
+  return NULL;
+}
+
+static void lift_barrier(void *data) {
+  barrier_lift((barrier_t *) data);
+}
+
+/*
+ * A sink that stops reading doesn't hold up the source: its backlog is
+ * bounded by the ring buffer. Once it falls further behind than that, it is
+ * disconnected, after receiving everything up to where it fell behind.
+ */
+static void test_muxer_disconnect_lagging(void) {
+  size_t      ring_buffer_size = 4096;
+  size_t      total            = 4 * 1024 * 1024;
+  int         source[2];
+  char        domain_path[256];
+  int         listen_sock      = 0;
+  int         fd               = 0;
+  reactor_t  *reactor          = NULL;
+  muxer_t    *muxer            = NULL;
+  barrier_t  *client_barrier   = NULL;
+  pthread_t   reactor_thread;
+  uint8_t     buf[4096];
+  uint8_t     header[STREAM_HEADER_SIZE];
+  uint8_t     hup              = 0;
+  uint8_t     intact           = 1;
+  uint64_t    pos              = 0;
+  size_t      nwritten         = 0, ii = 0;
+  ssize_t     nread            = 0;
+
+  if (-1 == pipe(source)) {
+    perror("pipe");
+    assert(0);
+  }
+
+  strcpy(domain_path, "/tmp/muxer_test_sock_XXXXXX");
+  fd = mkstemp(domain_path);
+  assert(-1 != fd);
+  close(fd);
+
+  listen_sock = create_unix_domain_listener(domain_path, 10);
+  assert(-1 != listen_sock);
+
+  reactor = reactor_alloc();
+  muxer = muxer_alloc(reactor, listen_sock, source[0], ring_buffer_size, 0);
+
+  client_barrier = barrier_alloc();
+  muxer_on_client(muxer, lift_barrier, client_barrier);
+  muxer_start(muxer);
+
+  if (pthread_create(&reactor_thread, NULL, run_reactor, reactor)) {
+    perror("pthread_create");
+    assert(0);
+  }
+
+  fd = unix_domain_connect(domain_path);
+  assert(-1 != fd);
+  barrier_wait(client_barrier);
+
+  /* Would block forever if the sink's backlog weren't bounded */
+  while (nwritten < total) {
+    for (ii = 0; ii < sizeof(buf); ++ii) {
+      buf[ii] = (uint8_t) ((nwritten + ii) % 251);
+    }
+
+    nwritten += atomic_write(source[1], buf, sizeof(buf), &hup);
+  }
+
+  TEST_CHECK(nwritten == total);
+
+  /* The connection is closed while the source is still open */
+  TEST_CHECK(STREAM_HEADER_SIZE ==
+             atomic_read(fd, header, sizeof(header), &hup));
+  TEST_CHECK(STREAM_HEADER_SIZE ==
+             stream_header_decode(header, sizeof(header), &pos));
+  TEST_CHECK(pos == 0);
+
+  do {
+    nread = atomic_read(fd, buf, sizeof(buf), &hup);
+
+    for (ii = 0; ii < (size_t) nread; ++ii) {
+      if (buf[ii] != (uint8_t) ((pos + ii) % 251)) {
+        intact = 0;
+      }
+    }
+
+    pos += nread;
+  } while (!hup);
+
+  /* What it did receive has no gaps */
+  TEST_CHECK(intact);
+  TEST_CHECK(pos > 0);
+  TEST_CHECK(pos < total);
+
+  reactor_stop(reactor);
+  pthread_join(reactor_thread, NULL);
+  muxer_stop(muxer, NULL, NULL);
+
+  muxer_free(muxer);
+  reactor_free(reactor);
+  barrier_free(client_barrier);
+  close(fd);
+  close(listen_sock);
+  close(source[1]);
+  unlink(domain_path);
+}
+
+/*
+ * Something other than the child may hold the source open and keep writing to
+ * it. Stopping the muxer must not wait for that to end.
+ */
+static void test_muxer_stop_bounded(void) {
+  int        source[2];
+  char       domain_path[256];
+  int        listen_sock = 0;
+  int        fd          = 0;
+  int        pipe_size   = 0;
+  reactor_t *reactor     = NULL;
+  muxer_t   *muxer       = NULL;
+  pthread_t  writer_thread;
+
+  if (-1 == pipe(source)) {
+    perror("pipe");
+    assert(0);
+  }
+
+  pipe_size = fcntl(source[1], F_GETPIPE_SZ);
+  assert(-1 != pipe_size);
+
+  strcpy(domain_path, "/tmp/muxer_test_sock_XXXXXX");
+  fd = mkstemp(domain_path);
+  assert(-1 != fd);
+  close(fd);
+
+  listen_sock = create_unix_domain_listener(domain_path, 10);
+  assert(-1 != listen_sock);
+
+  reactor = reactor_alloc();
+  muxer = muxer_alloc(reactor, listen_sock, source[0], 256, 0);
+
+  /* Read a byte at a time, so the writer easily keeps up */
+  muxer_set_max_chunk_size(muxer, 1);
+  muxer_start(muxer);
+
+  if (pthread_create(&writer_thread, NULL, run_writer, &source[1])) {
+    perror("pthread_create");
+    assert(0);
+  }
+
+  /* Let the pipe fill up */
+  usleep(100000);
+
+  muxer_stop(muxer, NULL, NULL);
+  pthread_join(writer_thread, NULL);
+
+  /* No more than what was buffered when the muxer was stopped */
+  TEST_CHECK(muxer_head(muxer) <= (uint64_t) pipe_size);
+  TEST_CHECK(muxer_source_closed(muxer));
+
+  muxer_free(muxer);
+  reactor_free(reactor);
+  close(listen_sock);
+  close(source[1]);
+  unlink(domain_path);
+}
+
 void test_muxer(void) {
   int        ring_buffer_size = 256;
   int        source[2];
   char       domain_path[256];
   int        listen_sock      = 0;
   int        fd               = 0;
+  reactor_t *reactor          = NULL;
   muxer_t   *muxer            = NULL;
-  pthread_t  muxer_thread;
+  pthread_t  reactor_thread;
   sink_t    *sinks[3];
   int        ii               = 0;
   uint8_t    hup              = 0;
-  uint32_t  *pos              = 0;
+  uint64_t   pos              = 0;
 
   signal(SIGPIPE, SIG_IGN);
 
@@ -121,9 +303,11 @@ void test_muxer(void) {
   listen_sock = create_unix_domain_listener(domain_path, 10);
   assert(-1 != listen_sock);
 
-  muxer = muxer_alloc(listen_sock, source[0], ring_buffer_size);
+  reactor = reactor_alloc();
+  muxer = muxer_alloc(reactor, listen_sock, source[0], ring_buffer_size, 0);
+  muxer_start(muxer);
 
-  if (pthread_create(&muxer_thread, NULL, run_muxer, muxer)) {
+  if (pthread_create(&reactor_thread, NULL, run_reactor, reactor)) {
     perror("pthread_create");
     assert(0);
   }
@@ -160,33 +344,42 @@ void test_muxer(void) {
   barrier_wait(sinks[2]->barrier);
 
   /* All done, wait for everyone to finish */
-  muxer_stop(muxer);
-  pthread_join(muxer_thread, NULL);
+  reactor_stop(reactor);
+  pthread_join(reactor_thread, NULL);
+  muxer_stop(muxer, NULL, NULL);
   for (ii = 0; ii < 3; ++ii) {
     pthread_join(sinks[ii]->thread, NULL);
   }
 
   /* Sinks 0 and 1 should receive the same data */
-  TEST_CHECK(sinks[0]->size == 516);
-  pos = (uint32_t *) sinks[0]->data;
-  TEST_CHECK(*pos == 0);
+  TEST_CHECK(sinks[0]->size == STREAM_HEADER_SIZE + 2 * ring_buffer_size);
+  TEST_CHECK(STREAM_HEADER_SIZE ==
+             stream_header_decode(sinks[0]->data, sinks[0]->size, &pos));
+  TEST_CHECK(pos == 0);
 
-  TEST_CHECK(sinks[1]->size == 516);
-  pos = (uint32_t *) sinks[1]->data;
-  TEST_CHECK(*pos == 0);
+  TEST_CHECK(sinks[1]->size == STREAM_HEADER_SIZE + 2 * ring_buffer_size);
+  TEST_CHECK(STREAM_HEADER_SIZE ==
+             stream_header_decode(sinks[1]->data, sinks[1]->size, &pos));
+  TEST_CHECK(pos == 0);
 
   TEST_CHECK(!memcmp(sinks[0]->data, sinks[1]->data, sinks[0]->size));
 
   /* Sink 2 missed the first ring buffer's worth of data */
-  TEST_CHECK(sinks[2]->size == 260);
-  pos = (uint32_t *) sinks[2]->data;
-  TEST_CHECK(ntohl(*pos) == 256);
-
+  TEST_CHECK(sinks[2]->size == STREAM_HEADER_SIZE + ring_buffer_size);
+  TEST_CHECK(STREAM_HEADER_SIZE ==
+             stream_header_decode(sinks[2]->data, sinks[2]->size, &pos));
+  TEST_CHECK(pos == 256);
 
   /* Cleanup */
   muxer_free(muxer);
+  reactor_free(reactor);
+  close(listen_sock);
+  close(source[1]);
   for (ii = 0; ii < 3; ++ii) {
     sink_free(sinks[ii]);
   }
   unlink(domain_path);
+
+  test_muxer_disconnect_lagging();
+  test_muxer_stop_bounded();
 }
@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -54,6 +56,161 @@ static void test_ring_buffer_read_write(void) {
   ring_buffer_free(rb);
 }
 
+static void test_ring_buffer_iov(void) {
+  ring_buffer_t *rb           = NULL;
+  uint8_t       *str          = (uint8_t *) "AAAABBBBCCCC";
+  size_t         buf_capacity = 8;
+  struct iovec   iov[2];
+  int            iovcnt       = 0;
+
+  rb = ring_buffer_alloc(buf_capacity);
+
+  /* Nothing to describe in an empty buffer */
+  iovcnt = ring_buffer_iov(rb, 0, buf_capacity, iov);
+  TEST_CHECK(iovcnt == 0);
+
+  /* Contiguous data takes a single segment */
+  ring_buffer_append(rb, str, 4);
+
+  iovcnt = ring_buffer_iov(rb, 1, buf_capacity, iov);
+  TEST_CHECK(iovcnt == 1);
+  TEST_CHECK(iov[0].iov_len == 3);
+  TEST_CHECK(!memcmp(iov[0].iov_base, "AAA", 3));
+
+  /* Wrapped data takes two segments */
+  ring_buffer_append(rb, str + 4, 8);
+
+  iovcnt = ring_buffer_iov(rb, 0, buf_capacity, iov);
+  TEST_CHECK(iovcnt == 2);
+  TEST_CHECK(iov[0].iov_len == 4);
+  TEST_CHECK(!memcmp(iov[0].iov_base, "BBBB", 4));
+  TEST_CHECK(iov[1].iov_len == 4);
+  TEST_CHECK(!memcmp(iov[1].iov_base, "CCCC", 4));
+
+  /* Only the requested part is described */
+  iovcnt = ring_buffer_iov(rb, 1, 2, iov);
+  TEST_CHECK(iovcnt == 1);
+  TEST_CHECK(iov[0].iov_len == 2);
+  TEST_CHECK(!memcmp(iov[0].iov_base, "BB", 2));
+
+  ring_buffer_free(rb);
+}
+
+static void test_ring_buffer_capacity(void) {
+  ring_buffer_t *rb           = NULL;
+  uint8_t       *str          = (uint8_t *) "AAAABBBBCCCC";
+  uint8_t        read_buf[12];
+  size_t         bytes_read   = 0;
+
+  /* Capacity is rounded up to the next power of two */
+  rb = ring_buffer_alloc(5);
+
+  ring_buffer_append(rb, str, 12);
+  TEST_CHECK(ring_buffer_size(rb) == 8);
+
+  bytes_read = ring_buffer_read(rb, 0, read_buf, sizeof(read_buf));
+  TEST_CHECK(bytes_read == 8);
+  TEST_CHECK(!memcmp(read_buf, "BBBBCCCC", bytes_read));
+
+  ring_buffer_free(rb);
+}
+
+static void test_ring_buffer_mirrored(void) {
+  ring_buffer_t *rb        = NULL;
+  uint8_t       *data      = NULL;
+  size_t         capacity  = 0;
+  size_t         ii        = 0;
+  uint8_t        read_buf[16];
+  struct iovec   iov[2];
+  int            iovcnt    = 0;
+
+  rb = ring_buffer_alloc_mirrored(1);
+  if (NULL == rb) {
+    /* Not supported on this kernel */
+    return;
+  }
+
+  TEST_CHECK(ring_buffer_is_mirrored(rb));
+
+  /* Rounded up to at least a page, fill it all but the last 4 bytes */
+  capacity = (size_t) sysconf(_SC_PAGESIZE);
+  data = calloc(capacity, 1);
+  memset(data, 'A', capacity);
+
+  ring_buffer_append(rb, data, capacity - 4);
+  TEST_CHECK(ring_buffer_size(rb) == capacity - 4);
+
+  /* Wrap around */
+  ring_buffer_append(rb, (uint8_t *) "BBBBCCCC", 8);
+  TEST_CHECK(ring_buffer_size(rb) == capacity);
+
+  /* The wrapped part is a single segment */
+  iovcnt = ring_buffer_iov(rb, capacity - 10, 10, iov);
+  TEST_CHECK(iovcnt == 1);
+  TEST_CHECK(iov[0].iov_len == 10);
+  TEST_CHECK(!memcmp(iov[0].iov_base, "AABBBBCCCC", 10));
+
+  ii = ring_buffer_read(rb, capacity - 10, read_buf, sizeof(read_buf));
+  TEST_CHECK(ii == 10);
+  TEST_CHECK(!memcmp(read_buf, "AABBBBCCCC", 10));
+
+  /* Oldest bytes were overwritten */
+  ring_buffer_read(rb, 0, read_buf, 4);
+  TEST_CHECK(!memcmp(read_buf, "AAAA", 4));
+
+  free(data);
+  ring_buffer_free(rb);
+}
+
+static void test_ring_buffer_splice_in(void) {
+  ring_buffer_t *rb       = NULL;
+  int            fds[2];
+  uint8_t        hup      = 0;
+  ssize_t        nmoved   = 0;
+  uint8_t        read_buf[16];
+
+  rb = ring_buffer_alloc_mirrored(1);
+  if (NULL == rb) {
+    /* Not supported on this kernel */
+    return;
+  }
+
+  if (-1 == pipe(fds)) {
+    perror("pipe");
+    assert(0);
+  }
+  set_nonblocking(fds[0]);
+
+  /* Nothing to move yet */
+  nmoved = ring_buffer_splice_in(rb, fds[0], sizeof(read_buf), &hup);
+  TEST_CHECK(nmoved == 0);
+  TEST_CHECK(!hup);
+
+  atomic_write(fds[1], "AAAABBBB", 8, &hup);
+
+  nmoved = ring_buffer_splice_in(rb, fds[0], sizeof(read_buf), &hup);
+  TEST_CHECK(nmoved == 8);
+  TEST_CHECK(!hup);
+  TEST_CHECK(ring_buffer_size(rb) == 8);
+
+  ring_buffer_read(rb, 0, read_buf, 8);
+  TEST_CHECK(!memcmp(read_buf, "AAAABBBB", 8));
+
+  /* Closed pipe */
+  close(fds[1]);
+
+  nmoved = ring_buffer_splice_in(rb, fds[0], sizeof(read_buf), &hup);
+  TEST_CHECK(nmoved == 0);
+  TEST_CHECK(hup);
+
+  close(fds[0]);
+  ring_buffer_free(rb);
+}
+
 void test_ring_buffer(void) {
   test_ring_buffer_read_write();
+  test_ring_buffer_capacity();
+  test_ring_buffer_iov();
+  test_ring_buffer_mirrored();
+  test_ring_buffer_splice_in();
 }
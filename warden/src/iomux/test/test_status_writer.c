@@ -7,6 +7,7 @@
 #include <unistd.h>
 
 #include "barrier.h"
+#include "reactor.h"
 #include "status_reader.h"
 #include "status_writer.h"
 #include "test_util.h"
@@ -40,10 +41,10 @@ static void sink_free(sink_t *s) {
   free(s);
 }
 
-static void *run_status_writer(void *data) {
+static void *run_reactor(void *data) {
   assert(NULL != data);
 
-  status_writer_run((status_writer_t *) data);
+  reactor_run((reactor_t *) data);
 
   return NULL;
 }
@@ -85,8 +86,9 @@ void test_status_writer(void) {
   char             domain_path[256];
   int              listen_sock = 0;
   int              fd          = 0;
+  reactor_t       *reactor     = NULL;
   status_writer_t *sw          = NULL;
-  pthread_t        sw_thread;
+  pthread_t        reactor_thread;
   sink_t          *sinks[3];
   int              ii          = 0;
   int              status      = 10;
@@ -105,9 +107,11 @@ void test_status_writer(void) {
   listen_sock = create_unix_domain_listener(domain_path, 10);
   assert(-1 != listen_sock);
 
-  sw = status_writer_alloc(listen_sock, NULL);
+  reactor = reactor_alloc();
+  sw = status_writer_alloc(reactor, listen_sock);
+  status_writer_start(sw);
 
-  if (pthread_create(&sw_thread, NULL, run_status_writer, sw)) {
+  if (pthread_create(&reactor_thread, NULL, run_reactor, reactor)) {
     perror("pthread_create");
     assert(0);
   }
@@ -121,9 +125,11 @@ void test_status_writer(void) {
     barrier_wait(sinks[ii]->barrier);
   }
 
+  reactor_stop(reactor);
+  pthread_join(reactor_thread, NULL);
+
   status_writer_finish(sw, status);
 
-  pthread_join(sw_thread, NULL);
   for (ii = 0; ii < 3; ++ii) {
     pthread_join(sinks[ii]->thread, NULL);
     TEST_CHECK(sinks[ii]->got_status == 1);
@@ -132,6 +138,8 @@ void test_status_writer(void) {
 
   /* Cleanup */
   status_writer_free(sw);
+  reactor_free(reactor);
+  close(listen_sock);
   for (ii = 0; ii < 3; ++ii) {
     sink_free(sinks[ii]);
   }
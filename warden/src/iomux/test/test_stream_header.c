@@ -0,0 +1,40 @@
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "stream_header.h"
+#include "test_util.h"
+
+static void test_stream_header_roundtrip(void) {
+  uint8_t  buf[STREAM_HEADER_SIZE];
+  uint64_t pos = 0;
+
+  stream_header_encode(buf, 0x123456789aULL);
+
+  /* Incomplete headers need more data */
+  TEST_CHECK(0 == stream_header_decode(buf, 3, &pos));
+  TEST_CHECK(0 == stream_header_decode(buf, STREAM_HEADER_SIZE - 1, &pos));
+
+  TEST_CHECK(STREAM_HEADER_SIZE ==
+             stream_header_decode(buf, STREAM_HEADER_SIZE, &pos));
+  TEST_CHECK(pos == 0x123456789aULL);
+
+  /* Unknown versions are rejected */
+  buf[7] = 3;
+  TEST_CHECK(-1 == stream_header_decode(buf, STREAM_HEADER_SIZE, &pos));
+}
+
+static void test_stream_header_v1(void) {
+  uint32_t v1  = htonl(1234);
+  uint64_t pos = 0;
+
+  /* Headers without the magic number are plain 32 bit positions */
+  TEST_CHECK(STREAM_HEADER_V1_SIZE ==
+             stream_header_decode((uint8_t *) &v1, sizeof(v1), &pos));
+  TEST_CHECK(pos == 1234);
+}
+
+void test_stream_header(void) {
+  test_stream_header_roundtrip();
+  test_stream_header_v1();
+}
@@ -0,0 +1,6 @@
+#ifndef TEST_STREAM_HEADER_H
+#define TEST_STREAM_HEADER_H 1
+
+void test_stream_header(void);
+
+#endif
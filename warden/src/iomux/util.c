@@ -9,6 +9,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -69,6 +70,62 @@ ssize_t atomic_write(int fd, const void *buf, size_t count, uint8_t *hup) {
   ATOMIC_IO(write, fd, buf, count, hup);
 }
 
+ssize_t atomic_writev(int fd, struct iovec *iov, int iovcnt, uint8_t *hup) {
+  ssize_t nbytes_tot = 0;
+  ssize_t nbytes_cur = 0;
+  size_t  nconsumed  = 0;
+
+  assert(NULL != iov);
+
+  if (NULL != hup) {
+    *hup = 0;
+  }
+
+  while (iovcnt > 0) {
+    /* Skip segments that are done */
+    if (0 == iov->iov_len) {
+      iov++;
+      iovcnt--;
+      continue;
+    }
+
+    nbytes_cur = writev(fd, iov, iovcnt);
+    if (-1 == nbytes_cur) {
+      if (EINTR == errno) {
+        continue;
+      }
+
+      if (EPIPE == errno || ECONNRESET == errno) {
+        if (NULL != hup) {
+          *hup = 1;
+        }
+      } else if (EAGAIN != errno) {
+        perror("atomic_writev");
+        assert(0);
+      }
+
+      break;
+    }
+
+    nbytes_tot += nbytes_cur;
+
+    /* Advance past what was written */
+    while (nbytes_cur > 0) {
+      nconsumed = MIN((size_t) nbytes_cur, iov->iov_len);
+      iov->iov_base = (uint8_t *) iov->iov_base + nconsumed;
+      iov->iov_len -= nconsumed;
+      nbytes_cur -= nconsumed;
+
+      if (0 == iov->iov_len) {
+        iov++;
+        iovcnt--;
+      }
+    }
+  }
+
+  return nbytes_tot;
+}
+
 void set_nonblocking(int fd) {
   int flags = 0;
 
@@ -165,43 +222,6 @@ int unix_domain_connect(const char *path) {
   return fd;
 }
 
-uint8_t wait_readable_or_stop(int read_fd, int stop_fd) {
-  uint8_t done   = 0;
-  int     nfds   = 0;
-  uint8_t events = 0;
-  fd_set  read_fds;
-
-  assert(read_fd >= 0);
-  assert(stop_fd >= 0);
-
-  nfds = MAX(read_fd, stop_fd) + 1;
-
-  FD_ZERO(&read_fds);
-  FD_SET(read_fd, &read_fds);
-  FD_SET(stop_fd, &read_fds);
-
-  do {
-    if (-1 != select(nfds, &read_fds, NULL, NULL, NULL)) {
-      if (FD_ISSET(read_fd, &read_fds)) {
-        events |= MUXER_READABLE;
-      }
-
-      if (FD_ISSET(stop_fd, &read_fds)) {
-        events |= MUXER_STOP;
-      }
-
-      done = 1;
-    } else {
-      if (EINTR != errno) {
-        perror("select()");
-        assert(0);
-      }
-    }
-  } while (!done);
-
-  return events;
-}
-
 void perrorf(const char *fmt, ...) {
   va_list ap;
 
@@ -211,3 +231,25 @@ void perrorf(const char *fmt, ...) {
 
   fprintf(stderr, " %s\n", strerror(errno));
 }
+
+int parse_size(const char *str, size_t max, size_t *size) {
+  char               *end = NULL;
+  unsigned long long  val = 0;
+
+  assert(NULL != str);
+  assert(NULL != size);
+
+  errno = 0;
+  val = strtoull(str, &end, 10);
+  if ((0 != errno) || (end == str) || ('\0' != *end) || ('-' == *str)) {
+    return -1;
+  }
+
+  if ((0 == val) || (val > max)) {
+    return -1;
+  }
+
+  *size = (size_t) val;
+
+  return 0;
+}
@@ -4,14 +4,17 @@
 #include <linux/limits.h>
 #include <pthread.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
-#define MUXER_READABLE 1
-#define MUXER_STOP 2
+/**
+ * Generic notification callback, e.g. for when a client has connected.
+ */
+typedef void (*notify_cb_t)(void *data);
 
 /**
  * Reads until _count_ bytes have been read or _fd_ would block.
@@ -23,6 +26,13 @@ ssize_t atomic_read(int fd, void *buf, size_t count, uint8_t *hup);
  */
 ssize_t atomic_write(int fd, const void *buf, size_t count, uint8_t *hup);
 
+/**
+ * Writes until all _iovcnt_ segments have been written or _fd_ would block.
+ *
+ * NB: _iov_ is updated in place to describe what is left to write.
+ */
+ssize_t atomic_writev(int fd, struct iovec *iov, int iovcnt, uint8_t *hup);
+
 void set_nonblocking(int fd);
 
 void set_cloexec(int fd);
@@ -35,8 +45,13 @@ int create_unix_domain_listener(const char *path, int backlog);
 
 int unix_domain_connect(const char *path);
 
-uint8_t wait_readable_or_stop(int read_fd, int stop_fd);
-
 void perrorf(const char *fmt, ...);
 
+/**
+ * Parses a positive decimal byte count.
+ *
+ * @return 0 on success, -1 if _str_ isn't a number in [1, _max_].
+ */
+int parse_size(const char *str, size_t max, size_t *size);
+
 #endif
@@ -0,0 +1,1027 @@
+/*
+ * Native replacement for create.sh and skeleton/setup.sh of linux containers.
+ *
+ *   setup probe DEPOT_PATH
+ *
+ * Prints the filesystem that containers in DEPOT_PATH are set up with: aufs,
+ * overlayfs or other (bind mounts), like setup_fs in lib/common.sh decides.
+ * The warden runs this once, and passes the result to every container as
+ * fs_type.
+ *
+ *   setup create SKELETON_PATH INSTANCE_PATH
+ *
+ * Copies the skeleton to the instance path and prepares the root filesystem
+ * of the container, taking the same environment as skeleton/setup.sh. The
+ * time every phase took is printed as "<phase> <seconds>" lines.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <grp.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FS_AUFS      "aufs"
+#define FS_OVERLAYFS "overlayfs"
+#define FS_OTHER     "other"
+
+typedef struct setup_s setup_t;
+
+struct setup_s {
+  const char *id;
+  const char *network_netmask;
+  const char *network_host_ip;
+  const char *network_container_ip;
+  const char *user_uid;
+  const char *allow_nested_warden;
+  const char *dns_servers;
+  const char *fs_type;
+  char rootfs_path[PATH_MAX];
+
+  uid_t uid;
+  gid_t gid;
+
+  /* Owner of the vcap user in the rootfs, rewritten to uid and gid */
+  uid_t old_uid;
+  gid_t old_gid;
+
+  /* Start of the current phase */
+  struct timespec phase;
+};
+
+/* Only one walk runs at a time, and nftw takes no argument for callbacks */
+static setup_t *setup__walking;
+
+static void setup__fail(const char *what, const char *path) {
+  if (path != NULL) {
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+  } else {
+    perror(what);
+  }
+
+  exit(1);
+}
+
+static const char *setup__getenv(const char *name, const char *def) {
+  const char *value = getenv(name);
+
+  if (value == NULL || strlen(value) == 0) {
+    return def;
+  }
+
+  return value;
+}
+
+static void setup__phase_start(setup_t *s) {
+  clock_gettime(CLOCK_MONOTONIC, &s->phase);
+}
+
+static void setup__phase_end(setup_t *s, const char *name) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  printf("%s %.6f\n", name,
+         (now.tv_sec - s->phase.tv_sec) +
+         (now.tv_nsec - s->phase.tv_nsec) / 1e9);
+
+  s->phase = now;
+}
+
+/* Runs argv and waits for it, returning its exit status */
+static int setup__run(char * const argv[], int quiet) {
+  pid_t pid;
+  int status;
+  int fd;
+
+  pid = fork();
+  if (pid == -1) {
+    setup__fail("fork", NULL);
+  }
+
+  if (pid == 0) {
+    if (quiet) {
+      fd = open("/dev/null", O_WRONLY);
+      if (fd != -1) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+      }
+    }
+
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR) {
+      setup__fail("waitpid", NULL);
+    }
+  }
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 255;
+}
+
+static void setup__write_file(const char *path, const char *data, mode_t mode) {
+  size_t len = strlen(data);
+  ssize_t rv;
+  int fd;
+
+  /* Replace rather than write through a symlink that points outside */
+  if (unlink(path) == -1 && errno != ENOENT) {
+    setup__fail("unlink", path);
+  }
+
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode);
+  if (fd == -1) {
+    setup__fail("open", path);
+  }
+
+  while (len > 0) {
+    rv = write(fd, data, len);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      setup__fail("write", path);
+    }
+
+    data += rv;
+    len -= rv;
+  }
+
+  if (close(fd) == -1) {
+    setup__fail("close", path);
+  }
+}
+
+/* Reads a whole file, returning NULL when it doesn't exist */
+static char *setup__read_file(const char *path) {
+  struct stat st;
+  char *buf;
+  size_t off = 0;
+  ssize_t rv;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      return NULL;
+    }
+
+    setup__fail("open", path);
+  }
+
+  if (fstat(fd, &st) == -1) {
+    setup__fail("stat", path);
+  }
+
+  /* Files in /proc report a size of 0 */
+  buf = malloc(st.st_size + 4096 + 1);
+  assert(buf != NULL);
+
+  for (;;) {
+    rv = read(fd, buf + off, st.st_size + 4096 - off);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      setup__fail("read", path);
+    }
+
+    if (rv == 0) {
+      break;
+    }
+
+    off += rv;
+    if (off == st.st_size + 4096) {
+      st.st_size *= 2;
+      buf = realloc(buf, st.st_size + 4096 + 1);
+      assert(buf != NULL);
+    }
+  }
+
+  buf[off] = '\0';
+  close(fd);
+
+  return buf;
+}
+
+static void setup__mkdir_p(const char *path, mode_t mode) {
+  char buf[PATH_MAX];
+  char *p;
+
+  if (strlen(path) >= sizeof(buf)) {
+    errno = ENAMETOOLONG;
+    setup__fail("mkdir", path);
+  }
+
+  strcpy(buf, path);
+
+  for (p = buf + 1; ; p++) {
+    if (*p != '/' && *p != '\0') {
+      continue;
+    }
+
+    char c = *p;
+    *p = '\0';
+
+    if (mkdir(buf, mode) == -1 && errno != EEXIST) {
+      setup__fail("mkdir", buf);
+    }
+
+    *p = c;
+    if (c == '\0') {
+      break;
+    }
+  }
+}
+
+static void setup__copy_file(int sfd, int dfd, const char *name, const char *path, mode_t mode) {
+  struct stat st;
+  ssize_t rv;
+  int in, out;
+
+  in = openat(sfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (in == -1) {
+    setup__fail("open", path);
+  }
+
+  if (fstat(in, &st) == -1) {
+    setup__fail("stat", path);
+  }
+
+  out = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode);
+  if (out == -1) {
+    setup__fail("open", path);
+  }
+
+  while (st.st_size > 0) {
+    rv = sendfile(out, in, NULL, st.st_size);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      setup__fail("sendfile", path);
+    }
+
+    if (rv == 0) {
+      break;
+    }
+
+    st.st_size -= rv;
+  }
+
+  close(in);
+
+  if (close(out) == -1) {
+    setup__fail("close", path);
+  }
+}
+
+/* Copies the contents of directory src into dst, like `cp -r` */
+static void setup__copy_tree(const char *src, const char *dst) {
+  char spath[PATH_MAX], dpath[PATH_MAX], target[PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+  ssize_t n;
+  int dfd;
+
+  dir = opendir(src);
+  if (dir == NULL) {
+    setup__fail("opendir", src);
+  }
+
+  dfd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd == -1) {
+    setup__fail("open", dst);
+  }
+
+  while ((errno = 0, de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+
+    snprintf(spath, sizeof(spath), "%s/%s", src, de->d_name);
+    snprintf(dpath, sizeof(dpath), "%s/%s", dst, de->d_name);
+
+    if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+      setup__fail("stat", spath);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      if (mkdirat(dfd, de->d_name, st.st_mode & 07777) == -1 && errno != EEXIST) {
+        setup__fail("mkdir", dpath);
+      }
+
+      setup__copy_tree(spath, dpath);
+    } else if (S_ISREG(st.st_mode)) {
+      setup__copy_file(dirfd(dir), dfd, de->d_name, spath, st.st_mode & 07777);
+    } else if (S_ISLNK(st.st_mode)) {
+      n = readlinkat(dirfd(dir), de->d_name, target, sizeof(target) - 1);
+      if (n == -1) {
+        setup__fail("readlink", spath);
+      }
+
+      target[n] = '\0';
+
+      if (symlinkat(target, dfd, de->d_name) == -1 && errno != EEXIST) {
+        setup__fail("symlink", dpath);
+      }
+    }
+  }
+
+  if (errno != 0) {
+    setup__fail("readdir", src);
+  }
+
+  close(dfd);
+  closedir(dir);
+}
+
+static int setup__remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  /* The directory that is emptied stays */
+  if (ftw->level == 0) {
+    return 0;
+  }
+
+  if (remove(path) == -1) {
+    setup__fail("remove", path);
+  }
+
+  return 0;
+}
+
+/* Removes everything in path, but not path itself */
+static void setup__empty_dir(const char *path) {
+  if (nftw(path, setup__remove_entry, 16, FTW_DEPTH | FTW_PHYS) == -1) {
+    setup__fail("nftw", path);
+  }
+}
+
+/*
+ * Filesystem
+ */
+
+/* Returns the filesystem of the mount that path is on */
+static char *setup__current_fs(const char *path) {
+  char real[PATH_MAX];
+  char *mounts, *line, *next;
+  char *fs = NULL;
+  size_t best = 0;
+
+  if (realpath(path, real) == NULL) {
+    setup__fail("realpath", path);
+  }
+
+  mounts = setup__read_file("/proc/mounts");
+  if (mounts == NULL) {
+    setup__fail("open", "/proc/mounts");
+  }
+
+  for (line = mounts; line != NULL && *line != '\0'; line = next) {
+    char dev[PATH_MAX], mp[PATH_MAX], type[256];
+    size_t len;
+
+    next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+
+    if (sscanf(line, "%4095s %4095s %255s", dev, mp, type) != 3) {
+      continue;
+    }
+
+    if (strcmp(type, "rootfs") == 0) {
+      continue;
+    }
+
+    len = strlen(mp);
+
+    /* The last of the longest mount points that contain path wins */
+    if (strncmp(real, mp, len) != 0 ||
+        (len > 1 && real[len] != '/' && real[len] != '\0')) {
+      continue;
+    }
+
+    if (len >= best) {
+      best = len;
+      free(fs);
+      fs = strdup(type);
+      assert(fs != NULL);
+    }
+  }
+
+  free(mounts);
+
+  return fs != NULL ? fs : strdup("");
+}
+
+static int setup__known_fs(const char *fs) {
+  char *filesystems;
+  int found;
+
+  filesystems = setup__read_file("/proc/filesystems");
+  found = (filesystems != NULL && strstr(filesystems, fs) != NULL);
+  free(filesystems);
+
+  return found;
+}
+
+static int setup__should_use(const char *fs, const char *current) {
+  char *argv[] = { "modprobe", "-q", (char *)fs, NULL };
+
+  /* Cannot mount a union filesystem in aufs or in overlayfs */
+  if (strcmp(current, FS_AUFS) == 0 || strcmp(current, FS_OVERLAYFS) == 0) {
+    return 0;
+  }
+
+  if (setup__known_fs(fs)) {
+    return 1;
+  }
+
+  /* Load it so it's in /proc/filesystems */
+  setup__run(argv, 1);
+
+  return setup__known_fs(fs);
+}
+
+static const char *setup__probe(const char *path) {
+  char *current = setup__current_fs(path);
+  const char *fs;
+
+  if (setup__should_use(FS_AUFS, current)) {
+    fs = FS_AUFS;
+  } else if (setup__should_use(FS_OVERLAYFS, current)) {
+    fs = FS_OVERLAYFS;
+  } else {
+    fs = FS_OTHER;
+  }
+
+  free(current);
+
+  return fs;
+}
+
+static void setup__bind(const char *src, const char *dst, int ro) {
+  if (mount(src, dst, NULL, MS_BIND, NULL) == -1) {
+    setup__fail("mount", dst);
+  }
+
+  if (mount(src, dst, NULL, MS_BIND | MS_REMOUNT | (ro ? MS_RDONLY : 0), NULL) == -1) {
+    setup__fail("mount", dst);
+  }
+}
+
+static void setup__overlay_directory_in_rootfs(const char *dir) {
+  char upper[PATH_MAX], lower[PATH_MAX];
+  struct stat st;
+
+  snprintf(upper, sizeof(upper), "tmp/rootfs%s", dir);
+  snprintf(lower, sizeof(lower), "mnt%s", dir);
+
+  /* Skip if exists */
+  if (stat(upper, &st) == -1 || !S_ISDIR(st.st_mode)) {
+    if (stat(lower, &st) == 0 && S_ISDIR(st.st_mode)) {
+      if (mkdir(upper, st.st_mode & 07777) == -1 && errno != EEXIST) {
+        setup__fail("mkdir", upper);
+      }
+
+      setup__copy_tree(lower, upper);
+    } else {
+      setup__mkdir_p(upper, 0777);
+    }
+  }
+
+  setup__bind(upper, lower, 0);
+}
+
+static void setup__fs(setup_t *s) {
+  char path[PATH_MAX + 16];
+  char data[2 * PATH_MAX];
+
+  setup__mkdir_p("tmp/rootfs", 0777);
+  setup__mkdir_p("mnt", 0777);
+
+  if (strcmp(s->fs_type, FS_AUFS) == 0) {
+    snprintf(data, sizeof(data), "br:tmp/rootfs=rw:%s=ro+wh", s->rootfs_path);
+
+    if (mount("none", "mnt", FS_AUFS, 0, data) == -1) {
+      setup__fail("mount", "mnt");
+    }
+  } else if (strcmp(s->fs_type, FS_OVERLAYFS) == 0) {
+    snprintf(data, sizeof(data), "rw,upperdir=tmp/rootfs,lowerdir=%s", s->rootfs_path);
+
+    if (mount("none", "mnt", FS_OVERLAYFS, 0, data) == -1) {
+      setup__fail("mount", "mnt");
+    }
+  } else {
+    snprintf(path, sizeof(path), "%s/proc", s->rootfs_path);
+    setup__mkdir_p(path, 0777);
+
+    setup__bind(s->rootfs_path, "mnt", 1);
+
+    setup__overlay_directory_in_rootfs("/dev");
+    setup__overlay_directory_in_rootfs("/etc");
+    setup__overlay_directory_in_rootfs("/home");
+    setup__overlay_directory_in_rootfs("/sbin");
+    setup__overlay_directory_in_rootfs("/var");
+
+    setup__mkdir_p("tmp/rootfs/tmp", 0777);
+    if (chmod("tmp/rootfs/tmp", 0777) == -1) {
+      setup__fail("chmod", "tmp/rootfs/tmp");
+    }
+
+    setup__overlay_directory_in_rootfs("/tmp");
+  }
+}
+
+/*
+ * Devices
+ */
+
+static void setup__mknod(const char *path, mode_t mode, int major, int minor, gid_t gid) {
+  if (mknod(path, S_IFCHR | mode, makedev(major, minor)) == -1) {
+    setup__fail("mknod", path);
+  }
+
+  /* Like `mknod -m`, regardless of the umask */
+  if (chmod(path, mode) == -1) {
+    setup__fail("chmod", path);
+  }
+
+  if (gid != (gid_t)-1 && chown(path, 0, gid) == -1) {
+    setup__fail("chown", path);
+  }
+}
+
+static void setup__symlink(const char *target, const char *path) {
+  if (symlink(target, path) == -1) {
+    setup__fail("symlink", path);
+  }
+}
+
+/* Returns the id in the third field of the entry for name, or -1 */
+static long setup__find_id(const char *db, const char *name) {
+  size_t len = strlen(name);
+  const char *line;
+  const char *p;
+  int i;
+
+  for (line = db; line != NULL && *line != '\0'; line = strchr(line, '\n')) {
+    if (*line == '\n') {
+      line++;
+    }
+
+    if (strncmp(line, name, len) != 0 || line[len] != ':') {
+      continue;
+    }
+
+    p = line;
+    for (i = 0; i < 2; i++) {
+      p = strchr(p, ':');
+      if (p == NULL) {
+        return -1;
+      }
+
+      p++;
+    }
+
+    return strtol(p, NULL, 10);
+  }
+
+  return -1;
+}
+
+static long setup__find_id_in(const char *path, const char *name) {
+  char *db = setup__read_file(path);
+  long id;
+
+  if (db == NULL) {
+    return -1;
+  }
+
+  id = setup__find_id(db, name);
+  free(db);
+
+  return id;
+}
+
+/* Runs a script in the root filesystem of the container, for the rare cases */
+static void setup__run_in_rootfs(const char *script) {
+  char *argv[] = { "chroot", "mnt", "env", "-i", "/bin/bash", "-l", "-c", (char *)script, NULL };
+
+  if (setup__run(argv, 0) != 0) {
+    fprintf(stderr, "chroot: %s: failed\n", script);
+    exit(1);
+  }
+}
+
+static void setup__dev(setup_t *s) {
+  struct group *gr;
+  gid_t tty_gid;
+  long fuse_gid;
+
+  /* Strip /dev down to the bare minimum */
+  setup__empty_dir("mnt/dev");
+
+  gr = getgrnam("tty");
+  if (gr == NULL) {
+    fprintf(stderr, "getgrnam: tty: not found\n");
+    exit(1);
+  }
+
+  tty_gid = gr->gr_gid;
+
+  setup__mknod("mnt/dev/tty", 0666, 5, 0, tty_gid);
+  setup__mknod("mnt/dev/random", 0666, 1, 8, 0);
+  setup__mknod("mnt/dev/urandom", 0666, 1, 9, 0);
+  setup__mknod("mnt/dev/null", 0666, 1, 3, 0);
+  setup__mknod("mnt/dev/zero", 0666, 1, 5, 0);
+
+  setup__symlink("/proc/self/fd", "mnt/dev/fd");
+  setup__symlink("fd/0", "mnt/dev/stdin");
+  setup__symlink("fd/1", "mnt/dev/stdout");
+  setup__symlink("fd/2", "mnt/dev/stderr");
+
+  /* Add fuse group and device, so fuse can work inside the container */
+  setup__mknod("mnt/dev/fuse", 0666, 10, 229, -1);
+
+  fuse_gid = setup__find_id_in("mnt/etc/group", "fuse");
+  if (fuse_gid == -1) {
+    setup__run_in_rootfs("addgroup --system fuse");
+
+    fuse_gid = setup__find_id_in("mnt/etc/group", "fuse");
+    if (fuse_gid == -1) {
+      fprintf(stderr, "addgroup: fuse: not found\n");
+      exit(1);
+    }
+  }
+
+  if (chown("mnt/dev/fuse", 0, fuse_gid) == -1) {
+    setup__fail("chown", "mnt/dev/fuse");
+  }
+}
+
+/*
+ * Files in /etc
+ */
+
+static void setup__etc(setup_t *s) {
+  char buf[4096];
+  char *resolv, *copy, *server, *saveptr;
+  size_t len;
+
+  snprintf(buf, sizeof(buf), "%s\n", s->id);
+  setup__write_file("mnt/etc/hostname", buf, 0644);
+
+  snprintf(buf, sizeof(buf),
+           "127.0.0.1 localhost\n"
+           "%s %s\n",
+           s->network_container_ip, s->id);
+  setup__write_file("mnt/etc/hosts", buf, 0644);
+
+  buf[0] = '\0';
+
+  if (strlen(s->dns_servers) > 0) {
+    /* A custom DNS server list was given; use that */
+    copy = strdup(s->dns_servers);
+    assert(copy != NULL);
+
+    for (server = strtok_r(copy, " \t\n", &saveptr);
+         server != NULL;
+         server = strtok_r(NULL, " \t\n", &saveptr)) {
+      len = strlen(buf);
+      snprintf(buf + len, sizeof(buf) - len, "nameserver %s\n", server);
+    }
+
+    free(copy);
+    setup__write_file("mnt/etc/resolv.conf", buf, 0644);
+    return;
+  }
+
+  resolv = setup__read_file("/etc/resolv.conf");
+  if (resolv == NULL) {
+    resolv = strdup("");
+    assert(resolv != NULL);
+  }
+
+  /*
+   * By default, inherit the nameserver from the host. When that is localhost,
+   * the host is assumed to run its own DNS server listening on all
+   * interfaces, which the container reaches through network_host_ip.
+   */
+  len = strlen(resolv);
+  while (len > 0 && resolv[len - 1] == '\n') {
+    len--;
+  }
+
+  if (len == strlen("nameserver 127.0.0.1") &&
+      strncmp(resolv, "nameserver 127.0.0.1", len) == 0) {
+    snprintf(buf, sizeof(buf), "nameserver %s\n", s->network_host_ip);
+    setup__write_file("mnt/etc/resolv.conf", buf, 0644);
+  } else {
+    setup__write_file("mnt/etc/resolv.conf", resolv, 0644);
+  }
+
+  free(resolv);
+}
+
+/*
+ * User
+ */
+
+/* Sets the ids in the third and fourth fields of the entry for name */
+static void setup__set_ids(const char *path, const char *name, long id, long gid) {
+  char tmp[PATH_MAX];
+  char *db, *out, *line, *next, *p;
+  size_t len = strlen(name);
+  struct stat st;
+  size_t off = 0;
+  int i;
+
+  db = setup__read_file(path);
+  if (db == NULL) {
+    setup__fail("open", path);
+  }
+
+  if (stat(path, &st) == -1) {
+    setup__fail("stat", path);
+  }
+
+  out = malloc(strlen(db) + 64);
+  assert(out != NULL);
+
+  for (line = db; line != NULL && *line != '\0'; line = next) {
+    next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+
+    if (strncmp(line, name, len) != 0 || line[len] != ':') {
+      off += sprintf(out + off, "%s\n", line);
+      continue;
+    }
+
+    /* name:password: */
+    p = line;
+    for (i = 0; i < 2 && p != NULL; i++) {
+      p = strchr(p, ':');
+      if (p != NULL) {
+        p++;
+      }
+    }
+
+    if (p == NULL) {
+      off += sprintf(out + off, "%s\n", line);
+      continue;
+    }
+
+    off += sprintf(out + off, "%.*s%ld", (int)(p - line), line, id);
+    p = strchr(p, ':');
+
+    if (gid != -1 && p != NULL) {
+      off += sprintf(out + off, ":%ld", gid);
+      p = strchr(p + 1, ':');
+    }
+
+    off += sprintf(out + off, "%s\n", p != NULL ? p : "");
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s+", path);
+  setup__write_file(tmp, out, st.st_mode & 07777);
+
+  if (rename(tmp, path) == -1) {
+    setup__fail("rename", path);
+  }
+
+  free(out);
+  free(db);
+}
+
+static int setup__chown_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  setup_t *s = setup__walking;
+  uid_t uid = -1;
+  gid_t gid = -1;
+
+  if (st->st_uid == s->old_uid) {
+    uid = s->uid;
+  }
+
+  if (st->st_gid == s->old_gid) {
+    gid = s->gid;
+  }
+
+  if ((uid != (uid_t)-1 || gid != (gid_t)-1) && lchown(path, uid, gid) == -1) {
+    setup__fail("chown", path);
+  }
+
+  return 0;
+}
+
+static void setup__user(setup_t *s) {
+  char script[256];
+  long old_uid, old_gid;
+
+  old_uid = setup__find_id_in("mnt/etc/passwd", "vcap");
+  old_gid = setup__find_id_in("mnt/etc/group", "vcap");
+
+  /* Creating the user takes useradd, which also populates its home */
+  if (old_uid == -1 || old_gid == -1) {
+    snprintf(script, sizeof(script),
+             "if [ %ld = -1 ]; then groupadd -g %d vcap; else groupmod -g %d vcap; fi; "
+             "if [ %ld = -1 ]; then useradd -m -u %d -s /bin/bash -g %d vcap; "
+             "else usermod -u %d -g %d vcap; fi",
+             old_gid, s->gid, s->gid,
+             old_uid, s->uid, s->gid, s->uid, s->gid);
+
+    setup__run_in_rootfs(script);
+  }
+
+  if (old_gid != -1 && old_gid != s->gid) {
+    setup__set_ids("mnt/etc/group", "vcap", s->gid, -1);
+  }
+
+  if (old_uid != -1 && (old_uid != s->uid || old_gid != s->gid)) {
+    setup__set_ids("mnt/etc/passwd", "vcap", s->uid, s->gid);
+  }
+
+  /* Files of the old ids change hands, in a single walk */
+  if ((old_uid != -1 && old_uid != s->uid) ||
+      (old_gid != -1 && old_gid != s->gid)) {
+    s->old_uid = (old_uid != -1 && old_uid != s->uid) ? old_uid : (uid_t)-1;
+    s->old_gid = (old_gid != -1 && old_gid != s->gid) ? old_gid : (gid_t)-1;
+
+    setup__walking = s;
+
+    if (nftw("mnt", setup__chown_entry, 16, FTW_PHYS) == -1) {
+      setup__fail("nftw", "mnt");
+    }
+
+    setup__walking = NULL;
+  }
+}
+
+static void setup__config(setup_t *s) {
+  char buf[2 * PATH_MAX];
+  int rv;
+
+  rv = snprintf(buf, sizeof(buf),
+           "id=%s\n"
+           "network_netmask=%s\n"
+           "network_host_ip=%s\n"
+           "network_host_iface=w-%s-0\n"
+           "network_container_ip=%s\n"
+           "network_container_iface=w-%s-1\n"
+           "network_ifb_iface=w-%s-2\n"
+           "user_uid=%s\n"
+           "rootfs_path=%s\n"
+           "allow_nested_warden=%s\n"
+           "fs_type=%s\n",
+           s->id,
+           s->network_netmask,
+           s->network_host_ip, s->id,
+           s->network_container_ip, s->id,
+           s->id,
+           s->user_uid,
+           s->rootfs_path,
+           s->allow_nested_warden,
+           s->fs_type);
+
+  if (rv >= sizeof(buf)) {
+    errno = ENAMETOOLONG;
+    setup__fail("write", "etc/config");
+  }
+
+  setup__write_file("etc/config", buf, 0644);
+}
+
+static int setup_create(const char *skeleton_path, const char *target) {
+  setup_t s;
+  struct stat st;
+  const char *rootfs_path;
+
+  memset(&s, 0, sizeof(s));
+
+  /* Defaults for debugging, like setup.sh */
+  s.id = setup__getenv("id", "test");
+  s.network_netmask = setup__getenv("network_netmask", "255.255.255.252");
+  s.network_host_ip = setup__getenv("network_host_ip", "10.0.0.1");
+  s.network_container_ip = setup__getenv("network_container_ip", "10.0.0.2");
+  s.user_uid = setup__getenv("user_uid", "10000");
+  s.allow_nested_warden = setup__getenv("allow_nested_warden", "false");
+  s.dns_servers = setup__getenv("dns_servers", "");
+  s.uid = strtol(s.user_uid, NULL, 10);
+  s.gid = s.uid;
+
+  rootfs_path = getenv("rootfs_path");
+  if (rootfs_path == NULL) {
+    fprintf(stderr, "rootfs_path: unbound variable\n");
+    return 1;
+  }
+
+  if (realpath(rootfs_path, s.rootfs_path) == NULL) {
+    setup__fail("realpath", rootfs_path);
+  }
+
+  setup__phase_start(&s);
+
+  if (stat(target, &st) == 0) {
+    fprintf(stderr, "\"%s\" already exists, aborting...\n", target);
+    return 1;
+  }
+
+  if (stat(skeleton_path, &st) == -1) {
+    setup__fail("stat", skeleton_path);
+  }
+
+  if (mkdir(target, st.st_mode & 07777) == -1) {
+    setup__fail("mkdir", target);
+  }
+
+  setup__copy_tree(skeleton_path, target);
+
+  setup__phase_end(&s, "copy");
+
+  /* Mounts only serve the setup, and go away with this process */
+  if (unshare(CLONE_NEWNS) == -1) {
+    setup__fail("unshare", NULL);
+  }
+
+  if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1) {
+    setup__fail("mount", "/");
+  }
+
+  if (chdir(target) == -1) {
+    setup__fail("chdir", target);
+  }
+
+  /* Probed once by the warden, see setup_probe */
+  s.fs_type = getenv("fs_type");
+  if (s.fs_type == NULL || strlen(s.fs_type) == 0) {
+    s.fs_type = setup__probe("tmp");
+  }
+
+  setup__config(&s);
+  setup__phase_end(&s, "config");
+
+  setup__fs(&s);
+  setup__phase_end(&s, "fs");
+
+  setup__dev(&s);
+  setup__phase_end(&s, "dev");
+
+  setup__etc(&s);
+  setup__phase_end(&s, "etc");
+
+  setup__user(&s);
+  setup__phase_end(&s, "user");
+
+  return 0;
+}
+
+static int setup_probe(const char *path) {
+  printf("%s\n", setup__probe(path));
+  return 0;
+}
+
+static int setup__usage(const char *name) {
+  fprintf(stderr, "Usage: %s probe DEPOT_PATH\n", name);
+  fprintf(stderr, "       %s create SKELETON_PATH INSTANCE_PATH\n", name);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  /* Timings are read by the warden once this exits */
+  setvbuf(stdout, NULL, _IOFBF, 0);
+
+  if (argc == 3 && strcmp(argv[1], "probe") == 0) {
+    return setup_probe(argv[2]);
+  }
+
+  if (argc == 4 && strcmp(argv[1], "create") == 0) {
+    return setup_create(argv[2], argv[3]);
+  }
+
+  return setup__usage(argv[0]);
+}
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "un.h"
+
+/*
+ * Measures how many commands per second wshd can run, by keeping a number of
+ * noninteractive requests in flight over wshd.sock and waiting for their exit
+ * status, the way wsh does.
+ */
+
+#define MAX_CONCURRENCY 1024
+
+static double bench__now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the fd carrying the exit status of the command */
+static int bench__start(const char *socket_path, const char *req, size_t len) {
+  msg_response_t res;
+  int fds[4];
+  int fd;
+  int i, rv;
+
+  fd = un_connect(socket_path);
+  if (fd == -1) {
+    perror("connect");
+    exit(1);
+  }
+
+  rv = write(fd, req, len);
+  if (rv != len) {
+    perror("write");
+    exit(1);
+  }
+
+  rv = un_recv_fds(fd, (char *)&res, sizeof(res), fds, 4);
+  if (rv != sizeof(res)) {
+    fprintf(stderr, "recvmsg: unexpected response\n");
+    exit(1);
+  }
+
+  close(fd);
+
+  for (i = 0; i < 3; i++) {
+    close(fds[i]);
+  }
+
+  return fds[3];
+}
+
+int main(int argc, char **argv) {
+  const char *socket_path = "run/wshd.sock";
+  const char *default_argv[] = { "/bin/true", NULL };
+  int count = 1000, concurrency = 1;
+  struct pollfd pfds[MAX_CONCURRENCY];
+  msg_request_t req;
+  char *buf;
+  size_t len;
+  int started = 0, done = 0, failed = 0;
+  int status;
+  double start;
+  int i, n, opt, rv;
+
+  while ((opt = getopt(argc, argv, "n:c:s:")) != -1) {
+    switch (opt) {
+      case 'n':
+        count = atoi(optarg);
+        break;
+
+      case 'c':
+        concurrency = atoi(optarg);
+        break;
+
+      case 's':
+        socket_path = optarg;
+        break;
+
+      default:
+        fprintf(stderr, "Usage: %s [-n count] [-c concurrency] [-s socket] [command...]\n", argv[0]);
+        exit(1);
+    }
+  }
+
+  if (count < 1 || concurrency < 1 || concurrency > MAX_CONCURRENCY) {
+    fprintf(stderr, "Invalid count or concurrency\n");
+    exit(1);
+  }
+
+  msg_request_init(&req);
+
+  if (optind < argc) {
+    msg_array_import(&req.arg, argc - optind, (const char **)&argv[optind]);
+  } else {
+    msg_array_import(&req.arg, 1, default_argv);
+  }
+
+  rv = msg_request_encode(&req, &buf, &len);
+  assert(rv == 0);
+
+  n = MIN(concurrency, count);
+  start = bench__now();
+
+  for (i = 0; i < n; i++) {
+    pfds[i].fd = bench__start(socket_path, buf, len);
+    pfds[i].events = POLLIN;
+    started++;
+  }
+
+  while (done < count) {
+    do {
+      rv = poll(pfds, n, -1);
+    } while (rv == -1 && errno == EINTR);
+
+    assert(rv > 0);
+
+    for (i = 0; i < n; i++) {
+      if (pfds[i].fd == -1 || pfds[i].revents == 0) {
+        continue;
+      }
+
+      /* No exit status is sent for commands that were killed */
+      if (read(pfds[i].fd, &status, sizeof(status)) != sizeof(status) || status != 0) {
+        failed++;
+      }
+
+      close(pfds[i].fd);
+      done++;
+
+      if (started < count) {
+        pfds[i].fd = bench__start(socket_path, buf, len);
+        started++;
+      } else {
+        pfds[i].fd = -1;
+      }
+    }
+  }
+
+  printf("%d execs (%d failed) in %.3fs, %.0f execs/s\n",
+         count, failed, bench__now() - start, count / (bench__now() - start));
+
+  free(buf);
+  msg_request_destroy(&req);
+
+  return failed ? 1 : 0;
+}
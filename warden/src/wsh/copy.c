@@ -0,0 +1,1014 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "un.h"
+
+#define COPY_CHUNK_SIZE (64 * 1024)
+
+/* Pipe buffer to ask for, so that sendfile and splice move more per call */
+#define COPY_PIPE_SIZE (1024 * 1024)
+
+/* Threads copying files that were passed as descriptors, and their backlog */
+#define COPY_WORKERS    4
+#define COPY_QUEUE_SIZE 64
+
+/* Upper bound on a single copy_file_range call */
+#define COPY_RANGE_SIZE (64 * 1024 * 1024)
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+typedef struct copy_s copy_t;
+typedef struct copy_entry_s copy_entry_t;
+typedef struct copy_job_s copy_job_t;
+typedef struct copy_pool_s copy_pool_t;
+
+struct copy_s {
+  /* Archive */
+  int fd;
+
+  /* Whether files are passed as descriptors, see copy_send_fds() */
+  int pass_fds;
+
+  /* Copies files received as descriptors, created when the first arrives */
+  copy_pool_t *pool;
+
+  /* Path of the current entry, for error messages */
+  char path[PATH_MAX];
+  size_t len;
+};
+
+struct copy_entry_s {
+  int type;
+  mode_t mode;
+  uint64_t size;
+  char name[NAME_MAX + 1];
+
+  /* Descriptor passed along with the entry, or -1 */
+  int fd;
+};
+
+struct copy_job_s {
+  int in;
+  int out;
+  uint64_t size;
+  mode_t mode;
+  char path[PATH_MAX];
+};
+
+struct copy_pool_s {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  copy_job_t jobs[COPY_QUEUE_SIZE];
+  int head;
+  int count;
+
+  /* Set once no more jobs will be queued */
+  int done;
+
+  /* Set by the first job that fails */
+  int failed;
+
+  pthread_t threads[COPY_WORKERS];
+};
+
+static void copy__init(copy_t *c, int fd) {
+  c->fd = fd;
+  c->pass_fds = 0;
+  c->pool = NULL;
+  c->path[0] = '\0';
+  c->len = 0;
+
+  /* Not every fd is a pipe, and the size may be capped */
+  fcntl(fd, F_SETPIPE_SZ, COPY_PIPE_SIZE);
+}
+
+/* Appends name to the path of the current entry, saving its length in len */
+static int copy__push(copy_t *c, const char *name, size_t *len) {
+  size_t n = strlen(name);
+  size_t off = c->len;
+
+  *len = c->len;
+
+  if (off > 0 && c->path[off - 1] != '/') {
+    off++;
+  }
+
+  if (off + n >= sizeof(c->path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if (off > c->len) {
+    c->path[c->len] = '/';
+  }
+
+  memcpy(c->path + off, name, n + 1);
+  c->len = off + n;
+
+  return 0;
+}
+
+static void copy__pop(copy_t *c, size_t len) {
+  c->len = len;
+  c->path[len] = '\0';
+}
+
+static int copy__fail(copy_t *c, const char *msg) {
+  fprintf(stderr, "%s: %s\n", c->path, msg);
+  return -1;
+}
+
+static int copy__error(copy_t *c, const char *what) {
+  /* The other end has failed, and reports why */
+  if (errno != EPIPE) {
+    fprintf(stderr, "%s %s: %s\n", what, c->path, strerror(errno));
+  }
+
+  return -1;
+}
+
+static int copy__write(int fd, const char *buf, size_t len) {
+  ssize_t rv;
+
+  while (len > 0) {
+    rv = write(fd, buf, len);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    buf += rv;
+    len -= rv;
+  }
+
+  return 0;
+}
+
+/* Returns 1 when len bytes were read, 0 on EOF, and -1 on error */
+static int copy__read(int fd, char *buf, size_t len) {
+  ssize_t rv;
+
+  while (len > 0) {
+    rv = read(fd, buf, len);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    if (rv == 0) {
+      return 0;
+    }
+
+    buf += rv;
+    len -= rv;
+  }
+
+  return 1;
+}
+
+/* Like copy__read, also taking a descriptor that was passed along the data */
+static int copy__read_fd(int fd, char *buf, size_t len, int *passed) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmh;
+  struct msghdr mh;
+  struct iovec iov;
+  ssize_t rv;
+
+  *passed = -1;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_control = control;
+  mh.msg_controllen = sizeof(control);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+
+  do {
+    rv = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+  } while (rv == -1 && errno == EINTR);
+
+  if (rv <= 0) {
+    return rv;
+  }
+
+  cmh = CMSG_FIRSTHDR(&mh);
+  if (cmh != NULL &&
+      cmh->cmsg_level == SOL_SOCKET &&
+      cmh->cmsg_type == SCM_RIGHTS &&
+      cmh->cmsg_len == CMSG_LEN(sizeof(int))) {
+    memcpy(passed, CMSG_DATA(cmh), sizeof(int));
+  }
+
+  if ((size_t)rv < len) {
+    rv = copy__read(fd, buf + rv, len - rv);
+    if (rv <= 0 && *passed != -1) {
+      close(*passed);
+      *passed = -1;
+    }
+
+    return rv;
+  }
+
+  return 1;
+}
+
+static char *copy__put_u32(char *p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static uint32_t copy__get_u32(const char *p) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+/*
+ * Writes the header and name of an entry, followed by data if any. The
+ * descriptor fd is passed along with them, unless it is -1.
+ */
+static int copy__put(copy_t *c, int type, mode_t mode, const char *name,
+                     uint64_t size, const char *data, size_t len, int fd) {
+  char buf[COPY_HEADER_SIZE + NAME_MAX + PATH_MAX];
+  size_t n = strlen(name);
+  char *p = buf;
+  int rv;
+
+  if (n > NAME_MAX || len > PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return copy__error(c, "write");
+  }
+
+  *p++ = type;
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 0;
+  p = copy__put_u32(p, mode);
+  p = copy__put_u32(p, n);
+  p = copy__put_u32(p, size >> 32);
+  p = copy__put_u32(p, size & 0xffffffff);
+
+  memcpy(p, name, n);
+  p += n;
+
+  if (len > 0) {
+    memcpy(p, data, len);
+    p += len;
+  }
+
+  if (fd != -1) {
+    rv = un_send_fds(c->fd, buf, p - buf, &fd, 1);
+    if (rv == -1) {
+      return copy__error(c, "sendmsg");
+    }
+  } else {
+    rv = 0;
+  }
+
+  if (copy__write(c->fd, buf + rv, p - buf - rv) == -1) {
+    return copy__error(c, "write");
+  }
+
+  return 0;
+}
+
+static int copy__send_data(copy_t *c, int in, uint64_t size) {
+  char buf[COPY_CHUNK_SIZE];
+  int use_sendfile = 1;
+  ssize_t rv;
+
+  while (size > 0) {
+    if (use_sendfile) {
+      rv = sendfile(c->fd, in, NULL, MIN(size, COPY_PIPE_SIZE));
+      if (rv == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        use_sendfile = 0;
+        continue;
+      }
+    } else {
+      rv = read(in, buf, MIN(size, sizeof(buf)));
+      if (rv > 0 && copy__write(c->fd, buf, rv) == -1) {
+        return copy__error(c, "write");
+      }
+    }
+
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return copy__error(c, use_sendfile ? "sendfile" : "read");
+    }
+
+    /* The size was already sent, there is no way to make up for this */
+    if (rv == 0) {
+      return copy__fail(c, "file shrank while being copied");
+    }
+
+    size -= rv;
+  }
+
+  return 0;
+}
+
+static int copy__send_entry(copy_t *c, int dirfd, const char *path, const char *name);
+
+/* Sends the directory open as fd, and closes it */
+static int copy__send_dir(copy_t *c, int fd, const char *name, mode_t mode) {
+  DIR *d;
+  struct dirent *de;
+  int rv;
+
+  rv = copy__put(c, COPY_TYPE_DIR, mode, name, 0, NULL, 0, -1);
+  if (rv == -1) {
+    close(fd);
+    return -1;
+  }
+
+  d = fdopendir(fd);
+  if (d == NULL) {
+    close(fd);
+    return copy__error(c, "opendir");
+  }
+
+  for (;;) {
+    errno = 0;
+    de = readdir(d);
+    if (de == NULL) {
+      if (errno != 0) {
+        rv = copy__error(c, "readdir");
+      }
+
+      break;
+    }
+
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+
+    rv = copy__send_entry(c, dirfd(d), de->d_name, de->d_name);
+    if (rv == -1) {
+      break;
+    }
+  }
+
+  closedir(d);
+
+  if (rv == 0) {
+    rv = copy__put(c, COPY_TYPE_UP, 0, "", 0, NULL, 0, -1);
+  }
+
+  return rv;
+}
+
+/* Sends path, relative to dirfd, as an entry called name */
+static int copy__send_entry(copy_t *c, int dirfd, const char *path, const char *name) {
+  char target[PATH_MAX];
+  struct stat st;
+  size_t len;
+  ssize_t n;
+  int fd, rv;
+
+  if (copy__push(c, path, &len) == -1) {
+    return copy__error(c, "stat");
+  }
+
+  rv = fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW);
+  if (rv == -1) {
+    rv = copy__error(c, "stat");
+    goto done;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    fd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      rv = copy__error(c, "open");
+    } else {
+      if (c->pass_fds) {
+        rv = copy__put(c, COPY_TYPE_FILE, st.st_mode & 07777, name, st.st_size, NULL, 0, fd);
+      } else {
+        rv = copy__put(c, COPY_TYPE_FILE, st.st_mode & 07777, name, st.st_size, NULL, 0, -1);
+        if (rv == 0) {
+          rv = copy__send_data(c, fd, st.st_size);
+        }
+      }
+    }
+
+    if (fd != -1) {
+      close(fd);
+    }
+  } else if (S_ISLNK(st.st_mode)) {
+    n = readlinkat(dirfd, path, target, sizeof(target));
+    if (n == sizeof(target)) {
+      errno = ENAMETOOLONG;
+      n = -1;
+    }
+
+    if (n == -1) {
+      rv = copy__error(c, "readlink");
+    } else {
+      rv = copy__put(c, COPY_TYPE_SYMLINK, 0777, name, n, target, n, -1);
+    }
+  } else if (S_ISDIR(st.st_mode)) {
+    fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+      rv = copy__error(c, "open");
+    } else {
+      rv = copy__send_dir(c, fd, name, st.st_mode & 07777);
+    }
+  } else {
+    /* Devices, fifos and sockets are skipped */
+    rv = 0;
+  }
+
+done:
+  copy__pop(c, len);
+  return rv;
+}
+
+static int copy__send(copy_t *c, const char *src) {
+  struct stat st;
+  const char *name;
+  size_t len;
+  int dfd, rv;
+
+  name = strrchr(src, '/');
+  name = (name != NULL) ? name + 1 : src;
+
+  if (strlen(name) == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    /* Only the contents, sent as the destination itself */
+    copy__push(c, src, &len);
+
+    dfd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1 || fstat(dfd, &st) == -1) {
+      rv = copy__error(c, "open");
+
+      if (dfd != -1) {
+        close(dfd);
+      }
+    } else {
+      rv = copy__send_dir(c, dfd, "", st.st_mode & 07777);
+    }
+  } else {
+    rv = copy__send_entry(c, AT_FDCWD, src, name);
+  }
+
+  if (rv == 0) {
+    rv = copy__put(c, COPY_TYPE_END, 0, "", 0, NULL, 0, -1);
+  }
+
+  return rv;
+}
+
+int copy_send(int fd, const char *src) {
+  copy_t c;
+
+  copy__init(&c, fd);
+
+  return copy__send(&c, src);
+}
+
+int copy_send_fds(int fd, const char *src) {
+  copy_t c;
+
+  copy__init(&c, fd);
+  c.pass_fds = 1;
+
+  return copy__send(&c, src);
+}
+
+static int copy__truncated(copy_t *c) {
+  return copy__fail(c, "unexpected end of archive");
+}
+
+/* Reads the header and name of the next entry, and its descriptor if any */
+static int copy__get(copy_t *c, copy_entry_t *e) {
+  char buf[COPY_HEADER_SIZE];
+  uint32_t len;
+  int rv;
+
+  if (c->pass_fds) {
+    rv = copy__read_fd(c->fd, buf, sizeof(buf), &e->fd);
+  } else {
+    rv = copy__read(c->fd, buf, sizeof(buf));
+    e->fd = -1;
+  }
+
+  if (rv <= 0) {
+    return (rv == 0) ? copy__truncated(c) : copy__error(c, "read");
+  }
+
+  e->type = (unsigned char)buf[0];
+  e->mode = copy__get_u32(buf + 4) & 07777;
+  len = copy__get_u32(buf + 8);
+  e->size = ((uint64_t)copy__get_u32(buf + 12) << 32) | copy__get_u32(buf + 16);
+
+  /* Only named files are passed as descriptors */
+  if (len > NAME_MAX || (e->fd != -1 && (e->type != COPY_TYPE_FILE || len == 0))) {
+    rv = copy__fail(c, "invalid archive");
+    goto err;
+  }
+
+  rv = copy__read(c->fd, e->name, len);
+  if (rv <= 0) {
+    rv = (rv == 0) ? copy__truncated(c) : copy__error(c, "read");
+    goto err;
+  }
+
+  e->name[len] = '\0';
+
+  /* Names are a single component, so entries can't escape the destination */
+  if (strlen(e->name) != len ||
+      strchr(e->name, '/') != NULL ||
+      strcmp(e->name, ".") == 0 ||
+      strcmp(e->name, "..") == 0) {
+    rv = copy__fail(c, "invalid archive");
+    goto err;
+  }
+
+  return 0;
+
+err:
+  if (e->fd != -1) {
+    close(e->fd);
+    e->fd = -1;
+  }
+
+  return rv;
+}
+
+static int copy__recv_data(copy_t *c, int out, uint64_t size) {
+  char buf[COPY_CHUNK_SIZE];
+  int use_splice = 1;
+  ssize_t rv;
+
+  while (size > 0) {
+    if (use_splice) {
+      rv = splice(c->fd, NULL, out, NULL, MIN(size, COPY_PIPE_SIZE), SPLICE_F_MOVE);
+      if (rv == -1 && errno == EINVAL) {
+        use_splice = 0;
+        continue;
+      }
+    } else {
+      rv = read(c->fd, buf, MIN(size, sizeof(buf)));
+      if (rv > 0 && copy__write(out, buf, rv) == -1) {
+        return copy__error(c, "write");
+      }
+    }
+
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return copy__error(c, use_splice ? "splice" : "read");
+    }
+
+    if (rv == 0) {
+      return copy__truncated(c);
+    }
+
+    size -= rv;
+  }
+
+  return 0;
+}
+
+static int copy__recv_entry(copy_t *c, int dirfd, const char *path, copy_entry_t *e);
+
+/* Copies the file in to out, returning what failed if anything did */
+static const char *copy__clone(copy_job_t *j, int *err) {
+  uint64_t size = j->size;
+  int use_range = 1;
+  ssize_t rv;
+
+  *err = 0;
+
+  /* Shares the blocks of in when the filesystem supports it */
+  if (ioctl(j->out, FICLONE, j->in) == 0) {
+    size = 0;
+  }
+
+  while (size > 0) {
+#ifdef __NR_copy_file_range
+    if (use_range) {
+      rv = syscall(__NR_copy_file_range, j->in, NULL, j->out, NULL,
+                   MIN(size, COPY_RANGE_SIZE), 0);
+      if (rv == -1 && (errno == EXDEV || errno == EINVAL ||
+                       errno == ENOSYS || errno == EOPNOTSUPP)) {
+        use_range = 0;
+        continue;
+      }
+    } else
+#endif
+    {
+      use_range = 0;
+      rv = sendfile(j->out, j->in, NULL, MIN(size, COPY_PIPE_SIZE));
+    }
+
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      *err = errno;
+      return use_range ? "copy_file_range" : "sendfile";
+    }
+
+    if (rv == 0) {
+      return "file shrank while being copied";
+    }
+
+    size -= rv;
+  }
+
+  if (fchmod(j->out, j->mode) == -1) {
+    *err = errno;
+    return "chmod";
+  }
+
+  return NULL;
+}
+
+static void *copy__worker(void *data) {
+  copy_pool_t *p = (copy_pool_t *)data;
+  copy_job_t job;
+  const char *what;
+  int err;
+
+  for (;;) {
+    pthread_mutex_lock(&p->lock);
+
+    while (p->count == 0 && !p->done) {
+      pthread_cond_wait(&p->cond, &p->lock);
+    }
+
+    if (p->count == 0) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+
+    job = p->jobs[p->head];
+    p->head = (p->head + 1) % COPY_QUEUE_SIZE;
+    p->count--;
+
+    /* Jobs queued after a failure are dropped */
+    what = NULL;
+    if (!p->failed) {
+      pthread_cond_broadcast(&p->cond);
+      pthread_mutex_unlock(&p->lock);
+      what = copy__clone(&job, &err);
+      pthread_mutex_lock(&p->lock);
+    }
+
+    if (what != NULL) {
+      /* Only the first failure is reported, like for other entries */
+      if (!p->failed) {
+        if (err != 0) {
+          fprintf(stderr, "%s %s: %s\n", what, job.path, strerror(err));
+        } else {
+          fprintf(stderr, "%s: %s\n", job.path, what);
+        }
+      }
+
+      p->failed = 1;
+    }
+
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    close(job.in);
+    close(job.out);
+  }
+
+  return NULL;
+}
+
+static copy_pool_t *copy__pool_create(void) {
+  copy_pool_t *p;
+  int i, rv;
+
+  p = calloc(1, sizeof(*p));
+  assert(p != NULL);
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+
+  for (i = 0; i < COPY_WORKERS; i++) {
+    rv = pthread_create(&p->threads[i], NULL, copy__worker, p);
+    assert(rv == 0);
+  }
+
+  return p;
+}
+
+/* Waits for the queued copies; returns -1 if one of them failed */
+static int copy__pool_destroy(copy_pool_t *p) {
+  int failed;
+  int i;
+
+  pthread_mutex_lock(&p->lock);
+  p->done = 1;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+
+  for (i = 0; i < COPY_WORKERS; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+
+  failed = p->failed;
+
+  pthread_cond_destroy(&p->cond);
+  pthread_mutex_destroy(&p->lock);
+  free(p);
+
+  return failed ? -1 : 0;
+}
+
+/* Queues a copy of the descriptor of e to out, taking ownership of both */
+static int copy__pool_add(copy_t *c, copy_entry_t *e, int out) {
+  copy_pool_t *p;
+  copy_job_t *j;
+  int rv = 0;
+
+  if (c->pool == NULL) {
+    c->pool = copy__pool_create();
+  }
+
+  p = c->pool;
+
+  pthread_mutex_lock(&p->lock);
+
+  while (p->count == COPY_QUEUE_SIZE && !p->failed) {
+    pthread_cond_wait(&p->cond, &p->lock);
+  }
+
+  if (p->failed) {
+    /* Already reported by the worker */
+    close(e->fd);
+    close(out);
+    rv = -1;
+  } else {
+    j = &p->jobs[(p->head + p->count) % COPY_QUEUE_SIZE];
+    j->in = e->fd;
+    j->out = out;
+    j->size = e->size;
+    j->mode = e->mode;
+    memcpy(j->path, c->path, c->len + 1);
+    p->count++;
+
+    pthread_cond_broadcast(&p->cond);
+  }
+
+  pthread_mutex_unlock(&p->lock);
+
+  e->fd = -1;
+  return rv;
+}
+
+/* Receives entries into the directory open as fd up to its end, and closes it */
+static int copy__recv_dir(copy_t *c, int fd, mode_t mode) {
+  copy_entry_t e;
+  int rv;
+
+  for (;;) {
+    rv = copy__get(c, &e);
+    if (rv == -1) {
+      break;
+    }
+
+    if (e.type == COPY_TYPE_UP) {
+      /* Last, so that read-only directories can be filled */
+      if (fchmod(fd, mode) == -1) {
+        rv = copy__error(c, "chmod");
+      }
+
+      break;
+    }
+
+    if (strlen(e.name) == 0) {
+      rv = copy__fail(c, "invalid archive");
+      break;
+    }
+
+    rv = copy__recv_entry(c, fd, e.name, &e);
+    if (rv == -1) {
+      break;
+    }
+  }
+
+  close(fd);
+
+  return rv;
+}
+
+/* Creates path, relative to dirfd, from the entry e */
+static int copy__recv_entry(copy_t *c, int dirfd, const char *path, copy_entry_t *e) {
+  char target[PATH_MAX];
+  size_t len;
+  int fd, rv;
+
+  if (copy__push(c, path, &len) == -1) {
+    rv = copy__error(c, "open");
+    goto out;
+  }
+
+  switch (e->type) {
+    case COPY_TYPE_FILE:
+      /* Replace rather than overwrite, like rsync does */
+      if (unlinkat(dirfd, path, 0) == -1 && errno != ENOENT) {
+        rv = copy__error(c, "unlink");
+        break;
+      }
+
+      fd = openat(dirfd, path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+      if (fd == -1) {
+        rv = copy__error(c, "open");
+        break;
+      }
+
+      if (e->fd != -1) {
+        rv = copy__pool_add(c, e, fd);
+        break;
+      }
+
+      rv = copy__recv_data(c, fd, e->size);
+      if (rv == 0 && fchmod(fd, e->mode) == -1) {
+        rv = copy__error(c, "chmod");
+      }
+
+      close(fd);
+      break;
+
+    case COPY_TYPE_SYMLINK:
+      if (e->size >= sizeof(target)) {
+        rv = copy__fail(c, "invalid archive");
+        break;
+      }
+
+      rv = copy__read(c->fd, target, e->size);
+      if (rv <= 0) {
+        rv = (rv == 0) ? copy__truncated(c) : copy__error(c, "read");
+        break;
+      }
+
+      target[e->size] = '\0';
+
+      if (unlinkat(dirfd, path, 0) == -1 && errno != ENOENT) {
+        rv = copy__error(c, "unlink");
+        break;
+      }
+
+      rv = symlinkat(target, dirfd, path);
+      if (rv == -1) {
+        rv = copy__error(c, "symlink");
+      }
+      break;
+
+    case COPY_TYPE_DIR:
+      if (mkdirat(dirfd, path, 0700) == -1 && errno != EEXIST) {
+        rv = copy__error(c, "mkdir");
+        break;
+      }
+
+      fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd == -1 && (errno == ENOTDIR || errno == ELOOP)) {
+        /* Replace what is in the way, like rsync does */
+        if (unlinkat(dirfd, path, 0) == 0 && mkdirat(dirfd, path, 0700) == 0) {
+          fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+      }
+
+      if (fd == -1) {
+        rv = copy__error(c, "open");
+        break;
+      }
+
+      rv = copy__recv_dir(c, fd, e->mode);
+      break;
+
+    default:
+      rv = copy__fail(c, "invalid archive");
+      break;
+  }
+
+  copy__pop(c, len);
+
+out:
+  if (e->fd != -1) {
+    close(e->fd);
+    e->fd = -1;
+  }
+
+  return rv;
+}
+
+int copy_recv(int fd, const char *dst) {
+  copy_t c;
+  copy_entry_t e;
+  struct stat st;
+  size_t len;
+  int is_dir;
+  int dfd, rv;
+
+  copy__init(&c, fd);
+  copy__push(&c, dst, &len);
+
+  /* Files may be passed as descriptors over unix sockets */
+  c.pass_fds = (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode));
+
+  rv = copy__get(&c, &e);
+  if (rv == -1) {
+    return -1;
+  }
+
+  if (e.type == COPY_TYPE_DIR) {
+    is_dir = 1;
+  } else if (e.type == COPY_TYPE_FILE || e.type == COPY_TYPE_SYMLINK) {
+    is_dir = (strlen(dst) > 0 && dst[strlen(dst) - 1] == '/') ||
+             (stat(dst, &st) == 0 && S_ISDIR(st.st_mode));
+  } else {
+    rv = copy__fail(&c, "invalid archive");
+    goto out;
+  }
+
+  if (strlen(e.name) == 0 && e.type != COPY_TYPE_DIR) {
+    rv = copy__fail(&c, "invalid archive");
+    goto out;
+  }
+
+  if (!is_dir) {
+    /* A file on its own takes the name of the destination */
+    copy__pop(&c, 0);
+    rv = copy__recv_entry(&c, AT_FDCWD, dst, &e);
+  } else {
+    if (mkdir(dst, 0777) == -1 && errno != EEXIST) {
+      rv = copy__error(&c, "mkdir");
+      goto out;
+    }
+
+    dfd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1) {
+      rv = copy__error(&c, "open");
+      goto out;
+    }
+
+    if (strlen(e.name) == 0) {
+      rv = copy__recv_dir(&c, dfd, e.mode);
+    } else {
+      rv = copy__recv_entry(&c, dfd, e.name, &e);
+      close(dfd);
+    }
+  }
+
+  if (rv == 0) {
+    rv = copy__get(&c, &e);
+    if (rv == 0 && e.type != COPY_TYPE_END) {
+      rv = copy__fail(&c, "invalid archive");
+    }
+  }
+
+out:
+  if (e.fd != -1) {
+    close(e.fd);
+  }
+
+  /* Files passed as descriptors are only complete once the pool is done */
+  if (c.pool != NULL && copy__pool_destroy(c.pool) == -1) {
+    rv = -1;
+  }
+
+  return rv;
+}
@@ -0,0 +1,60 @@
+#ifndef COPY_H
+#define COPY_H 1
+
+/*
+ * Archives that wsh and wshd stream between the host and a container to copy
+ * files in and out (see --copy-in and --copy-out in wsh.c). Permissions and
+ * symlinks are preserved, hard links are materialized, and other types of
+ * files are skipped, like `rsync -r -p --links` does.
+ *
+ * An archive is a sequence of entries. All integers are in network byte
+ * order. Every entry starts with a header:
+ *
+ *   type (1 byte) | reserved (3 bytes) | mode (4 bytes) | length (4 bytes) | size (8 bytes)
+ *
+ * followed by _length_ bytes of name and _size_ bytes of data. Names are a
+ * single path component; entries are relative to the innermost directory
+ * entry that has not been closed with COPY_TYPE_UP yet. Only the first entry
+ * may have an empty name: it is a directory that stands for the destination
+ * itself, which is what a source with a trailing `/` is sent as.
+ *
+ * A sender stops at the first error, so an archive that isn't terminated by
+ * COPY_TYPE_END is incomplete.
+ *
+ * When the archive is a unix socket, the header of a file may carry the file
+ * itself as a descriptor (SCM_RIGHTS) in place of its data, whose size is then
+ * only the number of bytes to copy from it.
+ */
+
+#define COPY_HEADER_SIZE 20
+
+#define COPY_TYPE_FILE    'f' /* Data is the contents of the file */
+#define COPY_TYPE_SYMLINK 'l' /* Data is the target of the link */
+#define COPY_TYPE_DIR     'd' /* No data, opens a directory */
+#define COPY_TYPE_UP      'u' /* No data, closes the innermost directory */
+#define COPY_TYPE_END     'e' /* No data, last entry */
+
+/*
+ * Writes an archive of src to fd. The archive contains the contents of src if
+ * it ends with a `/`, and src itself otherwise.
+ *
+ * Returns 0 on success, -1 after reporting what failed on stderr.
+ */
+int copy_send(int fd, const char *src);
+
+/*
+ * Like copy_send, but passes files as descriptors when fd is a unix socket.
+ * The receiver copies them with reflinks or copy_file_range when it can, on
+ * a few threads.
+ */
+int copy_send_fds(int fd, const char *src);
+
+/*
+ * Extracts an archive read from fd into dst. A file that is sent on its own
+ * is written to dst, unless dst is a directory or ends with a `/`.
+ *
+ * Returns 0 on success, -1 after reporting what failed on stderr.
+ */
+int copy_recv(int fd, const char *dst);
+
+#endif
@@ -0,0 +1,1062 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "job.h"
+#include "job_buffer.h"
+#include "util.h"
+
+#define JOB_DEFAULT_RING_BUFFER_SIZE (64 * 1024)
+#define JOB_MAX_RING_BUFFER_SIZE     (64 * 1024 * 1024)
+
+#define JOB_MIN_CHUNK_SIZE     4096
+#define JOB_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define JOB_MAX_CHUNK_SIZE     (16 * 1024 * 1024)
+
+typedef struct job_s job_t;
+typedef struct job_stream_s job_stream_t;
+typedef struct job_client_s job_client_t;
+
+struct job_stream_s {
+  job_t *job;
+
+  /* Read end of the pipe, -1 once closed */
+  int fd;
+  loop_watch_t *lw;
+
+  job_buffer_t rb;
+
+  /* Reads start small and grow while they keep coming back full */
+  size_t chunk_size;
+  size_t max_chunk_size;
+};
+
+struct job_s {
+  jobs_t *js;
+
+  uint32_t id;
+  pid_t pid;
+
+  int exited;
+  int status;
+
+  /* When the job finished, see JOB_RETENTION_SECS */
+  time_t finished_at;
+
+  /* Whether a client has received the exit status */
+  int delivered;
+
+  job_stream_t streams[2];
+
+  /* Attached clients */
+  job_client_t *clients;
+
+  job_t *next;
+};
+
+enum {
+  JOB_CLIENT_REQUEST,
+  JOB_CLIENT_REPLY,
+  JOB_CLIENT_ATTACHED,
+  JOB_CLIENT_DONE,
+};
+
+struct job_client_s {
+  jobs_t *js;
+
+  int fd;
+  loop_watch_t *lw;
+  int state;
+
+  /* Request */
+  uint8_t header[JOB_HEADER_SIZE];
+  size_t header_off;
+  uint32_t type;
+  uint8_t *body;
+  size_t body_len;
+  size_t body_off;
+
+  /* Reply to a spawn request */
+  uint8_t reply[JOB_HEADER_SIZE + 4 + JOB_MAX_ERROR_LENGTH];
+  size_t reply_len;
+  size_t reply_off;
+
+  /* Attached to a job */
+  job_t *job;
+  uint64_t pos[2];
+  int next_stream;
+  int blocked;
+
+  /* Frame being written */
+  int in_frame;
+  uint8_t frame[JOB_FRAME_HEADER_SIZE];
+  size_t frame_off;
+  int frame_stream;
+  uint32_t frame_length;
+  uint64_t frame_pos;
+  uint8_t status[4];
+
+  /* Copy of the unsent part of the frame, once the buffer is about to
+   * overwrite it. Frames are never cut short, even when the client lags. */
+  uint8_t *spill;
+  size_t spill_off;
+
+  job_client_t *next;
+};
+
+struct jobs_s {
+  loop_t *l;
+  int fd;
+  loop_watch_t *lw;
+  jobs_fork_t fork_cb;
+
+  uint32_t next_id;
+  job_t *jobs;
+};
+
+static void job__put_u32(uint8_t *buf, uint32_t v) {
+  v = htonl(v);
+  memcpy(buf, &v, sizeof(v));
+}
+
+static void job__put_u64(uint8_t *buf, uint64_t v) {
+  job__put_u32(buf, (uint32_t) (v >> 32));
+  job__put_u32(buf + 4, (uint32_t) v);
+}
+
+static uint32_t job__get_u32(const uint8_t *buf) {
+  uint32_t v;
+
+  memcpy(&v, buf, sizeof(v));
+  return ntohl(v);
+}
+
+static uint64_t job__get_u64(const uint8_t *buf) {
+  return ((uint64_t) job__get_u32(buf) << 32) | job__get_u32(buf + 4);
+}
+
+/* Like writev(2), but doesn't raise SIGPIPE and returns 0 if fd would block */
+static ssize_t job__sendv(int fd, struct iovec *iov, int iovcnt) {
+  struct msghdr mh;
+  ssize_t rv;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = iovcnt;
+
+  do {
+    rv = sendmsg(fd, &mh, MSG_NOSIGNAL);
+  } while (rv == -1 && errno == EINTR);
+
+  if (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+
+  return rv;
+}
+
+static job_t *jobs__find(jobs_t *js, uint32_t id) {
+  job_t *job;
+
+  for (job = js->jobs; job != NULL; job = job->next) {
+    if (job->id == id) {
+      return job;
+    }
+  }
+
+  return NULL;
+}
+
+static int job__finished(job_t *job) {
+  return job->exited && job->streams[0].fd == -1 && job->streams[1].fd == -1;
+}
+
+static void job__free(job_t *job) {
+  jobs_t *js = job->js;
+  job_t **jobp;
+  int i;
+
+  for (jobp = &js->jobs; *jobp != NULL; jobp = &(*jobp)->next) {
+    if (*jobp == job) {
+      *jobp = job->next;
+      break;
+    }
+  }
+
+  for (i = 0; i < 2; i++) {
+    job_buffer_destroy(&job->streams[i].rb);
+  }
+
+  free(job);
+}
+
+/* Jobs are forgotten once a client has received their exit status */
+static void job__maybe_free(job_t *job) {
+  if (job__finished(job) && job->delivered && job->clients == NULL) {
+    job__free(job);
+  }
+}
+
+static time_t job__now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* Forgets finished jobs whose exit status nobody collected for too long, and
+ * the oldest of them once there are too many */
+static void jobs__expire(jobs_t *js) {
+  job_t *job, *next;
+  time_t now = job__now();
+  int n = 0;
+
+  /* Newest jobs come first */
+  for (job = js->jobs; job != NULL; job = next) {
+    next = job->next;
+
+    if (!job__finished(job) || job->delivered || job->clients != NULL) {
+      continue;
+    }
+
+    if (++n > JOB_MAX_RETAINED || now - job->finished_at >= JOB_RETENTION_SECS) {
+      job__free(job);
+    }
+  }
+}
+
+static void job_client__close(job_client_t *c) {
+  job_t *job = c->job;
+  job_client_t **cp;
+
+  if (job != NULL) {
+    for (cp = &job->clients; *cp != NULL; cp = &(*cp)->next) {
+      if (*cp == c) {
+        *cp = c->next;
+        break;
+      }
+    }
+  }
+
+  loop_remove(c->js->l, c->lw);
+  close(c->fd);
+  free(c->body);
+  free(c->spill);
+  free(c);
+
+  if (job != NULL) {
+    job__maybe_free(job);
+  }
+}
+
+/* Sets up the next frame to send; returns 0 if there is nothing to send */
+static int job_client__next_frame(job_client_t *c) {
+  job_t *job = c->job;
+  job_stream_t *s;
+  uint64_t tail;
+  int i, j;
+
+  for (i = 0; i < 2; i++) {
+    j = (c->next_stream + i) % 2;
+    s = &job->streams[j];
+
+    /* Skip output that is no longer buffered */
+    tail = job_buffer_tail(&s->rb);
+    if (c->pos[j] < tail) {
+      c->pos[j] = tail;
+    }
+
+    if (c->pos[j] < s->rb.head) {
+      c->frame_stream = j;
+      c->frame_pos = c->pos[j];
+      c->frame_length = MIN(s->rb.head - c->pos[j], JOB_MAX_FRAME_LENGTH);
+      c->next_stream = (j + 1) % 2;
+      return 1;
+    }
+  }
+
+  /* Caught up, the exit status goes last */
+  if (job__finished(job)) {
+    c->frame_stream = JOB_STREAM_STATUS;
+    c->frame_pos = 0;
+    c->frame_length = sizeof(c->status);
+    job__put_u32(c->status, job->status);
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Writes frames until caught up or blocked; returns -1 if the client is gone */
+static int job_client__flush(job_client_t *c) {
+  job_t *job = c->job;
+  job_buffer_t *rb;
+  struct iovec iov[3];
+  int iovcnt;
+  size_t nsent, nwanted;
+  ssize_t rv;
+
+  while (c->state == JOB_CLIENT_ATTACHED) {
+    if (!c->in_frame) {
+      if (!job_client__next_frame(c)) {
+        break;
+      }
+
+      memset(c->frame, 0, sizeof(c->frame));
+      c->frame[0] = c->frame_stream;
+      job__put_u32(c->frame + 4, c->frame_length);
+      job__put_u64(c->frame + 8, c->frame_pos);
+
+      c->frame_off = 0;
+      c->in_frame = 1;
+    }
+
+    iovcnt = 0;
+    nsent = 0;
+
+    if (c->frame_off < sizeof(c->frame)) {
+      iov[iovcnt].iov_base = c->frame + c->frame_off;
+      iov[iovcnt].iov_len = sizeof(c->frame) - c->frame_off;
+      iovcnt++;
+    } else {
+      nsent = c->frame_off - sizeof(c->frame);
+    }
+
+    if (c->frame_stream == JOB_STREAM_STATUS) {
+      iov[iovcnt].iov_base = c->status + nsent;
+      iov[iovcnt].iov_len = sizeof(c->status) - nsent;
+      iovcnt++;
+    } else if (c->spill != NULL) {
+      iov[iovcnt].iov_base = c->spill + (nsent - c->spill_off);
+      iov[iovcnt].iov_len = c->frame_length - nsent;
+      iovcnt++;
+    } else {
+      rb = &job->streams[c->frame_stream].rb;
+      assert(c->frame_pos + nsent >= job_buffer_tail(rb));
+      iovcnt += job_buffer_iov(rb, c->frame_pos + nsent, c->frame_length - nsent, iov + iovcnt);
+    }
+
+    nwanted = sizeof(c->frame) + c->frame_length - c->frame_off;
+
+    rv = job__sendv(c->fd, iov, iovcnt);
+    if (rv == -1) {
+      return -1;
+    }
+
+    c->frame_off += rv;
+
+    if (rv < nwanted) {
+      break;
+    }
+
+    c->in_frame = 0;
+
+    free(c->spill);
+    c->spill = NULL;
+
+    if (c->frame_stream == JOB_STREAM_STATUS) {
+      c->state = JOB_CLIENT_DONE;
+      job->delivered = 1;
+    } else {
+      c->pos[c->frame_stream] += c->frame_length;
+    }
+  }
+
+  /* Watch for writability only while blocked; hangups are always noticed */
+  c->blocked = c->in_frame;
+  loop_modify(c->js->l, c->lw, LOOP_READ | (c->blocked ? LOOP_WRITE : 0));
+
+  return 0;
+}
+
+static void job_client__service(job_client_t *c) {
+  if (job_client__flush(c) == -1 || c->state == JOB_CLIENT_DONE) {
+    job_client__close(c);
+  }
+}
+
+/* Sends new output to attached clients that aren't blocked */
+static void job__notify(job_t *job) {
+  job_client_t *c, *next;
+
+  for (c = job->clients; c != NULL; c = next) {
+    next = c->next;
+
+    if (!c->blocked) {
+      job_client__service(c);
+    }
+  }
+}
+
+static void job__close_stream(job_stream_t *s) {
+  loop_remove(s->job->js->l, s->lw);
+  close(s->fd);
+  s->fd = -1;
+  s->lw = NULL;
+}
+
+/* Copies frames that the next read of up to len bytes could overwrite */
+static void job__spill(job_stream_t *s, size_t len) {
+  job_t *job = s->job;
+  job_client_t *c;
+  uint64_t limit, start;
+  struct iovec iov[2];
+  int i, iovcnt;
+  size_t off;
+
+  /* Positions below this are no longer buffered after the read */
+  limit = s->rb.head + len;
+  limit = (limit > s->rb.capacity) ? (limit - s->rb.capacity) : 0;
+
+  for (c = job->clients; c != NULL; c = c->next) {
+    if (!c->in_frame || c->spill != NULL || c->frame_stream != (s - job->streams)) {
+      continue;
+    }
+
+    c->spill_off = (c->frame_off > sizeof(c->frame)) ? (c->frame_off - sizeof(c->frame)) : 0;
+    start = c->frame_pos + c->spill_off;
+    if (start >= limit) {
+      continue;
+    }
+
+    c->spill = malloc(c->frame_length - c->spill_off);
+    assert(c->spill != NULL);
+
+    iovcnt = job_buffer_iov(&s->rb, start, c->frame_length - c->spill_off, iov);
+    for (i = 0, off = 0; i < iovcnt; i++) {
+      memcpy(c->spill + off, iov[i].iov_base, iov[i].iov_len);
+      off += iov[i].iov_len;
+    }
+  }
+}
+
+/* Size of the next read of at most max bytes from a stream */
+static size_t job__read_len(job_stream_t *s, size_t max) {
+  size_t len;
+
+  len = MIN(s->chunk_size, s->rb.capacity - (s->rb.head & (s->rb.capacity - 1)));
+  return MIN(len, max);
+}
+
+/* Reads at most max bytes. Returns the number of bytes read, or -1 once the
+ * stream is closed or drained */
+static ssize_t job__read_stream(job_stream_t *s, size_t max) {
+  size_t len;
+  ssize_t rv;
+
+  len = job__read_len(s, max);
+  job__spill(s, len);
+
+  rv = job_buffer_read_fd(&s->rb, s->fd, len);
+  if (rv > 0) {
+    if (rv == len && s->chunk_size < s->max_chunk_size) {
+      s->chunk_size = MIN(2 * s->chunk_size, s->max_chunk_size);
+    }
+
+    return rv;
+  }
+
+  if (rv == 0 || errno != EAGAIN) {
+    job__close_stream(s);
+  }
+
+  return -1;
+}
+
+/* Reads what the pipe of an exited job holds, and closes it. Processes that
+ * inherited the pipe can keep it from ever emptying, so only the bytes
+ * pending now are read. */
+static void job__drain_stream(job_stream_t *s) {
+  size_t pending, len;
+  ssize_t rv;
+  int n;
+
+  if (ioctl(s->fd, FIONREAD, &n) == 0 && n >= 0) {
+    pending = n;
+  } else {
+    pending = s->rb.capacity;
+  }
+
+  while (s->fd != -1 && pending > 0) {
+    len = job__read_len(s, pending);
+
+    rv = job__read_stream(s, pending);
+    if (rv < (ssize_t)len) {
+      break;
+    }
+
+    pending -= rv;
+  }
+
+  if (s->fd != -1) {
+    job__close_stream(s);
+  }
+}
+
+static void job__stream_cb(loop_t *l, loop_watch_t *lw, int events) {
+  job_stream_t *s = (job_stream_t *)lw->data;
+  job_t *job = s->job;
+
+  job__read_stream(s, SIZE_MAX);
+  job__notify(job);
+}
+
+/* Child stdin is a file with the contents, so it never has to be fed */
+static int job__stdin(const uint8_t *data, size_t len) {
+  char path[] = "/tmp/wshd-stdin-XXXXXX";
+  ssize_t rv;
+  size_t off = 0;
+  int fd = -1;
+
+  if (data == NULL) {
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+
+#ifdef SYS_memfd_create
+  fd = syscall(SYS_memfd_create, "stdin", 1 /* MFD_CLOEXEC */);
+#endif
+
+  if (fd == -1) {
+    fd = mkstemp(path);
+    if (fd == -1) {
+      return -1;
+    }
+
+    unlink(path);
+    fcntl_mix_cloexec(fd);
+  }
+
+  while (off < len) {
+    rv = write(fd, data + off, len - off);
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      close(fd);
+      return -1;
+    }
+
+    off += rv;
+  }
+
+  if (lseek(fd, 0, SEEK_SET) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Copies a record value into a NUL-terminated string, rejecting embedded NULs */
+static char *job__string(const uint8_t *value, uint32_t len) {
+  if (memchr(value, '\0', len) != NULL) {
+    return NULL;
+  }
+
+  return strndup((const char *)value, len);
+}
+
+static char **job__append(char **list, int *count, char *str) {
+  list = realloc(list, sizeof(list[0]) * (*count + 2));
+  assert(list != NULL);
+
+  list[(*count)++] = str;
+  list[*count] = NULL;
+
+  return list;
+}
+
+static void job__free_list(char **list, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    free(list[i]);
+  }
+
+  free(list);
+}
+
+/* Returns NULL and describes the failure in error if the job can't be spawned */
+static job_t *jobs__spawn(jobs_t *js, const uint8_t *body, size_t len, char *error, size_t error_len) {
+  msg_request_t req;
+  char *user = NULL;
+  char **argv = NULL, **envp = NULL;
+  int argc = 0, envc = 0;
+  const uint8_t *stdin_data = NULL;
+  size_t stdin_len = 0;
+  size_t ring_buffer_size = JOB_DEFAULT_RING_BUFFER_SIZE;
+  size_t max_chunk_size = JOB_DEFAULT_CHUNK_SIZE;
+  int in = -1, out[2] = { -1, -1 }, err[2] = { -1, -1 };
+  size_t off = 0;
+  job_t *job = NULL;
+  char *str;
+  int i, rv;
+
+  msg_request_init(&req);
+  snprintf(error, error_len, "invalid request");
+
+  while (off < len) {
+    uint8_t tag;
+    uint32_t vlen;
+    const uint8_t *value;
+
+    if (len - off < 5) {
+      goto err;
+    }
+
+    tag = body[off];
+    vlen = job__get_u32(body + off + 1);
+    off += 5;
+
+    if (vlen > len - off) {
+      goto err;
+    }
+
+    value = body + off;
+    off += vlen;
+
+    switch (tag) {
+      case JOB_TAG_USER:
+        free(user);
+        user = job__string(value, vlen);
+        if (user == NULL || strlen(user) >= sizeof(req.user.name)) {
+          goto err;
+        }
+        break;
+
+      case JOB_TAG_ARG:
+      case JOB_TAG_ENV:
+        str = job__string(value, vlen);
+        if (str == NULL) {
+          goto err;
+        }
+
+        if (tag == JOB_TAG_ARG) {
+          argv = job__append(argv, &argc, str);
+        } else {
+          envp = job__append(envp, &envc, str);
+
+          if (strncmp(str, "LANG=", 5) == 0 && strlen(str + 5) >= sizeof(req.lang.lang)) {
+            goto err;
+          }
+        }
+        break;
+
+      case JOB_TAG_STDIN:
+        stdin_data = value;
+        stdin_len = vlen;
+        break;
+
+      case JOB_TAG_RING_BUFFER_SIZE:
+      case JOB_TAG_MAX_CHUNK_SIZE:
+        if (vlen != 4) {
+          goto err;
+        }
+
+        if (tag == JOB_TAG_RING_BUFFER_SIZE) {
+          ring_buffer_size = job__get_u32(value);
+          if (ring_buffer_size == 0 || ring_buffer_size > JOB_MAX_RING_BUFFER_SIZE) {
+            goto err;
+          }
+        } else {
+          max_chunk_size = job__get_u32(value);
+          if (max_chunk_size == 0 || max_chunk_size > JOB_MAX_CHUNK_SIZE) {
+            goto err;
+          }
+        }
+        break;
+
+      default:
+        /* Ignore what this version doesn't know about */
+        break;
+    }
+  }
+
+  msg_array_import(&req.arg, argc, (const char **)argv);
+
+  rv = msg_rlimit_import_env(&req.rlim, envp);
+  if (rv == -1) {
+    goto err;
+  }
+
+  rv = msg_user_import(&req.user, user);
+  if (rv == -1) {
+    goto err;
+  }
+
+  rv = msg_lang_import_env(&req.lang, envp);
+  if (rv == -1) {
+    goto err;
+  }
+
+  job = calloc(1, sizeof(*job));
+  assert(job != NULL);
+
+  job->js = js;
+
+  for (i = 0; i < 2; i++) {
+    job->streams[i].job = job;
+    job->streams[i].fd = -1;
+
+    if (job_buffer_init(&job->streams[i].rb, ring_buffer_size) == -1) {
+      snprintf(error, error_len, "malloc: %s", strerror(errno));
+      goto err;
+    }
+
+    job->streams[i].max_chunk_size = max_chunk_size;
+    job->streams[i].chunk_size = MIN(JOB_MIN_CHUNK_SIZE, max_chunk_size);
+  }
+
+  in = job__stdin(stdin_data, stdin_len);
+  if (in == -1) {
+    snprintf(error, error_len, "stdin: %s", strerror(errno));
+    goto err;
+  }
+
+  if (pipe(out) == -1 || pipe(err) == -1) {
+    snprintf(error, error_len, "pipe: %s", strerror(errno));
+    goto err;
+  }
+
+  for (i = 0; i < 2; i++) {
+    fcntl_mix_cloexec(out[i]);
+    fcntl_mix_cloexec(err[i]);
+  }
+
+  job->pid = js->fork_cb(&req, in, out[1], err[1]);
+  if (job->pid == -1) {
+    snprintf(error, error_len, "clone: %s", strerror(errno));
+    goto err;
+  }
+
+  msg_request_destroy(&req);
+
+  close(in);
+  close(out[1]);
+  close(err[1]);
+
+  job->streams[0].fd = out[0];
+  job->streams[1].fd = err[0];
+
+  for (i = 0; i < 2; i++) {
+    fcntl_mix_nonblock(job->streams[i].fd);
+    job->streams[i].lw = loop_add(js->l, job->streams[i].fd, LOOP_READ, job__stream_cb, &job->streams[i]);
+  }
+
+  /* Ids wrap around, skipping 0 and those still in use */
+  do {
+    job->id = js->next_id++;
+  } while (job->id == 0 || jobs__find(js, job->id) != NULL);
+
+  job->next = js->jobs;
+  js->jobs = job;
+
+  free(user);
+  job__free_list(argv, argc);
+  job__free_list(envp, envc);
+
+  return job;
+
+err:
+  if (in > -1) close(in);
+
+  for (i = 0; i < 2; i++) {
+    if (out[i] > -1) close(out[i]);
+    if (err[i] > -1) close(err[i]);
+  }
+
+  if (job != NULL) {
+    for (i = 0; i < 2; i++) {
+      job_buffer_destroy(&job->streams[i].rb);
+    }
+
+    free(job);
+  }
+
+  msg_request_destroy(&req);
+  free(user);
+  job__free_list(argv, argc);
+  job__free_list(envp, envc);
+
+  return NULL;
+}
+
+/* Writes the reply to a spawn request; returns 1 when done, -1 on error */
+static int job_client__reply(job_client_t *c) {
+  struct iovec iov;
+  ssize_t rv;
+
+  iov.iov_base = c->reply + c->reply_off;
+  iov.iov_len = c->reply_len - c->reply_off;
+
+  rv = job__sendv(c->fd, &iov, 1);
+  if (rv == -1) {
+    return -1;
+  }
+
+  c->reply_off += rv;
+
+  return (c->reply_off == c->reply_len) ? 1 : 0;
+}
+
+static void job_client__dispatch(job_client_t *c) {
+  jobs_t *js = c->js;
+  job_t *job;
+  uint32_t id;
+  char error[JOB_MAX_ERROR_LENGTH];
+  size_t error_len = 0;
+
+  switch (c->type) {
+    case JOB_REQUEST_SPAWN:
+      jobs__expire(js);
+
+      job = jobs__spawn(js, c->body, c->body_len, error, sizeof(error));
+      if (job == NULL) {
+        error_len = strlen(error);
+        memcpy(c->reply + JOB_HEADER_SIZE + 4, error, error_len);
+      }
+
+      c->reply_len = JOB_HEADER_SIZE + 4 + error_len;
+
+      job__put_u32(c->reply, JOB_MAGIC);
+      job__put_u32(c->reply + 4, JOB_VERSION);
+      job__put_u32(c->reply + 8, JOB_REQUEST_SPAWN);
+      job__put_u32(c->reply + 12, 4 + error_len);
+      job__put_u32(c->reply + 16, (job != NULL) ? job->id : 0);
+
+      c->state = JOB_CLIENT_REPLY;
+
+      if (job_client__reply(c) == 0) {
+        loop_modify(js->l, c->lw, LOOP_WRITE);
+      } else {
+        job_client__close(c);
+      }
+      return;
+
+    case JOB_REQUEST_ATTACH:
+      if (c->body_len != 20) {
+        job_client__close(c);
+        return;
+      }
+
+      id = job__get_u32(c->body);
+      job = jobs__find(js, id);
+      if (job == NULL) {
+        job_client__close(c);
+        return;
+      }
+
+      c->pos[0] = job__get_u64(c->body + 4);
+      c->pos[1] = job__get_u64(c->body + 12);
+
+      c->state = JOB_CLIENT_ATTACHED;
+      c->job = job;
+      c->next = job->clients;
+      job->clients = c;
+
+      job_client__service(c);
+      return;
+
+    case JOB_REQUEST_KILL:
+      if (c->body_len == 8) {
+        id = job__get_u32(c->body);
+        job = jobs__find(js, id);
+
+        /* Children are session leaders, see child_fork() */
+        if (job != NULL && !job->exited) {
+          kill(-job->pid, job__get_u32(c->body + 4));
+        }
+      }
+
+      job_client__close(c);
+      return;
+  }
+}
+
+/* Reads (the rest of) the request; returns 1 when complete, -1 on error */
+static int job_client__read(job_client_t *c) {
+  uint8_t *buf;
+  size_t len;
+  ssize_t rv;
+
+  if (c->header_off < sizeof(c->header)) {
+    buf = c->header + c->header_off;
+    len = sizeof(c->header) - c->header_off;
+  } else {
+    buf = c->body + c->body_off;
+    len = c->body_len - c->body_off;
+  }
+
+  if (len > 0) {
+    do {
+      rv = read(c->fd, buf, len);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1 && errno == EAGAIN) {
+      return 0;
+    }
+
+    if (rv <= 0) {
+      return -1;
+    }
+  } else {
+    rv = 0;
+  }
+
+  if (c->header_off < sizeof(c->header)) {
+    c->header_off += rv;
+
+    if (c->header_off < sizeof(c->header)) {
+      return 0;
+    }
+
+    if (job__get_u32(c->header) != JOB_MAGIC ||
+        job__get_u32(c->header + 4) != JOB_VERSION) {
+      return -1;
+    }
+
+    c->type = job__get_u32(c->header + 8);
+    c->body_len = job__get_u32(c->header + 12);
+
+    if (c->body_len > JOB_MAX_REQUEST_SIZE) {
+      return -1;
+    }
+
+    c->body = malloc(c->body_len + 1);
+    assert(c->body != NULL);
+  } else {
+    c->body_off += rv;
+  }
+
+  return (c->body_off == c->body_len) ? 1 : 0;
+}
+
+static void job_client__cb(loop_t *l, loop_watch_t *lw, int events) {
+  job_client_t *c = (job_client_t *)lw->data;
+  char buf[1];
+  int rv;
+
+  switch (c->state) {
+    case JOB_CLIENT_REQUEST:
+      rv = job_client__read(c);
+      if (rv == -1) {
+        job_client__close(c);
+      } else if (rv == 1) {
+        job_client__dispatch(c);
+      }
+      break;
+
+    case JOB_CLIENT_REPLY:
+      if (job_client__reply(c) != 0) {
+        job_client__close(c);
+      }
+      break;
+
+    case JOB_CLIENT_ATTACHED:
+      /* Clients don't send anything after the request, so this is a hangup */
+      if (events & LOOP_READ) {
+        rv = read(c->fd, buf, sizeof(buf));
+        if (rv != -1 || (errno != EAGAIN && errno != EINTR)) {
+          job_client__close(c);
+          break;
+        }
+      }
+
+      if (events & LOOP_WRITE) {
+        job_client__service(c);
+      }
+      break;
+  }
+}
+
+static void jobs__accept_cb(loop_t *l, loop_watch_t *lw, int events) {
+  jobs_t *js = (jobs_t *)lw->data;
+  job_client_t *c;
+  int fd;
+
+  fd = accept(js->fd, NULL, NULL);
+  if (fd == -1) {
+    if (errno != EAGAIN && errno != EINTR) {
+      perror("accept");
+    }
+    return;
+  }
+
+  fcntl_mix_cloexec(fd);
+  fcntl_mix_nonblock(fd);
+
+  c = calloc(1, sizeof(*c));
+  assert(c != NULL);
+
+  c->js = js;
+  c->fd = fd;
+  c->state = JOB_CLIENT_REQUEST;
+  c->lw = loop_add(l, fd, LOOP_READ, job_client__cb, c);
+}
+
+jobs_t *jobs_create(loop_t *l, int fd, jobs_fork_t fork_cb) {
+  jobs_t *js;
+
+  js = calloc(1, sizeof(*js));
+  assert(js != NULL);
+
+  js->l = l;
+  js->fd = fd;
+  js->fork_cb = fork_cb;
+  js->next_id = 1;
+
+  fcntl_mix_nonblock(fd);
+  js->lw = loop_add(l, fd, LOOP_READ, jobs__accept_cb, js);
+
+  return js;
+}
+
+int jobs_reap(jobs_t *js, pid_t pid, int status) {
+  job_t *job;
+  int i;
+
+  for (job = js->jobs; job != NULL; job = job->next) {
+    if (job->pid == pid && !job->exited) {
+      break;
+    }
+  }
+
+  if (job == NULL) {
+    return 0;
+  }
+
+  job->exited = 1;
+  job->status = status;
+  job->finished_at = job__now();
+
+  /* Take what the child left behind, but don't wait for processes that
+   * inherited its stdout or stderr */
+  for (i = 0; i < 2; i++) {
+    if (job->streams[i].fd != -1) {
+      job__drain_stream(&job->streams[i]);
+    }
+  }
+
+  /* The job stays around until a client has attached for its status */
+  job__notify(job);
+  jobs__expire(js);
+
+  return 1;
+}
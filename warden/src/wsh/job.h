@@ -0,0 +1,90 @@
+#ifndef JOB_H
+#define JOB_H 1
+
+#include <sys/types.h>
+
+#include "loop.h"
+#include "msg.h"
+
+/*
+ * Jobs are commands that wshd runs on behalf of clients of jobs.sock. Unlike
+ * commands started through wsh, their output is buffered by wshd itself and
+ * their exit status is retained until a client has collected it, so that
+ * clients can detach and attach at will without any process of their own in
+ * between. Finished jobs that no client collects are forgotten after
+ * JOB_RETENTION_SECS, or once more than JOB_MAX_RETAINED of them pile up.
+ *
+ * Every connection carries a single request. All integers are in network
+ * byte order. A request starts with a header:
+ *
+ *   magic (4 bytes) | version (4 bytes) | type (4 bytes) | length (4 bytes)
+ *
+ * followed by _length_ bytes of body, depending on _type_:
+ *
+ * JOB_REQUEST_SPAWN: a sequence of records, each made of a tag (1 byte), a
+ * length (4 bytes), and _length_ bytes of value (see JOB_TAG_*). wshd replies
+ * with a header of the same type, and a 4 byte job id as body. If the job
+ * can't be spawned, the id is 0 and is followed by a message saying why.
+ *
+ * JOB_REQUEST_ATTACH: job id (4 bytes) | stdout pos (8) | stderr pos (8).
+ * wshd replies with frames of output, each made of a header and _length_
+ * bytes of payload:
+ *
+ *   stream (1 byte) | reserved (3 bytes) | length (4 bytes) | pos (8 bytes)
+ *
+ * _pos_ is the stream position of the first payload byte. Output that is no
+ * longer buffered is skipped. The last frame is for JOB_STREAM_STATUS; its
+ * payload is the wait status of the job as a 4 byte integer, after which the
+ * connection is closed. The connection is closed right away for unknown jobs.
+ *
+ * JOB_REQUEST_KILL: job id (4 bytes) | signal (4 bytes). The signal is sent to
+ * the process group of the job, and the connection is closed.
+ */
+
+#define JOB_MAGIC   0x5753484a /* "WSHJ" */
+#define JOB_VERSION 1
+
+#define JOB_REQUEST_SPAWN  1
+#define JOB_REQUEST_ATTACH 2
+#define JOB_REQUEST_KILL   3
+
+#define JOB_HEADER_SIZE       16
+#define JOB_FRAME_HEADER_SIZE 16
+
+/* Upper bound on the body of a request, which includes the script */
+#define JOB_MAX_REQUEST_SIZE (16 * 1024 * 1024)
+
+/* Upper bound on the payload of a single frame */
+#define JOB_MAX_FRAME_LENGTH (64 * 1024)
+
+/* Upper bound on the message of a failed spawn */
+#define JOB_MAX_ERROR_LENGTH 256
+
+/* Bounds on finished jobs whose exit status no client has collected */
+#define JOB_RETENTION_SECS (60 * 60)
+#define JOB_MAX_RETAINED   256
+
+#define JOB_TAG_USER             1 /* User to run as, defaults to root */
+#define JOB_TAG_ARG              2 /* Repeated, argv of the command */
+#define JOB_TAG_ENV              3 /* Repeated, KEY=VALUE; RLIMIT_* and LANG */
+#define JOB_TAG_STDIN            4 /* Contents of stdin */
+#define JOB_TAG_RING_BUFFER_SIZE 5 /* 4 bytes, output retained per stream */
+#define JOB_TAG_MAX_CHUNK_SIZE   6 /* 4 bytes, upper bound for reads */
+
+#define JOB_STREAM_STDOUT 0
+#define JOB_STREAM_STDERR 1
+#define JOB_STREAM_STATUS 2
+
+typedef struct jobs_s jobs_t;
+
+/* Forks a child with the given stdio, see child_fork() in wshd.c. Returns
+ * the pid of the child, or -1 with errno set */
+typedef int (*jobs_fork_t)(msg_request_t *req, int in, int out, int err);
+
+/* Starts serving jobs.sock, listening on fd */
+jobs_t *jobs_create(loop_t *l, int fd, jobs_fork_t fork_cb);
+
+/* Records the exit of pid; returns 1 if pid belongs to a job, 0 otherwise */
+int jobs_reap(jobs_t *js, pid_t pid, int status);
+
+#endif
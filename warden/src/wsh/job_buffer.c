@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#include "job_buffer.h"
+
+int job_buffer_init(job_buffer_t *rb, size_t capacity) {
+  size_t rounded = 1;
+
+  assert(capacity > 0);
+
+  /* Round up, so that positions map to offsets with a mask */
+  while (rounded < capacity) {
+    rounded <<= 1;
+  }
+
+  rb->data = malloc(rounded);
+  if (rb->data == NULL) {
+    return -1;
+  }
+
+  rb->capacity = rounded;
+  rb->head = 0;
+
+  return 0;
+}
+
+void job_buffer_destroy(job_buffer_t *rb) {
+  free(rb->data);
+  rb->data = NULL;
+}
+
+uint64_t job_buffer_tail(job_buffer_t *rb) {
+  return (rb->head > rb->capacity) ? (rb->head - rb->capacity) : 0;
+}
+
+ssize_t job_buffer_read_fd(job_buffer_t *rb, int fd, size_t max) {
+  size_t off = rb->head & (rb->capacity - 1);
+  ssize_t rv;
+
+  /* Only read what fits before wrapping around */
+  do {
+    rv = read(fd, rb->data + off, MIN(max, rb->capacity - off));
+  } while (rv == -1 && errno == EINTR);
+
+  if (rv > 0) {
+    rb->head += rv;
+  }
+
+  return rv;
+}
+
+int job_buffer_iov(job_buffer_t *rb, uint64_t pos, size_t size, struct iovec iov[2]) {
+  size_t off;
+  size_t nfirst;
+
+  assert(pos >= job_buffer_tail(rb));
+  assert(pos <= rb->head);
+
+  size = MIN(size, rb->head - pos);
+  if (size == 0) {
+    return 0;
+  }
+
+  off = pos & (rb->capacity - 1);
+  nfirst = MIN(size, rb->capacity - off);
+
+  iov[0].iov_base = rb->data + off;
+  iov[0].iov_len = nfirst;
+
+  if (nfirst == size) {
+    return 1;
+  }
+
+  iov[1].iov_base = rb->data;
+  iov[1].iov_len = size - nfirst;
+
+  return 2;
+}
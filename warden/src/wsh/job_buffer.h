@@ -0,0 +1,39 @@
+#ifndef JOB_BUFFER_H
+#define JOB_BUFFER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Fixed size buffer that retains the most recent output of a job. Data is
+ * addressed by stream position: the number of bytes written to the buffer
+ * before it. Writes never block; they overwrite the oldest data instead.
+ */
+
+typedef struct job_buffer_s job_buffer_t;
+
+struct job_buffer_s {
+  /* Always a power of two */
+  size_t capacity;
+
+  /* Position one past the newest byte */
+  uint64_t head;
+
+  uint8_t *data;
+};
+
+int job_buffer_init(job_buffer_t *rb, size_t capacity);
+void job_buffer_destroy(job_buffer_t *rb);
+
+/* Position of the oldest byte that is still buffered */
+uint64_t job_buffer_tail(job_buffer_t *rb);
+
+/* Reads at most max bytes from fd straight into the buffer (see read(2)) */
+ssize_t job_buffer_read_fd(job_buffer_t *rb, int fd, size_t max);
+
+/* Describes up to size buffered bytes starting at pos; returns #segments */
+int job_buffer_iov(job_buffer_t *rb, uint64_t pos, size_t size, struct iovec iov[2]);
+
+#endif
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+#include "loop.h"
+
+/* Number of events collected per call to epoll_wait */
+#define LOOP_MAX_EVENTS 256
+
+void loop_init(loop_t *l) {
+  l->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (l->epfd == -1) {
+    perror("epoll_create1");
+    abort();
+  }
+
+  l->removed = NULL;
+}
+
+static void loop__ctl(loop_t *l, loop_watch_t *lw, int events) {
+  struct epoll_event ev;
+  int op;
+  int rv;
+
+  /*
+   * A hangup is reported even when no events are requested, so a watch that
+   * is not interested in anything is taken out of the set instead.
+   */
+  if (events == 0) {
+    if (lw->registered) {
+      rv = epoll_ctl(l->epfd, EPOLL_CTL_DEL, lw->fd, NULL);
+      if (rv == -1) {
+        perror("epoll_ctl");
+        abort();
+      }
+
+      lw->registered = 0;
+    }
+
+    return;
+  }
+
+  ev.events = 0;
+  ev.data.ptr = lw;
+
+  if (events & LOOP_READ) {
+    ev.events |= EPOLLIN;
+  }
+
+  if (events & LOOP_WRITE) {
+    ev.events |= EPOLLOUT;
+  }
+
+  op = lw->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+  rv = epoll_ctl(l->epfd, op, lw->fd, &ev);
+  if (rv == -1) {
+    perror("epoll_ctl");
+    abort();
+  }
+
+  lw->registered = 1;
+}
+
+loop_watch_t *loop_add(loop_t *l, int fd, int events, loop_cb_t cb, void *data) {
+  loop_watch_t *lw;
+
+  assert(fd >= 0);
+
+  lw = calloc(1, sizeof(*lw));
+  assert(lw != NULL);
+
+  lw->fd = fd;
+  lw->cb = cb;
+  lw->data = data;
+
+  loop_modify(l, lw, events);
+
+  return lw;
+}
+
+void loop_modify(loop_t *l, loop_watch_t *lw, int events) {
+  assert(!lw->removed);
+
+  if (lw->events != events || (events != 0 && !lw->registered)) {
+    loop__ctl(l, lw, events);
+  }
+
+  lw->events = events;
+}
+
+void loop_remove(loop_t *l, loop_watch_t *lw) {
+  assert(!lw->removed);
+
+  loop__ctl(l, lw, 0);
+
+  /* Events for this watch may still be pending in the current round */
+  lw->removed = 1;
+  lw->next_removed = l->removed;
+  l->removed = lw;
+}
+
+static void loop__collect(loop_t *l) {
+  loop_watch_t *lw;
+
+  while ((lw = l->removed) != NULL) {
+    l->removed = lw->next_removed;
+    free(lw);
+  }
+}
+
+void loop_run_once(loop_t *l) {
+  struct epoll_event evs[LOOP_MAX_EVENTS];
+  loop_watch_t *lw;
+  int events;
+  int i;
+  int rv;
+
+  do {
+    rv = epoll_wait(l->epfd, evs, LOOP_MAX_EVENTS, -1);
+  } while (rv == -1 && errno == EINTR);
+
+  if (rv == -1) {
+    perror("epoll_wait");
+    abort();
+  }
+
+  for (i = 0; i < rv; i++) {
+    lw = evs[i].data.ptr;
+
+    if (lw->removed) {
+      continue;
+    }
+
+    events = 0;
+
+    if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      events |= LOOP_READ;
+    }
+
+    if (evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+      events |= LOOP_WRITE;
+    }
+
+    /* Only report what the watch currently asks for */
+    events &= lw->events;
+
+    if (events) {
+      lw->cb(l, lw, events);
+    }
+  }
+
+  loop__collect(l);
+}
@@ -0,0 +1,46 @@
+#ifndef LOOP_H
+#define LOOP_H 1
+
+/*
+ * Minimal epoll based event loop that dispatches readiness of file
+ * descriptors to callbacks. Watches can be added, modified and removed from
+ * within callbacks. A hangup or error is reported as readiness for whatever
+ * the watch is interested in.
+ */
+
+#define LOOP_READ  1
+#define LOOP_WRITE 2
+
+typedef struct loop_s loop_t;
+typedef struct loop_watch_s loop_watch_t;
+
+typedef void (*loop_cb_t)(loop_t *l, loop_watch_t *lw, int events);
+
+struct loop_watch_s {
+  int fd;
+  int events;
+  loop_cb_t cb;
+  void *data;
+
+  /* Whether fd is in the epoll set; it is not while events is 0 */
+  int registered;
+
+  /* Removed watches are freed after the current round of callbacks */
+  int removed;
+  loop_watch_t *next_removed;
+};
+
+struct loop_s {
+  int epfd;
+  loop_watch_t *removed;
+};
+
+void loop_init(loop_t *l);
+loop_watch_t *loop_add(loop_t *l, int fd, int events, loop_cb_t cb, void *data);
+void loop_modify(loop_t *l, loop_watch_t *lw, int events);
+void loop_remove(loop_t *l, loop_watch_t *lw);
+
+/* Waits for at least one watch to become ready and runs its callback */
+void loop_run_once(loop_t *l);
+
+#endif
@@ -1,7 +1,9 @@
 #define _GNU_SOURCE
 
+#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,18 +18,21 @@ int msg_array_import(msg__array_t * a, int count, const char ** ptr) {
   size_t len = 0;
   int i;
 
-  a->count = count;
-  memset(a->buf, 0, sizeof(a->buf));
-
   for (i = 0; i < count; i++) {
-    len = strlen(ptr[i]);
+    len += strlen(ptr[i]) + 1;
+  }
 
-    if ((sizeof(a->buf) - off) < (len + 1)) {
-      return -1;
-    }
+  free(a->buf);
+
+  a->count = count;
+  a->len = len;
+  a->buf = malloc(len + 1);
+  assert(a->buf != NULL);
 
+  for (i = 0; i < count; i++) {
+    len = strlen(ptr[i]) + 1;
     memcpy(a->buf + off, ptr[i], len);
-    off += len + 1;
+    off += len;
   }
 
   return 0;
@@ -79,28 +84,50 @@ static struct {
 
 #undef _R
 
+static const char *msg__getenv(char **envp, const char *name) {
+  size_t len = strlen(name);
+  int i;
+
+  if (envp == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; envp[i] != NULL; i++) {
+    if (strncmp(envp[i], name, len) == 0 && envp[i][len] == '=') {
+      return envp[i] + len + 1;
+    }
+  }
+
+  return NULL;
+}
+
 int msg_rlimit_import(msg__rlimit_t *r) {
+  return msg_rlimit_import_env(r, environ);
+}
+
+int msg_rlimit_import_env(msg__rlimit_t *r, char **envp) {
   int i;
   struct rlimit rlim;
-  char *value;
+  const char *value;
   int rv;
 
   r->count = 0;
   memset(r->rlim, 0, sizeof(r->rlim));
 
   for (i = 0; i < (sizeof(rlimits)/sizeof(rlimits[0])); i++) {
-    rlim = rlimits[i].rlim;
-    value = getenv(rlimits[i].name);
-    if (value != NULL) {
-      rv = sscanf(value, "%ld %ld", &rlim.rlim_cur, &rlim.rlim_max);
-      if (rv > 0) {
-        if (rv == 1) {
-          rlim.rlim_max = rlim.rlim_cur;
-        }
-      } else {
-        errno = EINVAL;
-        return -1;
+    value = msg__getenv(envp, rlimits[i].name);
+    if (value == NULL) {
+      continue;
+    }
+
+    rv = sscanf(value, "%ld %ld", &rlim.rlim_cur, &rlim.rlim_max);
+    if (rv > 0) {
+      if (rv == 1) {
+        rlim.rlim_max = rlim.rlim_cur;
       }
+    } else {
+      errno = EINVAL;
+      return -1;
     }
 
     r->rlim[r->count].id = rlimits[i].id;
@@ -111,19 +138,23 @@ int msg_rlimit_import(msg__rlimit_t *r) {
   return 0;
 }
 
-int msg_rlimit_export(msg__rlimit_t *r) {
-  int i;
-  int rv;
+void msg_rlimit_resolve(msg__rlimit_t *r, msg__rlimit_t *out) {
+  int i, j;
+
+  out->count = 0;
 
-  for (i = 0; i < r->count; i++) {
-    rv = setrlimit(r->rlim[i].id, &r->rlim[i].rlim);
-    if (rv == -1) {
-      fprintf(stderr, "%d\n", r->rlim[i].id);
-      return rv;
+  for (i = 0; i < (sizeof(rlimits)/sizeof(rlimits[0])); i++) {
+    out->rlim[i].id = rlimits[i].id;
+    out->rlim[i].rlim = rlimits[i].rlim;
+
+    for (j = 0; j < r->count; j++) {
+      if (r->rlim[j].id == rlimits[i].id) {
+        out->rlim[i].rlim = r->rlim[j].rlim;
+      }
     }
-  }
 
-  return 0;
+    out->count++;
+  }
 }
 
 int msg_user_import(msg__user_t *u, const char *name) {
@@ -137,28 +168,14 @@ int msg_user_import(msg__user_t *u, const char *name) {
   return 0;
 }
 
-int msg_user_export(msg__user_t *u, struct passwd *pw) {
-  ((void) u);
-
-  int rv;
-
-  rv = setgid(pw->pw_gid);
-  if (rv == -1) {
-    return rv;
-  }
-
-  rv = setuid(pw->pw_uid);
-  if (rv == -1) {
-    return rv;
-  }
-
-  return 0;
+int msg_lang_import(msg__lang_t *l) {
+  return msg_lang_import_env(l, environ);
 }
 
-int msg_lang_import(msg__lang_t *l) {
+int msg_lang_import_env(msg__lang_t *l, char **envp) {
   int rv;
 
-  char *lang = getenv("LANG");
+  const char *lang = msg__getenv(envp, "LANG");
   if (lang != NULL) {
     rv = snprintf(l->lang, sizeof(l->lang), "%s", lang);
     assert(rv < sizeof(l->lang));
@@ -167,32 +184,253 @@ int msg_lang_import(msg__lang_t *l) {
   return 0;
 }
 
-int msg_lang_export(msg__lang_t *l, msg__lang_t *lang) {
+int msg_copy_import(msg__copy_t *c, int mode, const char *path) {
   int rv;
 
-  lang->lang[0] = '\0';
-
-  if (l != NULL) {
-    if (strnlen(l->lang, sizeof(l->lang)) >= sizeof(l->lang)) {
-      errno = EINVAL;
-      rv = -1;
-    } else {
-      memcpy(lang, l, sizeof(*lang));
-      rv = 0;
-    }
+  rv = snprintf(c->path, sizeof(c->path), "%s", path);
+  if (rv >= sizeof(c->path)) {
+    errno = ENAMETOOLONG;
+    return -1;
   }
 
-  return rv;
+  c->mode = mode;
+
+  return 0;
 }
 
 void msg_request_init(msg_request_t *req) {
-  assert(sizeof(msg_request_t) <= MSG_MAX_SIZE);
   memset(req, 0, sizeof(*req));
   req->version = MSG_VERSION;
 }
 
+void msg_request_destroy(msg_request_t *req) {
+  free(req->arg.buf);
+  req->arg.buf = NULL;
+}
+
 void msg_response_init(msg_response_t *res) {
-  assert(sizeof(msg_response_t) <= MSG_MAX_SIZE);
   memset(res, 0, sizeof(*res));
   res->version = MSG_VERSION;
 }
+
+static char *msg__put_u32(char *p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static char *msg__put_u64(char *p, uint64_t v) {
+  p = msg__put_u32(p, v >> 32);
+  return msg__put_u32(p, v & 0xffffffff);
+}
+
+static uint32_t msg__get_u32(const char *p) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static uint64_t msg__get_u64(const char *p) {
+  return ((uint64_t)msg__get_u32(p) << 32) | msg__get_u32(p + 4);
+}
+
+static char *msg__put_record(char *p, int tag, const char *value, size_t len) {
+  *p++ = tag;
+  p = msg__put_u32(p, len);
+  memcpy(p, value, len);
+  return p + len;
+}
+
+#define MSG__RECORD_SIZE(len) (5 + (len))
+#define MSG__RLIMIT_SIZE      20
+#define MSG__COPY_SIZE(len)   (4 + (len))
+
+int msg_request_encode(msg_request_t *req, char **buf, size_t *len) {
+  char rlimit[MSG__RLIMIT_SIZE];
+  char copy[MSG__COPY_SIZE(PATH_MAX)];
+  const char *arg;
+  size_t size = 0;
+  char *p;
+  int i;
+
+  if (req->tty) {
+    size += MSG__RECORD_SIZE(0);
+  }
+
+  /* Every argument is a record of its own, without its terminator */
+  size += req->arg.len - req->arg.count + MSG__RECORD_SIZE(0) * req->arg.count;
+  size += MSG__RECORD_SIZE(MSG__RLIMIT_SIZE) * req->rlim.count;
+
+  if (strlen(req->user.name)) {
+    size += MSG__RECORD_SIZE(strlen(req->user.name));
+  }
+
+  if (strlen(req->lang.lang)) {
+    size += MSG__RECORD_SIZE(strlen(req->lang.lang));
+  }
+
+  if (req->copy.mode != MSG_COPY_NONE) {
+    size += MSG__RECORD_SIZE(MSG__COPY_SIZE(strlen(req->copy.path)));
+  }
+
+  if (size > MSG_MAX_SIZE) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  *buf = malloc(MSG_HEADER_SIZE + size);
+  assert(*buf != NULL);
+
+  p = msg__put_u32(*buf, req->version);
+  p = msg__put_u32(p, size);
+
+  if (req->tty) {
+    p = msg__put_record(p, MSG_TAG_TTY, NULL, 0);
+  }
+
+  for (i = 0, arg = req->arg.buf; i < req->arg.count; i++) {
+    p = msg__put_record(p, MSG_TAG_ARG, arg, strlen(arg));
+    arg += strlen(arg) + 1;
+  }
+
+  for (i = 0; i < req->rlim.count; i++) {
+    msg__put_u32(rlimit, req->rlim.rlim[i].id);
+    msg__put_u64(rlimit + 4, req->rlim.rlim[i].rlim.rlim_cur);
+    msg__put_u64(rlimit + 12, req->rlim.rlim[i].rlim.rlim_max);
+    p = msg__put_record(p, MSG_TAG_RLIMIT, rlimit, sizeof(rlimit));
+  }
+
+  if (strlen(req->user.name)) {
+    p = msg__put_record(p, MSG_TAG_USER, req->user.name, strlen(req->user.name));
+  }
+
+  if (strlen(req->lang.lang)) {
+    p = msg__put_record(p, MSG_TAG_LANG, req->lang.lang, strlen(req->lang.lang));
+  }
+
+  if (req->copy.mode != MSG_COPY_NONE) {
+    msg__put_u32(copy, req->copy.mode);
+    memcpy(copy + 4, req->copy.path, strlen(req->copy.path));
+    p = msg__put_record(p, MSG_TAG_COPY, copy, MSG__COPY_SIZE(strlen(req->copy.path)));
+  }
+
+  assert(p == *buf + MSG_HEADER_SIZE + size);
+  *len = MSG_HEADER_SIZE + size;
+
+  return 0;
+}
+
+int msg_request_decode(msg_request_t *req, const char *buf, size_t len) {
+  msg__array_t *a = &req->arg;
+  size_t off = 0;
+  size_t vlen;
+  const char *value;
+  int tag;
+  int id;
+
+  msg_request_init(req);
+
+  /* Arguments are appended as they come, sizing for the worst case */
+  a->buf = malloc(len + 1);
+  assert(a->buf != NULL);
+
+  while (off < len) {
+    if (len - off < MSG__RECORD_SIZE(0)) {
+      goto err;
+    }
+
+    tag = (unsigned char)buf[off];
+    vlen = msg__get_u32(buf + off + 1);
+    off += MSG__RECORD_SIZE(0);
+
+    if (vlen > len - off) {
+      goto err;
+    }
+
+    value = buf + off;
+    off += vlen;
+
+    /* Strings can't contain their terminator */
+    if (tag != MSG_TAG_RLIMIT && tag != MSG_TAG_COPY && memchr(value, '\0', vlen) != NULL) {
+      goto err;
+    }
+
+    switch (tag) {
+      case MSG_TAG_TTY:
+        req->tty = 1;
+        break;
+
+      case MSG_TAG_ARG:
+        memcpy(a->buf + a->len, value, vlen);
+        a->buf[a->len + vlen] = '\0';
+        a->len += vlen + 1;
+        a->count++;
+        break;
+
+      case MSG_TAG_RLIMIT:
+        if (vlen != MSG__RLIMIT_SIZE || req->rlim.count == RLIMIT_NLIMITS) {
+          goto err;
+        }
+
+        id = msg__get_u32(value);
+        if (id < 0 || id >= RLIMIT_NLIMITS) {
+          goto err;
+        }
+
+        req->rlim.rlim[req->rlim.count].id = id;
+        req->rlim.rlim[req->rlim.count].rlim.rlim_cur = msg__get_u64(value + 4);
+        req->rlim.rlim[req->rlim.count].rlim.rlim_max = msg__get_u64(value + 12);
+        req->rlim.count++;
+        break;
+
+      case MSG_TAG_USER:
+        if (vlen >= sizeof(req->user.name)) {
+          goto err;
+        }
+
+        memcpy(req->user.name, value, vlen);
+        req->user.name[vlen] = '\0';
+        break;
+
+      case MSG_TAG_LANG:
+        if (vlen >= sizeof(req->lang.lang)) {
+          goto err;
+        }
+
+        memcpy(req->lang.lang, value, vlen);
+        req->lang.lang[vlen] = '\0';
+        break;
+
+      case MSG_TAG_COPY:
+        if (vlen < MSG__COPY_SIZE(0) || vlen >= MSG__COPY_SIZE(sizeof(req->copy.path))) {
+          goto err;
+        }
+
+        /* The path is a string of its own */
+        if (memchr(value + 4, '\0', vlen - 4) != NULL) {
+          goto err;
+        }
+
+        req->copy.mode = msg__get_u32(value);
+        if (req->copy.mode != MSG_COPY_IN && req->copy.mode != MSG_COPY_OUT) {
+          goto err;
+        }
+
+        memcpy(req->copy.path, value + 4, vlen - 4);
+        req->copy.path[vlen - 4] = '\0';
+        break;
+
+      default:
+        /* Ignore what this version doesn't know about */
+        break;
+    }
+  }
+
+  return 0;
+
+err:
+  msg_request_destroy(req);
+  errno = EINVAL;
+  return -1;
+}
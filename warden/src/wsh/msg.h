@@ -1,9 +1,38 @@
 #ifndef MSG_H
 #define MSG_H 1
 
-#define MSG_VERSION 1
-#define MSG_MAX_SIZE (16 * 1024)
-
+/*
+ * Requests are encoded as a header followed by a sequence of records, so that
+ * only fields that are set go over the socket. All integers are in network
+ * byte order. The header is:
+ *
+ *   version (4 bytes) | length (4 bytes)
+ *
+ * followed by _length_ bytes of records, each made of a tag (1 byte), a length
+ * (4 bytes), and _length_ bytes of value (see MSG_TAG_*). wshd closes the
+ * connection when _version_ is not MSG_VERSION.
+ */
+
+#define MSG_VERSION 2
+
+#define MSG_HEADER_SIZE 8
+
+/* Upper bound on the records of a request */
+#define MSG_MAX_SIZE (4 * 1024 * 1024)
+
+#define MSG_TAG_TTY    1 /* No value, request a pty */
+#define MSG_TAG_ARG    2 /* Repeated, argv of the command */
+#define MSG_TAG_RLIMIT 3 /* Repeated, id (4 bytes) | cur (8) | max (8) */
+#define MSG_TAG_USER   4 /* User to run as */
+#define MSG_TAG_LANG   5 /* Value for LANG */
+#define MSG_TAG_COPY   6 /* mode (4 bytes) | path, see copy.h */
+
+#define MSG_COPY_NONE 0
+#define MSG_COPY_IN   1 /* Extract the archive read from stdin into path */
+#define MSG_COPY_OUT  2 /* Write an archive of path to stdout */
+
+#include <limits.h>
+#include <stddef.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -13,14 +42,17 @@ typedef struct msg__array_s msg__array_t;
 typedef struct msg__rlimit_s msg__rlimit_t;
 typedef struct msg__user_s msg__user_t;
 typedef struct msg__lang_s msg__lang_t;
+typedef struct msg__copy_s msg__copy_t;
 typedef struct msg_request_s msg_request_t;
 typedef struct msg_response_s msg_response_t;
 
 struct msg__array_s {
   int count;
-  char buf[8 * 1024];
+  size_t len;
+  char *buf;
 };
 
+/* Only limits that were set, see msg_rlimit_resolve() */
 struct msg__rlimit_s {
   int count;
   struct {
@@ -37,6 +69,12 @@ struct msg__lang_s {
   char lang[1024];
 };
 
+/* Copies files instead of running a command when mode is set */
+struct msg__copy_s {
+  int mode;
+  char path[PATH_MAX];
+};
+
 struct msg_request_s {
   int version;
   int tty;
@@ -44,6 +82,7 @@ struct msg_request_s {
   msg__rlimit_t rlim;
   msg__user_t user;
   msg__lang_t lang;
+  msg__copy_t copy;
 };
 
 struct msg_response_s {
@@ -54,15 +93,26 @@ int msg_array_import(msg__array_t * a, int count, const char ** ptr);
 const char ** msg_array_export(msg__array_t * a);
 
 int msg_rlimit_import(msg__rlimit_t *);
-int msg_rlimit_export(msg__rlimit_t *);
+int msg_rlimit_import_env(msg__rlimit_t *, char **envp);
+
+/* Fills out with every limit, using defaults for those that were not set */
+void msg_rlimit_resolve(msg__rlimit_t *r, msg__rlimit_t *out);
 
 int msg_user_import(msg__user_t *u, const char *name);
-int msg_user_export(msg__user_t *u, struct passwd *pw);
 
 int msg_lang_import(msg__lang_t *l);
-int msg_lang_export(msg__lang_t *l, msg__lang_t *lang);
+int msg_lang_import_env(msg__lang_t *l, char **envp);
+
+int msg_copy_import(msg__copy_t *c, int mode, const char *path);
 
 void msg_request_init(msg_request_t *req);
+void msg_request_destroy(msg_request_t *req);
 void msg_response_init(msg_response_t *res);
 
+/* Encodes req including its header into a newly allocated buffer */
+int msg_request_encode(msg_request_t *req, char **buf, size_t *len);
+
+/* Decodes the records of a request, whose header was already validated */
+int msg_request_decode(msg_request_t *req, const char *buf, size_t len);
+
 #endif
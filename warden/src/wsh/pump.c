@@ -5,18 +5,58 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "pump.h"
 #include "util.h"
 
+#define PUMP_CHUNK_SIZE (64 * 1024)
+
 void pump_init(pump_t *p) {
-  p->nfd = 0;
+  p->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (p->epfd == -1) {
+    perror("epoll_create1");
+    abort();
+  }
 
-  FD_ZERO(&p->rfds);
-  FD_ZERO(&p->wfds);
-  FD_ZERO(&p->efds);
+  p->nalways = 0;
+}
+
+/* Returns -1 if fd can't be polled, like regular files and /dev/null */
+static int pump__add(pump_t *p, int fd, void *data) {
+  struct epoll_event ev;
+  int rv;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = data;
+
+  rv = epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev);
+  if (rv == -1) {
+    if (errno == EPERM) {
+      return -1;
+    }
+
+    perror("epoll_ctl");
+    abort();
+  }
+
+  return 0;
+}
+
+void pump_add_fd(pump_t *p, int fd, void *data) {
+  int rv;
+
+  rv = pump__add(p, fd, data);
+  assert(rv == 0);
+}
+
+static int pump__is_pipe(int fd) {
+  struct stat st;
+
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
 }
 
 void pump_pair_init(pump_pair_t *pp, pump_t *p, int rfd, int wfd) {
@@ -29,107 +69,90 @@ void pump_pair_init(pump_pair_t *pp, pump_t *p, int rfd, int wfd) {
    * Therefore, simply configure both sides to be blocking. */
   fcntl_set_nonblock(rfd, 0);
   fcntl_set_nonblock(wfd, 0);
+
+  /* splice needs a pipe on at least one side */
+  pp->splice = pump__is_pipe(rfd) || pump__is_pipe(wfd);
+
+  if (pump__add(p, rfd, pp) == -1) {
+    assert(p->nalways < PUMP_MAX_ALWAYS);
+    p->always[p->nalways++] = pp;
+  }
 }
 
-void pump_pair_close(pump_pair_t *pp) {
+static void pump_pair_close(pump_pair_t *pp) {
+  pump_t *p = pp->p;
+  int i;
+
+  for (i = 0; i < p->nalways; i++) {
+    if (p->always[i] == pp) {
+      p->always[i] = p->always[--p->nalways];
+      break;
+    }
+  }
+
+  /* Fails for descriptors that were never added, which is fine */
+  epoll_ctl(p->epfd, EPOLL_CTL_DEL, pp->rfd, NULL);
+
   close(pp->rfd);
   pp->rfd = -1;
   close(pp->wfd);
   pp->wfd = -1;
 }
 
-int pump_add_fd(pump_t *p, int fd, int mode) {
-  if (fd < 0) {
-    return 0;
-  }
+int pump_wait(pump_t *p, void **ready, int nready, int timeout) {
+  struct epoll_event evs[16];
+  int i, n, rv;
 
-  if (fd > p->nfd) {
-    p->nfd = fd;
-  }
+  n = 0;
 
-  if (mode & PUMP_READ) {
-    FD_SET(fd, &p->rfds);
+  for (i = 0; i < p->nalways && n < nready; i++) {
+    ready[n++] = p->always[i];
   }
 
-  if (mode & PUMP_WRITE) {
-    FD_SET(fd, &p->wfds);
+  if (n > 0) {
+    timeout = 0;
   }
 
-  if (mode & PUMP_EXCEPT) {
-    FD_SET(fd, &p->efds);
+  if (nready - n > sizeof(evs) / sizeof(evs[0])) {
+    nready = n + sizeof(evs) / sizeof(evs[0]);
   }
 
-  return 1;
-}
-
-int pump_add_pair(pump_t *p, pump_pair_t *pp) {
-  int j = 0;
-
-  j += pump_add_fd(p, pp->rfd, PUMP_READ | PUMP_EXCEPT);
-  j += pump_add_fd(p, pp->wfd, PUMP_WRITE | PUMP_EXCEPT);
-
-  return j;
-}
-
-int pump_ready(pump_t *p, int fd, int mode) {
-  int rv = 0;
-
-  if (mode & PUMP_READ) {
-    rv |= FD_ISSET(fd, &p->rfds);
-  }
+  do {
+    rv = epoll_wait(p->epfd, evs, nready - n, timeout);
+  } while (rv == -1 && errno == EINTR);
 
-  if (mode & PUMP_WRITE) {
-    rv |= FD_ISSET(fd, &p->wfds);
+  if (rv == -1) {
+    perror("epoll_wait");
+    abort();
   }
 
-  if (mode & PUMP_EXCEPT) {
-    rv |= FD_ISSET(fd, &p->efds);
+  for (i = 0; i < rv; i++) {
+    ready[n++] = evs[i].data.ptr;
   }
 
-  return rv;
+  return n;
 }
 
-int pump_select(pump_t *p) {
-  return select(FD_SETSIZE, &p->rfds, NULL, &p->efds, NULL);
-}
-
-int pump_pair_splice(pump_pair_t *pp) {
+static int pump_pair_splice(pump_pair_t *pp) {
   int rv;
 
-  if (!FD_ISSET(pp->rfd, &pp->p->rfds)) {
-    return 0;
-  }
-
-  if (!FD_ISSET(pp->wfd, &pp->p->wfds)) {
-    return 0;
-  }
-
-  rv = splice(pp->rfd, NULL, pp->wfd, NULL, 64 * 1024, SPLICE_F_NONBLOCK);
-  if (rv == -1) {
-    perror("splice");
-    exit(1);
-  } else if (rv == 0) {
-    pump_pair_close(pp);
-  }
+  do {
+    rv = splice(pp->rfd, NULL, pp->wfd, NULL, PUMP_CHUNK_SIZE, SPLICE_F_MOVE);
+  } while (rv == -1 && errno == EINTR);
 
   return rv;
 }
 
-int pump_pair_copy(pump_pair_t *pp) {
-  char buf[64 * 1024];
+static int pump_pair_copy(pump_pair_t *pp) {
+  char buf[PUMP_CHUNK_SIZE];
   char *ptr = buf;
   int nr, nw;
 
-  if (!FD_ISSET(pp->rfd, &pp->p->rfds)) {
-    return 0;
-  }
-
   do {
     nr = read(pp->rfd, buf, sizeof(buf));
   } while (nr == -1 && errno == EINTR);
 
   if (nr <= 0) {
-    pump_pair_close(pp);
     return nr;
   }
 
@@ -139,13 +162,60 @@ int pump_pair_copy(pump_pair_t *pp) {
     } while (nw == -1 && errno == EINTR);
 
     if (nw <= 0) {
-      pump_pair_close(pp);
-      return nw;
+      return -1;
     }
 
     ptr += nw;
     nr -= nw;
   }
 
-  return 0;
+  return ptr - buf;
+}
+
+/* Moves whatever is available from rfd to wfd, closing both on EOF or error */
+int pump_pair_relay(pump_pair_t *pp) {
+  int rv;
+
+  if (pp->rfd < 0) {
+    return 0;
+  }
+
+  if (pp->splice) {
+    rv = pump_pair_splice(pp);
+
+    /* Not supported for this combination, e.g. for a terminal */
+    if (rv == -1 && errno == EINVAL) {
+      pp->splice = 0;
+      rv = pump_pair_copy(pp);
+    }
+  } else {
+    rv = pump_pair_copy(pp);
+  }
+
+  if (rv <= 0) {
+    pump_pair_close(pp);
+  }
+
+  return rv;
+}
+
+/*
+ * Like pump_pair_relay, but for a pipe keeps going until what it had buffered
+ * has been moved: a single splice stops short when the other side is full.
+ */
+int pump_pair_drain(pump_pair_t *pp) {
+  int avail;
+  int rv;
+
+  if (pp->rfd < 0 || !pump__is_pipe(pp->rfd) ||
+      ioctl(pp->rfd, FIONREAD, &avail) == -1) {
+    return pump_pair_relay(pp);
+  }
+
+  do {
+    rv = pump_pair_relay(pp);
+    avail -= rv;
+  } while (rv > 0 && avail > 0);
+
+  return rv;
 }
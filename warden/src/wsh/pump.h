@@ -1,37 +1,52 @@
 #ifndef PUMP_H
 #define PUMP_H 1
 
-#define PUMP_READ   1
-#define PUMP_WRITE  2
-#define PUMP_EXCEPT 4
+/*
+ * Relays data between pairs of file descriptors. Descriptors are registered
+ * with epoll once, and data is spliced when one side of a pair is a pipe,
+ * falling back to copying through user space otherwise.
+ */
+
+/* Upper bound on pairs whose source can't be polled, e.g. regular files */
+#define PUMP_MAX_ALWAYS 8
 
 typedef struct pump_s pump_t;
+typedef struct pump_pair_s pump_pair_t;
 
 struct pump_s {
-  int nfd;
+  int epfd;
 
-  fd_set rfds;
-  fd_set wfds;
-  fd_set efds;
+  /* Pairs that are considered ready on every wait */
+  pump_pair_t *always[PUMP_MAX_ALWAYS];
+  int nalways;
 };
 
-typedef struct pump_pair_s pump_pair_t;
-
 struct pump_pair_s {
   pump_t *p;
 
   int rfd;
   int wfd;
+
+  /* Whether splice is worth trying for this pair */
+  int splice;
 };
 
 void pump_init(pump_t *p);
-int pump_add_fd(pump_t *p, int fd, int mode);
-int pump_add_pair(pump_t *p, pump_pair_t *pp);
-int pump_ready(pump_t *p, int fd, int mode);
-int pump_select(pump_t *p);
+void pump_add_fd(pump_t *p, int fd, void *data);
+
+/*
+ * Waits for registered descriptors to become readable, and stores the data
+ * they were registered with (pairs for pairs) in ready. Doesn't block when a
+ * pair can't be polled, or when timeout is 0.
+ *
+ * Returns the number of entries stored.
+ */
+int pump_wait(pump_t *p, void **ready, int nready, int timeout);
 
 void pump_pair_init(pump_pair_t *pp, pump_t *p, int rfd, int wfd);
-int pump_pair_splice(pump_pair_t *pp);
-int pump_pair_copy(pump_pair_t *pp);
+int pump_pair_relay(pump_pair_t *pp);
+
+/* Relays everything that is buffered in the source, without waiting for more */
+int pump_pair_drain(pump_pair_t *pp);
 
 #endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "pwd.h"
 
@@ -24,23 +25,41 @@
       *(y) = '\0';                            \
   } while(0);
 
-/* Instead of using getpwnam from glibc, the following custom version is used
- * because we need to bypass dynamically loading the nsswitch libraries.
- * The version of glibc inside a container may be different than the version
- * that wshd is compiled for, leading to undefined behavior. */
-struct passwd *getpwnam(const char *name) {
-  static struct passwd passwd;
-  static char buf[1024];
+#define PWD_PATH "/etc/passwd"
+
+/* Number of users that are remembered, commands run as root or vcap */
+#define PWD_CACHE_SIZE 8
+
+typedef struct pwd__entry_s pwd__entry_t;
+
+struct pwd__entry_s {
+  struct passwd passwd;
+  char buf[1024];
+};
+
+/* Entries are dropped when the passwd file is replaced or modified */
+static struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  int count;
+  int next;
+  pwd__entry_t entries[PWD_CACHE_SIZE];
+} pwd__cache;
+
+static struct passwd *pwd__lookup(const char *name, struct passwd *out, char *buf, size_t buflen) {
+  struct passwd passwd;
   struct passwd *_passwd = NULL;
   FILE *f;
   char *p, *q;
 
-  f = fopen("/etc/passwd", "r");
+  f = fopen(PWD_PATH, "r");
   if (f == NULL) {
     goto done;
   }
 
-  while (fgets(buf, sizeof(buf), f) != NULL) {
+  while (fgets(buf, buflen, f) != NULL) {
     p = buf;
     q = NULL;
 
@@ -78,7 +97,8 @@ struct passwd *getpwnam(const char *name) {
     passwd.pw_shell = p;
 
     /* Done! */
-    _passwd = &passwd;
+    *out = passwd;
+    _passwd = out;
     goto done;
   }
 
@@ -90,4 +110,61 @@ done:
   return _passwd;
 }
 
+/* Instead of using getpwnam from glibc, the following custom version is used
+ * because we need to bypass dynamically loading the nsswitch libraries.
+ * The version of glibc inside a container may be different than the version
+ * that wshd is compiled for, leading to undefined behavior.
+ *
+ * Users that were found are cached, so that the passwd file is only read again
+ * once it changes. The result is valid until the next call. */
+struct passwd *getpwnam(const char *name) {
+  pwd__entry_t *e;
+  struct stat st;
+  int i;
+
+  if (stat(PWD_PATH, &st) == -1) {
+    return NULL;
+  }
+
+  if (st.st_dev != pwd__cache.dev ||
+      st.st_ino != pwd__cache.ino ||
+      st.st_size != pwd__cache.size ||
+      st.st_mtim.tv_sec != pwd__cache.mtime.tv_sec ||
+      st.st_mtim.tv_nsec != pwd__cache.mtime.tv_nsec) {
+    pwd__cache.dev = st.st_dev;
+    pwd__cache.ino = st.st_ino;
+    pwd__cache.size = st.st_size;
+    pwd__cache.mtime = st.st_mtim;
+    pwd__cache.count = 0;
+    pwd__cache.next = 0;
+  }
+
+  for (i = 0; i < pwd__cache.count; i++) {
+    e = &pwd__cache.entries[i];
+    if (strcmp(e->passwd.pw_name, name) == 0) {
+      return &e->passwd;
+    }
+  }
+
+  /* Replace entries round robin once the cache is full */
+  e = &pwd__cache.entries[pwd__cache.next];
+
+  if (pwd__lookup(name, &e->passwd, e->buf, sizeof(e->buf)) == NULL) {
+    /* The entry that was there may have been overwritten */
+    if (pwd__cache.next < pwd__cache.count) {
+      pwd__cache.count = 0;
+      pwd__cache.next = 0;
+    }
+
+    return NULL;
+  }
+
+  pwd__cache.next = (pwd__cache.next + 1) % PWD_CACHE_SIZE;
+  if (pwd__cache.count < PWD_CACHE_SIZE) {
+    pwd__cache.count++;
+  }
+
+  return &e->passwd;
+}
+
 #undef _GETPWNAM_NEXT
@@ -2,16 +2,21 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <grp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "copy.h"
 #include "msg.h"
 #include "pump.h"
+#include "pwd.h"
 #include "un.h"
 
 typedef struct wsh_s wsh_t;
@@ -25,6 +30,14 @@ struct wsh_s {
 
   /* User to change to */
   const char *user;
+
+  /* Copy files instead of running a command, see copy.h */
+  int copy;
+  const char *copy_src;
+  const char *copy_dst;
+
+  /* Root of the container to copy in through, bypassing wshd */
+  const char *rootfs;
 };
 
 int wsh__usage(wsh_t *w) {
@@ -42,6 +55,18 @@ int wsh__usage(wsh_t *w) {
   fprintf(stderr, "  --rsh         "
     "RSH compatibility mode"
     "\n");
+
+  fprintf(stderr, "  --copy-in SRC DST\n"
+    "                Copy SRC on the host to DST in the container"
+    "\n");
+
+  fprintf(stderr, "  --copy-out SRC DST\n"
+    "                Copy SRC in the container to DST on the host"
+    "\n");
+
+  fprintf(stderr, "  --rootfs PATH "
+    "Copy in through PATH, the root of the container, instead of wshd"
+    "\n");
   return 0;
 }
 
@@ -65,6 +90,22 @@ int wsh__getopt(wsh_t *w) {
       w->user = strdup(w->argv[i+1]);
       i += 2;
       j -= 2;
+    } else if (j >= 3 && strcmp(w->argv[i], "--copy-in") == 0) {
+      w->copy = MSG_COPY_IN;
+      w->copy_src = strdup(w->argv[i+1]);
+      w->copy_dst = strdup(w->argv[i+2]);
+      i += 3;
+      j -= 3;
+    } else if (j >= 3 && strcmp(w->argv[i], "--copy-out") == 0) {
+      w->copy = MSG_COPY_OUT;
+      w->copy_src = strdup(w->argv[i+1]);
+      w->copy_dst = strdup(w->argv[i+2]);
+      i += 3;
+      j -= 3;
+    } else if (j >= 2 && strcmp(w->argv[i], "--rootfs") == 0) {
+      w->rootfs = strdup(w->argv[i+1]);
+      i += 2;
+      j -= 2;
     } else if (j >= 1 && strcmp(w->argv[i], "--rsh") == 0) {
       i += 1;
       j -= 1;
@@ -116,52 +157,53 @@ invalid:
   return -1;
 }
 
-void pump_loop(pump_t *p, int exit_status_fd, pump_pair_t *pp, int pplen) {
-  int i, rv;
+/* Returns the exit status of the command, 255 if it was terminated by a signal */
+int pump_loop(pump_t *p, int exit_status_fd, pump_pair_t *pp, int pplen) {
+  void *ready[8];
+  int status;
+  int i, n, rv;
 
-  for (;;) {
-    pump_init(p);
+  /* The exit status fd is registered without data */
+  pump_add_fd(p, exit_status_fd, NULL);
 
-    for (i = 0; i < pplen; i++) {
-      pump_add_pair(p, &pp[i]);
-    }
+  for (;;) {
+    n = pump_wait(p, ready, 8, -1);
 
-    if (exit_status_fd >= 0) {
-      pump_add_fd(p, exit_status_fd, PUMP_READ | PUMP_EXCEPT);
+    for (i = 0; i < n; i++) {
+      if (ready[i] != NULL) {
+        pump_pair_relay((pump_pair_t *)ready[i]);
+      }
     }
 
-    do {
-      rv = pump_select(p);
-    } while (rv == -1 && errno == EINTR);
-
-    if (rv == -1) {
-      perror("select");
-      abort();
+    for (i = 0; i < n; i++) {
+      if (ready[i] == NULL) {
+        break;
+      }
     }
 
-    for (i = 0; i < pplen; i++) {
-      pump_pair_copy(&pp[i]);
+    if (i == n) {
+      continue;
     }
 
-    if (pump_ready(p, exit_status_fd, PUMP_READ | PUMP_EXCEPT)) {
-      int status;
-
-      rv = read(exit_status_fd, &status, sizeof(status));
-      assert(rv >= 0);
+    rv = read(exit_status_fd, &status, sizeof(status));
+    assert(rv >= 0);
 
-      /* One more splice to make sure kernel buffers are emptied */
-      for (i = 0; i < pplen; i++) {
-        pump_pair_copy(&pp[i]);
-      }
+    /* One more round to make sure kernel buffers are emptied */
+    n = pump_wait(p, ready, 8, 0);
 
-      if (rv == 0) {
-        /* EOF: process terminated by signal */
-        exit(255);
+    for (i = 0; i < n; i++) {
+      if (ready[i] != NULL) {
+        pump_pair_drain((pump_pair_t *)ready[i]);
       }
+    }
 
-      assert(rv == sizeof(status));
-      exit(status);
+    if (rv == 0) {
+      /* EOF: process terminated by signal */
+      return 255;
     }
+
+    assert(rv == sizeof(status));
+    return status;
   }
 }
 
@@ -227,9 +269,20 @@ void tty_winsz(void) {
   tty_swinsz();
 }
 
+void check_response(int rv) {
+  if (rv == 0) {
+    /* This is what wshd does with requests it cannot make sense of */
+    fprintf(stderr, "wshd closed the connection (version %d)\n", MSG_VERSION);
+  } else {
+    perror("recvmsg");
+  }
+
+  exit(255);
+}
+
 void loop_interactive(int fd) {
   msg_response_t res;
-  char buf[MSG_MAX_SIZE];
+  char buf[sizeof(res)];
   size_t buflen = sizeof(buf);
   int fds[2];
   size_t fdslen = sizeof(fds)/sizeof(fds[0]);
@@ -237,8 +290,7 @@ void loop_interactive(int fd) {
 
   rv = un_recv_fds(fd, buf, buflen, fds, fdslen);
   if (rv <= 0) {
-    perror("recvmsg");
-    exit(255);
+    check_response(rv);
   }
 
   assert(rv == sizeof(res));
@@ -253,16 +305,18 @@ void loop_interactive(int fd) {
   pump_t p;
   pump_pair_t pp[2];
 
+  pump_init(&p);
+
   /* Use duplicates to decouple input/output */
   pump_pair_init(&pp[0], &p, STDIN_FILENO, dup(fds[0]));
   pump_pair_init(&pp[1], &p, dup(fds[0]), STDOUT_FILENO);
 
-  pump_loop(&p, fds[1], pp, 2);
+  exit(pump_loop(&p, fds[1], pp, 2));
 }
 
 void loop_noninteractive(int fd) {
   msg_response_t res;
-  char buf[MSG_MAX_SIZE];
+  char buf[sizeof(res)];
   size_t buflen = sizeof(buf);
   int fds[4];
   size_t fdslen = sizeof(fds)/sizeof(fds[0]);
@@ -270,8 +324,7 @@ void loop_noninteractive(int fd) {
 
   rv = un_recv_fds(fd, buf, buflen, fds, fdslen);
   if (rv <= 0) {
-    perror("recvmsg");
-    exit(255);
+    check_response(rv);
   }
 
   assert(rv == sizeof(res));
@@ -280,11 +333,140 @@ void loop_noninteractive(int fd) {
   pump_t p;
   pump_pair_t pp[3];
 
+  pump_init(&p);
+
   pump_pair_init(&pp[0], &p, STDIN_FILENO, fds[0]);
   pump_pair_init(&pp[1], &p, fds[1], STDOUT_FILENO);
   pump_pair_init(&pp[2], &p, fds[2], STDERR_FILENO);
 
-  pump_loop(&p, fds[3], pp, 3);
+  exit(pump_loop(&p, fds[3], pp, 3));
+}
+
+void loop_copy(wsh_t *w, int fd) {
+  msg_response_t res;
+  char buf[sizeof(res)];
+  size_t buflen = sizeof(buf);
+  int fds[4];
+  size_t fdslen = sizeof(fds)/sizeof(fds[0]);
+  int status;
+  int rv;
+
+  rv = un_recv_fds(fd, buf, buflen, fds, fdslen);
+  if (rv <= 0) {
+    check_response(rv);
+  }
+
+  assert(rv == sizeof(res));
+  memcpy(&res, buf, sizeof(res));
+
+  /* A side that fails stops, the other side finds out when the pipe breaks */
+  signal(SIGPIPE, SIG_IGN);
+
+  pump_t p;
+  pump_pair_t pp[1];
+
+  pump_init(&p);
+
+  /*
+   * The archive is streamed by this process itself, while wshd's side only
+   * writes to stderr when it fails, which the pipe can buffer.
+   */
+  if (w->copy == MSG_COPY_IN) {
+    rv = copy_send(fds[0], w->copy_src);
+    close(fds[0]);
+    close(fds[1]);
+  } else {
+    close(fds[0]);
+    rv = copy_recv(fds[1], w->copy_dst);
+    close(fds[1]);
+  }
+
+  pump_pair_init(&pp[0], &p, fds[2], STDERR_FILENO);
+
+  status = pump_loop(&p, fds[3], pp, 1);
+
+  exit((rv == -1 && status == 0) ? 1 : status);
+}
+
+/*
+ * Copies in without going through wshd. A child that is confined to the root
+ * of the container and runs as the user creates the files, while this process
+ * opens the sources on the host and passes them to it as descriptors, so the
+ * data itself is copied by the kernel.
+ */
+void loop_copy_rootfs(wsh_t *w) {
+  struct passwd *pw;
+  int sv[2];
+  pid_t pid;
+  int status;
+  int rv;
+
+  rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+  if (rv == -1) {
+    perror("socketpair");
+    exit(255);
+  }
+
+  pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(255);
+  }
+
+  if (pid == 0) {
+    close(sv[0]);
+
+    if (chroot(w->rootfs) == -1 || chdir("/") == -1) {
+      perror("chroot");
+      _exit(255);
+    }
+
+    /* Looked up in the passwd file of the container */
+    errno = 0;
+    pw = getpwnam(w->user != NULL ? w->user : "root");
+    if (pw == NULL) {
+      fprintf(stderr, "getpwnam: %s\n", strerror(errno ? errno : ENOENT));
+      _exit(255);
+    }
+
+    if (setgroups(0, NULL) == -1 ||
+        setgid(pw->pw_gid) == -1 ||
+        setuid(pw->pw_uid) == -1) {
+      perror("setuid");
+      _exit(255);
+    }
+
+    if (chdir(pw->pw_dir) == -1) {
+      perror("chdir");
+      _exit(255);
+    }
+
+    rv = copy_recv(sv[1], w->copy_dst);
+    _exit(rv == 0 ? 0 : 1);
+  }
+
+  close(sv[1]);
+
+  /* The child stops when it fails, which breaks the socket */
+  signal(SIGPIPE, SIG_IGN);
+
+  rv = copy_send_fds(sv[0], w->copy_src);
+  close(sv[0]);
+
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR) {
+      perror("waitpid");
+      exit(255);
+    }
+  }
+
+  if (WIFEXITED(status)) {
+    status = WEXITSTATUS(status);
+  } else {
+    status = 255;
+  }
+
+  exit((rv == -1 && status == 0) ? 1 : status);
 }
 
 int main(int argc, char **argv) {
@@ -292,6 +474,8 @@ int main(int argc, char **argv) {
   int rv;
   int fd;
   msg_request_t req;
+  char *buf;
+  size_t buflen, off;
 
   w = calloc(1, sizeof(*w));
   assert(w != NULL);
@@ -304,6 +488,15 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  if (w->rootfs != NULL) {
+    if (w->copy != MSG_COPY_IN) {
+      fprintf(stderr, "%s: --rootfs requires --copy-in\n", argv[0]);
+      exit(1);
+    }
+
+    loop_copy_rootfs(w);
+  }
+
   if (w->socket_path == NULL) {
     w->socket_path = "run/wshd.sock";
   }
@@ -318,17 +511,22 @@ int main(int argc, char **argv) {
 
   msg_request_init(&req);
 
-  if (isatty(STDIN_FILENO)) {
+  if (w->copy) {
+    req.tty = 0;
+
+    rv = msg_copy_import(&req.copy, w->copy,
+                         w->copy == MSG_COPY_IN ? w->copy_dst : w->copy_src);
+    if (rv == -1) {
+      fprintf(stderr, "msg_copy_import: %s\n", strerror(errno));
+      exit(255);
+    }
+  } else if (isatty(STDIN_FILENO)) {
     req.tty = 1;
   } else {
     req.tty = 0;
   }
 
-  rv = msg_array_import(&req.arg, w->argc, (const char **)w->argv);
-  if (rv == -1) {
-    fprintf(stderr, "msg_import_array: Too much data\n");
-    exit(255);
-  }
+  msg_array_import(&req.arg, w->argc, (const char **)w->argv);
 
   rv = msg_rlimit_import(&req.rlim);
   if (rv == -1) {
@@ -348,13 +546,28 @@ int main(int argc, char **argv) {
     exit(255);
   }
 
-  rv = un_send_fds(fd, (char *)&req, sizeof(req), NULL, 0);
-  if (rv <= 0) {
-    perror("sendmsg");
+  rv = msg_request_encode(&req, &buf, &buflen);
+  if (rv == -1) {
+    fprintf(stderr, "msg_request_encode: %s\n", strerror(errno));
     exit(255);
   }
 
-  if (req.tty) {
+  for (off = 0; off < buflen; off += rv) {
+    do {
+      rv = write(fd, buf + off, buflen - off);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1) {
+      perror("write");
+      exit(255);
+    }
+  }
+
+  free(buf);
+
+  if (w->copy) {
+    loop_copy(w, fd);
+  } else if (req.tty) {
     loop_interactive(fd);
   } else {
     loop_noninteractive(fd);
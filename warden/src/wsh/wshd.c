@@ -1,26 +1,31 @@
 #define _GNU_SOURCE
 
+#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/ipc.h>
 #include <sys/param.h>
-#include <sys/shm.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "barrier.h"
+#include "copy.h"
+#include "job.h"
+#include "loop.h"
 #include "msg.h"
 #include "mount.h"
 #include "pty.h"
@@ -46,17 +51,29 @@ struct wshd_s {
   /* File descriptor of listening socket */
   int fd;
 
+  /* File descriptor of listening socket for jobs */
+  int jobs_fd;
+
+  /* Jobs, only set once the loop runs in the container */
+  jobs_t *jobs;
+
   barrier_t barrier_parent;
   barrier_t barrier_child;
 
-  /* Map pids to exit status fds */
-  struct {
-    pid_t pid;
-    int fd;
-  } *pid_to_fd;
+  /* Map pids to exit status fds, chained hash with a power of 2 of buckets */
+  struct pid_to_fd_s **pid_to_fd;
+  size_t pid_to_fd_size;
   size_t pid_to_fd_len;
 };
 
+struct pid_to_fd_s {
+  pid_t pid;
+  int fd;
+  struct pid_to_fd_s *next;
+};
+
+#define PID_TO_FD_MIN_SIZE 64
+
 int wshd__usage(wshd_t *w, int argc, char **argv) {
   fprintf(stderr, "Usage: %s OPTION...\n", argv[0]);
   fprintf(stderr, "\n");
@@ -156,8 +173,57 @@ void assert_directory(const char *path) {
   }
 }
 
+/* Runs a hook and prints how long it took to stdout, which start.sh sends to
+ * run/wshd.out.log. Warden reads these lines to report hook timings. */
+static int wshd__run_hook(const char *lib_path, const char *name) {
+  struct timespec t1, t2;
+  int rv;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  rv = run(lib_path, name);
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+
+  if (rv == 0) {
+    printf("%s %.6f\n", name,
+        (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9);
+
+    /* The child execs without flushing its buffers */
+    fflush(stdout);
+  }
+
+  return rv;
+}
+
+static size_t child__pid_hash(pid_t pid, size_t size) {
+  /* Fibonacci hashing spreads sequential pids over the buckets */
+  return ((uint32_t)pid * 2654435761u) & (size - 1);
+}
+
+static void child__pid_to_fd_resize(wshd_t *w, size_t size) {
+  struct pid_to_fd_s **buckets;
+  struct pid_to_fd_s *e, *next;
+  size_t i, h;
+
+  buckets = calloc(size, sizeof(buckets[0]));
+  assert(buckets != NULL);
+
+  for (i = 0; i < w->pid_to_fd_size; i++) {
+    for (e = w->pid_to_fd[i]; e != NULL; e = next) {
+      next = e->next;
+      h = child__pid_hash(e->pid, size);
+      e->next = buckets[h];
+      buckets[h] = e;
+    }
+  }
+
+  free(w->pid_to_fd);
+  w->pid_to_fd = buckets;
+  w->pid_to_fd_size = size;
+}
+
 void child_pid_to_fd_add(wshd_t *w, pid_t pid, int fd) {
-  int len = w->pid_to_fd_len;
+  struct pid_to_fd_s *e;
+  size_t h;
 
   /* Store a copy */
   fd = dup(fd);
@@ -166,42 +232,43 @@ void child_pid_to_fd_add(wshd_t *w, pid_t pid, int fd) {
     abort();
   }
 
-  w->pid_to_fd = realloc(w->pid_to_fd, (len + 1) * sizeof(w->pid_to_fd[0]));
-  assert(w->pid_to_fd != NULL);
+  /* Keep chains short on average */
+  if (w->pid_to_fd_len >= w->pid_to_fd_size) {
+    child__pid_to_fd_resize(w, MAX(PID_TO_FD_MIN_SIZE, 2 * w->pid_to_fd_size));
+  }
+
+  e = malloc(sizeof(*e));
+  assert(e != NULL);
 
-  w->pid_to_fd[len].pid = pid;
-  w->pid_to_fd[len].fd = fd;
+  h = child__pid_hash(pid, w->pid_to_fd_size);
+  e->pid = pid;
+  e->fd = fd;
+  e->next = w->pid_to_fd[h];
+  w->pid_to_fd[h] = e;
   w->pid_to_fd_len++;
 }
 
 int child_pid_to_fd_remove(wshd_t *w, pid_t pid) {
-  int i;
-  int len = w->pid_to_fd_len;
-  int fd = -1;
+  struct pid_to_fd_s **ep, *e;
+  int fd;
 
-  for (i = 0; i < len; i++) {
-    if (w->pid_to_fd[i].pid == pid) {
-      fd = w->pid_to_fd[i].fd;
+  if (w->pid_to_fd_size == 0) {
+    return -1;
+  }
 
-      /* Move tail if there is one */
-      if ((i + 1) < len) {
-        memmove(&w->pid_to_fd[i], &w->pid_to_fd[i+1], (len - i - 1) * sizeof(w->pid_to_fd[0]));
-      }
+  ep = &w->pid_to_fd[child__pid_hash(pid, w->pid_to_fd_size)];
 
-      w->pid_to_fd = realloc(w->pid_to_fd, (w->pid_to_fd_len - 1) * sizeof(w->pid_to_fd[0]));
+  for (; (e = *ep) != NULL; ep = &e->next) {
+    if (e->pid == pid) {
+      *ep = e->next;
+      fd = e->fd;
+      free(e);
       w->pid_to_fd_len--;
-
-      if (w->pid_to_fd_len) {
-        assert(w->pid_to_fd != NULL);
-      } else {
-        assert(w->pid_to_fd == NULL);
-      }
-
-      break;
+      return fd;
     }
   }
 
-  return fd;
+  return -1;
 }
 
 char **env__add(char **envp, const char *key, const char *value) {
@@ -234,15 +301,8 @@ char **env__add(char **envp, const char *key, const char *value) {
 }
 
 char **child_setup_environment(struct passwd *pw, char *lang) {
-  int rv;
   char **envp = NULL;
 
-  rv = chdir(pw->pw_dir);
-  if (rv == -1) {
-    perror("chdir");
-    return NULL;
-  }
-
   envp = env__add(envp, "HOME", pw->pw_dir);
   envp = env__add(envp, "USER", pw->pw_name);
 
@@ -259,93 +319,237 @@ char **child_setup_environment(struct passwd *pw, char *lang) {
   return envp;
 }
 
-int child_fork(msg_request_t *req, int in, int out, int err) {
-  int rv;
+/*
+ * Everything a child needs between clone and exec. It is prepared by wshd,
+ * so that the child itself only has to make system calls.
+ */
+typedef struct child_exec_s child_exec_t;
+
+struct child_exec_s {
+  int in, out, err;
+
+  /* Set when preparing failed, the child reports it and exits */
+  const char *error;
+  int error_errno;
+
+  char **argv;
+  char **envp;
+  char *dir;
+  uid_t uid;
+  gid_t gid;
+  msg__rlimit_t rlim;
+};
 
-  rv = fork();
-  if (rv == -1) {
-    perror("fork");
-    exit(1);
-  }
+/* Only one child is being launched at a time, they can share a stack */
+static char child__stack[64 * 1024] __attribute__((aligned(16)));
 
-  if (rv == 0) {
-    const char *user;
-    struct passwd *pw;
-    char *default_argv[] = { "/bin/sh", NULL };
-    char *default_envp[] = { NULL };
-    char **argv = default_argv;
-    char **envp = default_envp;
-    msg__lang_t lang;
+static void child__exec_error(const char *what, int errnum) {
+  const char *msg = strerror(errnum);
 
-    rv = dup2(in, STDIN_FILENO);
-    assert(rv != -1);
+  /* Calling into stdio is unsafe while sharing memory with wshd */
+  write(STDERR_FILENO, what, strlen(what));
+  write(STDERR_FILENO, ": ", 2);
+  write(STDERR_FILENO, msg, strlen(msg));
+  write(STDERR_FILENO, "\n", 1);
+}
+
+/* Everything up to exec; returns -1 after reporting what failed, if it can */
+static int child__setup(child_exec_t *e) {
+  sigset_t mask;
+  int i;
 
-    rv = dup2(out, STDOUT_FILENO);
-    assert(rv != -1);
+  if (dup2(e->in, STDIN_FILENO) == -1 ||
+      dup2(e->out, STDOUT_FILENO) == -1 ||
+      dup2(e->err, STDERR_FILENO) == -1) {
+    return -1;
+  }
 
-    rv = dup2(err, STDERR_FILENO);
-    assert(rv != -1);
+  if (setsid() == -1) {
+    return -1;
+  }
 
-    rv = setsid();
-    assert(rv != -1);
+  if (e->error != NULL) {
+    child__exec_error(e->error, e->error_errno);
+    return -1;
+  }
 
-    user = req->user.name;
-    if (!strlen(user)) {
-      user = "root";
+  /* Set controlling terminal if needed */
+  if (isatty(STDIN_FILENO)) {
+    if (ioctl(STDIN_FILENO, TIOCSCTTY, 1) == -1) {
+      return -1;
     }
+  }
 
-    pw = getpwnam(user);
-    if (pw == NULL) {
-      perror("getpwnam");
-      goto error;
+  for (i = 0; i < e->rlim.count; i++) {
+    if (setrlimit(e->rlim.rlim[i].id, &e->rlim.rlim[i].rlim) == -1) {
+      child__exec_error("setrlimit", errno);
+      return -1;
     }
+  }
 
-    if (strlen(pw->pw_shell)) {
-      default_argv[0] = strdup(pw->pw_shell);
-    }
+  if (setgid(e->gid) == -1 || setuid(e->uid) == -1) {
+    child__exec_error("setuid", errno);
+    return -1;
+  }
 
-    /* Set controlling terminal if needed */
-    if (isatty(in)) {
-      rv = ioctl(STDIN_FILENO, TIOCSCTTY, 1);
-      assert(rv != -1);
-    }
+  if (chdir(e->dir) == -1) {
+    child__exec_error("chdir", errno);
+    return -1;
+  }
+
+  sigemptyset(&mask);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  return 0;
+}
+
+static int child__exec(void *data) {
+  child_exec_t *e = (child_exec_t *)data;
+
+  if (child__setup(e) == -1) {
+    _exit(255);
+  }
+
+  execvpe(e->argv[0], e->argv, e->envp);
+  child__exec_error("execvpe", errno);
+  _exit(255);
+}
+
+/* Runs the copy in c as the user of the request, in its home directory */
+static void child__copy(child_exec_t *e, msg__copy_t *c) {
+  struct rlimit rlim;
+  int fd, rv;
+
+  /* Limit of wshd, the request may lower it below fds that are open */
+  rv = getrlimit(RLIMIT_NOFILE, &rlim);
+  if (rv == -1) {
+    _exit(255);
+  }
+
+  if (child__setup(e) == -1) {
+    _exit(255);
+  }
+
+  /* Without exec, fds of wshd (e.g. pipes of other children) stay open */
+  for (fd = STDERR_FILENO + 1; fd < rlim.rlim_cur; fd++) {
+    close(fd);
+  }
+
+  if (c->mode == MSG_COPY_IN) {
+    rv = copy_recv(STDIN_FILENO, c->path);
+  } else {
+    rv = copy_send(STDOUT_FILENO, c->path);
+  }
+
+  _exit(rv == 0 ? 0 : 1);
+}
 
-    /* Use argv from request if needed */
-    if (req->arg.count) {
-      argv = (char **)msg_array_export(&req->arg);
-      assert(argv != NULL);
+static void child__free_list(char **list) {
+  int i;
+
+  if (list != NULL) {
+    for (i = 0; list[i] != NULL; i++) {
+      free(list[i]);
     }
 
-    rv = msg_rlimit_export(&req->rlim);
-    if (rv == -1) {
-      perror("msg_rlimit_export");
-      goto error;
+    free(list);
+  }
+}
+
+/* Returns the pid of the child, or -1 with errno set if it can't be created */
+int child_fork(msg_request_t *req, int in, int out, int err) {
+  child_exec_t e;
+  const char *user;
+  struct passwd *pw;
+  const char **argv;
+  int i, rv, saved_errno = 0;
+
+  memset(&e, 0, sizeof(e));
+  e.in = in;
+  e.out = out;
+  e.err = err;
+
+  user = req->user.name;
+  if (!strlen(user)) {
+    user = "root";
+  }
+
+  errno = 0;
+  pw = getpwnam(user);
+  if (pw == NULL) {
+    e.error = "getpwnam";
+    e.error_errno = errno ? errno : ENOENT;
+    goto launch;
+  }
+
+  e.uid = pw->pw_uid;
+  e.gid = pw->pw_gid;
+  e.dir = strdup(pw->pw_dir);
+  assert(e.dir != NULL);
+
+  /* Use argv from request if needed, and the login shell otherwise */
+  if (req->arg.count) {
+    argv = msg_array_export(&req->arg);
+    assert(argv != NULL);
+
+    e.argv = calloc(req->arg.count + 1, sizeof(e.argv[0]));
+    assert(e.argv != NULL);
+
+    for (i = 0; i < req->arg.count; i++) {
+      e.argv[i] = strdup(argv[i]);
+      assert(e.argv[i] != NULL);
     }
 
-    rv = msg_user_export(&req->user, pw);
+    free(argv);
+  } else {
+    e.argv = calloc(2, sizeof(e.argv[0]));
+    assert(e.argv != NULL);
+
+    e.argv[0] = strdup(strlen(pw->pw_shell) ? pw->pw_shell : "/bin/sh");
+    assert(e.argv[0] != NULL);
+  }
+
+  if (strnlen(req->lang.lang, sizeof(req->lang.lang)) >= sizeof(req->lang.lang)) {
+    e.error = "msg_lang_export";
+    e.error_errno = EINVAL;
+    goto launch;
+  }
+
+  e.envp = child_setup_environment(pw, req->lang.lang);
+  assert(e.envp != NULL);
+
+  msg_rlimit_resolve(&req->rlim, &e.rlim);
+
+launch:
+  if (req->copy.mode != MSG_COPY_NONE) {
+    /* Copies run without exec, so they need memory of their own */
+    rv = fork();
     if (rv == -1) {
-      perror("msg_user_export");
-      goto error;
+      saved_errno = errno;
+      perror("fork");
+      goto done;
     }
 
-    rv = msg_lang_export(&req->lang, &lang);
+    if (rv == 0) {
+      child__copy(&e, &req->copy);
+    }
+  } else {
+    /* wshd is suspended until the child has called exec or exited */
+    rv = clone(child__exec, child__stack + sizeof(child__stack),
+               CLONE_VM | CLONE_VFORK | SIGCHLD, &e);
     if (rv == -1) {
-      perror("msg_lang_export");
-      goto error;
+      saved_errno = errno;
+      perror("clone");
     }
+  }
 
-    envp = child_setup_environment(pw, lang.lang);
-    assert(envp != NULL);
-
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigprocmask(SIG_SETMASK, &mask, NULL);
-
-    execvpe(argv[0], argv, envp);
-    perror("execvpe");
+done:
+  free(e.dir);
+  child__free_list(e.argv);
+  child__free_list(e.envp);
 
-error:
-    exit(255);
+  if (rv == -1) {
+    errno = saved_errno;
   }
 
   return rv;
@@ -395,7 +599,9 @@ int child_handle_interactive(int fd, wshd_t *w, msg_request_t *req) {
   }
 
   rv = child_fork(req, p[0][1], p[0][1], p[0][1]);
-  assert(rv > 0);
+  if (rv == -1) {
+    goto err;
+  }
 
   child_pid_to_fd_add(w, rv, p[1][1]);
 
@@ -456,7 +662,9 @@ int child_handle_noninteractive(int fd, wshd_t *w, msg_request_t *req) {
   }
 
   rv = child_fork(req, p[0][0], p[1][1], p[2][1]);
-  assert(rv > 0);
+  if (rv == -1) {
+    goto err;
+  }
 
   child_pid_to_fd_add(w, rv, p[3][1]);
 
@@ -478,41 +686,134 @@ err:
   return 0;
 }
 
-int child_accept(wshd_t *w) {
-  int rv, fd;
-  char buf[MSG_MAX_SIZE];
-  size_t buflen = sizeof(buf);
-  msg_request_t req;
+/* Connection to wshd.sock whose request has not fully arrived yet */
+typedef struct child_conn_s child_conn_t;
 
-  rv = accept(w->fd, NULL, NULL);
-  if (rv == -1) {
-    perror("accept");
-    abort();
+struct child_conn_s {
+  wshd_t *w;
+  int fd;
+  loop_watch_t *lw;
+  char header[MSG_HEADER_SIZE];
+  char *body;
+  size_t body_len;
+  size_t off;
+};
+
+static uint32_t child__get_u32(const char *p) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+/* Returns 1 when the request is complete, 0 if it is not, -1 on error */
+int child__conn_read(child_conn_t *c) {
+  char *p;
+  size_t len;
+  int rv;
+
+  if (c->body == NULL) {
+    p = c->header + c->off;
+    len = sizeof(c->header) - c->off;
+  } else {
+    p = c->body + c->off;
+    len = c->body_len - c->off;
   }
 
-  fd = rv;
+  rv = read(c->fd, p, len);
+  if (rv == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return 0;
+  }
 
-  fcntl_mix_cloexec(fd);
+  if (rv <= 0) {
+    return -1;
+  }
 
-  rv = un_recv_fds(fd, buf, buflen, NULL, 0);
-  if (rv < 0) {
-    perror("recvmsg");
-    exit(255);
+  c->off += rv;
+
+  if (c->body == NULL) {
+    if (c->off < sizeof(c->header)) {
+      return 0;
+    }
+
+    if (child__get_u32(c->header) != MSG_VERSION) {
+      return -1;
+    }
+
+    c->body_len = child__get_u32(c->header + 4);
+    if (c->body_len > MSG_MAX_SIZE) {
+      return -1;
+    }
+
+    c->body = malloc(c->body_len + 1);
+    assert(c->body != NULL);
+    c->off = 0;
   }
 
+  return (c->off == c->body_len) ? 1 : 0;
+}
+
+void child__conn_cb(loop_t *l, loop_watch_t *lw, int events) {
+  child_conn_t *c = (child_conn_t *)lw->data;
+  msg_request_t req;
+  int rv;
+
+  rv = child__conn_read(c);
   if (rv == 0) {
-    close(fd);
-    return 0;
+    return;
   }
 
-  assert(rv == sizeof(req));
-  memcpy(&req, buf, sizeof(req));
+  loop_remove(l, c->lw);
 
-  if (req.tty) {
-    return child_handle_interactive(fd, w, &req);
+  if (rv == 1) {
+    rv = msg_request_decode(&req, c->body, c->body_len);
+  }
+
+  if (rv == -1) {
+    /* Hung up early or sent something that doesn't make sense */
+    close(c->fd);
   } else {
-    return child_handle_noninteractive(fd, w, &req);
+    if (req.tty) {
+      child_handle_interactive(c->fd, c->w, &req);
+    } else {
+      child_handle_noninteractive(c->fd, c->w, &req);
+    }
+
+    msg_request_destroy(&req);
+  }
+
+  free(c->body);
+  free(c);
+}
+
+int child_accept(wshd_t *w, loop_t *l) {
+  child_conn_t *c;
+  int fd;
+
+  /* Take every pending connection, requests are read as they arrive */
+  for (;;) {
+    fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+
+      if (errno != EAGAIN) {
+        perror("accept4");
+      }
+
+      break;
+    }
+
+    c = calloc(1, sizeof(*c));
+    assert(c != NULL);
+
+    c->w = w;
+    c->fd = fd;
+    c->lw = loop_add(l, fd, LOOP_READ, child__conn_cb, c);
   }
+
+  return 0;
 }
 
 void child_handle_sigchld(wshd_t *w) {
@@ -533,6 +834,7 @@ void child_handle_sigchld(wshd_t *w) {
     /* Processes can be reparented, so a pid may not map to an fd */
     fd = child_pid_to_fd_remove(w, pid);
     if (fd == -1) {
+      jobs_reap(w->jobs, pid, status);
       continue;
     }
 
@@ -574,9 +876,24 @@ int child_signalfd(void) {
   return fd;
 }
 
+void child__accept_cb(loop_t *l, loop_watch_t *lw, int events) {
+  child_accept((wshd_t *)lw->data, l);
+}
+
+void child__sigchld_cb(loop_t *l, loop_watch_t *lw, int events) {
+  struct signalfd_siginfo fdsi;
+  int rv;
+
+  rv = read(lw->fd, &fdsi, sizeof(fdsi));
+  assert(rv == sizeof(fdsi));
+
+  /* Ignore siginfo and loop waitpid to catch all children */
+  child_handle_sigchld((wshd_t *)lw->data);
+}
+
 int child_loop(wshd_t *w) {
+  loop_t l;
   int sfd;
-  int rv;
 
   close(STDIN_FILENO);
   close(STDOUT_FILENO);
@@ -584,35 +901,16 @@ int child_loop(wshd_t *w) {
 
   sfd = child_signalfd();
 
-  for (;;) {
-    fd_set fds;
-
-    FD_ZERO(&fds);
-    FD_SET(w->fd, &fds);
-    FD_SET(sfd, &fds);
-
-    do {
-      rv = select(FD_SETSIZE, &fds, NULL, NULL, NULL);
-    } while (rv == -1 && errno == EINTR);
-
-    if (rv == -1) {
-      perror("select");
-      abort();
-    }
+  loop_init(&l);
 
-    if (FD_ISSET(w->fd, &fds)) {
-      child_accept(w);
-    }
-
-    if (FD_ISSET(sfd, &fds)) {
-      struct signalfd_siginfo fdsi;
+  fcntl_mix_nonblock(w->fd);
+  loop_add(&l, w->fd, LOOP_READ, child__accept_cb, w);
+  loop_add(&l, sfd, LOOP_READ, child__sigchld_cb, w);
 
-      rv = read(sfd, &fdsi, sizeof(fdsi));
-      assert(rv == sizeof(fdsi));
+  w->jobs = jobs_create(&l, w->jobs_fd, child_fork);
 
-      /* Ignore siginfo and loop waitpid to catch all children */
-      child_handle_sigchld(w);
-    }
+  for (;;) {
+    loop_run_once(&l);
   }
 
   return 1;
@@ -621,39 +919,48 @@ int child_loop(wshd_t *w) {
 /* No header defines this */
 extern int pivot_root(const char *new_root, const char *put_old);
 
-void child_save_to_shm(wshd_t *w) {
-  int rv;
-  void *w_;
+/*
+ * The state of wshd is handed to the process that is exec'ed in the container
+ * through a pipe that it inherits, instead of a SysV IPC key that every
+ * container would have to share. It fits in the buffer of the pipe, so it can
+ * be written before the reader exists.
+ */
+int child_save_to_pipe(wshd_t *w) {
+  int fds[2];
+  ssize_t rv;
 
-  rv = shmget(0xdeadbeef, sizeof(*w), IPC_CREAT | IPC_EXCL | 0600);
+  assert(sizeof(*w) <= PIPE_BUF);
+
+  rv = pipe(fds);
   if (rv == -1) {
-    perror("shmget");
+    perror("pipe");
     abort();
   }
 
-  w_ = shmat(rv, NULL, 0);
-  if (w_ == (void *)-1) {
-    perror("shmat");
+  do {
+    rv = write(fds[1], w, sizeof(*w));
+  } while (rv == -1 && errno == EINTR);
+
+  if (rv != sizeof(*w)) {
+    perror("write");
     abort();
   }
 
-  memcpy(w_, w, sizeof(*w));
+  close(fds[1]);
+
+  return fds[0];
 }
 
-wshd_t *child_load_from_shm(void) {
-  int rv;
+wshd_t *child_load_from_pipe(const char *arg) {
   wshd_t *w;
-  void *w_;
-
-  rv = shmget(0xdeadbeef, sizeof(*w), 0600);
-  if (rv == -1) {
-    perror("shmget");
-    abort();
-  }
-
-  w_ = shmat(rv, NULL, 0);
-  if (w_ == (void *)-1) {
-    perror("shmat");
+  char *end;
+  ssize_t rv;
+  long fd;
+
+  errno = 0;
+  fd = strtol(arg, &end, 10);
+  if (errno != 0 || *end != '\0' || fd < 0 || fd > INT_MAX) {
+    fprintf(stderr, "Invalid descriptor: %s\n", arg);
     abort();
   }
 
@@ -663,19 +970,16 @@ wshd_t *child_load_from_shm(void) {
     abort();
   }
 
-  memcpy(w, w_, sizeof(*w));
+  do {
+    rv = read(fd, w, sizeof(*w));
+  } while (rv == -1 && errno == EINTR);
 
-  rv = shmdt(w_);
-  if (w_ == (void *)-1) {
-    perror("shmdt");
+  if (rv != sizeof(*w)) {
+    perror("read");
     abort();
   }
 
-  rv = shmctl(0xdeadbeef, IPC_RMID, NULL);
-  if (w_ == (void *)-1) {
-    perror("shmctl");
-    abort();
-  }
+  close(fd);
 
   return w;
 }
@@ -685,12 +989,13 @@ int child_run(void *data) {
   int rv;
   char pivoted_lib_path[PATH_MAX];
   size_t pivoted_lib_path_len;
+  char fd[16];
 
   /* Wait for parent */
   rv = barrier_wait(&w->barrier_parent);
   assert(rv == 0);
 
-  rv = run(w->lib_path, "hook-child-before-pivot.sh");
+  rv = wshd__run_hook(w->lib_path, "hook-child-before-pivot.sh");
   assert(rv == 0);
 
   /* Prepare lib path for pivot */
@@ -722,12 +1027,13 @@ int child_run(void *data) {
     abort();
   }
 
-  rv = run(pivoted_lib_path, "hook-child-after-pivot.sh");
+  rv = wshd__run_hook(pivoted_lib_path, "hook-child-after-pivot.sh");
   assert(rv == 0);
 
-  child_save_to_shm(w);
+  rv = snprintf(fd, sizeof(fd), "%d", child_save_to_pipe(w));
+  assert(rv < sizeof(fd));
 
-  execl("/sbin/wshd", "/sbin/wshd", "--continue", NULL);
+  execl("/sbin/wshd", "/sbin/wshd", "--continue", fd, NULL);
   perror("exec");
   abort();
 }
@@ -736,11 +1042,12 @@ int child_continue(int argc, char **argv) {
   wshd_t *w;
   int rv;
 
-  w = child_load_from_shm();
+  w = child_load_from_pipe(argv[2]);
 
   /* Process MUST not leak file descriptors to children */
   barrier_mix_cloexec(&w->barrier_child);
   fcntl_mix_cloexec(w->fd);
+  fcntl_mix_cloexec(w->jobs_fd);
 
   if (strlen(w->title) > 0) {
     setproctitle(argv, w->title);
@@ -815,6 +1122,14 @@ int parent_run(wshd_t *w) {
 
   w->fd = un_listen(path);
 
+  memset(path, 0, sizeof(path));
+
+  strcpy(path + strlen(path), w->run_path);
+  strcpy(path + strlen(path), "/");
+  strcpy(path + strlen(path), "jobs.sock");
+
+  w->jobs_fd = un_listen(path);
+
   rv = barrier_open(&w->barrier_parent);
   assert(rv == 0);
 
@@ -826,7 +1141,7 @@ int parent_run(wshd_t *w) {
   rv = unshare(CLONE_NEWNS);
   assert(rv == 0);
 
-  rv = run(w->lib_path, "hook-parent-before-clone.sh");
+  rv = wshd__run_hook(w->lib_path, "hook-parent-before-clone.sh");
   assert(rv == 0);
 
   pid = child_start(w);
@@ -834,7 +1149,7 @@ int parent_run(wshd_t *w) {
 
   parent_setenv_pid(w, pid);
 
-  rv = run(w->lib_path, "hook-parent-after-clone.sh");
+  rv = wshd__run_hook(w->lib_path, "hook-parent-after-clone.sh");
   assert(rv == 0);
 
   rv = barrier_signal(&w->barrier_parent);
@@ -857,7 +1172,7 @@ int main(int argc, char **argv) {
   int rv;
 
   /* Continue child execution in the context of the container */
-  if (argc > 1 && strcmp(argv[1], "--continue") == 0) {
+  if (argc > 2 && strcmp(argv[1], "--continue") == 0) {
     return child_continue(argc, argv);
   }
 